@@ -0,0 +1,164 @@
+#ifndef AMEX_AMOUNT_H__
+#define AMEX_AMOUNT_H__
+/*
+ * amex_amount.h - Exact transaction amounts
+ *
+ * Amounts are kept as a signed number of öre (1/100 SEK), so sums are exact.
+ * Statements write them in Swedish notation, 1.234,56 or -12,00, which is
+ * parsed by stripping the separators into a zero padded block of 16 digits
+ * and then validating and converting that block eight digits at a time
+ * (SWAR, SIMD within a register).
+ */
+#include <glib.h>
+
+typedef gint64 amex_amount;
+
+#define AMEX_AMOUNT_MAX_DIGITS     16
+#define AMEX_AMOUNT_STR_LEN        24
+
+/* TRUE if all eight bytes of v are ASCII digits */
+static inline gboolean
+amex_swar_is_8digits(guint64 v)
+{
+  return ((v & G_GUINT64_CONSTANT(0xF0F0F0F0F0F0F0F0)) |
+          (((v + G_GUINT64_CONSTANT(0x0606060606060606)) &
+            G_GUINT64_CONSTANT(0xF0F0F0F0F0F0F0F0)) >> 4)) ==
+         G_GUINT64_CONSTANT(0x3333333333333333);
+}
+
+/* Convert eight ASCII digits, first digit in the lowest byte */
+static inline guint32
+amex_swar_parse_8digits(guint64 v)
+{
+  const guint64 mask = G_GUINT64_CONSTANT(0x000000FF000000FF);
+  const guint64 mul1 = G_GUINT64_CONSTANT(0x000F424000000064);
+  const guint64 mul2 = G_GUINT64_CONSTANT(0x0000271000000001);
+
+  v -= G_GUINT64_CONSTANT(0x3030303030303030);
+  v = (v * 10) + (v >> 8);
+  v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+
+  return (guint32) v;
+}
+
+static inline guint64
+amex_swar_load(const gchar *p)
+{
+  guint64 v;
+
+  memcpy(&v, p, sizeof(v));
+
+  return GUINT64_FROM_LE(v);
+}
+
+/*
+ * Parse an amount of len bytes: an optional '-', digits with optional '.'
+ * thousand separators, and optionally ',' followed by one or two decimals.
+ * With separators, the first group has one to three digits and the others
+ * exactly three.
+ */
+static inline gboolean
+amex_amount_parse(const gchar *str, gsize len, amex_amount *result)
+{
+  gchar digits[AMEX_AMOUNT_MAX_DIGITS];
+  const gchar *end = str + len;
+  const gchar *p = str;
+  const gchar *comma;
+  gboolean negative = FALSE;
+  gboolean grouped = FALSE;
+  gsize group = 0;
+  gsize int_len = 0;
+  gsize frac_len = 0;
+  gsize i;
+  guint64 hi;
+  guint64 lo;
+
+  if (p < end && *p == '-') {
+    negative = TRUE;
+    p++;
+  }
+
+  comma = memchr(p, ',', end - p);
+  if (comma) {
+    frac_len = end - comma - 1;
+    if (frac_len < 1 || frac_len > 2) {
+      return FALSE;
+    }
+  } else {
+    comma = end;
+  }
+
+  /* Right align the integer digits in front of the two decimals */
+  memset(digits, '0', sizeof(digits));
+  for (i = 0; p + i < comma; i++) {
+    if (p[i] != '.') {
+      int_len++;
+      group++;
+    } else if (group != 3 && (grouped || !group || group > 3)) {
+      return FALSE;
+    } else {
+      grouped = TRUE;
+      group = 0;
+    }
+  }
+  if (!int_len || int_len > AMEX_AMOUNT_MAX_DIGITS - 2 ||
+      (grouped && group != 3)) {
+    return FALSE;
+  }
+
+  for (i = AMEX_AMOUNT_MAX_DIGITS - 2 - int_len; p < comma; p++) {
+    if (*p != '.') {
+      digits[i++] = *p;
+    }
+  }
+  if (frac_len) {
+    memcpy(digits + AMEX_AMOUNT_MAX_DIGITS - 2, comma + 1, frac_len);
+  }
+
+  /* Both halves are validated and converted eight digits at a time */
+  hi = amex_swar_load(digits);
+  lo = amex_swar_load(digits + 8);
+  if (!amex_swar_is_8digits(hi) || !amex_swar_is_8digits(lo)) {
+    return FALSE;
+  }
+
+  *result = (amex_amount) amex_swar_parse_8digits(hi) * 100000000 +
+            amex_swar_parse_8digits(lo);
+  if (negative) {
+    *result = -*result;
+  }
+
+  return TRUE;
+}
+
+/* Write the amount as -1234.56 (not terminated), returns the length */
+static inline gsize
+amex_amount_format(amex_amount amount, gchar *out)
+{
+  gchar tmp[AMEX_AMOUNT_STR_LEN];
+  guint64 v = amount < 0 ? -(guint64) amount : (guint64) amount;
+  gsize n = 0;
+  gsize len = 0;
+
+  /* Digits are produced backwards, öre first */
+  tmp[n++] = '0' + v % 10;
+  v /= 10;
+  tmp[n++] = '0' + v % 10;
+  v /= 10;
+  tmp[n++] = '.';
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+
+  if (amount < 0) {
+    out[len++] = '-';
+  }
+  while (n) {
+    out[len++] = tmp[--n];
+  }
+
+  return len;
+}
+
+#endif /* AMEX_AMOUNT_H__ */
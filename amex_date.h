@@ -0,0 +1,139 @@
+#ifndef AMEX_DATE_H__
+#define AMEX_DATE_H__
+/*
+ * amex_date.h - Compact calendar dates
+ *
+ * A date is packed as (year << 9) | (month << 5) | day into 32 bits, which
+ * keeps dates ordered when compared as integers. 0 is the invalid date.
+ * Amex statements write dates as DD.MM.YY, always in this century.
+ */
+#include <glib.h>
+
+typedef guint32 amex_date;
+
+#define AMEX_DATE_INVALID          0
+#define AMEX_DATE_STR_LEN          8    /* DD.MM.YY */
+#define AMEX_DATE_ISO_LEN          10   /* YYYY-MM-DD */
+#define AMEX_DATE_MD_LEN           5    /* MM-DD */
+#define AMEX_DATE_BASE_YEAR        2000
+
+static inline amex_date
+amex_date_pack(guint year, guint month, guint day)
+{
+  return (year << 9) | (month << 5) | day;
+}
+
+static inline guint
+amex_date_year(amex_date d)
+{
+  return d >> 9;
+}
+
+static inline guint
+amex_date_month(amex_date d)
+{
+  return (d >> 5) & 0xf;
+}
+
+static inline guint
+amex_date_day(amex_date d)
+{
+  return d & 0x1f;
+}
+
+/*
+ * Parse exactly AMEX_DATE_STR_LEN bytes of DD.MM.YY. The caller guarantees
+ * that many bytes are readable. The shape is checked in a single test, then
+ * the month and day ranges.
+ */
+static inline gboolean
+amex_date_parse(const gchar *str, amex_date *result)
+{
+  /* Indexed by month, 1-12 */
+  static const guint8 mdays[13] = {
+    0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+  };
+  const guchar *s = (const guchar *) str;
+  guint d0 = s[0] - '0';
+  guint d1 = s[1] - '0';
+  guint m0 = s[3] - '0';
+  guint m1 = s[4] - '0';
+  guint y0 = s[6] - '0';
+  guint y1 = s[7] - '0';
+  guint day;
+  guint month;
+  guint year;
+  guint leap;
+
+  if ((d0 > 9) | (d1 > 9) | (m0 > 9) | (m1 > 9) | (y0 > 9) | (y1 > 9) |
+      (s[2] != '.') | (s[5] != '.')) {
+    return FALSE;
+  }
+
+  day = d0 * 10 + d1;
+  month = m0 * 10 + m1;
+  year = AMEX_DATE_BASE_YEAR + y0 * 10 + y1;
+  leap = (year % 4 == 0) && (year % 100 != 0 || year % 400 == 0);
+
+  /* Months beyond 15 would also overflow their bits in the packed date */
+  if (month - 1 >= 12 ||
+      day - 1 >= mdays[month] + (leap & (month == 2))) {
+    return FALSE;
+  }
+
+  *result = amex_date_pack(year, month, day);
+
+  return TRUE;
+}
+
+static inline void
+amex_put_2digits(gchar *out, guint v)
+{
+  out[0] = '0' + v / 10;
+  out[1] = '0' + v % 10;
+}
+
+/* Write YYYY-MM-DD (not terminated), returns AMEX_DATE_ISO_LEN */
+static inline gsize
+amex_date_format_iso(amex_date d, gchar *out)
+{
+  guint year = amex_date_year(d);
+
+  amex_put_2digits(out, year / 100);
+  amex_put_2digits(out + 2, year % 100);
+  out[4] = '-';
+  amex_put_2digits(out + 5, amex_date_month(d));
+  out[7] = '-';
+  amex_put_2digits(out + 8, amex_date_day(d));
+
+  return AMEX_DATE_ISO_LEN;
+}
+
+/* Days since 1970-01-01, valid dates only */
+static inline gint32
+amex_date_epoch_days(amex_date d)
+{
+  /* Years start in March, so the leap day is the last day of a year */
+  gint year = amex_date_year(d) - (amex_date_month(d) <= 2);
+  guint month = amex_date_month(d);
+  gint era = year / 400;
+  guint yoe = year - era * 400;
+  guint doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 +
+              amex_date_day(d) - 1;
+  guint doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + (gint) doe - 719468;
+}
+
+/* Write MM-DD (not terminated), returns AMEX_DATE_MD_LEN */
+static inline gsize
+amex_date_format_md(amex_date d, gchar *out)
+{
+  amex_put_2digits(out, amex_date_month(d));
+  out[2] = '-';
+  amex_put_2digits(out + 3, amex_date_day(d));
+
+  return AMEX_DATE_MD_LEN;
+}
+
+#endif /* AMEX_DATE_H__ */
@@ -2,868 +2,1421 @@
 #include <stdio.h>
 #include <errno.h>
 #include <getopt.h>
+#ifdef HAVE_INOTIFY
+#include <glib-unix.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
 
 #include "debug.h"
+#include "amexparser.h"
+#include "arrow.h"
+#include "database.h"
+#include "ledger.h"
+#include "log.h"
+#include "output.h"
+#include "store.h"
+#include "summary.h"
 
 #define PROG_VERSION       "0.1a"
 
-#define SWE_LOWER_OE       "\xc3\xb6"
-#define SWE_LOWER_AO       "\xc3\xa5"
-
-#define CARD_IDSTR_BEGIN_PFX       "Nya k"SWE_LOWER_OE"p f"SWE_LOWER_OE"r "
-#define CARD_IDSTR_END_PFX         "Summa nya k"SWE_LOWER_OE"p för "
-#define INBET_IDSTR_PFX            " Inbetalningar"
-#define EXTRAKORT_PFX              "Extrakort som slutar p"SWE_LOWER_AO" "
-#define PAGE_IDSTR_PFX             "Sida "
-#define OCR_IDSTR                  "OCR: "
-#define DUE_DATE_IDSTR             "F"SWE_LOWER_OE"rfallodag"
-
 #define DEFAULT_LOCATION_FILE      "locations.txt"
-#define DEFAULT_LINE_SPLIT_WIDTH    80
 #define MIN_LINE_SPLIT_WIDTH        10
-
-struct transaction {
-  GDateTime *date;
-  GDateTime *process_date;
-  gdouble value_sek;
-  gchar *location;
-  gchar *details;
-};
-
-struct amex_card {
- gchar *holder;
- gchar *suffix;
- GPtrArray *transactions;
-};
-
-struct statistics {
-  gint total_lines;
-  gint skipped_lines;
-  guint transaction_count;
+#define BATCH_INPUT_SUFFIX         ".txt"
+#define BATCH_PDF_SUFFIX           ".pdf"
+#define BATCH_OUTPUT_SUFFIX        ".csv"
+/* Statements parsed ahead of the one written next, per thread */
+#define BATCH_JOBS_AHEAD           4
+#define DEFAULT_CACHE_SIZE_MB      256
+/* Long options without a short equivalent */
+#define OPT_STATS                  0x100
+#define OPT_CACHE                  0x101
+#define OPT_CACHE_SIZE             0x102
+#define OPT_LEDGER                 0x103
+#define OPT_FORMAT                 0x104
+#define OPT_SQLITE                 0x105
+#define OPT_REPORT                 0x106
+#define OPT_STORE                  0x107
+#define OPT_FROM                   0x108
+#define OPT_TO                     0x109
+#define OPT_CARD                   0x10a
+#define OPT_LOCATION               0x10b
+#define OPT_MIN                    0x10c
+#define OPT_MAX                    0x10d
+#define OPT_DETAILS                0x10e
+/* Characters kept in ledger filenames, others are replaced by _ */
+#define LEDGER_NAME_CHARS          G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-"
+/* Store query results are CSV like the statements, with the card first */
+#define QUERY_CSV_HEADER \
+  "Kort;Datum;Bokf\xc3\xb6rt;Specifikation;Ort;Valuta;Utl.belopp/moms;Belopp\n"
+/* Events read from inotify at once */
+#define WATCH_EVENT_BUF_LEN        4096
+
+#define DT_STR_LEN                 16
+
+enum output_format {
+  OUTPUT_FORMAT_CSV = 0,
+  OUTPUT_FORMAT_ARROW,
 };
 
 struct prog_options {
   gchar *outfile;
-  gchar *infile;
   gint line_split_width;
   gchar *location_file;
-};
-
-struct prog_state {
-  struct prog_options opts;
-  GHashTable *loc_hash;
-  struct amex_card *curr_card;
-  struct statistics stats;
-  guint idx;
-  gchar *faktura_ocr;
-  GDateTime *faktura_due_date;
-  GPtrArray *cards;
-  GPtrArray *lines;
+  gchar *outdir;
+  gint jobs;
+  gchar *compiled_locations;
+  enum stats_format stats;
+  gchar *watch_dir;
+  gchar *cache_dir;
+  gint cache_size_mb;
+  gchar *ledger_dir;
+  enum output_format format;
+  gchar *sqlite_file;
+  enum stats_format report;
+  gchar *store_file;
 };
 
 DEFINE_GQUARK("amex_parser");
 
 const gchar *prog_name;
 
-static gchar *
-format_dt(GDateTime *dt)
+static const gchar *
+format_dt(amex_date dt, gchar *buffer, gsize len)
 {
-  static gchar buffer[16];
-
-  if (!dt) {
-    g_snprintf(buffer, sizeof(buffer), "<invalid>");
+  if (dt == AMEX_DATE_INVALID || len <= AMEX_DATE_ISO_LEN) {
+    g_snprintf(buffer, len, "<invalid>");
     return buffer;
   }
 
-  g_snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d",
-             g_date_time_get_year(dt),
-             g_date_time_get_month(dt),
-             g_date_time_get_day_of_month(dt));
+  buffer[amex_date_format_iso(dt, buffer)] = '\0';
+
+  return buffer;
+}
+
+static const gchar *
+format_amount(amex_amount amount, gchar *buffer)
+{
+  buffer[amex_amount_format(amount, buffer)] = '\0';
 
   return buffer;
 }
 
 static void
-free_transaction_entry(gpointer data)
+usage(const gchar *errstr, gint exit_code)
 {
-  struct transaction *ent = (struct transaction *) data;
+  g_printerr("AMEX Faktura simple parser v%s\n", PROG_VERSION);
 
-  if (!ent) {
-    return;
+  if (errstr) {
+    g_printerr("\nError: %s\n", errstr);
   }
 
-  if (ent->date) {
-    g_date_time_unref(ent->date);
-  }
-  if (ent->process_date) {
-    g_date_time_unref(ent->process_date);
-  }
-  g_free(ent->details);
-  g_free(ent->location);
-  g_free(ent);
+  g_printerr("\nUsage: %s [options] <input file|directory> [...]\n"
+             "       %s [options] --watch <directory>\n"
+             "       %s query <store> [query options]\n\n"
+             " Options:\n"
+             "    --outfile          -o      Filename to write the transactions to,\n"
+             "                               - for standard output\n"
+             "    --location-file    -l      File to populate location hash\n"
+             "    --split-width      -s      Line split width (default: per page)\n"
+             "    --output-dir       -d      Write one file per input file here\n"
+             "    --jobs             -j      Parser threads (default: CPUs)\n"
+             "    --compile-locations -c     Compile the location file (-l) into\n"
+             "                               this file and exit\n"
+             "    --quiet            -q      Only log errors\n"
+             "    --verbose          -v      Log progress, twice for debug output\n"
+             "    --log              -L      Log categories: splitter, classifier,\n"
+             "                               details, output, general (default: all)\n"
+             "    --watch            -w      Parse statements dropped into this\n"
+             "                               directory until interrupted\n"
+             "    --format csv|arrow         Format of -o and -d output (default: csv)\n"
+             "    --stats[=json]             Print timings and counters at exit\n"
+             "    --report[=json]            Print the spending by card, month and\n"
+             "                               location, and the top merchants\n"
+             "    --ledger <dir>             Merge all statements into one CSV\n"
+             "                               per card here, without duplicates\n"
+             "    --sqlite <db>              Store the statements in this SQLite\n"
+             "                               database, replacing earlier copies\n"
+             "    --store <file>             Keep the transactions in this file,\n"
+             "                               for querying\n"
+             "    --cache <dir>              Keep parsed statements in this\n"
+             "                               directory, to skip unchanged ones\n"
+             "    --cache-size <MiB>         Cache size limit (default: "
+             G_STRINGIFY(DEFAULT_CACHE_SIZE_MB) ")\n"
+             "    --help             -h      Show help options\n\n"
+             " Query options:\n"
+             "    --from, --to <date>        Date range, YYYY, YYYY-MM or\n"
+             "                               YYYY-MM-DD (inclusive)\n"
+             "    --card <card>              Card as listed, or the suffix of an\n"
+             "                               extra card\n"
+             "    --location <location>      Location name\n"
+             "    --min, --max <amount>      Amount range, e.g. 500 or -12.50\n"
+             "    --details <text>           Details containing the text\n"
+             "    --outfile          -o      Write the CSV here (default: -)\n\n",
+             prog_name, prog_name, prog_name);
+
+  exit(exit_code);
 }
 
 static void
-free_amex_card(gpointer data)
+dump_transactions(const struct amex_statement *st)
 {
-  struct amex_card *card = (struct amex_card *) data;
+  GPtrArray *cards = amex_statement_cards(st);
+  guint i;
+  amex_amount ttotal = 0;
+  gchar cbuf[AMEX_CARD_STR_LEN];
+  gchar dbuf[DT_STR_LEN];
+  gchar tdate[DT_STR_LEN];
+  gchar pdate[DT_STR_LEN];
+  gchar abuf[AMEX_AMOUNT_STR_LEN];
+  gchar val[AMEX_AMOUNT_STR_LEN + 4];
 
-  if (!card) {
-    return;
-  }
+  g_print("----------------------------------------------------------------------\n"
+          " Total cards: %03d\n"
+          "----------------------------------------------------------------------\n",
+          cards->len);
+
+  for  (i = 0; i < cards->len; i++) {
+    struct amex_card *c = g_ptr_array_index(cards, i);
+    amex_amount ctotal = 0;
+    guint j;
+
+    g_print("Card %03d: %s\n", i, amex_card_format(c, cbuf, sizeof(cbuf)));
+    g_print("-------------------------------------------------------------------------------------------------------------\n");
+
+    if (!c->transactions->len) {
+      g_print("No transactions for card\n\n");
+      continue;
+    }
+
+    for (j = 0; j < c->transactions->len; j++) {
+      struct amex_transaction *t = g_ptr_array_index(c->transactions, j);
+      format_dt(t->date, tdate, sizeof(tdate));
+      if (t->process_date) {
+        format_dt(t->process_date, pdate, sizeof(pdate));
+      } else {
+        g_strlcpy(pdate, "-", sizeof(pdate));
+      }
 
-  if (card->transactions) {
-    g_ptr_array_free(card->transactions, TRUE);
+      g_snprintf(val, sizeof(val), "%s kr", format_amount(t->amount, abuf));
+      g_print("%-10s %-10s %-40s %-30s %-20s\n",
+              tdate, pdate, t->details,
+              t->location ? t->location : "Unknown",
+              val);
+      ctotal += t->amount;
+    }
+    g_print("=============================================================================================================\n"
+            "Total purchases for %s: %s SEK\n"
+            "=============================================================================================================\n\n",
+            amex_card_format(c, cbuf, sizeof(cbuf)),
+            format_amount(ctotal, abuf));
+    ttotal += ctotal;
   }
-  g_free(card->holder);
-  g_free(card);
+
+  g_print("Total for all cards: %s SEK\n", format_amount(ttotal, abuf));
+  g_print("   Faktura due date: %s\n",
+          amex_statement_due_date(st) ?
+          format_dt(amex_statement_due_date(st), dbuf, sizeof(dbuf)) :
+          "(unknown)");
+  g_print("        Faktura OCR: %s\n\n",
+          amex_statement_ocr(st) ? amex_statement_ocr(st) : "(unknown)");
+
 }
 
 static const gchar *
-print_amex_card(const struct amex_card *card)
+output_format_name(enum output_format format)
 {
-  static gchar buffer[256];
-  gchar suffix_str[32] = "";
+  return format == OUTPUT_FORMAT_ARROW ? "Arrow" : "CSV";
+}
 
-  if (!card || !card->holder) {
-    return "<invalid card>";
-  }
+static const gchar *
+output_suffix(enum output_format format)
+{
+  return format == OUTPUT_FORMAT_ARROW ? AMEX_ARROW_SUFFIX :
+                                         BATCH_OUTPUT_SUFFIX;
+}
 
-  if (card->suffix) {
-    g_snprintf(suffix_str, sizeof(suffix_str), "-%s", card->suffix);
-  }
+/* With -o - the transactions go to standard output instead of the listing */
+static gboolean
+print_listing(const struct prog_options *opts)
+{
+  return g_strcmp0(opts->outfile, OUTPUT_STDOUT) != 0;
+}
 
-  g_snprintf(buffer, sizeof(buffer), "%s%s",
-             card->holder, suffix_str);
+/* To standard output, or stderr if the transactions are written there */
+static void
+print_summary(const struct prog_options *opts,
+              const struct amex_summary *summary)
+{
+  GString *gs = g_string_new(NULL);
 
-  return buffer;
+  if (opts->report == STATS_FORMAT_JSON) {
+    amex_summary_append_json(summary, gs);
+    g_string_append_c(gs, '\n');
+  } else {
+    amex_summary_append_text(summary, gs);
+  }
+
+  /* As UTF-8, g_print() would convert to the locale's charset */
+  fwrite(gs->str, 1, gs->len, print_listing(opts) ? stdout : stderr);
+  g_string_free(gs, TRUE);
 }
 
-static struct amex_card *
-alloc_amex_card(const gchar *holder, const gchar *suffix)
+/* Arrow files need all rows before the footer, they are built in memory */
+static guint
+write_arrow(struct amex_arrow_writer *writer, struct output *out)
 {
-  struct amex_card *card;
-
-  g_assert(holder);
+  GString *gs = g_string_new(NULL);
+  guint tc;
 
-  card = g_malloc0(sizeof(*card));
-  card->holder = g_strdup(holder);
-  card->suffix = g_strdup(suffix);
-  card->transactions = g_ptr_array_new_with_free_func(free_transaction_entry);
-  g_message("Allocated new %sAmex card %s for %s",
-            card->suffix ? "Extra " : "",
-            card->suffix ? card->suffix : "", card->holder);
+  tc = amex_arrow_writer_finish(writer, gs);
+  output_write(out, gs->str, gs->len);
+  g_string_free(gs, TRUE);
 
-  return card;
+  return tc;
 }
 
 static gboolean
-parse_page_num(const gchar *str, gint *page, gint *total_pages, GError **err)
+dump_transactions_to_file(struct amex_statement *st, const gchar *outfile,
+                          enum output_format format, GError **err)
 {
-  gint tc;
+  struct output *out;
+  guint64 written;
+  guint tc;
 
-  g_assert(str);
-  g_assert(total_pages);
-  g_assert(page);
+  g_assert(st);
+  g_assert(outfile);
 
-  if ((tc = sscanf(str, PAGE_IDSTR_PFX"%d av %d", page, total_pages)) < 0) {
-    SET_GERROR(err, -1, "could not parse page number: %s", g_strerror(errno));
+  if ((out = output_open(outfile, err)) == NULL) {
     return FALSE;
-  } else if (tc != 2) {
-    SET_GERROR(err, -1,
-               "invalid token count when parsing page (got %d, need 2)", tc);
+  }
+
+  if (format == OUTPUT_FORMAT_ARROW) {
+    struct amex_arrow_writer *writer = amex_arrow_writer_new();
+
+    amex_arrow_writer_add(writer, st);
+    tc = write_arrow(writer, out);
+    amex_arrow_writer_free(writer);
+  } else {
+    tc = amex_statement_write_csv(st, out);
+  }
+
+  written = output_written(out);
+  if (!output_close(out, err)) {
     return FALSE;
   }
+  stats_add(amex_statement_stats(st), STATS_BYTES_WRITTEN, written);
+
+  log_info(LOG_CAT_OUTPUT, "Wrote %u transaction(s) to %s file '%s'",
+           tc, output_format_name(format), outfile);
 
   return TRUE;
 }
 
+struct batch_job {
+  const gchar *infile;
+  gchar *outfile;
+  enum output_format format;
+  /* Summed up on the worker if set, merged in input order */
+  gboolean summarize;
+  struct amex_summary *summary;
+  struct amex_statement *st;
+  GError *err;
+  /* Set once the worker is done with it, guarded by the batch lock */
+  gboolean done;
+};
+
+/* Shared by the batch workers, the parser is read-only */
+struct batch_ctx {
+  const struct amex_parser *parser;
+  GMutex lock;
+  GCond done_cond;
+};
+
 static void
-combine_columns(GPtrArray *results, GList **lhs, GList **rhs)
+batch_process(struct batch_job *job, const struct amex_parser *parser)
 {
-  gint i;
-
-  g_assert(results);
-  g_assert(lhs);
-  g_assert(rhs);
+  struct statistics *stats;
+  gint64 start;
 
-  for (i = 0; i < 2; i++) {
-    GList **l = i == 0 ? lhs : rhs;
-    GList *node;
-    gint j;
+  if ((job->st = amex_parser_parse_file(parser, job->infile,
+                                        &job->err)) == NULL) {
+    return;
+  }
 
-    for (node = *l, j = 0; node; node = node->next, j++) {
-      g_ptr_array_add(results, g_strdup((gchar *) node->data));
-    }
-    g_list_free_full(*l, g_free);
-    *l = NULL;
-    g_message("[%s] Added %d entries", i == 0 ? "LHS" : "RHS", j);
+  stats = amex_statement_stats(job->st);
+  start = stats_clock(stats);
+  if (job->outfile && !dump_transactions_to_file(job->st, job->outfile,
+                                                 job->format, &job->err)) {
+    g_prefix_error(&job->err, "could not write %s: ",
+                   output_format_name(job->format));
+    g_clear_pointer(&job->st, amex_statement_free);
+    return;
   }
+  if (job->summarize) {
+    job->summary = amex_summary_new();
+    amex_summary_add(job->summary, job->st);
+  }
+  stats_time(stats, STATS_TIME_OUTPUT, start);
 }
 
-static gboolean
-split_lines_file(const gchar *filename, gint split_width,
-                 GPtrArray *lines, GError **err)
+static void
+batch_worker(gpointer data, gpointer user_data)
 {
-  gchar *buffer = NULL;
-  gboolean ret = FALSE;
-  gint page = 0;
-  gint last_page = 0;
-  gint page_total = 0;
-  guint i;
-  gsize flen = 0;
-  gchar **splits = NULL;
+  struct batch_job *job = (struct batch_job *) data;
+  struct batch_ctx *ctx = user_data;
 
-  GList *lhs = NULL;
-  GList *rhs = NULL;
+  batch_process(job, ctx->parser);
 
-  g_assert(filename);
-  g_assert(lines);
+  g_mutex_lock(&ctx->lock);
+  job->done = TRUE;
+  g_cond_signal(&ctx->done_cond);
+  g_mutex_unlock(&ctx->lock);
+}
 
-  /* 0. Read the file */
-  if (!g_file_get_contents(filename, &buffer, &flen, err)) {
-    return FALSE;
+static gint
+compare_filenames(gconstpointer a, gconstpointer b)
+{
+  return g_strcmp0(*(const gchar **) a, *(const gchar **) b);
+}
+
+static gboolean
+is_batch_input(const gchar *name)
+{
+#ifdef HAVE_POPPLER
+  if (g_str_has_suffix(name, BATCH_PDF_SUFFIX)) {
+    return TRUE;
   }
+#endif
 
-  /* 1. Split into lines */
-  splits = g_strsplit(buffer, "\n", -1);
+  return g_str_has_suffix(name, BATCH_INPUT_SUFFIX);
+}
 
-  for (i = 0; splits[i]; i++) {
-    gchar *l = splits[i];
-    const gchar *tmp = g_strstr_len(l, -1, PAGE_IDSTR_PFX);
-    gchar *tmp_lhs = NULL;
-    gchar *tmp_rhs = NULL;
-    gint slen;
+static gboolean
+collect_batch_inputs(gchar **paths, gint count, GPtrArray *infiles,
+                     GError **err)
+{
+  gint i;
 
-    if (!tmp && !page_total) {
-      /* Discard everything until we find the page identifier */
-      continue;
-    } else if (tmp) {
-      /* Page indicator */
-      if (!parse_page_num(tmp, &page, &page_total, err)) {
-        goto out;
-      }
+  g_assert(paths);
+  g_assert(infiles);
 
-      if (page > 1 && page != last_page) {
-        /* Handle next page here */
-        combine_columns(lines, &lhs, &rhs);
-        last_page = page;
-      }
-      g_message("Processing page %d of %d...", page, page_total);
+  for (i = 0; i < count; i++) {
+    GPtrArray *entries;
+    const gchar *name;
+    GDir *dir;
+    guint j;
+
+    if (!g_file_test(paths[i], G_FILE_TEST_IS_DIR)) {
+      g_ptr_array_add(infiles, g_strdup(paths[i]));
       continue;
     }
 
-    slen = strlen(l);
-    g_strdelimit(l, ";", '?');
-
-    if (slen >= split_width) {
-      l[split_width - 1] = '\0';
-      tmp_lhs = g_strdup(g_strstrip(l));
-      tmp_rhs = g_strdup(g_strstrip(l + split_width));
-    } else {
-      tmp_lhs = g_strdup(g_strstrip(l));
+    if ((dir = g_dir_open(paths[i], 0, err)) == NULL) {
+      return FALSE;
     }
 
-    if (strlen(tmp_lhs)) {
-      lhs = g_list_append(lhs, tmp_lhs);
-    } else {
-      g_free(tmp_lhs);
-    }
+    /* Directory order is arbitrary, keep the output stable */
+    entries = g_ptr_array_new();
+    while ((name = g_dir_read_name(dir)) != NULL) {
+      gchar *path = g_build_filename(paths[i], name, NULL);
 
-    if (tmp_rhs && strlen(tmp_rhs)) {
-      rhs = g_list_append(rhs, tmp_rhs);
-    } else {
-      g_free(tmp_rhs);
+      if (!is_batch_input(name) ||
+          !g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+        g_free(path);
+        continue;
+      }
+      g_ptr_array_add(entries, path);
     }
-  }
+    g_dir_close(dir);
 
-  /* If we didn't find a page total then this is probably not an Amex faktura */
-  if (!page_total) {
-    SET_GERROR(err, -1,
-               "could not find page identifier (is this an Amex bill?)");
-    goto out;
+    g_ptr_array_sort(entries, compare_filenames);
+    for (j = 0; j < entries->len; j++) {
+      g_ptr_array_add(infiles, g_ptr_array_index(entries, j));
+    }
+    g_ptr_array_free(entries, TRUE);
   }
 
-  g_message("Read %zi byte(s), %d pages and added %d line(s) from '%s'",
-            flen, page_total, lines->len, filename);
-  ret = TRUE;
-
-out:
-  g_strfreev(splits);
-  g_free(buffer);
-  g_list_free_full(lhs, g_free);
-  g_list_free_full(rhs, g_free);
+  return TRUE;
+}
 
-  if (!ret) {
-    g_prefix_error(err, "L%d: ", i);
+static gchar *
+batch_output_filename(const gchar *outdir, const gchar *infile,
+                      const gchar *suffix)
+{
+  gchar *base = g_path_get_basename(infile);
+  gchar *fname;
+  gchar *path;
+
+  if (g_str_has_suffix(base, BATCH_INPUT_SUFFIX)) {
+    base[strlen(base) - strlen(BATCH_INPUT_SUFFIX)] = '\0';
+  } else if (g_str_has_suffix(base, BATCH_PDF_SUFFIX)) {
+    base[strlen(base) - strlen(BATCH_PDF_SUFFIX)] = '\0';
   }
 
-  return ret;
+  fname = g_strconcat(base, suffix, NULL);
+  path = g_build_filename(outdir, fname, NULL);
+  g_free(fname);
+  g_free(base);
+
+  return path;
 }
 
 static gboolean
-handle_card_change(struct prog_state *state, const gchar *holder,
-                   GError **err)
+write_ledger(const gchar *dir, struct amex_ledger *ledger,
+             struct stats_report *report, GError **err)
 {
+  GPtrArray *cards;
+  guint dropped;
   guint i;
-  gchar *hldr_str = g_strdup(holder);
-  gchar *eptr = g_strstr_len(hldr_str, -1, EXTRAKORT_PFX);
-  gchar *suffix = NULL;
 
-  if (eptr) {
-    *eptr = '\0';
-    suffix = g_strstrip(eptr + strlen(EXTRAKORT_PFX));
-  }
+  g_assert(dir);
+  g_assert(ledger);
+  g_assert(report);
 
-  g_strstrip(hldr_str);
+  if (g_mkdir_with_parents(dir, 0755) < 0) {
+    SET_GERROR(err, -1, "could not create ledger directory '%s': %s",
+               dir, g_strerror(errno));
+    return FALSE;
+  }
 
-  for (i = 0; i < state->cards->len; i++) {
-    struct amex_card *c = g_ptr_array_index(state->cards, i);
+  dropped = amex_ledger_merge(ledger);
+  cards = amex_ledger_cards(ledger);
+  for (i = 0; i < cards->len; i++) {
+    const struct amex_ledger_card *card = g_ptr_array_index(cards, i);
+    GString *gs = g_string_new(NULL);
+    gchar *fname;
+    gchar *path;
+    gboolean ok;
+
+    amex_ledger_card_append_csv(card, gs);
+    fname = g_strconcat(card->name, BATCH_OUTPUT_SUFFIX, NULL);
+    g_strcanon(fname, LEDGER_NAME_CHARS ".", '_');
+    path = g_build_filename(dir, fname, NULL);
+
+    if ((ok = g_file_set_contents(path, gs->str, gs->len, err)) == TRUE) {
+      stats_add(&report->total, STATS_BYTES_WRITTEN, gs->len);
+      log_info(LOG_CAT_OUTPUT, "Wrote %u transaction(s) to ledger '%s'",
+               card->transactions->len, path);
+    }
+    g_free(path);
+    g_free(fname);
+    g_string_free(gs, TRUE);
 
-    if (!g_strcmp0(c->holder, hldr_str)) {
-      if (!suffix || !g_strcmp0(suffix, c->suffix)) {
-        g_message("Using existing card '%s'", print_amex_card(c));
-        state->curr_card = c;
-        goto out;
-      }
+    if (!ok) {
+      return FALSE;
     }
   }
 
-  /* New card */
-  state->curr_card = alloc_amex_card(g_strstrip(hldr_str), suffix);
-  g_ptr_array_add(state->cards, state->curr_card);
-  /* fall through */
-
-out:
-  g_free(hldr_str);
+  log_info(LOG_CAT_OUTPUT, "Wrote the ledgers of %u card(s), dropped %u "
+           "duplicate transaction(s)", cards->len, dropped);
 
   return TRUE;
 }
 
-#define DATE_STR_LEN 9
-
-static GDateTime *
-parse_amex_date(const gchar *str, GError **err)
+#ifdef HAVE_SQLITE
+/*
+ * Store statements in one database transaction. Statements that can't be
+ * stored are logged and counted in failed, the others are kept.
+ */
+static gboolean
+store_statements(struct amex_db *db, struct amex_statement **sts, guint n,
+                 guint *failed, GError **err)
 {
-  GDateTime *res;
-  gint year = 0;
-  gint month = 0;
-  gint day = 0;
-  gint tc;
+  guint i;
+
+  g_assert(db);
 
-  /* Amex date format is DD.MM.YY */
-  if ((tc = sscanf(str, "%02d.%02d.%02d",
-                  &day, &month, &year)) != 3) {
-    SET_GERROR(err, -1, "invalid date format, %s",
-               tc < 0 ? g_strerror(errno) : "too few tokens");
-    return NULL;
+  if (!amex_db_begin(db, err)) {
+    return FALSE;
   }
 
-  if ((res = g_date_time_new_local(year + 2000,
-                                   month,
-                                   day, 12, 00, 00.00)) == NULL) {
-    /* Not a valid date */
-    SET_GERROR(err, -1, "could not parse date");
+  for (i = 0; i < n; i++) {
+    GError *st_err = NULL;
+
+    if (!amex_db_add(db, sts[i], &st_err)) {
+      log_error(LOG_CAT_GENERAL, "Could not store '%s': %s",
+                amex_statement_filename(sts[i]), GERROR_MSG(st_err));
+      g_clear_error(&st_err);
+      (*failed)++;
+    }
   }
 
-  return res;
+  return amex_db_commit(db, err);
 }
+#endif
 
 static gboolean
-is_amex_transaction(const gchar *line, GDateTime **tdate, GDateTime **pdate)
+run_batch(const struct prog_options *opts, const struct amex_parser *parser,
+          struct amex_db *db, GPtrArray *infiles, struct amex_summary *summary,
+          struct stats_report *report, GError **err)
 {
-  GDateTime *td = NULL;
-  GDateTime *pd = NULL;
-  guint offs;
-  gint i;
+  struct amex_arrow_writer *arrow = NULL;
+  struct amex_ledger *ledger = NULL;
+  struct output *combined = NULL;
+  struct amex_statement **sts;
+  struct batch_job *jobs;
+  struct batch_ctx ctx;
+  GThreadPool *pool;
+  gboolean ret = TRUE;
+  gboolean keep;
+  guint failed = 0;
+  guint queued;
+  guint ahead;
+  guint tc = 0;
+  guint n = 0;
+  gint64 start;
+  guint i;
 
-  g_assert(line);
+  g_assert(opts);
+  g_assert(parser);
+  g_assert(infiles);
+  g_assert(report);
 
-  if (strlen(line) < DATE_STR_LEN * 2) {
-    /* Line is too short */
+  if (opts->outdir && g_mkdir_with_parents(opts->outdir, 0755) < 0) {
+    SET_GERROR(err, -1, "could not create output directory '%s': %s",
+               opts->outdir, g_strerror(errno));
     return FALSE;
   }
 
-  /* 08.06.21 08.06.21 */
-  for (i = 0, offs = 0; i < 2; i++, offs += DATE_STR_LEN) {
-    GDateTime **ptr = i == 0 ? &td : &pd;
+  /* Statements are written to it as they are collected below */
+  if (opts->outfile &&
+      (combined = output_open(opts->outfile, err)) == NULL) {
+    return FALSE;
+  }
 
-    if ((*ptr = parse_amex_date(line + offs, NULL)) == NULL) {
-      /* Not a valid date */
-      goto out;
-    }
+  ctx.parser = parser;
+  g_mutex_init(&ctx.lock);
+  g_cond_init(&ctx.done_cond);
+  if ((pool = g_thread_pool_new(batch_worker, &ctx, opts->jobs,
+                                FALSE, err)) == NULL) {
+    g_clear_pointer(&combined, output_abort);
+    g_cond_clear(&ctx.done_cond);
+    g_mutex_clear(&ctx.lock);
+    return FALSE;
   }
 
-out:
-  if (!td || !pd) {
-    g_clear_pointer(&td, g_date_time_unref);
-    g_clear_pointer(&pd, g_date_time_unref);
-    /* not an AMEX transaction */
+  log_info(LOG_CAT_GENERAL, "Parsing %u file(s) using %d thread(s)",
+           infiles->len, opts->jobs);
+
+  jobs = g_new0(struct batch_job, infiles->len);
+  for (i = 0; i < infiles->len; i++) {
+    jobs[i].infile = g_ptr_array_index(infiles, i);
+    jobs[i].outfile = opts->outdir ?
+                      batch_output_filename(opts->outdir, jobs[i].infile,
+                                            output_suffix(opts->format)) :
+                      NULL;
+    jobs[i].format = opts->format;
+    /* Ledgers drop duplicates first, they are summed up once merged */
+    jobs[i].summarize = summary && !opts->ledger_dir;
+  }
 
-    return FALSE;
+  /*
+   * Statements are collected in input order as soon as they are parsed, and
+   * freed right after unless the ledger, store or database needs all of them
+   * at the end. Only a few are parsed ahead then, so memory use doesn't
+   * grow with the batch.
+   */
+  keep = opts->ledger_dir || opts->store_file || db;
+  ahead = keep ? infiles->len :
+          MIN(infiles->len, (guint) opts->jobs * BATCH_JOBS_AHEAD);
+  for (queued = 0; queued < ahead; queued++) {
+    g_thread_pool_push(pool, &jobs[queued], NULL);
   }
 
-  g_assert(td && pd);
-  if (tdate) {
-    *tdate = g_date_time_ref(td);
+  if (combined && opts->format == OUTPUT_FORMAT_ARROW) {
+    arrow = amex_arrow_writer_new();
   }
-  if (pdate) {
-    *pdate = g_date_time_ref(pd);
+  if (opts->ledger_dir) {
+    ledger = amex_ledger_new();
   }
 
-  g_date_time_unref(td);
-  g_date_time_unref(pd);
+  for (i = 0; i < infiles->len; i++) {
+    struct batch_job *job = &jobs[i];
 
-  return TRUE;
-}
+    g_mutex_lock(&ctx.lock);
+    while (!job->done) {
+      g_cond_wait(&ctx.done_cond, &ctx.lock);
+    }
+    g_mutex_unlock(&ctx.lock);
+    if (queued < infiles->len) {
+      g_thread_pool_push(pool, &jobs[queued++], NULL);
+    }
 
-static gboolean
-parse_transaction_amount(const gchar *str, gdouble *result, GError **err)
-{
-  gint i;
-  gint j;
-  gchar sbuff[64];
-  gchar *eptr = NULL;
+    if (!job->st) {
+      log_error(LOG_CAT_GENERAL, "Could not process '%s': %s",
+                job->infile, GERROR_MSG(job->err));
+      failed++;
+    } else {
+      struct statistics *stats = amex_statement_stats(job->st);
 
-  g_assert(str);
-  g_assert(result);
+      start = stats_clock(stats);
+      if (print_listing(opts)) {
+        g_print("Statement: %s\n", job->infile);
+        dump_transactions(job->st);
+      }
+      if (arrow) {
+        amex_arrow_writer_add(arrow, job->st);
+      } else if (combined) {
+        tc += amex_statement_write_csv(job->st, combined);
+      }
+      if (ledger) {
+        amex_ledger_add(ledger, job->st);
+      }
+      if (job->summary) {
+        amex_summary_merge(summary, job->summary);
+      }
+      stats_time(stats, STATS_TIME_OUTPUT, start);
+      stats_report_add(report, job->infile, stats);
+      if (!keep) {
+        g_clear_pointer(&job->summary, amex_summary_free);
+        g_clear_pointer(&job->st, amex_statement_free);
+      }
+    }
+  }
 
-  for (i = 0, j = 0; str[i] && j < sizeof(sbuff) - 1; i++) {
+  /* Every job is done already */
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_cond_clear(&ctx.done_cond);
+  g_mutex_clear(&ctx.lock);
 
-    if (!g_ascii_isdigit(str[i])) {
-      if (!i) {
-        if (str[i] != '-') {
-          SET_GERROR(err, -1, "value '%s' is malformed", str);
-          return FALSE;
-        }
-        /* negative transaction */
-      } else if (str[i] == '.') {
-        continue;
-      } else if (str[i] == ',') {
-        sbuff[j++] = '.';
-        continue;
-      } else if (str[i] == ' ') {
-        break;
-      } else {
-        SET_GERROR(err, -1, "invalid character 0x%x in value (str=%s)", str[i], str);
-        return FALSE;
+  if (combined) {
+    guint64 written;
+
+    start = stats_clock(&report->total);
+    /* All statements go into a single record batch */
+    if (arrow) {
+      tc = write_arrow(arrow, combined);
+      amex_arrow_writer_free(arrow);
+    }
+    written = output_written(combined);
+    if ((ret = output_close(combined, err)) == TRUE) {
+      log_info(LOG_CAT_OUTPUT, "Wrote %u transaction(s) to %s file '%s'",
+               tc, output_format_name(opts->format), opts->outfile);
+      stats_add(&report->total, STATS_BYTES_WRITTEN, written);
+    }
+    stats_time(&report->total, STATS_TIME_OUTPUT, start);
+  }
+
+  sts = g_new(struct amex_statement *, infiles->len);
+  for (i = 0; i < infiles->len; i++) {
+    if (jobs[i].st) {
+      sts[n++] = jobs[i].st;
+    }
+  }
+#ifdef HAVE_SQLITE
+  /* One transaction for the whole batch */
+  if (db && ret) {
+    start = stats_clock(&report->total);
+    ret = store_statements(db, sts, n, &failed, err);
+    stats_time(&report->total, STATS_TIME_OUTPUT, start);
+  }
+#endif
+  /* The store is rewritten once for the whole batch */
+  if (opts->store_file && ret) {
+    guint skipped = 0;
+
+    start = stats_clock(&report->total);
+    if (!amex_store_update(opts->store_file, sts, n, &skipped, err)) {
+      g_prefix_error(err, "could not update store '%s': ", opts->store_file);
+      ret = FALSE;
+    }
+    /* The database counted statements without an OCR number already */
+    failed += db ? 0 : skipped;
+    stats_time(&report->total, STATS_TIME_OUTPUT, start);
+  }
+  g_free(sts);
+
+  /* The ledger points into the statements, they are freed after it */
+  if (ledger && ret) {
+    start = stats_clock(&report->total);
+    ret = write_ledger(opts->ledger_dir, ledger, report, err);
+    if (ret && summary) {
+      GPtrArray *cards = amex_ledger_cards(ledger);
+
+      for (i = 0; i < cards->len; i++) {
+        const struct amex_ledger_card *card = g_ptr_array_index(cards, i);
+
+        amex_summary_add_card(summary, card->name, card->transactions);
       }
     }
-    sbuff[j++] = str[i];
+    stats_time(&report->total, STATS_TIME_OUTPUT, start);
   }
+  amex_ledger_free(ledger);
 
-  sbuff[j] = '\0';
-  *result = g_ascii_strtod(sbuff, &eptr);
+  for (i = 0; i < infiles->len; i++) {
+    g_clear_error(&jobs[i].err);
+    g_free(jobs[i].outfile);
+    amex_summary_free(jobs[i].summary);
+    g_clear_pointer(&jobs[i].st, amex_statement_free);
+  }
+  g_free(jobs);
 
-  if (errno) {
-    SET_GERROR(err, -1, "could not convert amount '%s' to float", sbuff);
-    return FALSE;
-  } else if (eptr && strlen(eptr)) {
-    SET_GERROR(err, -1, "got garbage after amount");
-    return FALSE;
+  if (ret && failed) {
+    SET_GERROR(err, -1, "%u of %u file(s) could not be processed",
+               failed, infiles->len);
+    ret = FALSE;
   }
 
-  return TRUE;
+  return ret;
 }
 
-static gboolean
-parse_transaction_details(struct prog_state *state, const gchar *str,
-                          struct transaction *t,
-                          GError **err)
-{
-  GString *gs = NULL;
-  gchar *loc_str = NULL;
-  gchar *ldup = NULL;
-  gchar **splits = NULL;
-  guint tc;
-  guint i;
+#ifdef HAVE_INOTIFY
+enum watch_state {
+  WATCH_QUEUED = 1,
+  /* Written again while queued or being parsed, parse it once more */
+  WATCH_REQUEUE,
+};
 
-  g_assert(state);
-  g_assert(str);
-  g_assert(t);
-  g_assert(state->loc_hash);
+struct watcher {
+  const struct prog_options *opts;
+  /* Only used from the main loop */
+  struct amex_db *db;
+  struct amex_parser_options popts;
+  /* Replaced when the location file changes, guarded by lock */
+  struct amex_parser *parser;
+  GMutex lock;
+  GThreadPool *pool;
+  /* Input filename -> enum watch_state, while queued or being parsed */
+  GHashTable *pending;
+  struct stats_report *report;
+  GMainLoop *loop;
+  gint fd;
+  gint inbox_wd;
+  gint locations_wd;
+  gchar *locations_name;
+  /* File events first, then the signals. 0 once removed */
+  guint sources[3];
+  gboolean stopping;
+  gboolean lost;
+  guint n_done;
+  guint n_failed;
+};
 
-  ldup = g_strstrip(g_strdup(str));
+struct watch_job {
+  struct watcher *watcher;
+  gchar *infile;
+  gchar *outfile;
+  struct amex_statement *st;
+  GError *err;
+};
 
-  /* Algorithm is as follows:
-   *  - Take the following line and check against the location hash. If a match
-   *    is made, then use this as the location, the remainder as the details.
-   *  - If no match, take the last string
-   */
-  if (state->idx + 1 < state->lines->len + 1) {
-    gchar *tmp = (gchar *) g_ptr_array_index(state->lines, state->idx + 1);
+static void
+watch_job_free(struct watch_job *job)
+{
+  g_clear_error(&job->err);
+  g_clear_pointer(&job->st, amex_statement_free);
+  g_free(job->outfile);
+  g_free(job->infile);
+  g_free(job);
+}
 
-    if ((loc_str = g_strdup(g_hash_table_lookup(state->loc_hash,
-                                                tmp))) != NULL) {
-      /* Got a location match! Nice! */
-      state->idx++;
+static void
+watch_queue(struct watcher *w, const gchar *infile);
+
+/* Runs in the main loop once a worker is done with a statement */
+static gboolean
+watch_job_done(gpointer data)
+{
+  struct watch_job *job = (struct watch_job *) data;
+  struct watcher *w = job->watcher;
+  gint state;
+
+  if (!job->st) {
+    log_error(LOG_CAT_GENERAL, "Could not process '%s': %s",
+              job->infile, GERROR_MSG(job->err));
+    w->n_failed++;
+  } else {
+    GError *err = NULL;
+    guint failed = 0;
+
+#ifdef HAVE_SQLITE
+    if (w->db && !store_statements(w->db, &job->st, 1, &failed, &err)) {
+      log_error(LOG_CAT_GENERAL, "Could not store '%s': %s", job->infile,
+                GERROR_MSG(err));
+      g_clear_error(&err);
+      failed++;
+    }
+#endif
+    if (w->opts->store_file &&
+        !amex_store_update(w->opts->store_file, &job->st, 1, &failed, &err)) {
+      log_error(LOG_CAT_GENERAL, "Could not update store '%s': %s",
+                w->opts->store_file, GERROR_MSG(err));
+      g_clear_error(&err);
+      failed++;
     }
+    /* Counted once, whatever failed */
+    w->n_failed += failed != 0;
+    w->n_done += !failed;
+    stats_report_add(w->report, job->infile, amex_statement_stats(job->st));
   }
 
-  splits = g_strsplit(ldup, " ", -1);
-  if ((tc = g_strv_length(splits)) <= 1) {
-    g_warning("L%d: Very weird line with no spaces (%s)", state->idx, ldup);
-    t->details = g_strdup(ldup);
-    t->location = loc_str;
-    return TRUE;
+  state = GPOINTER_TO_INT(g_hash_table_lookup(w->pending, job->infile));
+  g_hash_table_remove(w->pending, job->infile);
+  if (state == WATCH_REQUEUE) {
+    watch_queue(w, job->infile);
   }
+  watch_job_free(job);
+
+  return G_SOURCE_REMOVE;
+}
 
-  g_debug("Remaining line: '%s'  tc=%u", ldup, g_strv_length(splits));
-  gs = g_string_new(NULL);
-  /* Check if the last token is the location */
-  if (!loc_str) {
-    loc_str = g_strdup(g_hash_table_lookup(state->loc_hash, splits[tc -1]));
+static void
+watch_worker(gpointer data, gpointer user_data)
+{
+  struct watch_job *job = (struct watch_job *) data;
+  struct watcher *w = job->watcher;
+  struct amex_parser *parser;
+  struct statistics *stats;
+  gint64 start;
+
+  /* Take the parser when starting, so queued jobs see reloaded locations */
+  g_mutex_lock(&w->lock);
+  parser = amex_parser_ref(w->parser);
+  g_mutex_unlock(&w->lock);
+
+  if ((job->st = amex_parser_parse_file(parser, job->infile,
+                                        &job->err)) == NULL) {
+    goto out;
   }
-  for (i = 0; i < tc; i++) {
-    if (!strlen(splits[i])) {
-      continue;
-    } else if (loc_str && i == tc - 1 && !g_strcmp0(loc_str, splits[i])) {
-      continue;
-    }
-    g_string_append_printf(gs, "%s%s", gs->len ? " " : "", splits[i]);
+
+  stats = amex_statement_stats(job->st);
+  start = stats_clock(stats);
+  if (!dump_transactions_to_file(job->st, job->outfile, w->opts->format,
+                                 &job->err)) {
+    g_prefix_error(&job->err, "could not write %s: ",
+                   output_format_name(w->opts->format));
+    g_clear_pointer(&job->st, amex_statement_free);
+    goto out;
   }
+  stats_time(stats, STATS_TIME_OUTPUT, start);
+  /* fall through */
+out:
+  amex_parser_unref(parser);
+  g_idle_add(watch_job_done, job);
+}
 
-  g_strfreev(splits);
-  g_free(ldup);
-  t->location = loc_str;
-  t->details = g_string_free(gs, FALSE);
+static gchar *
+watch_output_filename(const struct watcher *w, const gchar *infile)
+{
+  gchar *dir;
+  gchar *path;
 
-  return TRUE;
+  if (w->opts->outdir) {
+    return batch_output_filename(w->opts->outdir, infile,
+                                 output_suffix(w->opts->format));
+  }
+
+  /* Next to the statement */
+  dir = g_path_get_dirname(infile);
+  path = batch_output_filename(dir, infile, output_suffix(w->opts->format));
+  g_free(dir);
 
+  return path;
 }
 
-static gboolean
-process_transaction_line(struct prog_state *state, const gchar *line,
-                         GError **err)
+static void
+watch_queue(struct watcher *w, const gchar *infile)
 {
-  struct transaction *t;
-  gchar *tmp;
-  gchar *ldup = NULL;
+  struct watch_job *job;
 
-  g_assert(state);
-  g_assert(line);
-
-  if (!state->curr_card) {
-    /* This should probably be an error ... */
-    g_warning("Transaction without a current card!");
-    return TRUE;
+  if (w->stopping) {
+    return;
   }
 
-  t = g_malloc0(sizeof(*t));
-  if (!is_amex_transaction(line, &t->date, &t->process_date)) {
-    SET_GERROR(err, -1, "not a valid AMEX transaction");
-    goto out_fail;
+  if (g_hash_table_lookup(w->pending, infile)) {
+    g_hash_table_insert(w->pending, g_strdup(infile),
+                        GINT_TO_POINTER(WATCH_REQUEUE));
+    return;
   }
 
-  g_assert(strlen(line) >= DATE_STR_LEN * 2);
-  ldup = g_strdup(line + DATE_STR_LEN * 2);
+  log_info(LOG_CAT_GENERAL, "Queueing '%s'", infile);
+  g_hash_table_insert(w->pending, g_strdup(infile),
+                      GINT_TO_POINTER(WATCH_QUEUED));
 
-  /* Get the value of the transaction */
-  if ((tmp = g_strrstr(ldup, " ")) == NULL) {
-    SET_GERROR(err, -1, "malformed line, missing amount separator");
-    goto out_fail;
-  }
+  job = g_new0(struct watch_job, 1);
+  job->watcher = w;
+  job->infile = g_strdup(infile);
+  job->outfile = watch_output_filename(w, infile);
+  g_thread_pool_push(w->pool, job, NULL);
+}
+
+/* Queue the statements without output, or with output older than the input */
+static void
+watch_scan(struct watcher *w)
+{
+  GPtrArray *infiles = g_ptr_array_new_with_free_func(g_free);
+  gchar *dir = w->opts->watch_dir;
+  GError *err = NULL;
+  guint i;
 
-  /* Parse the value */
-  if (!parse_transaction_amount(tmp + 1, &t->value_sek, err)) {
-    g_prefix_error(err, "process amount: ");
-    goto out_fail;
+  if (!collect_batch_inputs(&dir, 1, infiles, &err)) {
+    log_error(LOG_CAT_GENERAL, "Could not read '%s': %s",
+              w->opts->watch_dir, GERROR_MSG(err));
+    g_clear_error(&err);
   }
 
-  *tmp = '\0'; /* Truncate the amount part */
-  if (!parse_transaction_details(state, ldup, t, err)) {
-    g_prefix_error(err, "parse details: ");
-    goto out_fail;
+  for (i = 0; i < infiles->len; i++) {
+    const gchar *infile = g_ptr_array_index(infiles, i);
+    gchar *outfile = watch_output_filename(w, infile);
+    struct stat in_sb;
+    struct stat out_sb;
+
+    if (stat(infile, &in_sb) == 0 &&
+        (stat(outfile, &out_sb) < 0 || out_sb.st_mtime < in_sb.st_mtime)) {
+      watch_queue(w, infile);
+    }
+    g_free(outfile);
   }
+  g_ptr_array_unref(infiles);
+}
 
-  g_message("Transaction for '%s', location=%s on %s for %.2f SEK, details: '%s'",
-            state->curr_card->holder,
-            t->location ? t->location : "unknown",
-            format_dt(t->date), t->value_sek, t->details);
+static void
+watch_reload_locations(struct watcher *w)
+{
+  struct location_index *locs;
+  struct amex_parser *old;
+  GError *err = NULL;
+  gint64 start;
 
-  g_free(ldup);
-  g_ptr_array_add(state->curr_card->transactions, t);
-  state->stats.transaction_count++;
+  start = stats_clock(&w->report->total);
+  if ((locs = location_index_load(w->opts->location_file, &err)) == NULL) {
+    log_error(LOG_CAT_GENERAL, "Could not reload location file, keeping "
+              "the previous one: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+    return;
+  }
+  stats_time(&w->report->total, STATS_TIME_LOCATIONS, start);
 
-  return TRUE;
+  log_info(LOG_CAT_GENERAL, "Reloaded %u location entries from '%s'",
+           location_index_size(locs), w->opts->location_file);
+  if (w->popts.cache) {
+    amex_cache_purge(w->popts.cache, location_index_version(locs));
+  }
 
-out_fail:
-  g_free(ldup);
-  free_transaction_entry(t);
+  /* Jobs already running keep the parser they started with */
+  g_mutex_lock(&w->lock);
+  old = w->parser;
+  w->parser = amex_parser_new(&w->popts, locs);
+  g_mutex_unlock(&w->lock);
 
-  return FALSE;
+  amex_parser_unref(old);
+  location_index_unref(locs);
 }
 
+/* Stop watching for good, from the file events source */
 static gboolean
-process_line(struct prog_state *state, const gchar *line, GError **err)
+watch_lost(struct watcher *w)
 {
-  g_assert(state);
-  g_assert(line);
+  w->lost = TRUE;
+  /* The source goes away on return, so it must not be removed again */
+  w->sources[0] = 0;
+  g_main_loop_quit(w->loop);
 
-  if (g_str_has_prefix(line, CARD_IDSTR_BEGIN_PFX)) {
-    if (!handle_card_change(state, line + strlen(CARD_IDSTR_BEGIN_PFX), err)) {
-      goto out_fail;
-    }
-    return TRUE;
-  } else if (g_str_has_prefix(line, CARD_IDSTR_END_PFX)) {
-    if (!state->curr_card) {
-      SET_GERROR(err, -1, "got card end, but no current card!");
-      goto out_fail;
-    }
-    g_message("Closed session for card '%s', %u transactions to date",
-              state->curr_card->holder, state->curr_card->transactions->len);
-    state->curr_card = NULL;
-    return TRUE;
-  } else if (is_amex_transaction(line, NULL, NULL)) {
-      if (!process_transaction_line(state, line, err)) {
-        goto out_fail;
-      }
-    return TRUE;
-  } else if (g_str_has_prefix(line, OCR_IDSTR) && !state->faktura_ocr) {
-    state->faktura_ocr = g_strdup(line + strlen(OCR_IDSTR));
-  } else if (g_str_has_prefix(line, DUE_DATE_IDSTR)) {
-    GError *lerr = NULL;
-    gchar *tmp = g_strstrip(g_strdup(line + strlen(DUE_DATE_IDSTR)));
+  return G_SOURCE_REMOVE;
+}
 
-    if ((state->faktura_due_date = parse_amex_date(tmp, &lerr)) == NULL) {
-      g_warning("Could not extract due date: %s", GERROR_MSG(lerr));
+static gboolean
+watch_events(gint fd, GIOCondition condition, gpointer user_data)
+{
+  struct watcher *w = user_data;
+  gchar buf[WATCH_EVENT_BUF_LEN]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  gboolean reload = FALSE;
+  gboolean rescan = FALSE;
+  gssize len;
+  gchar *p;
+
+  if ((len = read(fd, buf, sizeof(buf))) < 0) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return G_SOURCE_CONTINUE;
     }
-    g_free(tmp);
-    g_clear_error(&lerr);
+    log_error(LOG_CAT_GENERAL, "Could not read file events: %s",
+              g_strerror(errno));
+    return watch_lost(w);
   }
 
-  /* We don't know what to do with this line */
-  g_message("Discarding unsupported line '%s'", line);
-  state->stats.skipped_lines++;
-
-  return TRUE;
+  for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+    ev = (const struct inotify_event *) p;
 
-out_fail:
-  g_message("Offending line %u: %s\n", state->idx, line);
+    if (ev->mask & IN_Q_OVERFLOW) {
+      /* Events were dropped, look for what was missed */
+      rescan = TRUE;
+      continue;
+    }
 
-  return FALSE;
-}
+    if (ev->wd == w->inbox_wd && (ev->mask & IN_DELETE_SELF)) {
+      log_error(LOG_CAT_GENERAL, "Watched directory '%s' was removed",
+                w->opts->watch_dir);
+      return watch_lost(w);
+    }
 
-static gboolean
-process_transactions(struct prog_state *state, GError **err)
-{
-  g_assert(state);
+    if (!ev->len) {
+      continue;
+    }
 
-  for (state->idx = 0; state->idx < state->lines->len; state->idx++) {
-    gchar *line = (gchar *) g_ptr_array_index(state->lines, state->idx);
+    /* Editors tend to replace the file rather than write it in place */
+    if (ev->wd == w->locations_wd && !g_strcmp0(ev->name, w->locations_name)) {
+      reload = TRUE;
+    } else if (ev->wd == w->inbox_wd && is_batch_input(ev->name)) {
+      gchar *infile = g_build_filename(w->opts->watch_dir, ev->name, NULL);
 
-    if (!process_line(state, line, err)) {
-      return FALSE;
+      watch_queue(w, infile);
+      g_free(infile);
     }
-    state->stats.total_lines++;
   }
 
-  g_message("Processed %u card(s)..", state->cards->len);
-  return TRUE;
+  if (reload) {
+    watch_reload_locations(w);
+  }
+  if (rescan) {
+    watch_scan(w);
+  }
+
+  return G_SOURCE_CONTINUE;
 }
 
-static void
-clear_prog_state(struct prog_state *state)
+static gboolean
+watch_stop(gpointer user_data)
 {
-  g_assert(state);
-  g_clear_pointer(&state->loc_hash, g_hash_table_destroy);
-  g_clear_pointer(&state->faktura_due_date, g_date_time_unref);
-  g_free(state->faktura_ocr);
+  struct watcher *w = user_data;
 
-  if (state->lines) {
-    g_ptr_array_free(state->lines, TRUE);
-  }
-  if (state->cards) {
-    g_ptr_array_free(state->cards, TRUE);
-  }
+  log_info(LOG_CAT_GENERAL, "Stopping, finishing queued statements");
+  g_main_loop_quit(w->loop);
 
-  memset(state, 0, sizeof(*state));
+  return G_SOURCE_CONTINUE;
 }
 
 static gboolean
-populate_location_hash(const gchar *filename, GHashTable *hash, GError **err)
+run_watch(const struct prog_options *opts,
+          const struct amex_parser_options *popts, struct amex_parser *parser,
+          struct amex_db *db, struct stats_report *report, GError **err)
 {
-  gchar *buffer = NULL;
-  gsize flen = 0;
-  gchar **splits = NULL;
+  struct watcher w = { 0, };
+  gchar *locations_dir = NULL;
   gboolean ret = FALSE;
   guint i;
-  guint lc;
-  guint added = 0;
 
-  g_assert(filename);
-  g_assert(hash);
+  g_assert(opts);
+  g_assert(opts->watch_dir);
+  g_assert(popts);
+  g_assert(parser);
+  g_assert(report);
 
-  if (!g_file_get_contents(filename, &buffer, &flen, err)) {
-    return TRUE;
+  if (opts->outdir && g_mkdir_with_parents(opts->outdir, 0755) < 0) {
+    SET_GERROR(err, -1, "could not create output directory '%s': %s",
+               opts->outdir, g_strerror(errno));
+    return FALSE;
   }
 
-  splits = g_strsplit(buffer, "\n", -1);
-  lc = g_strv_length(splits);
+  w.opts = opts;
+  w.db = db;
+  w.popts = *popts;
+  w.parser = amex_parser_ref(parser);
+  w.report = report;
+  w.fd = -1;
+  w.inbox_wd = -1;
+  w.locations_wd = -1;
+  g_mutex_init(&w.lock);
+  w.pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  w.loop = g_main_loop_new(NULL, FALSE);
+
+  if ((w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    SET_GERROR(err, -1, "could not watch for files: %s", g_strerror(errno));
+    goto out;
+  }
 
-  for (i = 0; i < lc; i++) {
-    if (g_strstr_len(splits[i], -1, "->")) {
-      gchar **ss = g_strsplit(splits[i], "->", 3);
-      guint sl = g_strv_length(ss);
+  /* Both a finished write and a file moved in mean a complete statement */
+  if ((w.inbox_wd = inotify_add_watch(w.fd, opts->watch_dir,
+                                      IN_CLOSE_WRITE | IN_MOVED_TO |
+                                      IN_DELETE_SELF | IN_ONLYDIR)) < 0) {
+    SET_GERROR(err, -1, "could not watch '%s': %s", opts->watch_dir,
+               g_strerror(errno));
+    goto out;
+  }
 
-      if (sl != 2) {
-        SET_GERROR(err, -1, "L%d: Invalid location map entry", i + 1);
-        g_strfreev(ss);
-        goto out;
-      }
-      added++;
-      g_hash_table_insert(hash, g_strstrip(g_strdup(ss[0])),
-                          g_strstrip(g_strdup(ss[1])));
-      g_strfreev(ss);
-    } else if (g_strstr_len(splits[i], -1, " ")) {
-      SET_GERROR(err, -1, "L%d: Invalid location '%s'", i, splits[i]);
+  /* The directory is watched, so the location file can be replaced */
+  if (opts->location_file) {
+    locations_dir = g_path_get_dirname(opts->location_file);
+    w.locations_name = g_path_get_basename(opts->location_file);
+    if ((w.locations_wd = inotify_add_watch(w.fd, locations_dir,
+                                            IN_CLOSE_WRITE |
+                                            IN_MOVED_TO)) < 0) {
+      SET_GERROR(err, -1, "could not watch '%s': %s", locations_dir,
+                 g_strerror(errno));
       goto out;
     }
-    added++;
-    g_hash_table_insert(hash, g_strdup(splits[i]), g_strdup(splits[i]));
   }
 
-  g_message("Read %zi bytes, %u lines from '%s' and added %u location entries",
-            flen, lc, filename, added);
+  if ((w.pool = g_thread_pool_new(watch_worker, NULL, opts->jobs,
+                                  FALSE, err)) == NULL) {
+    goto out;
+  }
+
+  w.sources[0] = g_unix_fd_add(w.fd, G_IO_IN, watch_events, &w);
+  w.sources[1] = g_unix_signal_add(SIGINT, watch_stop, &w);
+  w.sources[2] = g_unix_signal_add(SIGTERM, watch_stop, &w);
+
+  log_info(LOG_CAT_GENERAL, "Watching '%s' using %d thread(s)",
+           opts->watch_dir, opts->jobs);
+
+  watch_scan(&w);
+  g_main_loop_run(w.loop);
+
+  /* Let the workers finish what is queued, then collect their results */
+  w.stopping = TRUE;
+  for (i = 0; i < G_N_ELEMENTS(w.sources); i++) {
+    if (w.sources[i]) {
+      g_source_remove(w.sources[i]);
+    }
+  }
+  g_thread_pool_free(w.pool, FALSE, TRUE);
+  while (g_main_context_iteration(NULL, FALSE)) {
+    ;
+  }
+
+  log_info(LOG_CAT_GENERAL, "Processed %u statement(s), %u failed",
+           w.n_done, w.n_failed);
+
+  if (w.lost) {
+    SET_GERROR(err, -1, "stopped watching '%s'", opts->watch_dir);
+    goto out;
+  }
+
   ret = TRUE;
   /* fall through */
 out:
-  g_strfreev(splits);
-  g_free(buffer);
+  if (w.fd >= 0) {
+    close(w.fd);
+  }
+  g_free(locations_dir);
+  g_free(w.locations_name);
+  g_main_loop_unref(w.loop);
+  g_hash_table_destroy(w.pending);
+  g_mutex_clear(&w.lock);
+  amex_parser_unref(w.parser);
 
   return ret;
 }
+#endif /* HAVE_INOTIFY */
 
-static void
-usage(const gchar *errstr, gint exit_code)
+static gint
+compile_locations(const struct prog_options *opts)
 {
-  g_printerr("AMEX Faktura simple parser v%s\n", PROG_VERSION);
+  struct location_index *locs;
+  GError *err = NULL;
+  gint ret = EXIT_FAILURE;
 
-  if (errstr) {
-    g_printerr("\nError: %s\n", errstr);
+  if (!opts->location_file) {
+    usage("Compiling locations needs a location file (-l)", EXIT_FAILURE);
   }
 
-  g_printerr("\nUsage: %s [options] <input file>\n\n"
-             " Options:\n"
-             "    --outfile          -o      CSV filename to write to\n"
-             "    --location-file    -l      File to populate location hash\n"
-             "    --split-width      -s      Line split width (default %u)\n"
-             "    --help             -h      Show help options\n\n",
-             prog_name, DEFAULT_LINE_SPLIT_WIDTH);
+  if ((locs = location_index_load(opts->location_file, &err)) == NULL) {
+    log_error(LOG_CAT_GENERAL, "Could not parse location file: %s",
+              GERROR_MSG(err));
+    goto out;
+  }
 
-  exit(exit_code);
-}
+  if (!location_index_save(locs, opts->compiled_locations, &err)) {
+    log_error(LOG_CAT_GENERAL, "Could not write compiled locations: %s",
+              GERROR_MSG(err));
+    goto out;
+  }
 
-static void
-dump_transactions(struct prog_state *state)
-{
-  guint i;
-  gdouble ttotal = 0.00;
-  g_assert(state);
+  log_info(LOG_CAT_GENERAL, "Compiled %u location entries into '%s'",
+           location_index_size(locs), opts->compiled_locations);
+  ret = EXIT_SUCCESS;
+  /* fall through */
+out:
+  g_clear_error(&err);
+  g_clear_pointer(&locs, location_index_unref);
 
-  g_print("----------------------------------------------------------------------\n"
-          " Total cards: %03d\n"
-          "----------------------------------------------------------------------\n",
-          state->cards->len);
+  return ret;
+}
 
-  for  (i = 0; i < state->cards->len; i++) {
-    struct amex_card *c = g_ptr_array_index(state->cards, i);
-    gdouble ctotal = 0.00;
-    guint j;
+/* YYYY, YYYY-MM or YYYY-MM-DD, as the first or the last day of the period */
+static gboolean
+parse_query_date(const gchar *str, gboolean last, amex_date *result)
+{
+  guint year;
+  guint month = last ? 12 : 1;
+  guint day = last ? 31 : 1;
+  gint n;
+  gint len = 0;
+
+  n = sscanf(str, "%4u%n-%2u%n-%2u%n", &year, &len, &month, &len, &day, &len);
+  if (n < 1 || str[len] || year < AMEX_DATE_BASE_YEAR || !month ||
+      month > 12 || !day || day > 31) {
+    return FALSE;
+  }
 
-    g_print("Card %03d: %s\n", i, print_amex_card(c));
-    g_print("-------------------------------------------------------------------------------------------------------------\n");
+  *result = amex_date_pack(year, month, day);
 
-    if (!c->transactions->len) {
-      g_print("No transactions for card\n\n");
-      continue;
-    }
+  return TRUE;
+}
 
-    for (j = 0; j < c->transactions->len; j++) {
-      struct transaction *t = g_ptr_array_index(c->transactions, j);
-      gchar *tdate = g_date_time_format(t->date, "%F");
-      gchar *pdate = t->process_date ? g_date_time_format(t->date, "%F") :
-                                       g_strdup("-");
-      gchar *val = g_strdup_printf("%.2f kr", t->value_sek);
+/* In kronor with a '.' before the decimals, as written by the CSV output */
+static gboolean
+parse_query_amount(const gchar *str, amex_amount *result)
+{
+  gchar *eptr = NULL;
+  gdouble v;
 
-      g_print("%-10s %-10s %-40s %-30s %-20s\n",
-              tdate, pdate, t->details,
-              t->location ? t->location : "Unknown",
-              val);
-      g_free(tdate);
-      g_free(pdate);
-      g_free(val);
-      ctotal += t->value_sek;
-    }
-    g_print("=============================================================================================================\n"
-            "Total purchases for %s: %.2f SEK\n"
-            "=============================================================================================================\n\n",
-            print_amex_card(c), ctotal);
-    ttotal += ctotal;
+  v = g_ascii_strtod(str, &eptr);
+  if (eptr == str || *eptr || v > 1e14 || v < -1e14) {
+    return FALSE;
   }
 
-  g_print("Total for all cards: %.2f SEK\n", ttotal);
-  g_print("   Faktura due date: %s\n",
-          state->faktura_due_date ? format_dt(state->faktura_due_date) :
-                                    "(unknown)");
-  g_print("        Faktura OCR: %s\n\n",
-          state->faktura_ocr ? state->faktura_ocr : "(unknown)");
+  *result = (amex_amount) (v * 100 + (v < 0 ? -0.5 : 0.5));
 
+  return TRUE;
 }
 
-#define CSV_HEADER_TMPL "Datum;Bokf"SWE_LOWER_OE"rt;Specifikation;Ort;Valuta;Utl.belopp/moms;Belopp\n"
-
-static gboolean
-dump_transactions_to_csv(struct prog_state *state, GError **err)
+/* Date;Bokfört;... as in ledgers, after the card */
+static void
+write_query_row(const struct amex_store_row *row, gpointer user_data)
 {
-  GString *gs;
-  guint i;
-  guint tc;
-  gboolean ret;
+  struct output *out = user_data;
+  gsize len;
+  gchar *p;
+
+  output_puts(out, row->holder);
+  if (row->suffix) {
+    output_putc(out, '-');
+    output_puts(out, row->suffix);
+  }
+  p = output_reserve(out, 2 * (AMEX_DATE_ISO_LEN + 1));
+  *p++ = ';';
+  p += amex_date_format_iso(row->date, p);
+  *p++ = ';';
+  p += amex_date_format_iso(row->process_date, p);
+  output_commit(out, 2 * (AMEX_DATE_ISO_LEN + 1));
+  output_putc(out, ';');
+  output_puts(out, row->details);
+  output_putc(out, ';');
+  output_puts(out, row->location ? row->location : "unknown");
+  output_puts(out, ";;;");
+  p = output_reserve(out, AMEX_AMOUNT_STR_LEN + 1);
+  len = amex_amount_format(row->amount, p);
+  p[len] = '\n';
+  output_commit(out, len + 1);
+}
 
-  g_assert(state);
-  g_assert(state->opts.outfile);
+static gint
+run_query(gint argc, gchar **argv)
+{
+  struct amex_store_filter filter = { 0, };
+  struct amex_store *store = NULL;
+  struct output *out = NULL;
+  const gchar *outfile = OUTPUT_STDOUT;
+  GError *err = NULL;
+  gint ret = EXIT_FAILURE;
+  gint64 start;
+  guint n;
+  gint opt;
 
-  gs = g_string_new(NULL);
+  static const struct option query_opts[] = {
+    { "help",          no_argument,       NULL, 'h' },
+    { "outfile",       required_argument, NULL, 'o' },
+    { "quiet",         no_argument,       NULL, 'q' },
+    { "verbose",       no_argument,       NULL, 'v' },
+    { "from",          required_argument, NULL, OPT_FROM },
+    { "to",            required_argument, NULL, OPT_TO },
+    { "card",          required_argument, NULL, OPT_CARD },
+    { "location",      required_argument, NULL, OPT_LOCATION },
+    { "min",           required_argument, NULL, OPT_MIN },
+    { "max",           required_argument, NULL, OPT_MAX },
+    { "details",       required_argument, NULL, OPT_DETAILS },
+    { NULL, 0, NULL, 0 }
+  };
 
-  for  (i = 0, tc = 0; i < state->cards->len; i++) {
-    struct amex_card *c = g_ptr_array_index(state->cards, i);
+  while ((opt = getopt_long(argc, argv, "ho:qv", query_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(NULL, EXIT_SUCCESS);
+      break;
+    case 'o':
+      outfile = optarg;
+      break;
+    case 'q':
+      log_level = LOG_LEVEL_ERROR;
+      break;
+    case 'v':
+      log_level = MIN(MAX(log_level, LOG_LEVEL_WARNING) + 1, LOG_LEVEL_DEBUG);
+      break;
+    case OPT_FROM:
+      if (!parse_query_date(optarg, FALSE, &filter.from)) {
+        usage("Invalid --from date", EXIT_FAILURE);
+      }
+      break;
+    case OPT_TO:
+      if (!parse_query_date(optarg, TRUE, &filter.to)) {
+        usage("Invalid --to date", EXIT_FAILURE);
+      }
+      break;
+    case OPT_CARD:
+      filter.card = optarg;
+      break;
+    case OPT_LOCATION:
+      filter.location = optarg;
+      break;
+    case OPT_MIN:
+      if (!parse_query_amount(optarg, &filter.min)) {
+        usage("Invalid --min amount", EXIT_FAILURE);
+      }
+      filter.has_min = TRUE;
+      break;
+    case OPT_MAX:
+      if (!parse_query_amount(optarg, &filter.max)) {
+        usage("Invalid --max amount", EXIT_FAILURE);
+      }
+      filter.has_max = TRUE;
+      break;
+    case OPT_DETAILS:
+      filter.details = optarg;
+      break;
+    default:
+      usage("Illegal query option", EXIT_FAILURE);
+      break;
+    }
+  }
 
-    guint j;
+  if (optind != argc - 1) {
+    usage("A query needs exactly one store file", EXIT_FAILURE);
+  }
 
-    g_string_append_printf(gs, "AMEX %s\n%s",
-                           print_amex_card(c), CSV_HEADER_TMPL);
+  log_init();
 
-    for (j = 0; j < c->transactions->len; j++) {
-      struct transaction *t = g_ptr_array_index(c->transactions, j);
-      gchar *tdate = g_date_time_format(t->date, "%m-%d");
-      gchar *pdate = t->process_date ? g_date_time_format(t->date, "%m-%d") :
-                                       g_strdup("");
-
-      /* Datum;Bokfört;Specifikation;Ort;Valuta;Utl.belopp/moms;Belopp */
-      g_string_append_printf(gs, "%s;%s;%s;%s;;;%.2f\n",
-                             tdate,
-                             pdate,
-                             t->details,
-                             t->location ? t->location : "unknown",
-                             t->value_sek);
-      g_free(tdate);
-      g_free(pdate);
-      tc++;
-    }
-    g_string_append_printf(gs, "\n");
-  }
-
-  if ((ret = g_file_set_contents(state->opts.outfile,
-                                 gs->str, -1, err)) == FALSE) {
+  if ((store = amex_store_open(argv[optind], &err)) == NULL) {
+    log_error(LOG_CAT_GENERAL, "Could not open store: %s", GERROR_MSG(err));
+    goto out;
+  } else if ((out = output_open(outfile, &err)) == NULL) {
+    log_error(LOG_CAT_GENERAL, "Could not write CSV: %s", GERROR_MSG(err));
     goto out;
   }
 
-  g_message("Wrote %u transaction(s) to CSV file '%s'",
-            tc, state->opts.outfile);
+  start = g_get_monotonic_time();
+  output_puts(out, QUERY_CSV_HEADER);
+  n = amex_store_query(store, &filter, write_query_row, out);
+  log_info(LOG_CAT_GENERAL, "Found %u of %u transaction(s) in %.3f ms", n,
+           amex_store_transactions(store),
+           (g_get_monotonic_time() - start) / 1000.0);
 
+  if (!output_close(g_steal_pointer(&out), &err)) {
+    log_error(LOG_CAT_GENERAL, "Could not write CSV: %s", GERROR_MSG(err));
+    goto out;
+  }
+
+  ret = EXIT_SUCCESS;
+  /* fall through */
 out:
-  g_string_free(gs, TRUE);
+  g_clear_error(&err);
+  g_clear_pointer(&out, output_abort);
+  amex_store_close(store);
+  log_shutdown();
 
   return ret;
 }
@@ -871,10 +1424,21 @@ out:
 int main(int argc, gchar **argv)
 {
   GError *err = NULL;
-  struct prog_state state = { 0, };
-  struct prog_options *opts = &state.opts;
+  struct prog_options options = { 0, };
+  struct prog_options *opts = &options;
+  struct amex_parser_options popts = { 0, };
+  struct amex_parser *parser = NULL;
+  struct amex_statement *st = NULL;
+  struct location_index *locs = NULL;
+  struct stats_report report = { 0, };
+  GPtrArray *infiles = NULL;
   gint ret = EXIT_FAILURE;
   gchar *eptr = NULL;
+  gint64 start;
+  struct amex_cache *cache = NULL;
+  struct amex_db *db = NULL;
+  struct amex_summary *summary = NULL;
+  gboolean batch;
   gint opt;
 
   static const struct option long_opts[] = {
@@ -882,15 +1446,32 @@ int main(int argc, gchar **argv)
     { "outfile",       required_argument, NULL, 'o' },
     { "location-file", required_argument, NULL, 'l' },
     { "split-width",   required_argument, NULL, 's' },
+    { "output-dir",    required_argument, NULL, 'd' },
+    { "jobs",          required_argument, NULL, 'j' },
+    { "compile-locations", required_argument, NULL, 'c' },
+    { "quiet",         no_argument,       NULL, 'q' },
+    { "verbose",       no_argument,       NULL, 'v' },
+    { "log",           required_argument, NULL, 'L' },
+    { "watch",         required_argument, NULL, 'w' },
+    { "stats",         optional_argument, NULL, OPT_STATS },
+    { "ledger",        required_argument, NULL, OPT_LEDGER },
+    { "format",        required_argument, NULL, OPT_FORMAT },
+    { "sqlite",        required_argument, NULL, OPT_SQLITE },
+    { "report",        optional_argument, NULL, OPT_REPORT },
+    { "store",         required_argument, NULL, OPT_STORE },
+    { "cache",         required_argument, NULL, OPT_CACHE },
+    { "cache-size",    required_argument, NULL, OPT_CACHE_SIZE },
     { NULL,            0,                 NULL,  0  }
   };
 
   prog_name = argv[0];
   if (argc < 2) {
     usage("Too few arguments", EXIT_FAILURE);
+  } else if (!g_strcmp0(argv[1], "query")) {
+    return run_query(argc - 1, argv + 1);
   }
 
-  while ((opt = getopt_long(argc, argv, "hl:o:s:", long_opts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "hl:o:s:d:j:c:qvL:w:", long_opts, NULL)) != -1) {
     switch (opt) {
     case 'h':
       usage(NULL, EXIT_SUCCESS);
@@ -909,64 +1490,282 @@ int main(int argc, gchar **argv)
               G_STRINGIFY(MIN_LINE_SPLIT_WIDTH), EXIT_FAILURE);
       }
       break;
+    case 'd':
+      opts->outdir = optarg;
+      break;
+    case 'j':
+      opts->jobs = g_ascii_strtoll(optarg, &eptr, 10);
+      if (opts->jobs < 1 || (eptr && strlen(eptr))) {
+        usage("Invalid number of jobs", EXIT_FAILURE);
+      }
+      break;
+    case 'c':
+      opts->compiled_locations = optarg;
+      break;
+    case 'q':
+      log_level = LOG_LEVEL_ERROR;
+      break;
+    case 'v':
+      log_level = MIN(MAX(log_level, LOG_LEVEL_WARNING) + 1, LOG_LEVEL_DEBUG);
+      break;
+    case 'L':
+      if (!log_parse_categories(optarg, &log_categories, &err)) {
+        usage(GERROR_MSG(err), EXIT_FAILURE);
+      }
+      break;
+    case 'w':
+      opts->watch_dir = optarg;
+      break;
+    case OPT_STATS:
+      if (!optarg) {
+        opts->stats = STATS_FORMAT_TEXT;
+      } else if (!g_strcmp0(optarg, "json")) {
+        opts->stats = STATS_FORMAT_JSON;
+      } else {
+        usage("Invalid statistics format, only json is supported",
+              EXIT_FAILURE);
+      }
+      break;
+    case OPT_REPORT:
+      if (!optarg) {
+        opts->report = STATS_FORMAT_TEXT;
+      } else if (!g_strcmp0(optarg, "json")) {
+        opts->report = STATS_FORMAT_JSON;
+      } else {
+        usage("Invalid report format, only json is supported", EXIT_FAILURE);
+      }
+      break;
+    case OPT_CACHE:
+      opts->cache_dir = optarg;
+      break;
+    case OPT_STORE:
+      opts->store_file = optarg;
+      break;
+    case OPT_LEDGER:
+      opts->ledger_dir = optarg;
+      break;
+    case OPT_SQLITE:
+#ifndef HAVE_SQLITE
+      usage("SQLite output is not supported by this build", EXIT_FAILURE);
+#endif
+      opts->sqlite_file = optarg;
+      break;
+    case OPT_FORMAT:
+      if (!g_strcmp0(optarg, "csv")) {
+        opts->format = OUTPUT_FORMAT_CSV;
+      } else if (!g_strcmp0(optarg, "arrow")) {
+        opts->format = OUTPUT_FORMAT_ARROW;
+      } else {
+        usage("Invalid output format, use csv or arrow", EXIT_FAILURE);
+      }
+      break;
+    case OPT_CACHE_SIZE:
+      opts->cache_size_mb = g_ascii_strtoll(optarg, &eptr, 10);
+      if (opts->cache_size_mb < 1 || (eptr && strlen(eptr))) {
+        usage("Invalid cache size", EXIT_FAILURE);
+      }
+      break;
     default:
       usage("Illegal option", EXIT_FAILURE);
       break;
     }
   }
 
-  if (optind >= argc) {
+  if (opts->compiled_locations) {
+    log_init();
+    ret = compile_locations(opts);
+    log_shutdown();
+    return ret;
+  } else if (opts->watch_dir) {
+#ifndef HAVE_INOTIFY
+    usage("Watching a directory is not supported by this build",
+          EXIT_FAILURE);
+#endif
+    if (optind < argc) {
+      usage("Input files can not be given with --watch", EXIT_FAILURE);
+    } else if (opts->outfile || opts->ledger_dir) {
+      usage("--watch writes one file per statement, use -d instead",
+            EXIT_FAILURE);
+    } else if (opts->report) {
+      usage("--report can not be used with --watch", EXIT_FAILURE);
+    }
+  } else if (optind >= argc) {
     usage("Missing input filename", EXIT_FAILURE);
   }
 
-  if (!opts->line_split_width) {
-    opts->line_split_width = DEFAULT_LINE_SPLIT_WIDTH;
+  /* From here on messages are written by the log thread */
+  log_init();
+  stats_report_init(&report, opts->stats);
+
+  if (opts->line_split_width) {
+    log_info(LOG_CAT_GENERAL, "Using line split width of %u",
+             opts->line_split_width);
+  } else {
+    log_info(LOG_CAT_GENERAL, "Detecting the line split width of every page");
   }
-  g_message("Using %sline split width of %u",
-            opts->line_split_width == DEFAULT_LINE_SPLIT_WIDTH ? "default " : "",
-            opts->line_split_width);
 
-  opts->infile = argv[optind++];
-  /* Initialise program state */
-  state.lines = g_ptr_array_new_with_free_func(g_free);
-  state.cards = g_ptr_array_new_with_free_func(free_amex_card);
-  state.loc_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
-                                         g_free, g_free);
+  if (!opts->jobs) {
+    opts->jobs = g_get_num_processors();
+  }
 
-  /* Populate the location hash */
-  if (opts->location_file && !populate_location_hash(opts->location_file,
-                                                     state.loc_hash,
-                                                     &err)) {
-    g_printerr("Could not parse location file: %s\n", GERROR_MSG(err));
+  infiles = g_ptr_array_new_with_free_func(g_free);
+  if (!opts->watch_dir &&
+      !collect_batch_inputs(argv + optind, argc - optind, infiles, &err)) {
+    log_error(LOG_CAT_GENERAL, "Could not read input directory: %s",
+              GERROR_MSG(err));
     goto out;
+  } else if (!opts->watch_dir && !infiles->len) {
+    log_shutdown();
+    usage("No input files found", EXIT_FAILURE);
   }
 
-  /* Read the file */
-  if (!split_lines_file(opts->infile, opts->line_split_width,
-                        state.lines, &err)) {
-    g_printerr("Could not parse input file: %s\n", GERROR_MSG(err));
+  /* Load the locations once, all statements share the same index */
+  start = stats_clock(&report.total);
+  if (!opts->location_file) {
+    locs = location_index_new_empty();
+  } else if ((locs = location_index_load(opts->location_file,
+                                         &err)) == NULL) {
+    log_error(LOG_CAT_GENERAL, "Could not parse location file: %s",
+              GERROR_MSG(err));
     goto out;
   }
+  stats_time(&report.total, STATS_TIME_LOCATIONS, start);
+
+  if (opts->cache_dir) {
+    if (!opts->cache_size_mb) {
+      opts->cache_size_mb = DEFAULT_CACHE_SIZE_MB;
+    }
+    if ((cache = amex_cache_open(opts->cache_dir,
+                                 (guint64) opts->cache_size_mb << 20,
+                                 &err)) == NULL) {
+      log_error(LOG_CAT_GENERAL, "Could not open cache: %s", GERROR_MSG(err));
+      goto out;
+    }
+    /* Entries made with an older location file won't be hit again */
+    amex_cache_purge(cache, location_index_version(locs));
+  }
 
-  /* Build the transaction state */
-  if (!process_transactions(&state, &err)) {
-    g_printerr("Could not process transactions: %s\n", GERROR_MSG(err));
+#ifdef HAVE_SQLITE
+  if (opts->sqlite_file &&
+      (db = amex_db_open(opts->sqlite_file, &err)) == NULL) {
+    log_error(LOG_CAT_GENERAL, "Could not open database: %s",
+              GERROR_MSG(err));
+    goto out;
+  }
+#endif
+
+  /* More than one statement (or a directory) enables batch mode */
+  batch = !opts->watch_dir &&
+          (infiles->len != 1 || argc - optind > 1 ||
+           g_file_test(argv[optind], G_FILE_TEST_IS_DIR) || opts->outdir ||
+           opts->ledger_dir);
+
+  popts.split_width = opts->line_split_width;
+  /* Several statements are parsed at a time, a single one splits its pages */
+  popts.split_jobs = batch || opts->watch_dir ? 1 : opts->jobs;
+  popts.timing = opts->stats != STATS_FORMAT_NONE;
+  popts.cache = cache;
+  parser = amex_parser_new(&popts, locs);
+
+#ifdef HAVE_INOTIFY
+  if (opts->watch_dir) {
+    if (!run_watch(opts, &popts, parser, db, &report, &err)) {
+      log_error(LOG_CAT_GENERAL, "Watching failed: %s", GERROR_MSG(err));
+      goto out;
+    }
+    ret = EXIT_SUCCESS;
+    goto out;
+  }
+#endif
+
+  if (opts->report) {
+    summary = amex_summary_new();
+  }
+
+  if (batch) {
+    if (!run_batch(opts, parser, db, infiles, summary, &report, &err)) {
+      log_error(LOG_CAT_GENERAL, "Batch processing failed: %s",
+                GERROR_MSG(err));
+      goto out;
+    }
+    ret = EXIT_SUCCESS;
+    goto out;
+  }
+
+  if ((st = amex_parser_parse_file(parser, g_ptr_array_index(infiles, 0),
+                                   &err)) == NULL) {
+    log_error(LOG_CAT_GENERAL, "Could not process '%s': %s",
+              (const gchar *) g_ptr_array_index(infiles, 0), GERROR_MSG(err));
     goto out;
   }
 
   /* Dump the transactions */
-  dump_transactions(&state);
+  start = stats_clock(amex_statement_stats(st));
+  if (print_listing(opts)) {
+    dump_transactions(st);
+  }
+  if (summary) {
+    amex_summary_add(summary, st);
+  }
 
-  if (opts->outfile && !dump_transactions_to_csv(&state, &err)) {
-    g_printerr("Could not dump to CSV: %s\n", GERROR_MSG(err));
+  if (opts->outfile && !dump_transactions_to_file(st, opts->outfile,
+                                                  opts->format, &err)) {
+    log_error(LOG_CAT_GENERAL, "Could not write %s: %s",
+              output_format_name(opts->format), GERROR_MSG(err));
     goto out;
   }
 
+#ifdef HAVE_SQLITE
+  if (db) {
+    guint failed = 0;
+
+    if (!store_statements(db, &st, 1, &failed, &err)) {
+      log_error(LOG_CAT_GENERAL, "Could not store '%s': %s",
+                amex_statement_filename(st), GERROR_MSG(err));
+      goto out;
+    } else if (failed) {
+      goto out;
+    }
+  }
+#endif
+  if (opts->store_file) {
+    guint failed = 0;
+
+    if (!amex_store_update(opts->store_file, &st, 1, &failed, &err)) {
+      log_error(LOG_CAT_GENERAL, "Could not update store '%s': %s",
+                opts->store_file, GERROR_MSG(err));
+      goto out;
+    } else if (failed) {
+      goto out;
+    }
+  }
+  stats_time(amex_statement_stats(st), STATS_TIME_OUTPUT, start);
+
   ret = EXIT_SUCCESS;
   /* fall through */
 out:
   g_clear_error(&err);
-  clear_prog_state(&state);
+  if (st) {
+    stats_report_add(&report, amex_statement_filename(st),
+                     amex_statement_stats(st));
+  }
+  g_clear_pointer(&st, amex_statement_free);
+  g_clear_pointer(&parser, amex_parser_unref);
+  g_clear_pointer(&cache, amex_cache_unref);
+#ifdef HAVE_SQLITE
+  g_clear_pointer(&db, amex_db_close);
+#endif
+  g_clear_pointer(&locs, location_index_unref);
+  g_clear_pointer(&infiles, g_ptr_array_unref);
+  log_shutdown();
+
+  /* After the log thread, so the reports aren't interleaved with messages */
+  if (summary) {
+    print_summary(opts, summary);
+    amex_summary_free(summary);
+  }
+  stats_report_print(&report);
+  stats_report_clear(&report);
 
   return ret;
 }
@@ -0,0 +1,111 @@
+#ifndef AMEXPARSER_H__
+#define AMEXPARSER_H__
+/*
+ * amexparser.h - Amex statement parsing library
+ *
+ * A parser is set up once with its options and location index and is
+ * read-only after that, so any number of threads can parse statements with
+ * the same parser at the same time. Parsers are reference counted, so one
+ * can be replaced while statements are still being parsed with it. Every
+ * parse returns a statement owned by the caller, holding all cards and
+ * transactions found in it. Strings in a statement live as long as the
+ * statement.
+ */
+#include <glib.h>
+
+#include "amex_amount.h"
+#include "amex_date.h"
+#include "cache.h"
+#include "locations.h"
+#include "stats.h"
+
+#define AMEX_PARSER_ERROR          (amex_parser_error_quark())
+
+/* Large enough for any card name returned by amex_card_format() */
+#define AMEX_CARD_STR_LEN          256
+
+struct amex_transaction {
+  amex_date date;
+  amex_date process_date;
+  amex_amount amount;
+  /* Canonical location name, NULL if unknown */
+  const gchar *location;
+  /* Shared by the transactions with the same description */
+  const gchar *details;
+};
+
+struct amex_card {
+  gchar *holder;
+  /* Last digits of an extra card, NULL for the main card */
+  gchar *suffix;
+  /* struct amex_transaction, in statement order */
+  GPtrArray *transactions;
+};
+
+struct amex_parser_options {
+  /* Column the right hand side starts at, 0 detects it for every page */
+  gint split_width;
+  /* Threads splitting the pages of one statement, 0 or 1 for none */
+  gint split_jobs;
+  /* Time the parsing stages in the statement statistics */
+  gboolean timing;
+  /* Read statements back from and add them to this cache, if set */
+  struct amex_cache *cache;
+};
+
+struct amex_parser;
+struct amex_statement;
+struct output;
+
+GQuark
+amex_parser_error_quark(void);
+
+/* The location index is referenced, NULL parses without locations */
+struct amex_parser *
+amex_parser_new(const struct amex_parser_options *opts,
+                struct location_index *locs);
+
+struct amex_parser *
+amex_parser_ref(struct amex_parser *parser);
+
+void
+amex_parser_unref(struct amex_parser *parser);
+
+struct amex_statement *
+amex_parser_parse_file(const struct amex_parser *parser,
+                       const gchar *filename, GError **err);
+
+void
+amex_statement_free(struct amex_statement *st);
+
+const gchar *
+amex_statement_filename(const struct amex_statement *st);
+
+/* struct amex_card, in the order they first appear */
+GPtrArray *
+amex_statement_cards(const struct amex_statement *st);
+
+/* The OCR number and due date of the payment, NULL/invalid if not found */
+const gchar *
+amex_statement_ocr(const struct amex_statement *st);
+
+amex_date
+amex_statement_due_date(const struct amex_statement *st);
+
+/* Callers may add the time they spend writing output */
+struct statistics *
+amex_statement_stats(struct amex_statement *st);
+
+/* Append all cards as CSV, returns the number of transactions written */
+guint
+amex_statement_append_csv(const struct amex_statement *st, GString *gs);
+
+/* The same written to out, see output.h */
+guint
+amex_statement_write_csv(const struct amex_statement *st, struct output *out);
+
+/* Holder name, followed by -<suffix> for extra cards */
+const gchar *
+amex_card_format(const struct amex_card *card, gchar *buffer, gsize len);
+
+#endif /* AMEXPARSER_H__ */
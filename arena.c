@@ -0,0 +1,105 @@
+#include <glib.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE          (64 * 1024)
+#define ARENA_STRING_CHUNK_SIZE   (16 * 1024)
+#define ARENA_ALIGN               16
+
+struct arena_block {
+  struct arena_block *next;
+  gsize size;
+  gsize used;
+  /* Keeps data[] aligned for any type we place in it */
+  gsize pad;
+  guint8 data[];
+};
+
+G_STATIC_ASSERT(sizeof(struct arena_block) % ARENA_ALIGN == 0);
+
+void
+arena_init(struct arena *arena)
+{
+  g_assert(arena);
+
+  arena->blocks = NULL;
+  arena->strings = g_string_chunk_new(ARENA_STRING_CHUNK_SIZE);
+  arena->n_allocs = 0;
+  arena->n_blocks = 0;
+}
+
+void
+arena_clear(struct arena *arena)
+{
+  struct arena_block *b;
+
+  g_assert(arena);
+
+  while ((b = arena->blocks) != NULL) {
+    arena->blocks = b->next;
+    g_free(b);
+  }
+  g_clear_pointer(&arena->strings, g_string_chunk_free);
+}
+
+gpointer
+arena_alloc0(struct arena *arena, gsize size)
+{
+  struct arena_block *b;
+  gpointer ptr;
+
+  g_assert(arena);
+
+  size = (size + ARENA_ALIGN - 1) & ~((gsize) ARENA_ALIGN - 1);
+  b = arena->blocks;
+
+  if (!b || b->size - b->used < size) {
+    gsize bsize = MAX(size, ARENA_BLOCK_SIZE);
+
+    b = g_malloc(sizeof(*b) + bsize);
+    arena->n_blocks++;
+    b->size = bsize;
+    b->used = 0;
+
+    if (size > ARENA_BLOCK_SIZE / 4 && arena->blocks) {
+      /* Oversized allocation, keep bumping in the current block */
+      b->next = arena->blocks->next;
+      arena->blocks->next = b;
+    } else {
+      b->next = arena->blocks;
+      arena->blocks = b;
+    }
+  }
+
+  ptr = b->data + b->used;
+  b->used += size;
+  arena->n_allocs++;
+
+  return memset(ptr, 0, size);
+}
+
+gchar *
+arena_strndup(struct arena *arena, const gchar *str, gsize len)
+{
+  g_assert(arena);
+
+  if (!str) {
+    return NULL;
+  }
+  arena->n_allocs++;
+
+  return g_string_chunk_insert_len(arena->strings, str, len);
+}
+
+gchar *
+arena_strdup(struct arena *arena, const gchar *str)
+{
+  g_assert(arena);
+
+  if (!str) {
+    return NULL;
+  }
+  arena->n_allocs++;
+
+  return g_string_chunk_insert(arena->strings, str);
+}
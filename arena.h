@@ -0,0 +1,39 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+/*
+ * arena.h - Per-statement bump allocator
+ *
+ * Everything parsed from one statement (lines, cards, transactions and their
+ * strings) is allocated from the statement's arena and released in one go
+ * by arena_clear(). Individual allocations are never freed.
+ */
+#include <glib.h>
+
+struct arena_block;
+
+struct arena {
+  struct arena_block *blocks;
+  GStringChunk *strings;
+  /* Allocations made, and the heap blocks backing arena_alloc0() */
+  guint64 n_allocs;
+  guint64 n_blocks;
+};
+
+void
+arena_init(struct arena *arena);
+
+void
+arena_clear(struct arena *arena);
+
+gpointer
+arena_alloc0(struct arena *arena, gsize size);
+
+gchar *
+arena_strndup(struct arena *arena, const gchar *str, gsize len);
+
+gchar *
+arena_strdup(struct arena *arena, const gchar *str);
+
+#define arena_new0(arena, type) ((type *) arena_alloc0(arena, sizeof(type)))
+
+#endif /* ARENA_H__ */
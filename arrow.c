@@ -0,0 +1,761 @@
+#include <glib.h>
+#include <string.h>
+
+#include "arrow.h"
+
+#define ARROW_MAGIC                "ARROW1"
+/* Buffers in a message body start at multiples of this */
+#define ARROW_ALIGN                8
+
+/* Format.fbs enums and union members used here */
+#define ARROW_METADATA_V5          4
+#define ARROW_HEADER_SCHEMA        1
+#define ARROW_HEADER_DICTIONARY    2
+#define ARROW_HEADER_RECORD_BATCH  3
+#define ARROW_TYPE_INT             2
+#define ARROW_TYPE_UTF8            5
+#define ARROW_TYPE_DECIMAL         7
+#define ARROW_TYPE_DATE            8
+#define ARROW_DATE_DAY             0
+
+#define ARROW_DECIMAL_PRECISION    18
+#define ARROW_DECIMAL_SCALE        2
+
+enum arrow_column {
+  ARROW_COL_HOLDER = 0,
+  ARROW_COL_CARD_SUFFIX,
+  ARROW_COL_DATE,
+  ARROW_COL_PROCESS_DATE,
+  ARROW_COL_AMOUNT,
+  ARROW_COL_LOCATION,
+  ARROW_COL_DETAILS,
+  ARROW_COL_COUNT,
+};
+
+enum arrow_dict {
+  ARROW_DICT_HOLDER = 0,
+  ARROW_DICT_LOCATION,
+  ARROW_DICT_COUNT,
+};
+
+/* The buffers of one column, unused ones stay empty */
+struct arrow_column_data {
+  GByteArray *validity;
+  GByteArray *offsets;
+  GByteArray *values;
+  guint null_count;
+};
+
+/* A string column without nulls, and the index of every string in it */
+struct arrow_dictionary {
+  struct arrow_column_data data;
+  GHashTable *index;
+  guint len;
+};
+
+struct amex_arrow_writer {
+  struct arrow_column_data columns[ARROW_COL_COUNT];
+  struct arrow_dictionary dicts[ARROW_DICT_COUNT];
+  guint rows;
+};
+
+static const struct {
+  const gchar *name;
+  guint8 type;
+  gboolean nullable;
+  gint dict;
+} column_info[ARROW_COL_COUNT] = {
+  [ARROW_COL_HOLDER]       = { "holder", ARROW_TYPE_UTF8, FALSE,
+                               ARROW_DICT_HOLDER },
+  [ARROW_COL_CARD_SUFFIX]  = { "card_suffix", ARROW_TYPE_UTF8, TRUE, -1 },
+  [ARROW_COL_DATE]         = { "date", ARROW_TYPE_DATE, FALSE, -1 },
+  [ARROW_COL_PROCESS_DATE] = { "process_date", ARROW_TYPE_DATE, FALSE, -1 },
+  [ARROW_COL_AMOUNT]       = { "amount", ARROW_TYPE_DECIMAL, FALSE, -1 },
+  [ARROW_COL_LOCATION]     = { "location", ARROW_TYPE_UTF8, TRUE,
+                               ARROW_DICT_LOCATION },
+  [ARROW_COL_DETAILS]      = { "details", ARROW_TYPE_UTF8, FALSE, -1 },
+};
+
+/*
+ * A minimal flatbuffer builder. Flatbuffers are normally built back to
+ * front; this one writes front to back instead, every table before its
+ * children, and patches the offsets to the children once they are written.
+ * Offsets thereby always point forward, as flatbuffers require.
+ */
+struct fb {
+  GByteArray *buf;
+};
+
+struct fb_field {
+  /* Size in bytes, 0 for fields left out */
+  guint8 size;
+  /* An offset, patched by fb_patch() once the target is written */
+  gboolean offset;
+  guint64 value;
+  /* Where the field was written */
+  gsize slot;
+};
+
+#define FB_ABSENT                  { 0, FALSE, 0, 0 }
+#define FB_SCALAR(size, value)     { size, FALSE, value, 0 }
+#define FB_OFFSET                  { 4, TRUE, 0, 0 }
+
+static void
+fb_pad(struct fb *fb, gsize align, gsize rem)
+{
+  static const guint8 zeros[ARROW_ALIGN] = { 0, };
+
+  g_byte_array_append(fb->buf, zeros,
+                      (align + rem - fb->buf->len % align) % align);
+}
+
+static void
+fb_put_le(struct fb *fb, guint64 value, guint size)
+{
+  guint8 bytes[8];
+  guint i;
+
+  for (i = 0; i < size; i++) {
+    bytes[i] = value >> (8 * i);
+  }
+  g_byte_array_append(fb->buf, bytes, size);
+}
+
+static void
+fb_set_u32(struct fb *fb, gsize pos, guint32 value)
+{
+  guint i;
+
+  for (i = 0; i < 4; i++) {
+    fb->buf->data[pos + i] = value >> (8 * i);
+  }
+}
+
+static void
+fb_patch(struct fb *fb, gsize slot, gsize target)
+{
+  g_assert(target > slot);
+
+  fb_set_u32(fb, slot, target - slot);
+}
+
+/* Starts with the offset of the root table, patched with fb_patch(fb, 0) */
+static void
+fb_init(struct fb *fb)
+{
+  fb->buf = g_byte_array_new();
+  fb_put_le(fb, 0, 4);
+}
+
+/* Write a vtable and its table, returns the position of the table */
+static gsize
+fb_table(struct fb *fb, struct fb_field *fields, guint n)
+{
+  guint16 field_offs[16];
+  gsize vtable;
+  gsize table;
+  guint table_len = 4;
+  guint size;
+  guint i;
+
+  g_assert(n <= G_N_ELEMENTS(field_offs));
+
+  /* Largest fields first, each naturally aligned after the vtable offset */
+  for (size = 8; size > 0; size /= 2) {
+    for (i = 0; i < n; i++) {
+      if (fields[i].size == size) {
+        field_offs[i] = table_len;
+        table_len += size;
+      } else if (!fields[i].size) {
+        field_offs[i] = 0;
+      }
+    }
+  }
+
+  fb_pad(fb, 2, 0);
+  vtable = fb->buf->len;
+  fb_put_le(fb, 4 + 2 * n, 2);
+  fb_put_le(fb, table_len, 2);
+  for (i = 0; i < n; i++) {
+    fb_put_le(fb, field_offs[i], 2);
+  }
+
+  /* Eight byte fields follow the four byte vtable offset */
+  fb_pad(fb, 8, 4);
+  table = fb->buf->len;
+  fb_put_le(fb, table - vtable, 4);
+  g_byte_array_set_size(fb->buf, table + table_len);
+
+  for (i = 0; i < n; i++) {
+    guint j;
+
+    if (!fields[i].size) {
+      continue;
+    }
+    fields[i].slot = table + field_offs[i];
+    for (j = 0; j < fields[i].size; j++) {
+      fb->buf->data[fields[i].slot + j] = fields[i].value >> (8 * j);
+    }
+  }
+
+  return table;
+}
+
+static gsize
+fb_string(struct fb *fb, const gchar *str)
+{
+  gsize pos;
+
+  fb_pad(fb, 4, 0);
+  pos = fb->buf->len;
+  fb_put_le(fb, strlen(str), 4);
+  g_byte_array_append(fb->buf, (const guint8 *) str, strlen(str) + 1);
+
+  return pos;
+}
+
+/* A vector of n offsets, the slot of element i is at pos + 4 + 4 * i */
+static gsize
+fb_offset_vector(struct fb *fb, guint n)
+{
+  gsize pos;
+
+  fb_pad(fb, 4, 0);
+  pos = fb->buf->len;
+  fb_put_le(fb, n, 4);
+  g_byte_array_set_size(fb->buf, pos + 4 + 4 * n);
+
+  return pos;
+}
+
+/* A vector of structs made of 64-bit fields only */
+static gsize
+fb_struct_vector(struct fb *fb, const guint64 *fields, guint n,
+                 guint fields_per_struct)
+{
+  gsize pos;
+  guint i;
+
+  fb_pad(fb, 8, 4);
+  pos = fb->buf->len;
+  fb_put_le(fb, n, 4);
+  for (i = 0; i < n * fields_per_struct; i++) {
+    fb_put_le(fb, fields[i], 8);
+  }
+
+  return pos;
+}
+
+static void
+column_data_init(struct arrow_column_data *col)
+{
+  col->validity = g_byte_array_new();
+  col->offsets = g_byte_array_new();
+  col->values = g_byte_array_new();
+  col->null_count = 0;
+}
+
+static void
+column_data_clear(struct arrow_column_data *col)
+{
+  g_byte_array_unref(col->validity);
+  g_byte_array_unref(col->offsets);
+  g_byte_array_unref(col->values);
+}
+
+static void
+append_le(GByteArray *arr, guint64 value, guint size)
+{
+  guint8 bytes[16] = { 0, };
+  guint i;
+
+  for (i = 0; i < size; i++) {
+    /* Sign extended past 64 bits, for decimals */
+    bytes[i] = i < 8 ? value >> (8 * i) : ((gint64) value < 0 ? 0xff : 0);
+  }
+  g_byte_array_append(arr, bytes, size);
+}
+
+static void
+append_valid(struct arrow_column_data *col, guint row, gboolean valid)
+{
+  if (row % 8 == 0) {
+    g_byte_array_append(col->validity, (const guint8 *) "", 1);
+  }
+  if (valid) {
+    col->validity->data[row / 8] |= 1 << (row % 8);
+  } else {
+    col->null_count++;
+  }
+}
+
+static void
+append_string(struct arrow_column_data *col, const gchar *str)
+{
+  if (!col->offsets->len) {
+    append_le(col->offsets, 0, 4);
+  }
+  if (str) {
+    g_byte_array_append(col->values, (const guint8 *) str, strlen(str));
+  }
+  append_le(col->offsets, col->values->len, 4);
+}
+
+static guint32
+dictionary_index(struct arrow_dictionary *dict, const gchar *str)
+{
+  gpointer idx;
+
+  if (!g_hash_table_lookup_extended(dict->index, str, NULL, &idx)) {
+    idx = GUINT_TO_POINTER(dict->len++);
+    g_hash_table_insert(dict->index, g_strdup(str), idx);
+    append_string(&dict->data, str);
+  }
+
+  return GPOINTER_TO_UINT(idx);
+}
+
+struct amex_arrow_writer *
+amex_arrow_writer_new(void)
+{
+  struct amex_arrow_writer *w;
+  guint i;
+
+  w = g_new0(struct amex_arrow_writer, 1);
+  for (i = 0; i < ARROW_COL_COUNT; i++) {
+    column_data_init(&w->columns[i]);
+  }
+  for (i = 0; i < ARROW_DICT_COUNT; i++) {
+    column_data_init(&w->dicts[i].data);
+    w->dicts[i].index = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, NULL);
+  }
+
+  return w;
+}
+
+void
+amex_arrow_writer_free(struct amex_arrow_writer *w)
+{
+  guint i;
+
+  if (!w) {
+    return;
+  }
+
+  for (i = 0; i < ARROW_COL_COUNT; i++) {
+    column_data_clear(&w->columns[i]);
+  }
+  for (i = 0; i < ARROW_DICT_COUNT; i++) {
+    column_data_clear(&w->dicts[i].data);
+    g_hash_table_destroy(w->dicts[i].index);
+  }
+  g_free(w);
+}
+
+void
+amex_arrow_writer_add(struct amex_arrow_writer *w,
+                      const struct amex_statement *st)
+{
+  struct arrow_column_data *cols;
+  GPtrArray *cards;
+  guint i;
+  guint j;
+
+  g_assert(w);
+  g_assert(st);
+
+  cols = w->columns;
+  cards = amex_statement_cards(st);
+  for (i = 0; i < cards->len; i++) {
+    const struct amex_card *c = g_ptr_array_index(cards, i);
+    guint32 holder = dictionary_index(&w->dicts[ARROW_DICT_HOLDER],
+                                      c->holder);
+
+    for (j = 0; j < c->transactions->len; j++) {
+      const struct amex_transaction *t = g_ptr_array_index(c->transactions,
+                                                           j);
+      guint row = w->rows++;
+
+      append_le(cols[ARROW_COL_HOLDER].values, holder, 4);
+
+      append_valid(&cols[ARROW_COL_CARD_SUFFIX], row, c->suffix != NULL);
+      append_string(&cols[ARROW_COL_CARD_SUFFIX], c->suffix);
+
+      append_le(cols[ARROW_COL_DATE].values,
+                amex_date_epoch_days(t->date), 4);
+      append_le(cols[ARROW_COL_PROCESS_DATE].values,
+                amex_date_epoch_days(t->process_date), 4);
+      /* Amounts are in öre, which is exactly the scale of the decimal */
+      append_le(cols[ARROW_COL_AMOUNT].values, t->amount, 16);
+
+      append_valid(&cols[ARROW_COL_LOCATION], row, t->location != NULL);
+      append_le(cols[ARROW_COL_LOCATION].values, t->location ?
+                dictionary_index(&w->dicts[ARROW_DICT_LOCATION],
+                                 t->location) : 0, 4);
+
+      append_string(&cols[ARROW_COL_DETAILS], t->details);
+    }
+  }
+}
+
+/*
+ * The body of a record batch and its metadata: one node per column and
+ * the validity, offsets and values buffers of each (as Arrow lays them out
+ * for its type, empty when unused).
+ */
+struct arrow_batch {
+  GByteArray *body;
+  /* length, null_count per node; offset, length per buffer */
+  GArray *nodes;
+  GArray *buffers;
+  guint64 length;
+};
+
+static void
+batch_add_buffer(struct arrow_batch *b, const GByteArray *buf)
+{
+  static const guint8 zeros[ARROW_ALIGN] = { 0, };
+  guint64 offset = b->body->len;
+  guint64 len = buf ? buf->len : 0;
+
+  g_array_append_val(b->buffers, offset);
+  g_array_append_val(b->buffers, len);
+  if (len) {
+    g_byte_array_append(b->body, buf->data, len);
+    g_byte_array_append(b->body, zeros, (ARROW_ALIGN - len % ARROW_ALIGN) %
+                                        ARROW_ALIGN);
+  }
+}
+
+static void
+batch_add_column(struct arrow_batch *b, const struct arrow_column_data *col,
+                 gboolean string)
+{
+  guint64 null_count = col->null_count;
+
+  g_array_append_val(b->nodes, b->length);
+  g_array_append_val(b->nodes, null_count);
+  /* Without nulls the validity bitmap can be left out */
+  batch_add_buffer(b, null_count ? col->validity : NULL);
+  if (string) {
+    batch_add_buffer(b, col->offsets);
+  }
+  batch_add_buffer(b, col->values);
+}
+
+static void
+batch_init(struct arrow_batch *b, guint64 length)
+{
+  b->body = g_byte_array_new();
+  b->nodes = g_array_new(FALSE, FALSE, sizeof(guint64));
+  b->buffers = g_array_new(FALSE, FALSE, sizeof(guint64));
+  b->length = length;
+}
+
+static void
+batch_clear(struct arrow_batch *b)
+{
+  g_byte_array_unref(b->body);
+  g_array_free(b->nodes, TRUE);
+  g_array_free(b->buffers, TRUE);
+}
+
+/* A RecordBatch table, returns its position */
+static gsize
+fb_record_batch(struct fb *fb, const struct arrow_batch *b)
+{
+  struct fb_field fields[] = {
+    FB_SCALAR(8, b->length),
+    FB_OFFSET,
+    FB_OFFSET,
+  };
+  gsize table;
+
+  table = fb_table(fb, fields, G_N_ELEMENTS(fields));
+  fb_patch(fb, fields[1].slot,
+           fb_struct_vector(fb, (const guint64 *) b->nodes->data,
+                            b->nodes->len / 2, 2));
+  fb_patch(fb, fields[2].slot,
+           fb_struct_vector(fb, (const guint64 *) b->buffers->data,
+                            b->buffers->len / 2, 2));
+
+  return table;
+}
+
+/* An Int table of 32-bit signed integers, for dictionary indices */
+static gsize
+fb_int32(struct fb *fb)
+{
+  struct fb_field fields[] = {
+    FB_SCALAR(4, 32),
+    FB_SCALAR(1, TRUE),
+  };
+
+  return fb_table(fb, fields, G_N_ELEMENTS(fields));
+}
+
+static gsize
+fb_field(struct fb *fb, guint col)
+{
+  struct fb_field fields[] = {
+    FB_OFFSET,
+    FB_SCALAR(1, column_info[col].nullable),
+    FB_SCALAR(1, column_info[col].type),
+    FB_OFFSET,
+    FB_ABSENT,
+    FB_OFFSET,
+  };
+  gsize table;
+
+  if (column_info[col].dict >= 0) {
+    struct fb_field dict = FB_OFFSET;
+
+    fields[4] = dict;
+  }
+  table = fb_table(fb, fields, G_N_ELEMENTS(fields));
+  fb_patch(fb, fields[0].slot, fb_string(fb, column_info[col].name));
+
+  /* The type, of the values for dictionary encoded columns */
+  if (column_info[col].type == ARROW_TYPE_DATE) {
+    struct fb_field date[] = { FB_SCALAR(2, ARROW_DATE_DAY) };
+
+    fb_patch(fb, fields[3].slot, fb_table(fb, date, G_N_ELEMENTS(date)));
+  } else if (column_info[col].type == ARROW_TYPE_DECIMAL) {
+    struct fb_field decimal[] = {
+      FB_SCALAR(4, ARROW_DECIMAL_PRECISION),
+      FB_SCALAR(4, ARROW_DECIMAL_SCALE),
+      FB_SCALAR(4, 128),
+    };
+
+    fb_patch(fb, fields[3].slot,
+             fb_table(fb, decimal, G_N_ELEMENTS(decimal)));
+  } else {
+    /* Utf8 has no fields */
+    fb_patch(fb, fields[3].slot, fb_table(fb, NULL, 0));
+  }
+
+  if (column_info[col].dict >= 0) {
+    struct fb_field dict[] = {
+      FB_SCALAR(8, column_info[col].dict),
+      FB_OFFSET,
+    };
+
+    fb_patch(fb, fields[4].slot, fb_table(fb, dict, G_N_ELEMENTS(dict)));
+    fb_patch(fb, dict[1].slot, fb_int32(fb));
+  }
+
+  fb_patch(fb, fields[5].slot, fb_offset_vector(fb, 0));
+
+  return table;
+}
+
+static gsize
+fb_schema(struct fb *fb)
+{
+  struct fb_field fields[] = {
+    /* Little endian */
+    FB_SCALAR(2, 0),
+    FB_OFFSET,
+  };
+  gsize table;
+  gsize vec;
+  guint i;
+
+  table = fb_table(fb, fields, G_N_ELEMENTS(fields));
+  vec = fb_offset_vector(fb, ARROW_COL_COUNT);
+  fb_patch(fb, fields[1].slot, vec);
+  for (i = 0; i < ARROW_COL_COUNT; i++) {
+    fb_patch(fb, vec + 4 + 4 * i, fb_field(fb, i));
+  }
+
+  return table;
+}
+
+/*
+ * Append an encapsulated message: the continuation marker, the length of
+ * the padded metadata, the metadata and the body. Returns the length of
+ * everything but the body, as recorded in the footer.
+ */
+static gsize
+append_message(GString *gs, struct fb *fb, const GByteArray *body)
+{
+  guint8 prefix[8];
+  gsize len;
+
+  fb_pad(fb, ARROW_ALIGN, 0);
+  len = fb->buf->len;
+  memcpy(prefix, "\xff\xff\xff\xff", 4);
+  prefix[4] = len;
+  prefix[5] = len >> 8;
+  prefix[6] = len >> 16;
+  prefix[7] = len >> 24;
+
+  g_string_append_len(gs, (const gchar *) prefix, sizeof(prefix));
+  g_string_append_len(gs, (const gchar *) fb->buf->data, len);
+  if (body) {
+    g_string_append_len(gs, (const gchar *) body->data, body->len);
+  }
+  g_byte_array_unref(fb->buf);
+
+  return sizeof(prefix) + len;
+}
+
+/* A Message table with a header of the given type, returns its header slot */
+static gsize
+fb_message(struct fb *fb, guint8 header_type, guint64 body_len)
+{
+  struct fb_field fields[] = {
+    FB_SCALAR(2, ARROW_METADATA_V5),
+    FB_SCALAR(1, header_type),
+    FB_OFFSET,
+    FB_SCALAR(8, body_len),
+  };
+
+  fb_init(fb);
+  fb_patch(fb, 0, fb_table(fb, fields, G_N_ELEMENTS(fields)));
+
+  return fields[2].slot;
+}
+
+/* Position, metadata length and body length of a message, for the footer */
+struct arrow_block {
+  guint64 offset;
+  guint64 meta_len;
+  guint64 body_len;
+};
+
+static void
+append_dictionary(GString *gs, struct arrow_dictionary *dict, guint64 id,
+                  struct arrow_block *block)
+{
+  struct arrow_batch b;
+  struct fb fb;
+  gsize slot;
+  struct fb_field fields[] = {
+    FB_SCALAR(8, id),
+    FB_OFFSET,
+  };
+  gsize table;
+
+  batch_init(&b, dict->len);
+  if (!dict->len) {
+    /* Even an empty string column has one offset */
+    append_le(dict->data.offsets, 0, 4);
+  }
+  batch_add_column(&b, &dict->data, TRUE);
+
+  slot = fb_message(&fb, ARROW_HEADER_DICTIONARY, b.body->len);
+  table = fb_table(&fb, fields, G_N_ELEMENTS(fields));
+  fb_patch(&fb, slot, table);
+  fb_patch(&fb, fields[1].slot, fb_record_batch(&fb, &b));
+
+  block->offset = gs->len;
+  block->meta_len = append_message(gs, &fb, b.body);
+  block->body_len = b.body->len;
+  batch_clear(&b);
+}
+
+static void
+append_record_batch(GString *gs, struct amex_arrow_writer *w,
+                    struct arrow_block *block)
+{
+  struct arrow_batch b;
+  struct fb fb;
+  gsize slot;
+  guint i;
+
+  batch_init(&b, w->rows);
+  for (i = 0; i < ARROW_COL_COUNT; i++) {
+    struct arrow_column_data *col = &w->columns[i];
+    gboolean string = column_info[i].type == ARROW_TYPE_UTF8 &&
+                      column_info[i].dict < 0;
+
+    if (string && !col->offsets->len) {
+      append_le(col->offsets, 0, 4);
+    }
+    batch_add_column(&b, col, string);
+  }
+
+  slot = fb_message(&fb, ARROW_HEADER_RECORD_BATCH, b.body->len);
+  fb_patch(&fb, slot, fb_record_batch(&fb, &b));
+
+  block->offset = gs->len;
+  block->meta_len = append_message(gs, &fb, b.body);
+  block->body_len = b.body->len;
+  batch_clear(&b);
+}
+
+static void
+fb_block_vector(struct fb *fb, gsize slot, const struct arrow_block *blocks,
+                guint n)
+{
+  guint64 fields[3 * ARROW_DICT_COUNT];
+  guint i;
+
+  g_assert(n <= ARROW_DICT_COUNT);
+
+  /* Block is { offset: long, metaDataLength: int, bodyLength: long } */
+  for (i = 0; i < n; i++) {
+    fields[3 * i] = blocks[i].offset;
+    fields[3 * i + 1] = blocks[i].meta_len;
+    fields[3 * i + 2] = blocks[i].body_len;
+  }
+  fb_patch(fb, slot, fb_struct_vector(fb, fields, n, 3));
+}
+
+guint
+amex_arrow_writer_finish(struct amex_arrow_writer *w, GString *gs)
+{
+  struct arrow_block dicts[ARROW_DICT_COUNT];
+  struct arrow_block batch;
+  struct fb_field fields[] = {
+    FB_SCALAR(2, ARROW_METADATA_V5),
+    FB_OFFSET,
+    FB_OFFSET,
+    FB_OFFSET,
+  };
+  struct fb fb;
+  gsize start;
+  gsize slot;
+  gsize len;
+  guint i;
+
+  g_assert(w);
+  g_assert(gs);
+
+  /* Offsets in the footer are relative to the start of the file */
+  start = gs->len;
+  g_string_append_len(gs, ARROW_MAGIC "\0\0", 8);
+
+  slot = fb_message(&fb, ARROW_HEADER_SCHEMA, 0);
+  fb_patch(&fb, slot, fb_schema(&fb));
+  append_message(gs, &fb, NULL);
+
+  for (i = 0; i < ARROW_DICT_COUNT; i++) {
+    append_dictionary(gs, &w->dicts[i], i, &dicts[i]);
+    dicts[i].offset -= start;
+  }
+  append_record_batch(gs, w, &batch);
+  batch.offset -= start;
+
+  /* End of stream */
+  g_string_append_len(gs, "\xff\xff\xff\xff\0\0\0\0", 8);
+
+  fb_init(&fb);
+  fb_patch(&fb, 0, fb_table(&fb, fields, G_N_ELEMENTS(fields)));
+  fb_patch(&fb, fields[1].slot, fb_schema(&fb));
+  fb_block_vector(&fb, fields[2].slot, dicts, ARROW_DICT_COUNT);
+  fb_block_vector(&fb, fields[3].slot, &batch, 1);
+
+  len = fb.buf->len;
+  g_string_append_len(gs, (const gchar *) fb.buf->data, len);
+  g_byte_array_unref(fb.buf);
+  g_string_append_c(gs, len);
+  g_string_append_c(gs, len >> 8);
+  g_string_append_c(gs, len >> 16);
+  g_string_append_c(gs, len >> 24);
+  g_string_append_len(gs, ARROW_MAGIC, 6);
+
+  return w->rows;
+}
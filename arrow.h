@@ -0,0 +1,43 @@
+#ifndef ARROW_H__
+#define ARROW_H__
+/*
+ * arrow.h - Transactions as an Arrow IPC (Feather v2) file
+ *
+ * One row per transaction, in typed columns:
+ *
+ *   holder        dictionary<int32, utf8>
+ *   card_suffix   utf8, null for the main card
+ *   date          date32
+ *   process_date  date32
+ *   amount        decimal128(18, 2)
+ *   location      dictionary<int32, utf8>, null if unknown
+ *   details       utf8
+ *
+ * Rows are collected from any number of statements and written as one
+ * record batch. The few flatbuffers Arrow needs for its metadata are built
+ * by hand, so there is no dependency on the Arrow libraries.
+ */
+#include <glib.h>
+
+#include "amexparser.h"
+
+#define AMEX_ARROW_SUFFIX          ".arrow"
+
+struct amex_arrow_writer;
+
+struct amex_arrow_writer *
+amex_arrow_writer_new(void);
+
+void
+amex_arrow_writer_free(struct amex_arrow_writer *writer);
+
+/* Adds the rows of all cards, strings are copied */
+void
+amex_arrow_writer_add(struct amex_arrow_writer *writer,
+                      const struct amex_statement *st);
+
+/* Append the whole file to gs, returns the number of rows */
+guint
+amex_arrow_writer_finish(struct amex_arrow_writer *writer, GString *gs);
+
+#endif /* ARROW_H__ */
@@ -0,0 +1,309 @@
+/*
+ * Per-stage timing of the parser on a generated statement. The stages are
+ * static to the library, so its parser is pulled in whole.
+ */
+#include <glib.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "parser.c"
+
+#include "statement_gen.h"
+
+#define BENCH_DEFAULT_MIN_TIME     0.5
+#define USEC_PER_SEC               1000000.0
+
+enum bench_stage {
+  STAGE_SPLIT = 0,
+  STAGE_CLASSIFY,
+  STAGE_PROCESS,
+  STAGE_DETAILS,
+  STAGE_CSV,
+  STAGE_COUNT,
+};
+
+static const gchar *stage_names[STAGE_COUNT] = {
+  [STAGE_SPLIT]    = "split",
+  [STAGE_CLASSIFY] = "classify",
+  [STAGE_PROCESS]  = "process",
+  [STAGE_DETAILS]  = "details",
+  [STAGE_CSV]      = "csv",
+};
+
+struct bench {
+  struct amex_parser *parser;
+  const gchar *infile;
+  gdouble min_time;
+  guint64 lines;
+  guint64 transactions;
+};
+
+/* Returns the time spent in the stage itself, in microseconds */
+static gboolean
+run_stage(struct bench *b, enum bench_stage stage, gint64 *elapsed,
+          GError **err)
+{
+  struct amex_parser *parser;
+  struct amex_statement *st;
+  struct parse_state state;
+  gboolean ret = FALSE;
+  GString *gs = NULL;
+  gint64 start = 0;
+  guint i;
+
+  /* The intern table lives as long as the parser, so details runs get their
+   * own parser to time the lookups of a first run rather than table hits */
+  parser = stage == STAGE_DETAILS ?
+           amex_parser_new(&b->parser->opts, b->parser->locs) :
+           amex_parser_ref(b->parser);
+  st = statement_new(parser, b->infile);
+  init_parse_state(&state, parser, st);
+
+  if (stage == STAGE_SPLIT) {
+    start = g_get_monotonic_time();
+  }
+  if (!split_statement(parser, st, err)) {
+    goto out;
+  }
+
+  switch (stage) {
+  case STAGE_SPLIT:
+    break;
+  case STAGE_CLASSIFY: {
+    struct line_info info;
+    guint found = 0;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < st->lines->len; i++) {
+      found += classify_line(&g_array_index(st->lines, struct line_view, i),
+                             &info) == LINE_TRANSACTION;
+    }
+    g_assert(found == b->transactions);
+    break;
+  }
+  case STAGE_PROCESS:
+    start = g_get_monotonic_time();
+    if (!process_transactions(&state, err)) {
+      goto out;
+    }
+    break;
+  case STAGE_DETAILS:
+    /* Amount and details parsing only, lines are classified up front */
+    start = g_get_monotonic_time();
+    for (i = 0; i < st->lines->len; i++) {
+      const struct line_view *line = &g_array_index(st->lines,
+                                                    struct line_view, i);
+      struct amex_transaction t = { 0, };
+      struct line_info info;
+      const gchar *amount;
+
+      if (classify_line(line, &info) != LINE_TRANSACTION ||
+          (amount = strrchr(info.payload, ' ')) == NULL) {
+        continue;
+      }
+
+      state.idx = i;
+      if (!parse_transaction_amount(amount + 1, &t.amount, err) ||
+          !parse_transaction_details(&state, info.payload,
+                                     amount - info.payload, &t, err)) {
+        goto out;
+      }
+    }
+    break;
+  case STAGE_CSV:
+    if (!process_transactions(&state, err)) {
+      goto out;
+    }
+    gs = g_string_sized_new(st->lines->len * 64);
+    start = g_get_monotonic_time();
+    amex_statement_append_csv(st, gs);
+    break;
+  case STAGE_COUNT:
+    g_assert_not_reached();
+  }
+
+  *elapsed = g_get_monotonic_time() - start;
+  b->lines = st->lines->len;
+  ret = TRUE;
+
+out:
+  if (gs) {
+    g_string_free(gs, TRUE);
+  }
+  amex_statement_free(st);
+  amex_parser_unref(parser);
+
+  return ret;
+}
+
+static gboolean
+bench_stage(struct bench *b, enum bench_stage stage, guint pages,
+            GError **err)
+{
+  gint64 total = 0;
+  guint runs = 0;
+  gdouble per_run;
+
+  /* Repeat until the stage has run for long enough to time reliably */
+  do {
+    gint64 elapsed;
+
+    if (!run_stage(b, stage, &elapsed, err)) {
+      g_prefix_error(err, "%s: ", stage_names[stage]);
+      return FALSE;
+    }
+    total += elapsed;
+    runs++;
+  } while (total < b->min_time * USEC_PER_SEC);
+
+  per_run = MAX((gdouble) total / runs, 1.0) / USEC_PER_SEC;
+  g_print("%-9s pages=%-7u lines=%-9" G_GUINT64_FORMAT
+          " transactions=%-9" G_GUINT64_FORMAT
+          " runs=%-5u %10.3f ms/run %12.0f lines/s %12.0f transactions/s\n",
+          stage_names[stage], pages, b->lines, b->transactions, runs,
+          per_run * 1000.0, b->lines / per_run, b->transactions / per_run);
+
+  return TRUE;
+}
+
+static gboolean
+write_input(const gchar *tmpl, gboolean locations,
+            const struct statement_params *params,
+            struct statement_counts *counts, gchar **filename, GError **err)
+{
+  gboolean ret;
+  FILE *out;
+  gint fd;
+
+  if ((fd = g_file_open_tmp(tmpl, filename, err)) < 0) {
+    return FALSE;
+  } else if ((out = fdopen(fd, "w")) == NULL) {
+    SET_GERROR(err, -1, "fdopen failed: %s", g_strerror(errno));
+    close(fd);
+    return FALSE;
+  }
+
+  ret = locations ? statement_write_locations(out, err) :
+                    statement_generate(params, out, counts, err);
+  if (fclose(out) != 0 && ret) {
+    SET_GERROR(err, -1, "could not write '%s': %s", *filename,
+               g_strerror(errno));
+    ret = FALSE;
+  }
+
+  return ret;
+}
+
+static void
+bench_usage(const gchar *prog, const gchar *errstr)
+{
+  if (errstr) {
+    g_printerr("Error: %s\n\n", errstr);
+  }
+  g_printerr("Usage: %s [--pages N] [--width N] [--transactions N] "
+             "[--min-time SECONDS] [stage ...]\n"
+             "Stages: split, classify, process, details, csv (default: all)\n",
+             prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, gchar **argv)
+{
+  struct statement_params params;
+  struct statement_counts counts;
+  struct amex_parser_options popts = { 0, };
+  struct location_index *locs = NULL;
+  struct bench b = { 0, };
+  gboolean stages[STAGE_COUNT] = { FALSE, };
+  gboolean any = FALSE;
+  gchar *infile = NULL;
+  gchar *locfile = NULL;
+  GError *err = NULL;
+  gint ret = EXIT_FAILURE;
+  gint opt;
+  guint i;
+
+  static const struct option long_opts[] = {
+    { "pages",         required_argument, NULL, 'p' },
+    { "width",         required_argument, NULL, 'w' },
+    { "transactions",  required_argument, NULL, 't' },
+    { "min-time",      required_argument, NULL, 'm' },
+    { NULL,            0,                 NULL,  0  }
+  };
+
+  statement_params_init(&params);
+  b.min_time = BENCH_DEFAULT_MIN_TIME;
+
+  while ((opt = getopt_long(argc, argv, "p:w:t:m:", long_opts,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'p':
+      params.pages = g_ascii_strtoull(optarg, NULL, 10);
+      break;
+    case 'w':
+      params.width = g_ascii_strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      params.transactions = g_ascii_strtoull(optarg, NULL, 10);
+      break;
+    case 'm':
+      b.min_time = g_ascii_strtod(optarg, NULL);
+      break;
+    default:
+      bench_usage(argv[0], "Illegal option");
+      break;
+    }
+  }
+
+  for (; optind < argc; optind++) {
+    for (i = 0; i < STAGE_COUNT; i++) {
+      if (!g_strcmp0(argv[optind], stage_names[i])) {
+        stages[i] = any = TRUE;
+        break;
+      }
+    }
+    if (i == STAGE_COUNT) {
+      bench_usage(argv[0], "Unknown stage");
+    }
+  }
+
+  if (!write_input("amex-bench-XXXXXX.txt", FALSE, &params, &counts,
+                   &infile, &err) ||
+      !write_input("amex-bench-loc-XXXXXX.txt", TRUE, &params, &counts,
+                   &locfile, &err)) {
+    g_printerr("Could not generate input: %s\n", GERROR_MSG(err));
+    goto out;
+  }
+
+  if ((locs = location_index_load(locfile, &err)) == NULL) {
+    g_printerr("Could not load locations: %s\n", GERROR_MSG(err));
+    goto out;
+  }
+  b.parser = amex_parser_new(&popts, locs);
+  b.infile = infile;
+  b.transactions = counts.transactions;
+
+  for (i = 0; i < STAGE_COUNT; i++) {
+    if ((!any || stages[i]) && !bench_stage(&b, i, params.pages, &err)) {
+      g_printerr("Benchmark failed: %s\n", GERROR_MSG(err));
+      goto out;
+    }
+  }
+
+  ret = EXIT_SUCCESS;
+  /* fall through */
+out:
+  g_clear_error(&err);
+  g_clear_pointer(&b.parser, amex_parser_unref);
+  g_clear_pointer(&locs, location_index_unref);
+  if (infile) {
+    remove(infile);
+    g_free(infile);
+  }
+  if (locfile) {
+    remove(locfile);
+    g_free(locfile);
+  }
+
+  return ret;
+}
@@ -0,0 +1,167 @@
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "debug.h"
+#include "statement_gen.h"
+
+DEFINE_GQUARK("amex_parser");
+
+static const gchar *prog_name;
+
+static void
+usage(const gchar *errstr, gint exit_code)
+{
+  g_printerr("Synthetic Amex statement generator\n");
+
+  if (errstr) {
+    g_printerr("\nError: %s\n", errstr);
+  }
+
+  g_printerr("\nUsage: %s [options]\n\n"
+             " Options:\n"
+             "    --pages            -p      Number of pages\n"
+             "    --cards            -c      Number of card holders\n"
+             "    --extra-cards      -e      Extra cards per holder\n"
+             "    --transactions     -t      Transactions per card section\n"
+             "    --width            -w      Column the right hand side starts at\n"
+             "    --rows             -r      Lines per column and page\n"
+             "    --seed             -S      Random seed\n"
+             "    --outfile          -o      Statement file (default: stdout)\n"
+             "    --locations        -l      Also write a matching location file\n"
+             "    --help             -h      Show help options\n\n",
+             prog_name);
+
+  exit(exit_code);
+}
+
+static guint
+parse_uint(const gchar *str, const gchar *what)
+{
+  gchar *eptr = NULL;
+  guint64 v = g_ascii_strtoull(str, &eptr, 10);
+
+  if (!*str || (eptr && *eptr) || v > G_MAXUINT) {
+    gchar *msg = g_strdup_printf("Invalid %s '%s'", what, str);
+
+    usage(msg, EXIT_FAILURE);
+  }
+
+  return (guint) v;
+}
+
+static gboolean
+write_file(const gchar *filename, gboolean locations,
+           const struct statement_params *params, GError **err)
+{
+  struct statement_counts counts;
+  gboolean ret;
+  FILE *out = stdout;
+
+  if (filename && (out = fopen(filename, "w")) == NULL) {
+    SET_GERROR(err, -1, "could not open '%s': %s", filename,
+               g_strerror(errno));
+    return FALSE;
+  }
+
+  if (locations) {
+    ret = statement_write_locations(out, err);
+  } else if ((ret = statement_generate(params, out, &counts, err)) == TRUE) {
+    g_printerr("Wrote %u page(s), %" G_GUINT64_FORMAT " line(s), %"
+               G_GUINT64_FORMAT " transaction(s), %" G_GUINT64_FORMAT
+               " byte(s)\n", params->pages, counts.lines,
+               counts.transactions, counts.bytes);
+  }
+
+  if (out != stdout && fclose(out) != 0 && ret) {
+    SET_GERROR(err, -1, "could not write '%s': %s", filename,
+               g_strerror(errno));
+    ret = FALSE;
+  }
+
+  return ret;
+}
+
+int main(int argc, gchar **argv)
+{
+  struct statement_params params;
+  const gchar *outfile = NULL;
+  const gchar *locfile = NULL;
+  GError *err = NULL;
+  gint ret = EXIT_FAILURE;
+  gint opt;
+
+  static const struct option long_opts[] = {
+    { "help",          no_argument,       NULL, 'h' },
+    { "pages",         required_argument, NULL, 'p' },
+    { "cards",         required_argument, NULL, 'c' },
+    { "extra-cards",   required_argument, NULL, 'e' },
+    { "transactions",  required_argument, NULL, 't' },
+    { "width",         required_argument, NULL, 'w' },
+    { "rows",          required_argument, NULL, 'r' },
+    { "seed",          required_argument, NULL, 'S' },
+    { "outfile",       required_argument, NULL, 'o' },
+    { "locations",     required_argument, NULL, 'l' },
+    { NULL,            0,                 NULL,  0  }
+  };
+
+  prog_name = argv[0];
+  statement_params_init(&params);
+
+  while ((opt = getopt_long(argc, argv, "hp:c:e:t:w:r:S:o:l:", long_opts,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(NULL, EXIT_SUCCESS);
+      break;
+    case 'p':
+      params.pages = parse_uint(optarg, "page count");
+      break;
+    case 'c':
+      params.cards = parse_uint(optarg, "card count");
+      break;
+    case 'e':
+      params.extra_cards = parse_uint(optarg, "extra card count");
+      break;
+    case 't':
+      params.transactions = parse_uint(optarg, "transaction count");
+      break;
+    case 'w':
+      params.width = parse_uint(optarg, "width");
+      break;
+    case 'r':
+      params.rows = parse_uint(optarg, "row count");
+      break;
+    case 'S':
+      params.seed = parse_uint(optarg, "seed");
+      break;
+    case 'o':
+      outfile = optarg;
+      break;
+    case 'l':
+      locfile = optarg;
+      break;
+    default:
+      usage("Illegal option", EXIT_FAILURE);
+      break;
+    }
+  }
+
+  if (locfile && !write_file(locfile, TRUE, &params, &err)) {
+    g_printerr("Could not write location file: %s\n", GERROR_MSG(err));
+    goto out;
+  }
+
+  if (!write_file(outfile, FALSE, &params, &err)) {
+    g_printerr("Could not generate statement: %s\n", GERROR_MSG(err));
+    goto out;
+  }
+
+  ret = EXIT_SUCCESS;
+  /* fall through */
+out:
+  g_clear_error(&err);
+
+  return ret;
+}
@@ -0,0 +1,359 @@
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "statement_gen.h"
+
+#define SWE_LOWER_OE               "\xc3\xb6"
+#define SWE_LOWER_AO               "\xc3\xa5"
+#define SWE_LOWER_AE               "\xc3\xa4"
+
+#define CARD_BEGIN_PFX             "Nya k"SWE_LOWER_OE"p f"SWE_LOWER_OE"r "
+#define CARD_END_PFX               "Summa nya k"SWE_LOWER_OE"p f"SWE_LOWER_OE"r "
+#define EXTRAKORT_PFX              "Extrakort som slutar p"SWE_LOWER_AO" "
+#define PAGE_IDSTR_INDENT          60
+
+#define GEN_DEFAULT_PAGES          1
+#define GEN_DEFAULT_CARDS          2
+#define GEN_DEFAULT_EXTRA_CARDS    1
+#define GEN_DEFAULT_TRANSACTIONS   20
+#define GEN_DEFAULT_WIDTH          80
+#define GEN_DEFAULT_ROWS           40
+#define GEN_DEFAULT_SEED           4711
+/* The widest left hand line (an extra card header) has to fit */
+#define GEN_MIN_WIDTH              72
+/* Percentages of transactions */
+#define GEN_NEXT_LINE_LOCATION     20
+#define GEN_ASCII_LOCATION         20
+#define GEN_UNKNOWN_LOCATION       5
+#define GEN_REFUNDS                3
+
+#define AMOUNT_STR_LEN             32
+
+DEFINE_GQUARK("amex_parser");
+
+enum section_phase {
+  PHASE_BEGIN = 0,
+  PHASE_TRANSACTIONS,
+  PHASE_END,
+};
+
+struct gen_location {
+  const gchar *name;
+  /* How merchants without Swedish characters write it, if different */
+  const gchar *ascii;
+};
+
+static const gchar *holders[] = {
+  "ANNA SVENSSON", "BERTIL SVENSSON", "CECILIA LINDQVIST", "DAVID NILSSON",
+  "EVA "SWE_LOWER_AO"BERG", "FREDRIK JOHANSSON", "GUNILLA KARLSSON",
+  "HENRIK ANDERSSON",
+};
+
+static const gchar *merchants[] = {
+  "ICA MAXI", "ICA NARA", "COOP KONSUM", "SYSTEMBOLAGET", "SHELL", "CIRCLE K",
+  "SPOTIFY", "PIZZERIA NAPOLI", "HOTEL", "SJ AB", "APOTEKET", "CLAS OHLSON",
+  "BIO", "IKEA", "PRESSBYRAN", "MAX HAMBURGARE", "BAUHAUS", "TAXI",
+};
+
+static const struct gen_location locations[] = {
+  { "Stockholm", NULL },
+  { "Malm"SWE_LOWER_OE, "Malmo" },
+  { "Lund", NULL },
+  { "Arl"SWE_LOWER_OE"v", "Arlov" },
+  { "Bjuv", NULL },
+  { "Staffanstorp", NULL },
+  { "K"SWE_LOWER_AE"vlinge", "Kavlinge" },
+  { "Oxie", NULL },
+  { "Svedala", NULL },
+  { "Solna", NULL },
+  { "V"SWE_LOWER_AE"ster"SWE_LOWER_AO"s", "Vasteras" },
+  { "Bj"SWE_LOWER_AE"rred", "Bjarred" },
+  { "Palmerston North", NULL },
+  { "G"SWE_LOWER_OE"teborg", "Goteborg" },
+  { "Helsingborg", NULL },
+  { "Uppsala", NULL },
+};
+
+static const gchar *unknown_locations[] = {
+  "London", "Berlin", "Kobenhavn", "Oslo",
+};
+
+/* Produces the column contents one line at a time, card after card */
+struct content {
+  const struct statement_params *params;
+  GRand *rand;
+  GString *line;
+  struct statement_counts *counts;
+  enum section_phase phase;
+  guint preamble;
+  guint card;
+  guint transaction;
+  guint month;
+  gint64 total;
+  /* A location to put on the line after its transaction */
+  const gchar *pending;
+};
+
+void
+statement_params_init(struct statement_params *params)
+{
+  g_assert(params);
+
+  params->pages = GEN_DEFAULT_PAGES;
+  params->cards = GEN_DEFAULT_CARDS;
+  params->extra_cards = GEN_DEFAULT_EXTRA_CARDS;
+  params->transactions = GEN_DEFAULT_TRANSACTIONS;
+  params->width = GEN_DEFAULT_WIDTH;
+  params->rows = GEN_DEFAULT_ROWS;
+  params->seed = GEN_DEFAULT_SEED;
+}
+
+/* Swedish notation: 1.234,56 */
+static const gchar *
+format_amount(gint64 amount, gchar *buf)
+{
+  guint64 v = amount < 0 ? -(guint64) amount : (guint64) amount;
+  gchar tmp[AMOUNT_STR_LEN];
+  guint64 whole = v / 100;
+  gsize n = 0;
+  gsize len = 0;
+  guint digits = 0;
+
+  do {
+    if (digits && digits % 3 == 0) {
+      tmp[n++] = '.';
+    }
+    tmp[n++] = '0' + whole % 10;
+    whole /= 10;
+    digits++;
+  } while (whole);
+
+  if (amount < 0) {
+    buf[len++] = '-';
+  }
+  while (n) {
+    buf[len++] = tmp[--n];
+  }
+  g_snprintf(buf + len, AMOUNT_STR_LEN - len, ",%02u", (guint) (v % 100));
+
+  return buf;
+}
+
+static const gchar *
+card_holder(struct content *c, gchar *buf, gsize len)
+{
+  guint holder = c->card / (c->params->extra_cards + 1);
+
+  if (holder < G_N_ELEMENTS(holders)) {
+    return holders[holder];
+  }
+
+  g_snprintf(buf, len, "%s %u", holders[holder % G_N_ELEMENTS(holders)],
+             holder / (guint) G_N_ELEMENTS(holders) + 1);
+
+  return buf;
+}
+
+static void
+append_transaction(struct content *c)
+{
+  const gchar *merchant;
+  const gchar *location;
+  gchar abuf[AMOUNT_STR_LEN];
+  gint64 amount;
+  guint day;
+
+  merchant = merchants[g_rand_int_range(c->rand, 0, G_N_ELEMENTS(merchants))];
+  if (g_rand_int_range(c->rand, 0, 100) < GEN_UNKNOWN_LOCATION) {
+    location = unknown_locations[g_rand_int_range(c->rand, 0,
+                                   G_N_ELEMENTS(unknown_locations))];
+  } else {
+    const struct gen_location *l;
+
+    l = &locations[g_rand_int_range(c->rand, 0, G_N_ELEMENTS(locations))];
+    location = l->ascii &&
+               g_rand_int_range(c->rand, 0, 100) < GEN_ASCII_LOCATION ?
+               l->ascii : l->name;
+  }
+
+  amount = g_rand_int_range(c->rand, 100, 500000);
+  if (g_rand_int_range(c->rand, 0, 100) < GEN_REFUNDS) {
+    amount = -amount;
+  }
+  c->total += amount;
+
+  day = g_rand_int_range(c->rand, 1, 28);
+  g_string_append_printf(c->line, "%02u.%02u.21 %02u.%02u.21 %s",
+                         day, c->month + 1, day + 1, c->month + 1, merchant);
+
+  /* Only merchants with a multi-word name wrap their location */
+  if (strchr(merchant, ' ') &&
+      g_rand_int_range(c->rand, 0, 100) < GEN_NEXT_LINE_LOCATION) {
+    c->pending = location;
+  } else {
+    g_string_append_printf(c->line, " %s", location);
+  }
+  g_string_append_printf(c->line, "%*s%s", g_rand_int_range(c->rand, 2, 8),
+                         "", format_amount(amount, abuf));
+}
+
+static const gchar *
+next_line(struct content *c)
+{
+  gchar hbuf[64];
+  gchar abuf[AMOUNT_STR_LEN];
+  guint ncards = c->params->cards * (c->params->extra_cards + 1);
+
+  g_string_truncate(c->line, 0);
+
+  /* Payment details come first */
+  if (c->preamble < 2) {
+    if (c->preamble++ == 0) {
+      g_string_append_printf(c->line, "OCR: %013" G_GINT64_FORMAT,
+                             (gint64) c->params->seed * 7919 + 1000000000);
+    } else {
+      g_string_append(c->line, "F"SWE_LOWER_OE"rfallodag 30.06.21");
+    }
+    c->counts->lines++;
+    return c->line->str;
+  }
+
+  if (c->pending) {
+    g_string_append(c->line, c->pending);
+    c->pending = NULL;
+    c->counts->lines++;
+    return c->line->str;
+  }
+
+  if (c->phase == PHASE_TRANSACTIONS &&
+      c->transaction == c->params->transactions) {
+    c->phase = PHASE_END;
+  }
+
+  switch (c->phase) {
+  case PHASE_BEGIN: {
+    guint extra = c->card % (c->params->extra_cards + 1);
+
+    g_string_append_printf(c->line, CARD_BEGIN_PFX "%s",
+                           card_holder(c, hbuf, sizeof(hbuf)));
+    if (extra) {
+      g_string_append_printf(c->line, " " EXTRAKORT_PFX "%05u",
+                             10000 + c->card * 37 % 90000);
+    }
+    c->total = 0;
+    c->transaction = 0;
+    c->phase = PHASE_TRANSACTIONS;
+    break;
+  }
+  case PHASE_TRANSACTIONS:
+    append_transaction(c);
+    c->transaction++;
+    c->counts->transactions++;
+    break;
+  case PHASE_END:
+    g_string_append_printf(c->line, CARD_END_PFX "%s   %s",
+                           card_holder(c, hbuf, sizeof(hbuf)),
+                           format_amount(c->total, abuf));
+    c->card = (c->card + 1) % ncards;
+    c->month = (c->month + !c->card) % 12;
+    c->phase = PHASE_BEGIN;
+    break;
+  }
+
+  c->counts->lines++;
+
+  return c->line->str;
+}
+
+gboolean
+statement_generate(const struct statement_params *params, FILE *out,
+                   struct statement_counts *counts, GError **err)
+{
+  struct content c = { 0, };
+  GString *page;
+  GPtrArray *cells;
+  gboolean ret = FALSE;
+  guint p;
+  guint r;
+
+  g_assert(params);
+  g_assert(out);
+  g_assert(counts);
+
+  if (params->width < GEN_MIN_WIDTH) {
+    SET_GERROR(err, -1, "width must be at least %u", GEN_MIN_WIDTH);
+    return FALSE;
+  } else if (!params->pages || !params->cards || !params->rows) {
+    SET_GERROR(err, -1, "pages, cards and rows must be at least 1");
+    return FALSE;
+  }
+
+  memset(counts, 0, sizeof(*counts));
+  c.params = params;
+  c.counts = counts;
+  c.rand = g_rand_new_with_seed(params->seed);
+  c.line = g_string_new(NULL);
+  page = g_string_new("AMERICAN EXPRESS\nFaktura\n");
+  cells = g_ptr_array_new_with_free_func(g_free);
+
+  for (p = 1; p <= params->pages; p++) {
+    g_string_append_printf(page, "%*sSida %u av %u\n", PAGE_IDSTR_INDENT, "",
+                           p, params->pages);
+
+    /* The left column is filled first, so produce the right one up front */
+    for (r = 0; r < params->rows * 2; r++) {
+      g_ptr_array_add(cells, g_strdup(next_line(&c)));
+    }
+
+    for (r = 0; r < params->rows; r++) {
+      const gchar *left = g_ptr_array_index(cells, r);
+      glong pad = params->width - g_utf8_strlen(left, -1);
+
+      g_string_append_printf(page, "%s%*s%s\n", left, (gint) pad, "",
+                             (const gchar *) g_ptr_array_index(cells, r +
+                                                               params->rows));
+    }
+    g_ptr_array_set_size(cells, 0);
+
+    counts->bytes += page->len;
+    if (fwrite(page->str, 1, page->len, out) != page->len) {
+      SET_GERROR(err, -1, "write failed: %s", g_strerror(errno));
+      goto out;
+    }
+    g_string_truncate(page, 0);
+  }
+
+  ret = TRUE;
+out:
+  g_ptr_array_free(cells, TRUE);
+  g_string_free(page, TRUE);
+  g_string_free(c.line, TRUE);
+  g_rand_free(c.rand);
+
+  return ret;
+}
+
+gboolean
+statement_write_locations(FILE *out, GError **err)
+{
+  guint i;
+
+  g_assert(out);
+
+  for (i = 0; i < G_N_ELEMENTS(locations); i++) {
+    if (locations[i].ascii) {
+      fprintf(out, "%s -> %s\n", locations[i].ascii, locations[i].name);
+    } else {
+      fprintf(out, "%s\n", locations[i].name);
+    }
+  }
+
+  if (ferror(out)) {
+    SET_GERROR(err, -1, "write failed: %s", g_strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,46 @@
+#ifndef STATEMENT_GEN_H__
+#define STATEMENT_GEN_H__
+/*
+ * statement_gen.h - Synthetic Amex statements
+ *
+ * Writes statements the way pdftotext -layout renders them: two columns
+ * per page, split at a configurable gutter, with card sections, extra
+ * cards, transactions (some with the location on the following line),
+ * card totals, OCR number and due date. Output is deterministic for a
+ * given seed.
+ */
+#include <glib.h>
+#include <stdio.h>
+
+struct statement_params {
+  guint pages;
+  /* Card holders, and extra cards per holder */
+  guint cards;
+  guint extra_cards;
+  /* Transactions per card section */
+  guint transactions;
+  /* Character column the right hand side starts at */
+  guint width;
+  /* Lines per column and page */
+  guint rows;
+  guint32 seed;
+};
+
+struct statement_counts {
+  guint64 lines;
+  guint64 transactions;
+  guint64 bytes;
+};
+
+void
+statement_params_init(struct statement_params *params);
+
+gboolean
+statement_generate(const struct statement_params *params, FILE *out,
+                   struct statement_counts *counts, GError **err);
+
+/* Write a location file matching the generated transactions */
+gboolean
+statement_write_locations(FILE *out, GError **err);
+
+#endif /* STATEMENT_GEN_H__ */
@@ -0,0 +1,382 @@
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "cache.h"
+#include "hash.h"
+#include "log.h"
+
+#define CACHE_MAGIC                "AMXCACHE"
+/* Bump when the entry header changes */
+#define CACHE_VERSION              1
+#define CACHE_SUFFIX               ".stmt"
+/* Entries are named <dictionary version>-<key>.stmt, both in hex */
+#define CACHE_HEX_LEN              16
+#define CACHE_NAME_LEN             (2 * CACHE_HEX_LEN + 1 + \
+                                    sizeof(CACHE_SUFFIX) - 1)
+/* Trimming stops once the cache is down to this share of its limit */
+#define CACHE_TRIM_PERCENT         90
+
+/* Entries are only read back on the host they were written on */
+struct cache_header {
+  gchar magic[8];
+  guint32 version;
+  guint32 reserved;
+  guint64 dict_version;
+  guint64 key;
+  guint64 len;
+  /* XXH64 of the payload */
+  guint64 checksum;
+};
+
+struct cache_entry {
+  gchar *path;
+  time_t mtime;
+  guint64 size;
+};
+
+struct amex_cache {
+  gint ref_count;
+  gchar *dir;
+  guint64 max_size;
+  /* Guards size, and keeps trimming to one thread at a time */
+  GMutex lock;
+  guint64 size;
+};
+
+DEFINE_GQUARK("amex_parser");
+
+static gchar *
+entry_path(const struct amex_cache *cache, guint64 dict_version, guint64 key)
+{
+  gchar name[CACHE_NAME_LEN + 1];
+
+  g_snprintf(name, sizeof(name), "%016" G_GINT64_MODIFIER "x-%016"
+             G_GINT64_MODIFIER "x" CACHE_SUFFIX, dict_version, key);
+
+  return g_build_filename(cache->dir, name, NULL);
+}
+
+/* Anything else in the directory (like files being written) is left alone */
+static gboolean
+parse_entry_name(const gchar *name, guint64 *dict_version)
+{
+  gchar *end = NULL;
+
+  if (strlen(name) != CACHE_NAME_LEN || name[CACHE_HEX_LEN] != '-' ||
+      !g_str_has_suffix(name, CACHE_SUFFIX)) {
+    return FALSE;
+  }
+
+  *dict_version = g_ascii_strtoull(name, &end, 16);
+
+  return end == name + CACHE_HEX_LEN;
+}
+
+static void
+clear_entry(gpointer data)
+{
+  struct cache_entry *e = (struct cache_entry *) data;
+
+  g_free(e->path);
+}
+
+static gint
+compare_entries_mtime(gconstpointer a, gconstpointer b)
+{
+  const struct cache_entry *ea = a;
+  const struct cache_entry *eb = b;
+
+  return ea->mtime < eb->mtime ? -1 : ea->mtime > eb->mtime;
+}
+
+/* All entries in the directory, returns their total size */
+static guint64
+scan_entries(const struct amex_cache *cache, GArray *entries, GError **err)
+{
+  const gchar *name;
+  guint64 total = 0;
+  GDir *dir;
+
+  if ((dir = g_dir_open(cache->dir, 0, err)) == NULL) {
+    return 0;
+  }
+
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    struct cache_entry e;
+    guint64 dict_version;
+    struct stat sb;
+
+    if (!parse_entry_name(name, &dict_version)) {
+      continue;
+    }
+
+    e.path = g_build_filename(cache->dir, name, NULL);
+    if (stat(e.path, &sb) < 0) {
+      /* Removed by someone else meanwhile */
+      g_free(e.path);
+      continue;
+    }
+    e.mtime = sb.st_mtime;
+    e.size = sb.st_size;
+    total += e.size;
+
+    if (entries) {
+      g_array_append_val(entries, e);
+    } else {
+      g_free(e.path);
+    }
+  }
+  g_dir_close(dir);
+
+  return total;
+}
+
+/* Remove the least recently used entries until the cache is small enough */
+static void
+trim_locked(struct amex_cache *cache)
+{
+  GArray *entries;
+  GError *err = NULL;
+  guint64 target = cache->max_size / 100 * CACHE_TRIM_PERCENT;
+  guint removed = 0;
+  guint i;
+
+  entries = g_array_new(FALSE, FALSE, sizeof(struct cache_entry));
+  g_array_set_clear_func(entries, clear_entry);
+
+  /* Other processes may have added or removed entries too */
+  cache->size = scan_entries(cache, entries, &err);
+  if (err) {
+    log_warning(LOG_CAT_GENERAL, "Could not read cache directory: %s",
+                GERROR_MSG(err));
+    g_clear_error(&err);
+  }
+
+  g_array_sort(entries, compare_entries_mtime);
+  for (i = 0; i < entries->len && cache->size > target; i++) {
+    const struct cache_entry *e = &g_array_index(entries,
+                                                 struct cache_entry, i);
+
+    if (unlink(e->path) < 0 && errno != ENOENT) {
+      log_warning(LOG_CAT_GENERAL, "Could not remove cache entry '%s': %s",
+                  e->path, g_strerror(errno));
+      continue;
+    }
+    cache->size -= e->size;
+    removed++;
+  }
+  g_array_free(entries, TRUE);
+
+  log_info(LOG_CAT_GENERAL, "Removed %u cache entries, %" G_GUINT64_FORMAT
+           " bytes left", removed, cache->size);
+}
+
+struct amex_cache *
+amex_cache_open(const gchar *dir, guint64 max_size, GError **err)
+{
+  struct amex_cache *cache;
+  GError *scan_err = NULL;
+
+  g_assert(dir);
+
+  if (g_mkdir_with_parents(dir, 0755) < 0) {
+    SET_GERROR(err, -1, "could not create cache directory '%s': %s",
+               dir, g_strerror(errno));
+    return NULL;
+  }
+
+  cache = g_new0(struct amex_cache, 1);
+  cache->ref_count = 1;
+  cache->dir = g_strdup(dir);
+  cache->max_size = max_size;
+  g_mutex_init(&cache->lock);
+
+  cache->size = scan_entries(cache, NULL, &scan_err);
+  if (scan_err) {
+    g_propagate_error(err, scan_err);
+    amex_cache_unref(cache);
+    return NULL;
+  }
+
+  log_info(LOG_CAT_GENERAL, "Using cache '%s' of %" G_GUINT64_FORMAT
+           " bytes, limit %" G_GUINT64_FORMAT, dir, cache->size, max_size);
+
+  return cache;
+}
+
+struct amex_cache *
+amex_cache_ref(struct amex_cache *cache)
+{
+  g_assert(cache);
+
+  g_atomic_int_inc(&cache->ref_count);
+
+  return cache;
+}
+
+void
+amex_cache_unref(struct amex_cache *cache)
+{
+  g_assert(cache);
+
+  if (!g_atomic_int_dec_and_test(&cache->ref_count)) {
+    return;
+  }
+
+  g_mutex_clear(&cache->lock);
+  g_free(cache->dir);
+  g_free(cache);
+}
+
+guint
+amex_cache_purge(struct amex_cache *cache, guint64 dict_version)
+{
+  const gchar *name;
+  GError *err = NULL;
+  guint removed = 0;
+  GDir *dir;
+
+  g_assert(cache);
+
+  if ((dir = g_dir_open(cache->dir, 0, &err)) == NULL) {
+    log_warning(LOG_CAT_GENERAL, "Could not read cache directory: %s",
+                GERROR_MSG(err));
+    g_clear_error(&err);
+    return 0;
+  }
+
+  g_mutex_lock(&cache->lock);
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    guint64 version;
+    gchar *path;
+    struct stat sb;
+
+    if (!parse_entry_name(name, &version) || version == dict_version) {
+      continue;
+    }
+
+    path = g_build_filename(cache->dir, name, NULL);
+    if (stat(path, &sb) == 0 && unlink(path) == 0) {
+      cache->size -= MIN((guint64) sb.st_size, cache->size);
+      removed++;
+    }
+    g_free(path);
+  }
+  g_mutex_unlock(&cache->lock);
+  g_dir_close(dir);
+
+  if (removed) {
+    log_info(LOG_CAT_GENERAL, "Purged %u cache entries of other location "
+             "dictionaries", removed);
+  }
+
+  return removed;
+}
+
+gchar *
+amex_cache_lookup(struct amex_cache *cache, guint64 dict_version,
+                  guint64 key, gsize *len)
+{
+  struct cache_header hdr;
+  gchar *contents = NULL;
+  gchar *path;
+  gsize flen;
+
+  g_assert(cache);
+  g_assert(len);
+
+  path = entry_path(cache, dict_version, key);
+  if (!g_file_get_contents(path, &contents, &flen, NULL)) {
+    goto out;
+  }
+
+  if (flen < sizeof(hdr)) {
+    goto out_invalid;
+  }
+  memcpy(&hdr, contents, sizeof(hdr));
+  if (memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != CACHE_VERSION || hdr.dict_version != dict_version ||
+      hdr.key != key || hdr.len != flen - sizeof(hdr) ||
+      hdr.checksum != hash_xxh64(contents + sizeof(hdr), hdr.len, 0)) {
+    goto out_invalid;
+  }
+
+  /* Touch it, trimming removes the least recently used entries first */
+  utime(path, NULL);
+
+  memmove(contents, contents + sizeof(hdr), hdr.len);
+  *len = hdr.len;
+  goto out;
+
+out_invalid:
+  log_warning(LOG_CAT_GENERAL, "Removing invalid cache entry '%s'", path);
+  unlink(path);
+  g_clear_pointer(&contents, g_free);
+  /* fall through */
+out:
+  g_free(path);
+
+  return contents;
+}
+
+gboolean
+amex_cache_store(struct amex_cache *cache, guint64 dict_version, guint64 key,
+                 const gchar *data, gsize len, GError **err)
+{
+  struct cache_header hdr = { { 0, }, };
+  gboolean ret = FALSE;
+  GString *gs;
+  gchar *path;
+
+  g_assert(cache);
+  g_assert(data || !len);
+
+  memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version = CACHE_VERSION;
+  hdr.dict_version = dict_version;
+  hdr.key = key;
+  hdr.len = len;
+  hdr.checksum = hash_xxh64(data, len, 0);
+
+  gs = g_string_sized_new(sizeof(hdr) + len);
+  g_string_append_len(gs, (const gchar *) &hdr, sizeof(hdr));
+  g_string_append_len(gs, data, len);
+
+  /* Written to a temporary file and renamed, readers never see half of it */
+  path = entry_path(cache, dict_version, key);
+  if ((ret = g_file_set_contents(path, gs->str, gs->len, err)) == FALSE) {
+    goto out;
+  }
+
+  g_mutex_lock(&cache->lock);
+  cache->size += gs->len;
+  if (cache->size > cache->max_size) {
+    trim_locked(cache);
+  }
+  g_mutex_unlock(&cache->lock);
+  /* fall through */
+out:
+  g_string_free(gs, TRUE);
+  g_free(path);
+
+  return ret;
+}
+
+guint64
+amex_cache_size(struct amex_cache *cache)
+{
+  guint64 size;
+
+  g_assert(cache);
+
+  g_mutex_lock(&cache->lock);
+  size = cache->size;
+  g_mutex_unlock(&cache->lock);
+
+  return size;
+}
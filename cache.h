@@ -0,0 +1,49 @@
+#ifndef CACHE_H__
+#define CACHE_H__
+/*
+ * cache.h - On-disk cache of parsed statements
+ *
+ * Entries are keyed by a hash of the statement bytes and the settings it was
+ * parsed with, so a statement that hasn't changed is read back rather than
+ * parsed again. Every entry is a file of its own in the cache directory,
+ * named after the location dictionary version and the key. Entries made with
+ * another dictionary are purged by name, and the least recently used entries
+ * are removed once the cache grows past its size limit.
+ *
+ * A cache can be shared by any number of threads and processes.
+ */
+#include <glib.h>
+
+struct amex_cache;
+
+/* The directory is created if needed, max_size is in bytes */
+struct amex_cache *
+amex_cache_open(const gchar *dir, guint64 max_size, GError **err);
+
+struct amex_cache *
+amex_cache_ref(struct amex_cache *cache);
+
+void
+amex_cache_unref(struct amex_cache *cache);
+
+/* Remove the entries of all other dictionaries, returns how many */
+guint
+amex_cache_purge(struct amex_cache *cache, guint64 dict_version);
+
+/*
+ * Look up an entry. Returns its payload (free with g_free()) and sets len,
+ * or NULL if there is no valid entry
+ */
+gchar *
+amex_cache_lookup(struct amex_cache *cache, guint64 dict_version,
+                  guint64 key, gsize *len);
+
+gboolean
+amex_cache_store(struct amex_cache *cache, guint64 dict_version, guint64 key,
+                 const gchar *data, gsize len, GError **err);
+
+/* Bytes used by the entries, as far as this process knows */
+guint64
+amex_cache_size(struct amex_cache *cache);
+
+#endif /* CACHE_H__ */
@@ -0,0 +1,396 @@
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "debug.h"
+#include "database.h"
+#include "log.h"
+
+/* Kept in PRAGMA user_version, bump when the schema changes */
+#define DB_SCHEMA_VERSION          1
+/* How long to wait for readers holding a lock, in milliseconds */
+#define DB_BUSY_TIMEOUT_MS         5000
+
+/*
+ * Dates are ISO 8601 text and amounts are in öre. The main card has an
+ * empty suffix rather than NULL, so the (holder, suffix) key stays unique.
+ */
+static const gchar *db_schema =
+  "CREATE TABLE statements ("
+  "  id INTEGER PRIMARY KEY,"
+  "  ocr TEXT NOT NULL UNIQUE,"
+  "  filename TEXT NOT NULL,"
+  "  due_date TEXT,"
+  "  loaded TEXT NOT NULL DEFAULT CURRENT_TIMESTAMP"
+  ");"
+  "CREATE TABLE cards ("
+  "  id INTEGER PRIMARY KEY,"
+  "  holder TEXT NOT NULL,"
+  "  suffix TEXT NOT NULL DEFAULT '',"
+  "  UNIQUE (holder, suffix)"
+  ");"
+  "CREATE TABLE transactions ("
+  "  id INTEGER PRIMARY KEY,"
+  "  statement_id INTEGER NOT NULL"
+  "    REFERENCES statements (id) ON DELETE CASCADE,"
+  "  card_id INTEGER NOT NULL REFERENCES cards (id),"
+  "  seq INTEGER NOT NULL,"
+  "  date TEXT NOT NULL,"
+  "  process_date TEXT NOT NULL,"
+  "  amount INTEGER NOT NULL,"
+  "  location TEXT,"
+  "  details TEXT NOT NULL"
+  ");"
+  "CREATE INDEX transactions_statement ON transactions (statement_id);"
+  "CREATE INDEX transactions_card_date ON transactions (card_id, date);"
+  "PRAGMA user_version = " G_STRINGIFY(DB_SCHEMA_VERSION) ";";
+
+enum db_stmt {
+  DB_STMT_BEGIN = 0,
+  DB_STMT_COMMIT,
+  DB_STMT_ROLLBACK,
+  DB_STMT_SAVEPOINT,
+  DB_STMT_RELEASE,
+  DB_STMT_ROLLBACK_TO,
+  DB_STMT_STATEMENT,
+  DB_STMT_CLEAR,
+  DB_STMT_CARD,
+  DB_STMT_TRANSACTION,
+  DB_STMT_COUNT,
+};
+
+/* Prepared once when opening, reset after every use */
+static const gchar *db_sql[DB_STMT_COUNT] = {
+  [DB_STMT_BEGIN]       = "BEGIN IMMEDIATE",
+  [DB_STMT_COMMIT]      = "COMMIT",
+  [DB_STMT_ROLLBACK]    = "ROLLBACK",
+  /* One statement failing leaves the others of the transaction alone */
+  [DB_STMT_SAVEPOINT]   = "SAVEPOINT statement",
+  [DB_STMT_RELEASE]     = "RELEASE statement",
+  [DB_STMT_ROLLBACK_TO] = "ROLLBACK TO statement",
+  [DB_STMT_STATEMENT]   = "INSERT INTO statements (ocr, filename, due_date) "
+                          "VALUES (?1, ?2, ?3) ON CONFLICT (ocr) DO UPDATE "
+                          "SET filename = excluded.filename, "
+                          "due_date = excluded.due_date, "
+                          "loaded = CURRENT_TIMESTAMP RETURNING id",
+  [DB_STMT_CLEAR]       = "DELETE FROM transactions WHERE statement_id = ?1",
+  /* The no-op update makes RETURNING give the id of an existing card */
+  [DB_STMT_CARD]        = "INSERT INTO cards (holder, suffix) VALUES (?1, ?2) "
+                          "ON CONFLICT (holder, suffix) DO UPDATE "
+                          "SET holder = excluded.holder RETURNING id",
+  [DB_STMT_TRANSACTION] = "INSERT INTO transactions (statement_id, card_id, "
+                          "seq, date, process_date, amount, location, "
+                          "details) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)",
+};
+
+struct amex_db {
+  gchar *filename;
+  sqlite3 *handle;
+  sqlite3_stmt *stmts[DB_STMT_COUNT];
+  gboolean in_transaction;
+};
+
+DEFINE_GQUARK("amex_parser");
+
+static gboolean
+db_error(struct amex_db *db, const gchar *what, GError **err)
+{
+  SET_GERROR(err, -1, "%s '%s': %s", what, db->filename,
+             sqlite3_errmsg(db->handle));
+
+  return FALSE;
+}
+
+/*
+ * Step a prepared statement until it is done, keeping the integer in the
+ * first column of the first row if id isn't NULL. The statement is reset
+ * for the next use whatever the outcome.
+ */
+static gboolean
+db_run(struct amex_db *db, enum db_stmt which, gint64 *id, GError **err)
+{
+  sqlite3_stmt *stmt = db->stmts[which];
+  gboolean ret = TRUE;
+  gint rc;
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (id) {
+      *id = sqlite3_column_int64(stmt, 0);
+      id = NULL;
+    }
+  }
+  if (rc != SQLITE_DONE) {
+    ret = db_error(db, "could not write to", err);
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  return ret;
+}
+
+/* Creates the tables of a new database, refuses other schema versions */
+static gboolean
+db_init_schema(struct amex_db *db, GError **err)
+{
+  sqlite3_stmt *stmt;
+  gint version = -1;
+
+  if (sqlite3_prepare_v2(db->handle, "PRAGMA user_version", -1, &stmt,
+                         NULL) != SQLITE_OK) {
+    return db_error(db, "could not read", err);
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    version = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  if (version == DB_SCHEMA_VERSION) {
+    return TRUE;
+  } else if (version != 0) {
+    SET_GERROR(err, -1, "database '%s' has schema version %d, expected %d",
+               db->filename, version, DB_SCHEMA_VERSION);
+    return FALSE;
+  }
+
+  log_info(LOG_CAT_OUTPUT, "Creating the tables of database '%s'",
+           db->filename);
+  if (sqlite3_exec(db->handle, "BEGIN IMMEDIATE", NULL, NULL,
+                   NULL) != SQLITE_OK ||
+      sqlite3_exec(db->handle, db_schema, NULL, NULL, NULL) != SQLITE_OK) {
+    db_error(db, "could not create the tables of", err);
+    sqlite3_exec(db->handle, "ROLLBACK", NULL, NULL, NULL);
+    return FALSE;
+  }
+  if (sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    return db_error(db, "could not create the tables of", err);
+  }
+
+  return TRUE;
+}
+
+struct amex_db *
+amex_db_open(const gchar *filename, GError **err)
+{
+  struct amex_db *db;
+  guint i;
+
+  g_assert(filename);
+
+  db = g_new0(struct amex_db, 1);
+  db->filename = g_strdup(filename);
+
+  /* A handle is returned even on failure, for the error message */
+  if (sqlite3_open_v2(filename, &db->handle, SQLITE_OPEN_READWRITE |
+                      SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+    db_error(db, "could not open database", err);
+    goto out_err;
+  }
+  sqlite3_busy_timeout(db->handle, DB_BUSY_TIMEOUT_MS);
+
+  /* Off by default, keeps transactions from pointing at missing rows */
+  if (sqlite3_exec(db->handle, "PRAGMA foreign_keys = ON", NULL, NULL,
+                   NULL) != SQLITE_OK) {
+    db_error(db, "could not configure database", err);
+    goto out_err;
+  }
+
+  if (!db_init_schema(db, err)) {
+    goto out_err;
+  }
+
+  for (i = 0; i < DB_STMT_COUNT; i++) {
+    if (sqlite3_prepare_v3(db->handle, db_sql[i], -1,
+                           SQLITE_PREPARE_PERSISTENT, &db->stmts[i],
+                           NULL) != SQLITE_OK) {
+      db_error(db, "could not prepare statements for database", err);
+      goto out_err;
+    }
+  }
+
+  return db;
+
+out_err:
+  amex_db_close(db);
+
+  return NULL;
+}
+
+void
+amex_db_close(struct amex_db *db)
+{
+  guint i;
+
+  if (!db) {
+    return;
+  }
+
+  if (db->in_transaction) {
+    amex_db_rollback(db);
+  }
+  for (i = 0; i < DB_STMT_COUNT; i++) {
+    sqlite3_finalize(db->stmts[i]);
+  }
+  sqlite3_close(db->handle);
+  g_free(db->filename);
+  g_free(db);
+}
+
+gboolean
+amex_db_begin(struct amex_db *db, GError **err)
+{
+  g_assert(db);
+  g_assert(!db->in_transaction);
+
+  if (!db_run(db, DB_STMT_BEGIN, NULL, err)) {
+    return FALSE;
+  }
+  db->in_transaction = TRUE;
+
+  return TRUE;
+}
+
+gboolean
+amex_db_commit(struct amex_db *db, GError **err)
+{
+  g_assert(db);
+  g_assert(db->in_transaction);
+
+  /* A failed commit leaves the transaction open, roll it back */
+  if (!db_run(db, DB_STMT_COMMIT, NULL, err)) {
+    amex_db_rollback(db);
+    return FALSE;
+  }
+  db->in_transaction = FALSE;
+
+  return TRUE;
+}
+
+void
+amex_db_rollback(struct amex_db *db)
+{
+  GError *err = NULL;
+
+  g_assert(db);
+
+  /* SQLite may have rolled back by itself already */
+  if (!sqlite3_get_autocommit(db->handle) &&
+      !db_run(db, DB_STMT_ROLLBACK, NULL, &err)) {
+    log_warning(LOG_CAT_OUTPUT, "Could not roll back: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+  }
+  db->in_transaction = FALSE;
+}
+
+static gboolean
+db_add_card(struct amex_db *db, const struct amex_card *c, gint64 st_id,
+            GError **err)
+{
+  sqlite3_stmt *stmt;
+  gint64 card_id = 0;
+  guint i;
+
+  stmt = db->stmts[DB_STMT_CARD];
+  sqlite3_bind_text(stmt, 1, c->holder, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, c->suffix ? c->suffix : "", -1, SQLITE_STATIC);
+  if (!db_run(db, DB_STMT_CARD, &card_id, err)) {
+    return FALSE;
+  }
+
+  stmt = db->stmts[DB_STMT_TRANSACTION];
+  for (i = 0; i < c->transactions->len; i++) {
+    const struct amex_transaction *t = g_ptr_array_index(c->transactions, i);
+    gchar date[AMEX_DATE_ISO_LEN];
+    gchar pdate[AMEX_DATE_ISO_LEN];
+
+    sqlite3_bind_int64(stmt, 1, st_id);
+    sqlite3_bind_int64(stmt, 2, card_id);
+    sqlite3_bind_int(stmt, 3, i);
+    sqlite3_bind_text(stmt, 4, date, amex_date_format_iso(t->date, date),
+                      SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, pdate,
+                      amex_date_format_iso(t->process_date, pdate),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 6, t->amount);
+    if (t->location) {
+      sqlite3_bind_text(stmt, 7, t->location, -1, SQLITE_STATIC);
+    }
+    sqlite3_bind_text(stmt, 8, t->details, -1, SQLITE_STATIC);
+    if (!db_run(db, DB_STMT_TRANSACTION, NULL, err)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean
+db_add_statement(struct amex_db *db, const struct amex_statement *st,
+                 const gchar *ocr, GError **err)
+{
+  amex_date due = amex_statement_due_date(st);
+  gchar due_buf[AMEX_DATE_ISO_LEN];
+  sqlite3_stmt *stmt;
+  GPtrArray *cards;
+  gint64 st_id = 0;
+  guint tc = 0;
+  guint i;
+
+  stmt = db->stmts[DB_STMT_STATEMENT];
+  sqlite3_bind_text(stmt, 1, ocr, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, amex_statement_filename(st), -1, SQLITE_STATIC);
+  if (due != AMEX_DATE_INVALID) {
+    sqlite3_bind_text(stmt, 3, due_buf, amex_date_format_iso(due, due_buf),
+                      SQLITE_STATIC);
+  }
+  if (!db_run(db, DB_STMT_STATEMENT, &st_id, err)) {
+    return FALSE;
+  }
+
+  /* Stored before, start over */
+  sqlite3_bind_int64(db->stmts[DB_STMT_CLEAR], 1, st_id);
+  if (!db_run(db, DB_STMT_CLEAR, NULL, err)) {
+    return FALSE;
+  }
+
+  cards = amex_statement_cards(st);
+  for (i = 0; i < cards->len; i++) {
+    const struct amex_card *c = g_ptr_array_index(cards, i);
+
+    if (!db_add_card(db, c, st_id, err)) {
+      return FALSE;
+    }
+    tc += c->transactions->len;
+  }
+
+  log_info(LOG_CAT_OUTPUT, "Stored %u transaction(s) of statement %s in "
+           "database '%s'", tc, ocr, db->filename);
+
+  return TRUE;
+}
+
+gboolean
+amex_db_add(struct amex_db *db, const struct amex_statement *st,
+            GError **err)
+{
+  const gchar *ocr = amex_statement_ocr(st);
+
+  g_assert(db);
+  g_assert(st);
+  g_assert(db->in_transaction);
+
+  if (!ocr) {
+    SET_GERROR(err, -1, "no OCR number, the statement can not be stored");
+    return FALSE;
+  }
+
+  if (!db_run(db, DB_STMT_SAVEPOINT, NULL, err)) {
+    return FALSE;
+  }
+  if (!db_add_statement(db, st, ocr, err)) {
+    /* Undone, but the savepoint must still be released */
+    db_run(db, DB_STMT_ROLLBACK_TO, NULL, NULL);
+    db_run(db, DB_STMT_RELEASE, NULL, NULL);
+    return FALSE;
+  }
+
+  return db_run(db, DB_STMT_RELEASE, NULL, err);
+}
@@ -0,0 +1,43 @@
+#ifndef DATABASE_H__
+#define DATABASE_H__
+/*
+ * database.h - Statements in an SQLite database
+ *
+ * Statements, cards and transactions get a table each, see the schema in
+ * database.c. Statements are keyed on their OCR number: storing a statement
+ * again replaces its transactions, so loading the same files twice leaves
+ * the database as it was. Statements without an OCR number are refused.
+ *
+ * Rows are inserted through prepared statements kept for the lifetime of
+ * the database, inside a transaction per amex_db_begin()/amex_db_commit().
+ * Only built with SQLite.
+ */
+#include <glib.h>
+
+#include "amexparser.h"
+
+struct amex_db;
+
+/* Creates the file and the tables as needed */
+struct amex_db *
+amex_db_open(const gchar *filename, GError **err);
+
+/* Rolls back a transaction left open */
+void
+amex_db_close(struct amex_db *db);
+
+gboolean
+amex_db_begin(struct amex_db *db, GError **err);
+
+/* Store a statement in the current transaction, replacing an earlier copy */
+gboolean
+amex_db_add(struct amex_db *db, const struct amex_statement *st,
+            GError **err);
+
+gboolean
+amex_db_commit(struct amex_db *db, GError **err);
+
+void
+amex_db_rollback(struct amex_db *db);
+
+#endif /* DATABASE_H__ */
@@ -14,10 +14,10 @@
 #define DEFINE_GQUARK(catalog) \
 static GQuark error_quark(void)\
 {\
-  static GQuark quark;\
-  if (!quark)\
-    quark = g_quark_from_static_string(catalog);\
-  return quark;\
+  static gsize quark;\
+  if (g_once_init_enter(&quark))\
+    g_once_init_leave(&quark, g_quark_from_static_string(catalog));\
+  return (GQuark) quark;\
 }
 
 #define SET_GERROR(error, code, ...) \
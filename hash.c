@@ -0,0 +1,116 @@
+#include <glib.h>
+#include <string.h>
+
+#include "hash.h"
+
+#define XXH_PRIME64_1              G_GUINT64_CONSTANT(0x9e3779b185ebca87)
+#define XXH_PRIME64_2              G_GUINT64_CONSTANT(0xc2b2ae3d27d4eb4f)
+#define XXH_PRIME64_3              G_GUINT64_CONSTANT(0x165667b19e3779f9)
+#define XXH_PRIME64_4              G_GUINT64_CONSTANT(0x85ebca77c2b2ae63)
+#define XXH_PRIME64_5              G_GUINT64_CONSTANT(0x27d4eb2f165667c5)
+/* Bytes consumed by one round of the four accumulators */
+#define XXH_STRIPE_LEN             32
+
+static inline guint64
+rotl64(guint64 v, guint r)
+{
+  return (v << r) | (v >> (64 - r));
+}
+
+/* Unaligned little endian reads */
+static inline guint64
+read64(const guchar *p)
+{
+  guint64 v;
+
+  memcpy(&v, p, sizeof(v));
+
+  return GUINT64_FROM_LE(v);
+}
+
+static inline guint32
+read32(const guchar *p)
+{
+  guint32 v;
+
+  memcpy(&v, p, sizeof(v));
+
+  return GUINT32_FROM_LE(v);
+}
+
+static inline guint64
+xxh_round(guint64 acc, guint64 input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = rotl64(acc, 31);
+
+  return acc * XXH_PRIME64_1;
+}
+
+static inline guint64
+xxh_merge_round(guint64 acc, guint64 val)
+{
+  acc ^= xxh_round(0, val);
+
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+guint64
+hash_xxh64(gconstpointer data, gsize len, guint64 seed)
+{
+  const guchar *p = data;
+  const guchar *end = p + len;
+  guint64 h;
+
+  g_assert(data || !len);
+
+  if (len >= XXH_STRIPE_LEN) {
+    const guchar *limit = end - XXH_STRIPE_LEN;
+    guint64 v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    guint64 v2 = seed + XXH_PRIME64_2;
+    guint64 v3 = seed;
+    guint64 v4 = seed - XXH_PRIME64_1;
+
+    do {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+      p += XXH_STRIPE_LEN;
+    } while (p <= limit);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge_round(h, v1);
+    h = xxh_merge_round(h, v2);
+    h = xxh_merge_round(h, v3);
+    h = xxh_merge_round(h, v4);
+  } else {
+    h = seed + XXH_PRIME64_5;
+  }
+
+  h += len;
+
+  /* The tail, in 8, 4 and 1 byte steps */
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * XXH_PRIME64_1;
+    h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * XXH_PRIME64_5;
+    h = rotl64(h, 11) * XXH_PRIME64_1;
+  }
+
+  /* Avalanche */
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
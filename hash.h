@@ -0,0 +1,14 @@
+#ifndef HASH_H__
+#define HASH_H__
+/*
+ * hash.h - Fast non-cryptographic hashing
+ *
+ * XXH64, as specified by the xxHash project. The result only depends on the
+ * bytes hashed and the seed, not on the host, so hashes can be kept on disk.
+ */
+#include <glib.h>
+
+guint64
+hash_xxh64(gconstpointer data, gsize len, guint64 seed);
+
+#endif /* HASH_H__ */
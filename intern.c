@@ -0,0 +1,164 @@
+#include <glib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "intern.h"
+
+#define INTERN_SHARDS              16
+/* Beyond this many descriptions per shard new ones are not kept */
+#define INTERN_SHARD_MAX_ENTRIES   (64 * 1024)
+
+struct intern_entry {
+  struct intern_details value;
+  const gchar *str;
+  gsize len;
+  guint64 hash;
+};
+
+struct intern_shard {
+  GMutex lock;
+  /* struct intern_entry, allocated from the arena along with its strings */
+  GHashTable *entries;
+  struct arena arena;
+};
+
+struct intern_table {
+  gint ref_count;
+  struct location_index *locs;
+  struct intern_shard shards[INTERN_SHARDS];
+};
+
+static guint
+hash_entry(gconstpointer key)
+{
+  return ((const struct intern_entry *) key)->hash;
+}
+
+static gboolean
+equal_entry(gconstpointer a, gconstpointer b)
+{
+  const struct intern_entry *ea = a;
+  const struct intern_entry *eb = b;
+
+  return ea->hash == eb->hash && ea->len == eb->len &&
+         !memcmp(ea->str, eb->str, ea->len);
+}
+
+static struct intern_shard *
+shard_of(struct intern_table *table, guint64 hash)
+{
+  /* The low bits pick the hash table bucket, use the high ones here */
+  return &table->shards[hash >> 60];
+}
+
+G_STATIC_ASSERT(INTERN_SHARDS == 16);
+
+struct intern_table *
+intern_table_new(struct location_index *locs)
+{
+  struct intern_table *table;
+  guint i;
+
+  g_assert(locs);
+
+  table = g_new0(struct intern_table, 1);
+  table->ref_count = 1;
+  table->locs = location_index_ref(locs);
+  for (i = 0; i < INTERN_SHARDS; i++) {
+    g_mutex_init(&table->shards[i].lock);
+    table->shards[i].entries = g_hash_table_new(hash_entry, equal_entry);
+    arena_init(&table->shards[i].arena);
+  }
+
+  return table;
+}
+
+struct intern_table *
+intern_table_ref(struct intern_table *table)
+{
+  g_assert(table);
+
+  g_atomic_int_inc(&table->ref_count);
+
+  return table;
+}
+
+void
+intern_table_unref(struct intern_table *table)
+{
+  guint i;
+
+  g_assert(table);
+
+  if (!g_atomic_int_dec_and_test(&table->ref_count)) {
+    return;
+  }
+
+  for (i = 0; i < INTERN_SHARDS; i++) {
+    g_hash_table_destroy(table->shards[i].entries);
+    arena_clear(&table->shards[i].arena);
+    g_mutex_clear(&table->shards[i].lock);
+  }
+  location_index_unref(table->locs);
+  g_free(table);
+}
+
+const struct intern_details *
+intern_table_lookup(struct intern_table *table, const gchar *str, gsize len)
+{
+  struct intern_entry key = { { NULL, }, str, len, 0 };
+  struct intern_shard *shard;
+  struct intern_entry *e;
+
+  g_assert(table);
+  g_assert(str);
+
+  key.hash = hash_xxh64(str, len, 0);
+  shard = shard_of(table, key.hash);
+
+  g_mutex_lock(&shard->lock);
+  e = g_hash_table_lookup(shard->entries, &key);
+  g_mutex_unlock(&shard->lock);
+
+  /* Entries are never changed or removed once added */
+  return e ? &e->value : NULL;
+}
+
+const struct intern_details *
+intern_table_insert(struct intern_table *table, const gchar *str, gsize len,
+                    const struct intern_details *value)
+{
+  struct intern_entry key = { { NULL, }, str, len, 0 };
+  struct intern_shard *shard;
+  struct intern_entry *e;
+
+  g_assert(table);
+  g_assert(str);
+  g_assert(value);
+
+  key.hash = hash_xxh64(str, len, 0);
+  shard = shard_of(table, key.hash);
+
+  g_mutex_lock(&shard->lock);
+  if ((e = g_hash_table_lookup(shard->entries, &key)) != NULL ||
+      g_hash_table_size(shard->entries) >= INTERN_SHARD_MAX_ENTRIES) {
+    goto out;
+  }
+
+  e = arena_new0(&shard->arena, struct intern_entry);
+  e->str = arena_strndup(&shard->arena, str, len);
+  e->len = len;
+  e->hash = key.hash;
+  e->value.details = arena_strdup(&shard->arena, value->details);
+  e->value.plain = value->plain == value->details ? e->value.details :
+                   arena_strdup(&shard->arena, value->plain);
+  e->value.location = value->location;
+  e->value.kind = value->kind;
+  g_hash_table_add(shard->entries, e);
+  /* fall through */
+out:
+  g_mutex_unlock(&shard->lock);
+
+  return e ? &e->value : NULL;
+}
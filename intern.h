@@ -0,0 +1,53 @@
+#ifndef INTERN_H__
+#define INTERN_H__
+/*
+ * intern.h - Details already parsed, shared by all statements of a parser
+ *
+ * The same merchant descriptions come back on every statement. The table
+ * maps a raw description (trimmed, as on the statement) to its normalized
+ * details and the location found in it, so a repeat costs one hash probe and
+ * every transaction of a merchant points to the same strings.
+ *
+ * The table is split into shards with a lock each, so worker threads parsing
+ * statements at the same time rarely wait for each other. Statements hold a
+ * reference to the table their strings live in, and the table one to the
+ * location index its locations point into.
+ */
+#include <glib.h>
+
+#include "locations.h"
+
+struct intern_details {
+  /* Normalized, without the location found in it */
+  const gchar *details;
+  /* Normalized, for when the location is on the following line */
+  const gchar *plain;
+  /* Found in the description, NULL if none */
+  const gchar *location;
+  enum location_match_kind kind;
+};
+
+struct intern_table;
+
+struct intern_table *
+intern_table_new(struct location_index *locs);
+
+struct intern_table *
+intern_table_ref(struct intern_table *table);
+
+void
+intern_table_unref(struct intern_table *table);
+
+/* The details of the description, NULL if not seen before */
+const struct intern_details *
+intern_table_lookup(struct intern_table *table, const gchar *str, gsize len);
+
+/*
+ * Add the details of a description, copying the strings. Returns the copy,
+ * the entry added meanwhile by another thread, or NULL once the table is full.
+ */
+const struct intern_details *
+intern_table_insert(struct intern_table *table, const gchar *str, gsize len,
+                    const struct intern_details *value);
+
+#endif /* INTERN_H__ */
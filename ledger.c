@@ -0,0 +1,398 @@
+#include <glib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "ledger.h"
+#include "log.h"
+
+#define LEDGER_CSV_HEADER \
+  "Datum;Bokf\xc3\xb6rt;Specifikation;Ort;Valuta;Utl.belopp/moms;Belopp\n"
+
+struct ledger_entry {
+  const struct amex_transaction *t;
+  /* Position in the statement, keeps the statement order for equal dates */
+  guint seq;
+};
+
+/* The transactions of one card in one statement, sorted by date */
+struct ledger_run {
+  guint stmt;
+  GArray *entries;
+};
+
+struct ledger_card {
+  struct amex_ledger_card pub;
+  GPtrArray *runs;
+};
+
+struct amex_ledger {
+  /* struct ledger_card, in the order they were first seen */
+  GPtrArray *cards;
+  GHashTable *by_name;
+  guint n_statements;
+};
+
+/* Head of a run in the merge heap */
+struct ledger_cursor {
+  const struct ledger_run *run;
+  guint pos;
+};
+
+/*
+ * A distinct transaction of the day being merged, how often it was kept, and
+ * how often it was found in the statement currently being merged
+ */
+struct ledger_dup {
+  const struct amex_transaction *t;
+  guint64 hash;
+  guint kept;
+  guint stmt;
+  guint seen;
+};
+
+static void
+free_run(gpointer data)
+{
+  struct ledger_run *run = (struct ledger_run *) data;
+
+  g_array_free(run->entries, TRUE);
+  g_free(run);
+}
+
+static void
+free_card(gpointer data)
+{
+  struct ledger_card *card = (struct ledger_card *) data;
+
+  g_ptr_array_free(card->runs, TRUE);
+  g_ptr_array_free(card->pub.transactions, TRUE);
+  g_free(card->pub.name);
+  g_free(card);
+}
+
+static gint
+compare_entries(const struct ledger_entry *a, guint stmt_a,
+                const struct ledger_entry *b, guint stmt_b)
+{
+  if (a->t->date != b->t->date) {
+    return a->t->date < b->t->date ? -1 : 1;
+  } else if (a->t->process_date != b->t->process_date) {
+    return a->t->process_date < b->t->process_date ? -1 : 1;
+  } else if (stmt_a != stmt_b) {
+    return stmt_a < stmt_b ? -1 : 1;
+  }
+
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static gint
+compare_run_entries(gconstpointer a, gconstpointer b)
+{
+  /* Within one run */
+  return compare_entries(a, 0, b, 0);
+}
+
+struct amex_ledger *
+amex_ledger_new(void)
+{
+  struct amex_ledger *ledger;
+
+  ledger = g_new0(struct amex_ledger, 1);
+  ledger->cards = g_ptr_array_new_with_free_func(free_card);
+  ledger->by_name = g_hash_table_new(g_str_hash, g_str_equal);
+
+  return ledger;
+}
+
+void
+amex_ledger_free(struct amex_ledger *ledger)
+{
+  if (!ledger) {
+    return;
+  }
+
+  g_hash_table_destroy(ledger->by_name);
+  g_ptr_array_free(ledger->cards, TRUE);
+  g_free(ledger);
+}
+
+void
+amex_ledger_add(struct amex_ledger *ledger, const struct amex_statement *st)
+{
+  GPtrArray *cards;
+  guint i;
+
+  g_assert(ledger);
+  g_assert(st);
+
+  cards = amex_statement_cards(st);
+  for (i = 0; i < cards->len; i++) {
+    const struct amex_card *c = g_ptr_array_index(cards, i);
+    gchar cbuf[AMEX_CARD_STR_LEN];
+    struct ledger_card *card;
+    struct ledger_run *run;
+    const gchar *name;
+    guint j;
+
+    name = amex_card_format(c, cbuf, sizeof(cbuf));
+    if ((card = g_hash_table_lookup(ledger->by_name, name)) == NULL) {
+      card = g_new0(struct ledger_card, 1);
+      card->pub.name = g_strdup(name);
+      card->pub.transactions = g_ptr_array_new();
+      card->runs = g_ptr_array_new_with_free_func(free_run);
+      g_ptr_array_add(ledger->cards, card);
+      g_hash_table_insert(ledger->by_name, card->pub.name, card);
+    }
+
+    run = g_new0(struct ledger_run, 1);
+    run->stmt = ledger->n_statements;
+    run->entries = g_array_sized_new(FALSE, FALSE, sizeof(struct ledger_entry),
+                                     c->transactions->len);
+    for (j = 0; j < c->transactions->len; j++) {
+      struct ledger_entry e = { g_ptr_array_index(c->transactions, j), j };
+
+      g_array_append_val(run->entries, e);
+    }
+    /* Statements list transactions by date, this is mostly a no-op */
+    g_array_sort(run->entries, compare_run_entries);
+    g_ptr_array_add(card->runs, run);
+  }
+  ledger->n_statements++;
+}
+
+/* Details are compared ignoring case and spacing */
+static void
+normalize_details(GString *gs, const gchar *details)
+{
+  gboolean space = FALSE;
+
+  g_string_truncate(gs, 0);
+  for (; *details; details++) {
+    if (g_ascii_isspace(*details)) {
+      space = gs->len > 0;
+      continue;
+    }
+    if (space) {
+      g_string_append_c(gs, ' ');
+      space = FALSE;
+    }
+    g_string_append_c(gs, g_ascii_tolower(*details));
+  }
+}
+
+/* Equal once normalized, without normalizing either */
+static gboolean
+details_equal(const gchar *a, const gchar *b)
+{
+  for (;;) {
+    while (g_ascii_isspace(*a)) {
+      a++;
+    }
+    while (g_ascii_isspace(*b)) {
+      b++;
+    }
+    if (!*a || !*b) {
+      return !*a && !*b;
+    }
+
+    /* One word of each */
+    for (; *a && !g_ascii_isspace(*a); a++, b++) {
+      if (g_ascii_tolower(*a) != g_ascii_tolower(*b)) {
+        return FALSE;
+      }
+    }
+    if (*b && !g_ascii_isspace(*b)) {
+      return FALSE;
+    }
+  }
+}
+
+static guint
+hash_dup(gconstpointer key)
+{
+  return ((const struct ledger_dup *) key)->hash;
+}
+
+static gboolean
+equal_dup(gconstpointer a, gconstpointer b)
+{
+  const struct amex_transaction *ta = ((const struct ledger_dup *) a)->t;
+  const struct amex_transaction *tb = ((const struct ledger_dup *) b)->t;
+
+  return ta->date == tb->date && ta->process_date == tb->process_date &&
+         ta->amount == tb->amount && details_equal(ta->details, tb->details);
+}
+
+static gboolean
+cursor_less(const struct ledger_cursor *a, const struct ledger_cursor *b)
+{
+  return compare_entries(&g_array_index(a->run->entries,
+                                        struct ledger_entry, a->pos),
+                         a->run->stmt,
+                         &g_array_index(b->run->entries,
+                                        struct ledger_entry, b->pos),
+                         b->run->stmt) < 0;
+}
+
+static void
+heap_sift_down(struct ledger_cursor *heap, guint n, guint i)
+{
+  for (;;) {
+    struct ledger_cursor tmp;
+    guint smallest = i;
+    guint l = 2 * i + 1;
+    guint r = l + 1;
+
+    if (l < n && cursor_less(&heap[l], &heap[smallest])) {
+      smallest = l;
+    }
+    if (r < n && cursor_less(&heap[r], &heap[smallest])) {
+      smallest = r;
+    }
+    if (smallest == i) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+/* Merge the runs of one card, returns the number of duplicates dropped */
+static guint
+merge_card(struct ledger_card *card, GHashTable *dups, GString *scratch)
+{
+  struct ledger_cursor *heap;
+  amex_date day = AMEX_DATE_INVALID;
+  guint dropped = 0;
+  guint n = 0;
+  guint i;
+
+  g_ptr_array_set_size(card->pub.transactions, 0);
+  heap = g_new(struct ledger_cursor, card->runs->len);
+  for (i = 0; i < card->runs->len; i++) {
+    const struct ledger_run *run = g_ptr_array_index(card->runs, i);
+
+    if (run->entries->len) {
+      heap[n].run = run;
+      heap[n].pos = 0;
+      n++;
+    }
+  }
+  for (i = n / 2; i-- > 0;) {
+    heap_sift_down(heap, n, i);
+  }
+
+  while (n) {
+    struct ledger_cursor *top = &heap[0];
+    const struct ledger_entry *e = &g_array_index(top->run->entries,
+                                                  struct ledger_entry,
+                                                  top->pos);
+    struct ledger_dup key = { e->t, 0, };
+    struct ledger_dup *dup;
+
+    /* Duplicates share the date, only one day is kept in the table */
+    if (e->t->date != day) {
+      g_hash_table_remove_all(dups);
+      day = e->t->date;
+    }
+
+    normalize_details(scratch, e->t->details);
+    key.hash = hash_xxh64(scratch->str, scratch->len,
+                          ((guint64) e->t->process_date << 32) ^
+                          (guint64) e->t->amount);
+    if ((dup = g_hash_table_lookup(dups, &key)) == NULL) {
+      dup = g_new0(struct ledger_dup, 1);
+      *dup = key;
+      dup->stmt = top->run->stmt;
+      g_hash_table_add(dups, dup);
+    } else if (dup->stmt != top->run->stmt) {
+      /* Copies in one statement are merged before the next statement's */
+      dup->stmt = top->run->stmt;
+      dup->seen = 0;
+    }
+
+    if (++dup->seen > dup->kept) {
+      g_ptr_array_add(card->pub.transactions, (gpointer) e->t);
+      dup->kept++;
+    } else {
+      dropped++;
+    }
+
+    if (++top->pos == top->run->entries->len) {
+      heap[0] = heap[--n];
+    }
+    heap_sift_down(heap, n, 0);
+  }
+  g_hash_table_remove_all(dups);
+  g_free(heap);
+
+  return dropped;
+}
+
+guint
+amex_ledger_merge(struct amex_ledger *ledger)
+{
+  GHashTable *dups;
+  GString *scratch;
+  guint dropped = 0;
+  guint i;
+
+  g_assert(ledger);
+
+  dups = g_hash_table_new_full(hash_dup, equal_dup, g_free, NULL);
+  scratch = g_string_new(NULL);
+
+  for (i = 0; i < ledger->cards->len; i++) {
+    struct ledger_card *card = g_ptr_array_index(ledger->cards, i);
+    guint n = merge_card(card, dups, scratch);
+
+    log_info(LOG_CAT_OUTPUT, "Merged %u statement(s) of card '%s' into %u "
+             "transaction(s), dropped %u duplicate(s)", card->runs->len,
+             card->pub.name, card->pub.transactions->len, n);
+    dropped += n;
+  }
+
+  g_string_free(scratch, TRUE);
+  g_hash_table_destroy(dups);
+
+  return dropped;
+}
+
+GPtrArray *
+amex_ledger_cards(const struct amex_ledger *ledger)
+{
+  g_assert(ledger);
+
+  /* The public part comes first in every card */
+  return ledger->cards;
+}
+
+guint
+amex_ledger_card_append_csv(const struct amex_ledger_card *card, GString *gs)
+{
+  gchar buf[AMEX_AMOUNT_STR_LEN];
+  guint i;
+
+  g_assert(card);
+  g_assert(gs);
+
+  g_string_append_printf(gs, "AMEX %s\n%s", card->name, LEDGER_CSV_HEADER);
+
+  for (i = 0; i < card->transactions->len; i++) {
+    const struct amex_transaction *t = g_ptr_array_index(card->transactions,
+                                                         i);
+
+    /* Datum;Bokfört;Specifikation;Ort;Valuta;Utl.belopp/moms;Belopp */
+    g_string_append_len(gs, buf, amex_date_format_iso(t->date, buf));
+    g_string_append_c(gs, ';');
+    g_string_append_len(gs, buf, amex_date_format_iso(t->process_date, buf));
+    g_string_append_printf(gs, ";%s;%s;;;", t->details,
+                           t->location ? t->location : "unknown");
+    g_string_append_len(gs, buf, amex_amount_format(t->amount, buf));
+    g_string_append_c(gs, '\n');
+  }
+
+  return card->transactions->len;
+}
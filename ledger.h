@@ -0,0 +1,52 @@
+#ifndef LEDGER_H__
+#define LEDGER_H__
+/*
+ * ledger.h - One ledger per card, merged from many statements
+ *
+ * Statement periods overlap, so the same transaction is often found on two
+ * statements. The transactions of every card are merged by date across all
+ * statements (a k-way merge of the per-statement runs) and duplicates are
+ * dropped on the way: a transaction found n times in one statement and m
+ * times in another is kept max(n, m) times. Transactions are told apart by
+ * date, process date, amount and their details, ignoring case and spacing.
+ * Only the transactions of a single day are remembered while merging.
+ */
+#include <glib.h>
+
+#include "amexparser.h"
+
+struct amex_ledger;
+
+struct amex_ledger_card {
+  /* As formatted by amex_card_format() */
+  gchar *name;
+  /* struct amex_transaction, by date and then process date */
+  GPtrArray *transactions;
+};
+
+struct amex_ledger *
+amex_ledger_new(void);
+
+void
+amex_ledger_free(struct amex_ledger *ledger);
+
+/* The statement must outlive the ledger, statements can be added in any order */
+void
+amex_ledger_add(struct amex_ledger *ledger, const struct amex_statement *st);
+
+/*
+ * Merge all statements added, returns the number of duplicates dropped.
+ * Statements added after merging are merged in by the next call.
+ */
+guint
+amex_ledger_merge(struct amex_ledger *ledger);
+
+/* struct amex_ledger_card, in the order the cards were first seen */
+GPtrArray *
+amex_ledger_cards(const struct amex_ledger *ledger);
+
+/* Append the card as CSV with ISO dates, returns the transactions written */
+guint
+amex_ledger_card_append_csv(const struct amex_ledger_card *card, GString *gs);
+
+#endif /* LEDGER_H__ */
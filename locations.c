@@ -0,0 +1,1163 @@
+#include <glib.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "hash.h"
+#include "log.h"
+#include "locations.h"
+
+#define LOC_MAP_SEPARATOR          "->"
+#define LOC_INDEX_MAGIC            "AMEXLOC"
+#define LOC_INDEX_VERSION          1
+#define LOC_AC_ROOT_SIZE           256
+#define LOC_MIN_HASH_SIZE          16
+/* Fuzzy matching bounds, in characters. Shorter words are too often one
+ * edit away from a location ("Fund", "Land" and "Lund") */
+#define LOC_FUZZY_MIN_LEN          6
+#define LOC_FUZZY_LONG_LEN         8
+#define LOC_FUZZY_MAX_LEN          48
+
+DEFINE_GQUARK("amex_parser");
+
+/*
+ * The compiled index is one contiguous blob: the header followed by the
+ * sections below, in this order. Everything refers to other parts of the
+ * blob by index or offset, never by pointer.
+ */
+struct loc_header {
+  gchar magic[8];
+  guint32 version;
+  guint32 n_entries;
+  guint32 hash_size;
+  guint32 n_ac_nodes;
+  guint32 n_ac_edges;
+  guint32 n_bk_nodes;
+  guint32 n_bk_edges;
+  guint32 n_codepoints;
+  guint32 strings_len;
+  guint32 reserved;
+};
+
+struct loc_entry {
+  guint32 key;        /* Offset of the case folded variant in the strings */
+  guint32 key_len;
+  guint32 value;      /* Offset of the canonical location name */
+  guint32 cp;         /* Index of the variant's code points */
+  guint32 cp_len;
+  guint32 reserved;
+};
+
+struct ac_node {
+  guint32 edges;      /* Index of the first (byte sorted) edge */
+  guint32 n_edges;
+  guint32 fail;
+  guint32 out;        /* Next node on the fail chain with a match, or 0 */
+  guint32 match;      /* Entry index + 1 of the variant ending here, or 0 */
+};
+
+struct ac_edge {
+  guint32 byte;
+  guint32 target;
+};
+
+struct bk_node {
+  guint32 entry;
+  guint32 edges;
+  guint32 n_edges;
+};
+
+struct bk_edge {
+  guint32 dist;
+  guint32 node;
+};
+
+struct location_index {
+  gint ref_count;
+  /* The blob is either owned or points into a compiled file mapping */
+  GMappedFile *map;
+  gpointer blob;
+  gsize blob_len;
+  const struct loc_header *hdr;
+  const struct loc_entry *entries;
+  const guint32 *hash;
+  const guint32 *ac_root;
+  const struct ac_node *ac_nodes;
+  const struct ac_edge *ac_edges;
+  const struct bk_node *bk_nodes;
+  const struct bk_edge *bk_edges;
+  const guint32 *codepoints;
+  const gchar *strings;
+};
+
+/*
+ * Case folding works on single bytes so it can run inside the automaton.
+ * ASCII and the Latin-1 part of UTF-8 (Å, Ä, Ö, É, ...) are lowered, the
+ * latter only when preceded by the 0xc3 lead byte.
+ */
+static inline guchar
+fold_byte(guchar prev, guchar c)
+{
+  if (c >= 'A' && c <= 'Z') {
+    return c + ('a' - 'A');
+  } else if (prev == 0xc3 && c >= 0x80 && c <= 0x9e && c != 0x97) {
+    return c + 0x20;
+  }
+
+  return c;
+}
+
+static gchar *
+fold_string(const gchar *str, gsize len)
+{
+  gchar *res = g_malloc(len + 1);
+  guchar prev = 0;
+  gsize i;
+
+  for (i = 0; i < len; i++) {
+    res[i] = fold_byte(prev, str[i]);
+    prev = str[i];
+  }
+  res[len] = '\0';
+
+  return res;
+}
+
+static inline guint32
+hash_folded(const gchar *str, gsize len)
+{
+  guint32 h = 2166136261u;
+  guchar prev = 0;
+  gsize i;
+
+  /* FNV-1a over the folded bytes */
+  for (i = 0; i < len; i++) {
+    h ^= fold_byte(prev, str[i]);
+    h *= 16777619u;
+    prev = str[i];
+  }
+
+  return h;
+}
+
+static inline gboolean
+equal_folded(const gchar *key, const gchar *str, gsize len)
+{
+  guchar prev = 0;
+  gsize i;
+
+  for (i = 0; i < len; i++) {
+    if ((guchar) key[i] != fold_byte(prev, str[i])) {
+      return FALSE;
+    }
+    prev = str[i];
+  }
+
+  return TRUE;
+}
+
+/* Decode (already folded) UTF-8, invalid bytes decode as themselves */
+static guint
+decode_codepoints(const gchar *str, gsize len, guint32 *out, guint max)
+{
+  const guchar *s = (const guchar *) str;
+  guint n = 0;
+  gsize i = 0;
+
+  while (i < len) {
+    guint32 c = s[i];
+    gsize k = 1;
+
+    if (c >= 0xf0 && i + 3 < len) {
+      c = ((c & 0x07) << 18) | ((s[i + 1] & 0x3f) << 12) |
+          ((s[i + 2] & 0x3f) << 6) | (s[i + 3] & 0x3f);
+      k = 4;
+    } else if (c >= 0xe0 && i + 2 < len) {
+      c = ((c & 0x0f) << 12) | ((s[i + 1] & 0x3f) << 6) | (s[i + 2] & 0x3f);
+      k = 3;
+    } else if (c >= 0xc0 && i + 1 < len) {
+      c = ((c & 0x1f) << 6) | (s[i + 1] & 0x3f);
+      k = 2;
+    }
+
+    if (n == max) {
+      return max + 1;
+    }
+    out[n++] = c;
+    i += k;
+  }
+
+  return n;
+}
+
+/* Levenshtein distance, anything above bound is reported as bound + 1 */
+static guint
+edit_distance(const guint32 *a, guint la, const guint32 *b, guint lb,
+              guint bound)
+{
+  guint rows[2][LOC_FUZZY_MAX_LEN + 1];
+  guint *prev = rows[0];
+  guint *cur = rows[1];
+  guint i;
+  guint j;
+
+  g_assert(la <= LOC_FUZZY_MAX_LEN && lb <= LOC_FUZZY_MAX_LEN);
+
+  if ((la > lb ? la - lb : lb - la) > bound) {
+    return bound + 1;
+  }
+
+  for (j = 0; j <= lb; j++) {
+    prev[j] = j;
+  }
+
+  for (i = 1; i <= la; i++) {
+    guint row_min;
+    guint *tmp;
+
+    cur[0] = row_min = i;
+    for (j = 1; j <= lb; j++) {
+      guint v = prev[j - 1] + (a[i - 1] != b[j - 1]);
+
+      v = MIN(v, prev[j] + 1);
+      v = MIN(v, cur[j - 1] + 1);
+      cur[j] = v;
+      row_min = MIN(row_min, v);
+    }
+
+    if (row_min > bound) {
+      return bound + 1;
+    }
+    tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  return MIN(prev[lb], bound + 1);
+}
+
+static guint32
+ac_step(const struct location_index *index, guint32 state, guchar c)
+{
+  for (;;) {
+    const struct ac_node *n;
+    guint32 lo;
+    guint32 hi;
+
+    if (!state) {
+      return index->ac_root[c];
+    }
+
+    /* Edges are sorted by byte */
+    n = &index->ac_nodes[state];
+    lo = n->edges;
+    hi = n->edges + n->n_edges;
+    while (lo < hi) {
+      guint32 mid = lo + (hi - lo) / 2;
+
+      if (index->ac_edges[mid].byte < c) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < n->edges + n->n_edges && index->ac_edges[lo].byte == c) {
+      return index->ac_edges[lo].target;
+    }
+
+    state = n->fail;
+  }
+}
+
+static gboolean
+attach_blob(struct location_index *index, gpointer blob, gsize len,
+            GError **err)
+{
+  const struct loc_header *hdr = blob;
+  const guint8 *p = blob;
+  gsize need;
+
+  if (len < sizeof(*hdr) ||
+      memcmp(hdr->magic, LOC_INDEX_MAGIC, sizeof(hdr->magic)) != 0) {
+    SET_GERROR(err, -1, "not a compiled location index");
+    return FALSE;
+  } else if (hdr->version != LOC_INDEX_VERSION) {
+    SET_GERROR(err, -1, "unsupported location index version %u",
+               hdr->version);
+    return FALSE;
+  }
+
+  need = sizeof(*hdr) +
+         (gsize) hdr->n_entries * sizeof(struct loc_entry) +
+         (gsize) hdr->hash_size * sizeof(guint32) +
+         LOC_AC_ROOT_SIZE * sizeof(guint32) +
+         (gsize) hdr->n_ac_nodes * sizeof(struct ac_node) +
+         (gsize) hdr->n_ac_edges * sizeof(struct ac_edge) +
+         (gsize) hdr->n_bk_nodes * sizeof(struct bk_node) +
+         (gsize) hdr->n_bk_edges * sizeof(struct bk_edge) +
+         (gsize) hdr->n_codepoints * sizeof(guint32) +
+         hdr->strings_len;
+  if (need != len || !hdr->hash_size ||
+      (hdr->hash_size & (hdr->hash_size - 1)) || !hdr->n_ac_nodes) {
+    SET_GERROR(err, -1, "corrupt location index (size mismatch)");
+    return FALSE;
+  }
+
+  index->blob = blob;
+  index->blob_len = len;
+  index->hdr = hdr;
+  p += sizeof(*hdr);
+  index->entries = (const struct loc_entry *) p;
+  p += hdr->n_entries * sizeof(struct loc_entry);
+  index->hash = (const guint32 *) p;
+  p += hdr->hash_size * sizeof(guint32);
+  index->ac_root = (const guint32 *) p;
+  p += LOC_AC_ROOT_SIZE * sizeof(guint32);
+  index->ac_nodes = (const struct ac_node *) p;
+  p += hdr->n_ac_nodes * sizeof(struct ac_node);
+  index->ac_edges = (const struct ac_edge *) p;
+  p += hdr->n_ac_edges * sizeof(struct ac_edge);
+  index->bk_nodes = (const struct bk_node *) p;
+  p += hdr->n_bk_nodes * sizeof(struct bk_node);
+  index->bk_edges = (const struct bk_edge *) p;
+  p += hdr->n_bk_edges * sizeof(struct bk_edge);
+  index->codepoints = (const guint32 *) p;
+  p += hdr->n_codepoints * sizeof(guint32);
+  index->strings = (const gchar *) p;
+
+  return TRUE;
+}
+
+/*
+ * Compiled files come from disk, so check every index and offset once
+ * before trusting them. This walks the sections without allocating.
+ */
+static gboolean
+validate_blob(const struct location_index *index, GError **err)
+{
+  const struct loc_header *hdr = index->hdr;
+  guint32 i;
+
+  /* An open addressing table without a free slot would never terminate */
+  if (!hdr->strings_len || index->strings[hdr->strings_len - 1] != '\0' ||
+      hdr->hash_size <= hdr->n_entries) {
+    goto out_corrupt;
+  }
+
+  for (i = 0; i < hdr->n_entries; i++) {
+    const struct loc_entry *e = &index->entries[i];
+
+    if (e->key >= hdr->strings_len || e->value >= hdr->strings_len ||
+        e->key_len > hdr->strings_len - e->key - 1 ||
+        e->cp > hdr->n_codepoints || e->cp_len > LOC_FUZZY_MAX_LEN ||
+        e->cp_len > hdr->n_codepoints - e->cp) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < hdr->hash_size; i++) {
+    if (index->hash[i] > hdr->n_entries) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < LOC_AC_ROOT_SIZE; i++) {
+    if (index->ac_root[i] >= hdr->n_ac_nodes) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < hdr->n_ac_nodes; i++) {
+    const struct ac_node *n = &index->ac_nodes[i];
+
+    if (n->edges > hdr->n_ac_edges || n->n_edges > hdr->n_ac_edges - n->edges ||
+        n->match > hdr->n_entries ||
+        (i && (n->fail >= i || n->out >= i)) || (!i && (n->fail || n->out))) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < hdr->n_ac_edges; i++) {
+    if (index->ac_edges[i].target >= hdr->n_ac_nodes ||
+        index->ac_edges[i].byte >= LOC_AC_ROOT_SIZE) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < hdr->n_bk_nodes; i++) {
+    const struct bk_node *n = &index->bk_nodes[i];
+
+    if (n->entry >= hdr->n_entries || n->edges > hdr->n_bk_edges ||
+        n->n_edges > hdr->n_bk_edges - n->edges) {
+      goto out_corrupt;
+    }
+  }
+  /* Children always come after their parent, so searches terminate */
+  for (i = 0; i < hdr->n_bk_nodes; i++) {
+    const struct bk_node *n = &index->bk_nodes[i];
+    guint32 j;
+
+    for (j = n->edges; j < n->edges + n->n_edges; j++) {
+      if (index->bk_edges[j].node <= i ||
+          index->bk_edges[j].node >= hdr->n_bk_nodes) {
+        goto out_corrupt;
+      }
+    }
+  }
+
+  return TRUE;
+
+out_corrupt:
+  SET_GERROR(err, -1, "corrupt location index");
+  return FALSE;
+}
+
+/* Builder ---------------------------------------------------------------- */
+
+struct loc_pair {
+  gchar *key;         /* Case folded */
+  gchar *value;
+};
+
+struct trie_node {
+  guint32 first_child;
+  guint32 next_sibling;
+  guint32 match;
+  guint32 byte;
+};
+
+struct bk_tmp {
+  guint32 entry;
+  guint32 first_child;
+  guint32 next_sibling;
+  guint32 dist;
+};
+
+struct loc_builder {
+  GArray *pairs;
+  GHashTable *keys;
+};
+
+static void
+builder_add(struct loc_builder *b, const gchar *key, const gchar *value)
+{
+  struct loc_pair pair;
+  gpointer idx;
+
+  pair.key = fold_string(key, strlen(key));
+
+  /* A later definition of the same variant wins */
+  if ((idx = g_hash_table_lookup(b->keys, pair.key)) != NULL) {
+    struct loc_pair *p = &g_array_index(b->pairs, struct loc_pair,
+                                        GPOINTER_TO_UINT(idx) - 1);
+
+    g_free(p->value);
+    p->value = g_strdup(value);
+    g_free(pair.key);
+    return;
+  }
+
+  pair.value = g_strdup(value);
+  g_array_append_val(b->pairs, pair);
+  g_hash_table_insert(b->keys, pair.key, GUINT_TO_POINTER(b->pairs->len));
+}
+
+static gboolean
+builder_parse(struct loc_builder *b, const gchar *buffer, GError **err)
+{
+  gchar **splits = g_strsplit(buffer, "\n", -1);
+  gboolean ret = FALSE;
+  guint i;
+
+  for (i = 0; splits[i]; i++) {
+    gchar *line = g_strstrip(splits[i]);
+    gchar *sep;
+
+    if (!*line) {
+      continue;
+    }
+
+    if ((sep = strstr(line, LOC_MAP_SEPARATOR)) != NULL) {
+      gchar *value = sep + strlen(LOC_MAP_SEPARATOR);
+
+      *sep = '\0';
+      g_strstrip(line);
+      g_strstrip(value);
+      if (!*line || !*value || strstr(value, LOC_MAP_SEPARATOR)) {
+        SET_GERROR(err, -1, "L%d: Invalid location map entry", i + 1);
+        goto out;
+      }
+      builder_add(b, line, value);
+    } else {
+      builder_add(b, line, line);
+    }
+  }
+
+  ret = TRUE;
+out:
+  g_strfreev(splits);
+
+  return ret;
+}
+
+static guint32
+trie_insert(GArray *trie, const gchar *key, guint32 entry)
+{
+  guint32 node = 0;
+  const guchar *c;
+
+  for (c = (const guchar *) key; *c; c++) {
+    guint32 child = g_array_index(trie, struct trie_node, node).first_child;
+
+    while (child && g_array_index(trie, struct trie_node, child).byte != *c) {
+      child = g_array_index(trie, struct trie_node, child).next_sibling;
+    }
+
+    if (!child) {
+      struct trie_node n = { 0, };
+
+      n.byte = *c;
+      n.next_sibling = g_array_index(trie, struct trie_node, node).first_child;
+      child = trie->len;
+      g_array_append_val(trie, n);
+      g_array_index(trie, struct trie_node, node).first_child = child;
+    }
+    node = child;
+  }
+
+  g_array_index(trie, struct trie_node, node).match = entry + 1;
+
+  return node;
+}
+
+static gint
+compare_ac_edges(gconstpointer a, gconstpointer b)
+{
+  const struct ac_edge *ea = a;
+  const struct ac_edge *eb = b;
+
+  return (gint) ea->byte - (gint) eb->byte;
+}
+
+static gint
+compare_bk_edges(gconstpointer a, gconstpointer b)
+{
+  const struct bk_edge *ea = a;
+  const struct bk_edge *eb = b;
+
+  return (gint) ea->dist - (gint) eb->dist;
+}
+
+static guint
+entry_distance(const guint32 *cps, const struct loc_entry *a,
+               const struct loc_entry *b)
+{
+  return edit_distance(cps + a->cp, a->cp_len, cps + b->cp, b->cp_len,
+                       G_MAXUINT - 1);
+}
+
+static struct location_index *
+builder_compile(struct loc_builder *b)
+{
+  struct location_index *index;
+  struct loc_header hdr = { LOC_INDEX_MAGIC, };
+  GHashTable *values;
+  GByteArray *strings;
+  GArray *entries;
+  GArray *codepoints;
+  GArray *trie;
+  GArray *ac_nodes;
+  GArray *ac_edges;
+  GArray *order;
+  guint32 *rank;
+  GArray *bk_tmp;
+  GArray *bk_nodes;
+  GArray *bk_edges;
+  guint32 *hash;
+  guint32 root[LOC_AC_ROOT_SIZE] = { 0, };
+  guint8 *blob;
+  gsize len;
+  guint i;
+
+  values = g_hash_table_new(g_str_hash, g_str_equal);
+  strings = g_byte_array_new();
+  entries = g_array_new(FALSE, TRUE, sizeof(struct loc_entry));
+  codepoints = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+  /* Canonical names are locations in their own right */
+  for (i = 0; i < b->pairs->len; i++) {
+    struct loc_pair *p = &g_array_index(b->pairs, struct loc_pair, i);
+    gchar *folded = fold_string(p->value, strlen(p->value));
+
+    if (!g_hash_table_contains(b->keys, folded)) {
+      builder_add(b, p->value, p->value);
+    }
+    g_free(folded);
+  }
+
+  /* 1. Entries, strings and code points */
+  for (i = 0; i < b->pairs->len; i++) {
+    struct loc_pair *p = &g_array_index(b->pairs, struct loc_pair, i);
+    guint32 cps[LOC_FUZZY_MAX_LEN];
+    struct loc_entry e = { 0, };
+    gpointer voff;
+
+    if (!g_hash_table_lookup_extended(values, p->value, NULL, &voff)) {
+      voff = GUINT_TO_POINTER(strings->len);
+      g_byte_array_append(strings, (const guint8 *) p->value,
+                          strlen(p->value) + 1);
+      g_hash_table_insert(values, p->value, voff);
+    }
+    e.value = GPOINTER_TO_UINT(voff);
+
+    e.key = strings->len;
+    e.key_len = strlen(p->key);
+    g_byte_array_append(strings, (const guint8 *) p->key, e.key_len + 1);
+
+    /* Variants too long for fuzzy matching are left out of the BK-tree */
+    e.cp = codepoints->len;
+    e.cp_len = decode_codepoints(p->key, e.key_len, cps, LOC_FUZZY_MAX_LEN);
+    if (e.cp_len > LOC_FUZZY_MAX_LEN) {
+      e.cp_len = 0;
+    }
+    g_array_append_vals(codepoints, cps, e.cp_len);
+    g_array_append_val(entries, e);
+  }
+  /* Keep the sections behind the strings 4 byte aligned */
+  while (strings->len % 4) {
+    g_byte_array_append(strings, (const guint8 *) "", 1);
+  }
+
+  /* 2. Open addressing hash of the variants */
+  for (hdr.hash_size = LOC_MIN_HASH_SIZE;
+       hdr.hash_size < entries->len * 2; hdr.hash_size *= 2);
+  hash = g_new0(guint32, hdr.hash_size);
+  for (i = 0; i < entries->len; i++) {
+    const struct loc_entry *e = &g_array_index(entries, struct loc_entry, i);
+    const gchar *key = (const gchar *) strings->data + e->key;
+    guint32 slot = hash_folded(key, e->key_len) & (hdr.hash_size - 1);
+
+    while (hash[slot]) {
+      slot = (slot + 1) & (hdr.hash_size - 1);
+    }
+    hash[slot] = i + 1;
+  }
+
+  /* 3. Aho-Corasick automaton: trie, flattened edges, then fail links */
+  trie = g_array_new(FALSE, TRUE, sizeof(struct trie_node));
+  g_array_set_size(trie, 1);
+  for (i = 0; i < entries->len; i++) {
+    const struct loc_entry *e = &g_array_index(entries, struct loc_entry, i);
+
+    trie_insert(trie, (const gchar *) strings->data + e->key, i);
+  }
+
+  /*
+   * States are numbered breadth first, so fail and output links always
+   * point to lower numbers and all fail targets are complete before use.
+   */
+  order = g_array_new(FALSE, FALSE, sizeof(guint32));
+  rank = g_new0(guint32, trie->len);
+  g_array_append_vals(order, &(guint32) { 0 }, 1);
+  for (i = 0; i < order->len; i++) {
+    guint32 child = g_array_index(trie, struct trie_node,
+                                  g_array_index(order, guint32, i)).first_child;
+
+    for (; child;
+         child = g_array_index(trie, struct trie_node, child).next_sibling) {
+      rank[child] = order->len;
+      g_array_append_val(order, child);
+    }
+  }
+
+  ac_nodes = g_array_new(FALSE, TRUE, sizeof(struct ac_node));
+  ac_edges = g_array_new(FALSE, TRUE, sizeof(struct ac_edge));
+  g_array_set_size(ac_nodes, trie->len);
+  for (i = 0; i < order->len; i++) {
+    struct trie_node *t = &g_array_index(trie, struct trie_node,
+                                         g_array_index(order, guint32, i));
+    struct ac_node *n = &g_array_index(ac_nodes, struct ac_node, i);
+    guint32 child;
+
+    n->edges = ac_edges->len;
+    n->match = t->match;
+    for (child = t->first_child; child;
+         child = g_array_index(trie, struct trie_node, child).next_sibling) {
+      struct ac_edge edge;
+
+      edge.byte = g_array_index(trie, struct trie_node, child).byte;
+      edge.target = rank[child];
+      g_array_append_val(ac_edges, edge);
+      if (!i) {
+        root[edge.byte] = edge.target;
+      }
+    }
+    n->n_edges = ac_edges->len - n->edges;
+    if (n->n_edges > 1) {
+      qsort(&g_array_index(ac_edges, struct ac_edge, n->edges), n->n_edges,
+            sizeof(struct ac_edge), compare_ac_edges);
+    }
+  }
+
+  index = g_new0(struct location_index, 1);
+  index->ac_root = root;
+  index->ac_nodes = (const struct ac_node *) ac_nodes->data;
+  index->ac_edges = (const struct ac_edge *) ac_edges->data;
+
+  for (i = 0; i < ac_nodes->len; i++) {
+    struct ac_node *un = &g_array_index(ac_nodes, struct ac_node, i);
+    guint32 j;
+
+    for (j = un->edges; j < un->edges + un->n_edges; j++) {
+      const struct ac_edge *edge = &g_array_index(ac_edges, struct ac_edge, j);
+      struct ac_node *vn = &g_array_index(ac_nodes, struct ac_node,
+                                          edge->target);
+      const struct ac_node *fn;
+
+      vn->fail = i ? ac_step(index, un->fail, edge->byte) : 0;
+      fn = &g_array_index(ac_nodes, struct ac_node, vn->fail);
+      vn->out = fn->match ? vn->fail : fn->out;
+    }
+  }
+  g_array_free(order, TRUE);
+  g_free(rank);
+
+  /* 4. BK-tree over the code points of the variants */
+  bk_tmp = g_array_new(FALSE, TRUE, sizeof(struct bk_tmp));
+  for (i = 0; i < entries->len; i++) {
+    const struct loc_entry *e = &g_array_index(entries, struct loc_entry, i);
+    const guint32 *cps = (const guint32 *) codepoints->data;
+    struct bk_tmp n = { 0, };
+    guint32 cur = 0;
+
+    if (!e->cp_len) {
+      continue;
+    }
+
+    n.entry = i;
+    while (bk_tmp->len) {
+      struct bk_tmp *c = &g_array_index(bk_tmp, struct bk_tmp, cur);
+      guint d = entry_distance(cps, &g_array_index(entries, struct loc_entry,
+                                                   c->entry), e);
+      guint32 child;
+
+      for (child = c->first_child; child;
+           child = g_array_index(bk_tmp, struct bk_tmp, child).next_sibling) {
+        if (g_array_index(bk_tmp, struct bk_tmp, child).dist == d) {
+          break;
+        }
+      }
+
+      if (!child) {
+        n.dist = d;
+        n.next_sibling = c->first_child;
+        c->first_child = bk_tmp->len;
+        break;
+      }
+      cur = child;
+    }
+    g_array_append_val(bk_tmp, n);
+  }
+
+  bk_nodes = g_array_new(FALSE, TRUE, sizeof(struct bk_node));
+  bk_edges = g_array_new(FALSE, TRUE, sizeof(struct bk_edge));
+  g_array_set_size(bk_nodes, bk_tmp->len);
+  for (i = 0; i < bk_tmp->len; i++) {
+    struct bk_tmp *t = &g_array_index(bk_tmp, struct bk_tmp, i);
+    struct bk_node *n = &g_array_index(bk_nodes, struct bk_node, i);
+    guint32 child;
+
+    n->entry = t->entry;
+    n->edges = bk_edges->len;
+    for (child = t->first_child; child;
+         child = g_array_index(bk_tmp, struct bk_tmp, child).next_sibling) {
+      struct bk_edge edge;
+
+      edge.dist = g_array_index(bk_tmp, struct bk_tmp, child).dist;
+      edge.node = child;
+      g_array_append_val(bk_edges, edge);
+    }
+    n->n_edges = bk_edges->len - n->edges;
+    qsort(&g_array_index(bk_edges, struct bk_edge, n->edges), n->n_edges,
+          sizeof(struct bk_edge), compare_bk_edges);
+  }
+
+  /* 5. Pack everything into one blob */
+  hdr.version = LOC_INDEX_VERSION;
+  hdr.n_entries = entries->len;
+  hdr.n_ac_nodes = ac_nodes->len;
+  hdr.n_ac_edges = ac_edges->len;
+  hdr.n_bk_nodes = bk_nodes->len;
+  hdr.n_bk_edges = bk_edges->len;
+  hdr.n_codepoints = codepoints->len;
+  hdr.strings_len = strings->len;
+
+  len = sizeof(hdr) + entries->len * sizeof(struct loc_entry) +
+        hdr.hash_size * sizeof(guint32) + sizeof(root) +
+        ac_nodes->len * sizeof(struct ac_node) +
+        ac_edges->len * sizeof(struct ac_edge) +
+        bk_nodes->len * sizeof(struct bk_node) +
+        bk_edges->len * sizeof(struct bk_edge) +
+        codepoints->len * sizeof(guint32) + strings->len;
+  blob = g_malloc(len);
+
+#define PACK(ptr, size)                                   \
+  G_STMT_START {                                          \
+    /* Empty arrays have no data at all */                \
+    if ((size) != 0) {                                    \
+      memcpy(p, ptr, size);                               \
+      p += (size);                                        \
+    }                                                     \
+  } G_STMT_END
+  {
+    guint8 *p = blob;
+
+    PACK(&hdr, sizeof(hdr));
+    PACK(entries->data, entries->len * sizeof(struct loc_entry));
+    PACK(hash, hdr.hash_size * sizeof(guint32));
+    PACK(root, sizeof(root));
+    PACK(ac_nodes->data, ac_nodes->len * sizeof(struct ac_node));
+    PACK(ac_edges->data, ac_edges->len * sizeof(struct ac_edge));
+    PACK(bk_nodes->data, bk_nodes->len * sizeof(struct bk_node));
+    PACK(bk_edges->data, bk_edges->len * sizeof(struct bk_edge));
+    PACK(codepoints->data, codepoints->len * sizeof(guint32));
+    PACK(strings->data, strings->len);
+    g_assert(p == blob + len);
+  }
+#undef PACK
+
+  memset(index, 0, sizeof(*index));
+  index->ref_count = 1;
+  if (!attach_blob(index, blob, len, NULL)) {
+    g_assert_not_reached();
+  }
+
+  g_free(hash);
+  g_hash_table_destroy(values);
+  g_byte_array_free(strings, TRUE);
+  g_array_free(entries, TRUE);
+  g_array_free(codepoints, TRUE);
+  g_array_free(trie, TRUE);
+  g_array_free(ac_nodes, TRUE);
+  g_array_free(ac_edges, TRUE);
+  g_array_free(bk_tmp, TRUE);
+  g_array_free(bk_nodes, TRUE);
+  g_array_free(bk_edges, TRUE);
+
+  return index;
+}
+
+static void
+builder_init(struct loc_builder *b)
+{
+  b->pairs = g_array_new(FALSE, FALSE, sizeof(struct loc_pair));
+  b->keys = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void
+builder_clear(struct loc_builder *b)
+{
+  guint i;
+
+  for (i = 0; i < b->pairs->len; i++) {
+    struct loc_pair *p = &g_array_index(b->pairs, struct loc_pair, i);
+
+    g_free(p->key);
+    g_free(p->value);
+  }
+  g_array_free(b->pairs, TRUE);
+  g_hash_table_destroy(b->keys);
+}
+
+/* Public API ------------------------------------------------------------- */
+
+struct location_index *
+location_index_new_empty(void)
+{
+  struct location_index *index;
+  struct loc_builder b;
+
+  builder_init(&b);
+  index = builder_compile(&b);
+  builder_clear(&b);
+
+  return index;
+}
+
+static struct location_index *
+compile_text(const gchar *filename, const gchar *contents, gsize len,
+             GError **err)
+{
+  struct location_index *index = NULL;
+  struct loc_builder b;
+  gchar *buffer = g_strndup(contents, len);
+
+  builder_init(&b);
+  if (builder_parse(&b, buffer, err)) {
+    index = builder_compile(&b);
+    log_info(LOG_CAT_GENERAL, "Read %zi bytes from '%s' and added %u location "
+             "entries (%u automaton states)", len, filename,
+             index->hdr->n_entries, index->hdr->n_ac_nodes);
+  }
+  builder_clear(&b);
+  g_free(buffer);
+
+  return index;
+}
+
+struct location_index *
+location_index_load(const gchar *filename, GError **err)
+{
+  struct location_index *index = NULL;
+  GMappedFile *map;
+  const gchar *contents;
+  gsize len;
+
+  g_assert(filename);
+
+  if ((map = g_mapped_file_new(filename, FALSE, err)) == NULL) {
+    return NULL;
+  }
+  contents = g_mapped_file_get_contents(map);
+  len = g_mapped_file_get_length(map);
+
+  /* Anything that is not a compiled index is treated as a text file */
+  if (len < sizeof(struct loc_header) ||
+      memcmp(contents, LOC_INDEX_MAGIC, sizeof(LOC_INDEX_MAGIC)) != 0) {
+    index = compile_text(filename, contents ? contents : "", len, err);
+    g_mapped_file_unref(map);
+    return index;
+  }
+
+  /* Compiled: use the mapping as is, the pages are shared between processes */
+  index = g_new0(struct location_index, 1);
+  index->ref_count = 1;
+  index->map = map;
+  if (!attach_blob(index, (gpointer) contents, len, err) ||
+      !validate_blob(index, err)) {
+    g_prefix_error(err, "%s: ", filename);
+    location_index_unref(index);
+    return NULL;
+  }
+
+  log_info(LOG_CAT_GENERAL, "Mapped %zi bytes from '%s' with %u location "
+           "entries", len, filename, index->hdr->n_entries);
+
+  return index;
+}
+
+gboolean
+location_index_save(const struct location_index *index,
+                    const gchar *filename, GError **err)
+{
+  g_assert(index);
+  g_assert(filename);
+
+  return g_file_set_contents(filename, index->blob, index->blob_len, err);
+}
+
+struct location_index *
+location_index_ref(struct location_index *index)
+{
+  g_assert(index);
+
+  g_atomic_int_inc(&index->ref_count);
+
+  return index;
+}
+
+void
+location_index_unref(struct location_index *index)
+{
+  g_assert(index);
+
+  if (!g_atomic_int_dec_and_test(&index->ref_count)) {
+    return;
+  }
+
+  if (index->map) {
+    g_mapped_file_unref(index->map);
+  } else {
+    g_free(index->blob);
+  }
+  g_free(index);
+}
+
+guint
+location_index_size(const struct location_index *index)
+{
+  g_assert(index);
+
+  return index->hdr->n_entries;
+}
+
+guint64
+location_index_version(const struct location_index *index)
+{
+  g_assert(index);
+
+  return hash_xxh64(index->blob, index->blob_len, 0);
+}
+
+const gchar *
+location_index_lookup(const struct location_index *index,
+                      const gchar *str, gsize len)
+{
+  guint32 mask;
+  guint32 slot;
+
+  g_assert(index);
+  g_assert(str);
+
+  mask = index->hdr->hash_size - 1;
+  for (slot = hash_folded(str, len) & mask; index->hash[slot];
+       slot = (slot + 1) & mask) {
+    const struct loc_entry *e = &index->entries[index->hash[slot] - 1];
+
+    if (e->key_len == len && equal_folded(index->strings + e->key, str, len)) {
+      return index->strings + e->value;
+    }
+  }
+
+  return NULL;
+}
+
+static inline gboolean
+is_word_separator(guchar c)
+{
+  return c < 0x80 && !g_ascii_isalnum(c);
+}
+
+static gboolean
+match_exact(const struct location_index *index, const gchar *text, gsize len,
+            struct location_match *match)
+{
+  guint32 state = 0;
+  guchar prev = 0;
+  gsize i;
+
+  for (i = 0; i < len; i++) {
+    guint32 m;
+
+    state = ac_step(index, state, fold_byte(prev, text[i]));
+    prev = text[i];
+
+    m = index->ac_nodes[state].match ? state : index->ac_nodes[state].out;
+    for (; m; m = index->ac_nodes[m].out) {
+      const struct loc_entry *e = &index->entries[index->ac_nodes[m].match - 1];
+      gsize start = i + 1 - e->key_len;
+
+      /* Whole words only */
+      if ((start && !is_word_separator(text[start - 1])) ||
+          (i + 1 < len && !is_word_separator(text[i + 1]))) {
+        continue;
+      }
+
+      /* Locations are normally last, so prefer the last and longest match */
+      if (match->kind == LOCATION_MATCH_NONE || i + 1 > match->end ||
+          (i + 1 == match->end && start < match->start)) {
+        match->kind = LOCATION_MATCH_EXACT;
+        match->location = index->strings + e->value;
+        match->start = start;
+        match->end = i + 1;
+        match->distance = 0;
+      }
+    }
+  }
+
+  return match->kind != LOCATION_MATCH_NONE;
+}
+
+static void
+bk_search(const struct location_index *index, guint32 node,
+          const guint32 *q, guint qlen, guint bound,
+          const struct loc_entry **best, guint *best_dist)
+{
+  const struct bk_node *n = &index->bk_nodes[node];
+  const struct loc_entry *e = &index->entries[n->entry];
+  guint d;
+  guint32 i;
+
+  /* The exact distance is needed to prune children, cap it reasonably */
+  d = edit_distance(q, qlen, index->codepoints + e->cp, e->cp_len,
+                    LOC_FUZZY_MAX_LEN);
+  if (d <= bound && d < *best_dist) {
+    *best = e;
+    *best_dist = d;
+  }
+
+  for (i = n->edges; i < n->edges + n->n_edges; i++) {
+    const struct bk_edge *edge = &index->bk_edges[i];
+
+    if (edge->dist + bound < d) {
+      continue;
+    } else if (edge->dist > d + bound) {
+      break;
+    }
+    bk_search(index, edge->node, q, qlen, bound, best, best_dist);
+  }
+}
+
+static gboolean
+match_fuzzy(const struct location_index *index, const gchar *text, gsize len,
+            gsize start, struct location_match *match)
+{
+  guint32 q[LOC_FUZZY_MAX_LEN];
+  const struct loc_entry *best = NULL;
+  guint best_dist = G_MAXUINT;
+  gchar *folded;
+  guint qlen;
+  guint bound;
+
+  folded = fold_string(text + start, len - start);
+  qlen = decode_codepoints(folded, len - start, q, LOC_FUZZY_MAX_LEN);
+  g_free(folded);
+
+  if (qlen < LOC_FUZZY_MIN_LEN || qlen > LOC_FUZZY_MAX_LEN) {
+    return FALSE;
+  }
+
+  bound = qlen < LOC_FUZZY_LONG_LEN ? 1 : 2;
+  bk_search(index, 0, q, qlen, bound, &best, &best_dist);
+
+  if (!best || (match->kind != LOCATION_MATCH_NONE &&
+                best_dist >= match->distance)) {
+    return FALSE;
+  }
+
+  match->kind = LOCATION_MATCH_FUZZY;
+  match->location = index->strings + best->value;
+  match->start = start;
+  match->end = len;
+  match->distance = best_dist;
+
+  return TRUE;
+}
+
+gboolean
+location_index_match(const struct location_index *index,
+                     const gchar *text, gsize len,
+                     struct location_match *match)
+{
+  gsize last = len;
+  gint tokens;
+
+  g_assert(index);
+  g_assert(text);
+  g_assert(match);
+
+  memset(match, 0, sizeof(*match));
+
+  if (match_exact(index, text, len, match)) {
+    return TRUE;
+  } else if (!index->hdr->n_bk_nodes) {
+    return FALSE;
+  }
+
+  /* Fall back to a misspelt last token, then the last two tokens */
+  for (tokens = 0; tokens < 2 && last; tokens++) {
+    while (last && text[last - 1] != ' ') {
+      last--;
+    }
+    match_fuzzy(index, text, len, last, match);
+    while (last && text[last - 1] == ' ') {
+      last--;
+    }
+  }
+
+  return match->kind != LOCATION_MATCH_NONE;
+}
@@ -0,0 +1,72 @@
+#ifndef LOCATIONS_H__
+#define LOCATIONS_H__
+/*
+ * locations.h - Purchase location dictionary and matcher
+ *
+ * The location file is compiled once into a read-only index that can be
+ * shared between threads. It holds every location variant (case folded),
+ * the canonical name it maps to, an Aho-Corasick automaton to find all
+ * variants in a description in one pass, and a BK-tree over the variants
+ * for bounded edit-distance lookups of misspelt locations.
+ *
+ * The index is a single flat blob without pointers, so it can be saved as
+ * a compiled location file and mapped straight back in by later runs.
+ */
+#include <glib.h>
+
+struct location_index;
+
+enum location_match_kind {
+  LOCATION_MATCH_NONE = 0,
+  LOCATION_MATCH_EXACT,
+  LOCATION_MATCH_FUZZY,
+};
+
+struct location_match {
+  enum location_match_kind kind;
+  /* Canonical location name */
+  const gchar *location;
+  /* Matched bytes [start, end) of the searched text */
+  gsize start;
+  gsize end;
+  /* Edit distance of fuzzy matches */
+  guint distance;
+};
+
+struct location_index *
+location_index_new_empty(void);
+
+/* Loads either a text location file or a compiled one */
+struct location_index *
+location_index_load(const gchar *filename, GError **err);
+
+gboolean
+location_index_save(const struct location_index *index,
+                    const gchar *filename, GError **err);
+
+struct location_index *
+location_index_ref(struct location_index *index);
+
+void
+location_index_unref(struct location_index *index);
+
+guint
+location_index_size(const struct location_index *index);
+
+/*
+ * Changes whenever the dictionary does, whether it was loaded from a text
+ * file or a compiled one. Hashes the whole index, so keep the result
+ */
+guint64
+location_index_version(const struct location_index *index);
+
+const gchar *
+location_index_lookup(const struct location_index *index,
+                      const gchar *str, gsize len);
+
+gboolean
+location_index_match(const struct location_index *index,
+                     const gchar *text, gsize len,
+                     struct location_match *match);
+
+#endif /* LOCATIONS_H__ */
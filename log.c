@@ -0,0 +1,206 @@
+#include <glib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "log.h"
+
+#define LOG_RING_SLOTS             1024
+#define LOG_MSG_MAX_LEN            256
+/* Slots copied out of the ring per write */
+#define LOG_WRITER_BATCH           64
+
+DEFINE_GQUARK("amex_parser");
+
+struct log_slot {
+  gsize len;
+  gchar msg[LOG_MSG_MAX_LEN];
+};
+
+struct log_ring {
+  GMutex lock;
+  GCond data_cond;
+  GCond space_cond;
+  GThread *writer;
+  gboolean stopping;
+  /* Free running counters, the slot is the counter modulo the ring size */
+  guint head;
+  guint tail;
+  guint dropped;
+  struct log_slot slots[LOG_RING_SLOTS];
+};
+
+static const gchar *level_names[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+static const gchar *category_names[LOG_CAT_COUNT] = {
+  [LOG_CAT_GENERAL]    = "general",
+  [LOG_CAT_SPLITTER]   = "splitter",
+  [LOG_CAT_CLASSIFIER] = "classifier",
+  [LOG_CAT_DETAILS]    = "details",
+  [LOG_CAT_OUTPUT]     = "output",
+};
+
+gint log_level = LOG_LEVEL_WARNING;
+guint log_categories = LOG_CAT_ALL;
+
+static struct log_ring ring;
+
+gboolean
+log_parse_categories(const gchar *str, guint *mask, GError **err)
+{
+  gchar **names;
+  gboolean ret = FALSE;
+  guint i;
+
+  g_assert(str);
+  g_assert(mask);
+
+  *mask = 0;
+  names = g_strsplit(str, ",", -1);
+  for (i = 0; names[i]; i++) {
+    gchar *name = g_strstrip(names[i]);
+    guint c;
+
+    if (!g_strcmp0(name, "all")) {
+      *mask |= LOG_CAT_ALL;
+      continue;
+    }
+
+    for (c = 0; c < LOG_CAT_COUNT; c++) {
+      if (!g_strcmp0(name, category_names[c])) {
+        *mask |= 1u << c;
+        break;
+      }
+    }
+    if (c == LOG_CAT_COUNT) {
+      SET_GERROR(err, -1, "unknown log category '%s'", name);
+      goto out;
+    }
+  }
+
+  ret = TRUE;
+out:
+  g_strfreev(names);
+
+  return ret;
+}
+
+static gpointer
+log_writer(gpointer data)
+{
+  gchar buffer[LOG_WRITER_BATCH * LOG_MSG_MAX_LEN];
+
+  (void) data;
+
+  g_mutex_lock(&ring.lock);
+  for (;;) {
+    gsize len = 0;
+    guint dropped;
+    guint n;
+
+    while (ring.head == ring.tail && !ring.stopping) {
+      g_cond_wait(&ring.data_cond, &ring.lock);
+    }
+    if (ring.head == ring.tail) {
+      break;
+    }
+
+    /* Copy a batch out so stderr is written without holding the lock */
+    for (n = 0; n < LOG_WRITER_BATCH && ring.tail != ring.head; n++) {
+      const struct log_slot *s = &ring.slots[ring.tail++ % LOG_RING_SLOTS];
+
+      memcpy(buffer + len, s->msg, s->len);
+      len += s->len;
+    }
+    dropped = ring.dropped;
+    ring.dropped = 0;
+    g_cond_broadcast(&ring.space_cond);
+    g_mutex_unlock(&ring.lock);
+
+    fwrite(buffer, 1, len, stderr);
+    if (dropped) {
+      fprintf(stderr, "** WARNING [general]: %u log message(s) dropped\n",
+              dropped);
+    }
+
+    g_mutex_lock(&ring.lock);
+  }
+  g_mutex_unlock(&ring.lock);
+  fflush(stderr);
+
+  return NULL;
+}
+
+void
+log_init(void)
+{
+  g_assert(!ring.writer);
+
+  ring.stopping = FALSE;
+  ring.writer = g_thread_new("log-writer", log_writer, NULL);
+}
+
+void
+log_shutdown(void)
+{
+  GThread *writer;
+
+  g_mutex_lock(&ring.lock);
+  writer = ring.writer;
+  ring.stopping = TRUE;
+  g_cond_signal(&ring.data_cond);
+  g_mutex_unlock(&ring.lock);
+
+  if (writer) {
+    g_thread_join(writer);
+  }
+
+  g_mutex_lock(&ring.lock);
+  ring.writer = NULL;
+  g_mutex_unlock(&ring.lock);
+}
+
+void
+log_write(gint level, enum log_category cat, const gchar *fmt, ...)
+{
+  struct log_slot slot;
+  va_list args;
+  gint n;
+
+  g_assert(level >= LOG_LEVEL_ERROR && level <= LOG_LEVEL_DEBUG);
+  g_assert(cat < LOG_CAT_COUNT);
+
+  n = g_snprintf(slot.msg, sizeof(slot.msg), "** %s [%s]: ",
+                 level_names[level], category_names[cat]);
+  va_start(args, fmt);
+  n += g_vsnprintf(slot.msg + n, sizeof(slot.msg) - n, fmt, args);
+  va_end(args);
+
+  /* Over long messages are truncated, keeping room for the newline */
+  slot.len = MIN((gsize) n, sizeof(slot.msg) - 2);
+  slot.msg[slot.len++] = '\n';
+
+  g_mutex_lock(&ring.lock);
+  if (!ring.writer || ring.stopping) {
+    g_mutex_unlock(&ring.lock);
+    fwrite(slot.msg, 1, slot.len, stderr);
+    return;
+  }
+
+  /* Only errors are worth waiting for, everything else is dropped */
+  while (ring.head - ring.tail == LOG_RING_SLOTS &&
+         level == LOG_LEVEL_ERROR) {
+    g_cond_wait(&ring.space_cond, &ring.lock);
+  }
+
+  if (ring.head - ring.tail == LOG_RING_SLOTS) {
+    ring.dropped++;
+  } else {
+    struct log_slot *s = &ring.slots[ring.head % LOG_RING_SLOTS];
+
+    memcpy(s->msg, slot.msg, slot.len);
+    s->len = slot.len;
+    if (ring.head++ == ring.tail) {
+      g_cond_signal(&ring.data_cond);
+    }
+  }
+  g_mutex_unlock(&ring.lock);
+}
@@ -0,0 +1,97 @@
+#ifndef LOG_H__
+#define LOG_H__
+/*
+ * log.h - Leveled, per-category logging
+ *
+ * Messages above LOG_COMPILE_LEVEL (set by the meson log_level option) are
+ * compiled out completely, their arguments are never evaluated. Enabled
+ * messages are formatted by the caller and queued in a ring buffer, which
+ * a writer thread drains to stderr. If the ring is full the message is
+ * dropped and counted rather than blocking the parser.
+ */
+#include <glib.h>
+
+#define LOG_LEVEL_ERROR            0
+#define LOG_LEVEL_WARNING          1
+#define LOG_LEVEL_INFO             2
+#define LOG_LEVEL_DEBUG            3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL          LOG_LEVEL_DEBUG
+#endif
+
+enum log_category {
+  LOG_CAT_GENERAL = 0,
+  LOG_CAT_SPLITTER,
+  LOG_CAT_CLASSIFIER,
+  LOG_CAT_DETAILS,
+  LOG_CAT_OUTPUT,
+  LOG_CAT_COUNT,
+};
+
+#define LOG_CAT_ALL                ((1u << LOG_CAT_COUNT) - 1)
+
+/* Runtime filter, only written before log_init() */
+extern gint log_level;
+extern guint log_categories;
+
+/* Errors are never filtered by category */
+#define log_enabled(level, cat)                                   \
+  ((level) <= log_level &&                                        \
+   ((level) == LOG_LEVEL_ERROR || (log_categories & (1u << (cat)))))
+
+#define LOG_AT(level, cat, ...)                   \
+  G_STMT_START {                                  \
+    if (log_enabled(level, cat)) {                \
+      log_write(level, cat, __VA_ARGS__);         \
+    }                                             \
+  } G_STMT_END
+
+/* Never executed and removed by the compiler, but still type checked */
+#define LOG_ELIDED(level, cat, ...)               \
+  G_STMT_START {                                  \
+    if (0) {                                      \
+      log_write(level, cat, __VA_ARGS__);         \
+    }                                             \
+  } G_STMT_END
+
+#define log_error(cat, ...)        LOG_AT(LOG_LEVEL_ERROR, cat, __VA_ARGS__)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARNING
+#define log_warning(cat, ...)      LOG_AT(LOG_LEVEL_WARNING, cat, __VA_ARGS__)
+#else
+#define log_warning(cat, ...) \
+  LOG_ELIDED(LOG_LEVEL_WARNING, cat, __VA_ARGS__)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define log_info(cat, ...)         LOG_AT(LOG_LEVEL_INFO, cat, __VA_ARGS__)
+#else
+#define log_info(cat, ...) \
+  LOG_ELIDED(LOG_LEVEL_INFO, cat, __VA_ARGS__)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(cat, ...)        LOG_AT(LOG_LEVEL_DEBUG, cat, __VA_ARGS__)
+#else
+#define log_debug(cat, ...) \
+  LOG_ELIDED(LOG_LEVEL_DEBUG, cat, __VA_ARGS__)
+#endif
+
+/* Parse a comma separated list of category names into a mask */
+gboolean
+log_parse_categories(const gchar *str, guint *mask, GError **err);
+
+/* Start the writer thread. Until then messages are written directly */
+void
+log_init(void);
+
+/* Flush everything queued and stop the writer thread */
+void
+log_shutdown(void);
+
+void
+log_write(gint level, enum log_category cat, const gchar *fmt, ...)
+  G_GNUC_PRINTF(3, 4);
+
+#endif /* LOG_H__ */
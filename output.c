@@ -0,0 +1,206 @@
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "debug.h"
+#include "output.h"
+
+DEFINE_GQUARK("amex_parser");
+
+struct output *
+output_open(const gchar *path, GError **err)
+{
+  struct output *out;
+
+  g_assert(path);
+
+  out = g_new0(struct output, 1);
+
+  if (!g_strcmp0(path, OUTPUT_STDOUT)) {
+    out->fd = STDOUT_FILENO;
+    out->path = g_strdup("standard output");
+    return out;
+  }
+
+  out->path = g_strdup(path);
+  out->tmp_path = g_strconcat(path, ".XXXXXX", NULL);
+  if ((out->fd = g_mkstemp_full(out->tmp_path, O_WRONLY | O_CLOEXEC,
+                                0666)) < 0) {
+    SET_GERROR(err, -1, "could not create '%s': %s", out->path,
+               g_strerror(errno));
+    g_free(out->tmp_path);
+    g_free(out->path);
+    g_free(out);
+    return NULL;
+  }
+
+  return out;
+}
+
+struct output *
+output_new_gstring(GString *gs)
+{
+  struct output *out;
+
+  g_assert(gs);
+
+  out = g_new0(struct output, 1);
+  out->fd = -1;
+  out->gs = gs;
+
+  return out;
+}
+
+/* Write all of iov, returns FALSE and sets out->err on failure */
+static gboolean
+output_writev(struct output *out, struct iovec *iov, gint n)
+{
+  while (n) {
+    ssize_t ret = writev(out->fd, iov, n);
+
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      SET_GERROR(&out->err, -1, "could not write to '%s': %s", out->path,
+                 g_strerror(errno));
+      return FALSE;
+    }
+
+    out->written += ret;
+    /* Skip what was written, usually all of it */
+    for (; n && (gsize) ret >= iov->iov_len; iov++, n--) {
+      ret -= iov->iov_len;
+    }
+    if (n) {
+      iov->iov_base = (gchar *) iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+
+  return TRUE;
+}
+
+void
+output_flush(struct output *out)
+{
+  struct iovec iov = { out->buf, out->len };
+
+  g_assert(out);
+
+  if (!out->len) {
+    return;
+  }
+
+  if (out->gs) {
+    g_string_append_len(out->gs, out->buf, out->len);
+    out->written += out->len;
+  } else if (!out->err) {
+    output_writev(out, &iov, 1);
+  }
+  out->len = 0;
+}
+
+void
+output_write(struct output *out, const gchar *data, gsize len)
+{
+  struct iovec iov[2];
+
+  g_assert(out);
+  g_assert(data || !len);
+
+  if (G_LIKELY(len <= OUTPUT_BUF_SIZE - out->len)) {
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return;
+  } else if (len < OUTPUT_BUF_SIZE) {
+    output_flush(out);
+    memcpy(out->buf, data, len);
+    out->len = len;
+    return;
+  }
+
+  /* Too large to buffer, write it along with what is buffered */
+  if (out->gs) {
+    output_flush(out);
+    g_string_append_len(out->gs, data, len);
+    out->written += len;
+    return;
+  }
+
+  iov[0].iov_base = out->buf;
+  iov[0].iov_len = out->len;
+  iov[1].iov_base = (gchar *) data;
+  iov[1].iov_len = len;
+  if (!out->err) {
+    output_writev(out, iov, 2);
+  }
+  out->len = 0;
+}
+
+static void
+output_free(struct output *out)
+{
+  g_clear_error(&out->err);
+  g_free(out->tmp_path);
+  g_free(out->path);
+  g_free(out);
+}
+
+gboolean
+output_close(struct output *out, GError **err)
+{
+  gboolean ret = FALSE;
+
+  g_assert(out);
+
+  output_flush(out);
+
+  if (out->tmp_path) {
+    /* Like g_file_set_contents(), only a file being replaced is synced */
+    if (!out->err && g_file_test(out->path, G_FILE_TEST_EXISTS) &&
+        fsync(out->fd) < 0) {
+      SET_GERROR(&out->err, -1, "could not write to '%s': %s", out->path,
+                 g_strerror(errno));
+    }
+    if (close(out->fd) < 0 && !out->err) {
+      SET_GERROR(&out->err, -1, "could not write to '%s': %s", out->path,
+                 g_strerror(errno));
+    }
+    if (!out->err && rename(out->tmp_path, out->path) < 0) {
+      SET_GERROR(&out->err, -1, "could not rename '%s' to '%s': %s",
+                 out->tmp_path, out->path, g_strerror(errno));
+    }
+    if (out->err) {
+      unlink(out->tmp_path);
+    }
+  }
+
+  if (out->err) {
+    g_propagate_error(err, out->err);
+    out->err = NULL;
+    goto out;
+  }
+
+  ret = TRUE;
+  /* fall through */
+out:
+  output_free(out);
+
+  return ret;
+}
+
+void
+output_abort(struct output *out)
+{
+  g_assert(out);
+
+  if (out->tmp_path) {
+    close(out->fd);
+    unlink(out->tmp_path);
+  }
+  output_free(out);
+}
@@ -0,0 +1,95 @@
+#ifndef OUTPUT_H__
+#define OUTPUT_H__
+/*
+ * output.h - Buffered output to a file, standard output or a GString
+ *
+ * Writes are collected in a fixed buffer and handed to the kernel in large
+ * write()/writev() calls, so the memory used stays the same however much is
+ * written. Files are written under a temporary name and renamed into place
+ * when closed, readers never see half a file. The first error is kept and
+ * reported by output_close(), writing after an error is a no-op.
+ */
+#include <glib.h>
+#include <string.h>
+
+/* Also the most output_reserve() hands out at once */
+#define OUTPUT_BUF_SIZE            (64 * 1024)
+/* Filename meaning standard output */
+#define OUTPUT_STDOUT              "-"
+
+struct output {
+  gint fd;
+  /* Appended to instead of a file if not NULL */
+  GString *gs;
+  /* For messages, and the name the temporary file is renamed to */
+  gchar *path;
+  gchar *tmp_path;
+  guint64 written;
+  GError *err;
+  gsize len;
+  gchar buf[OUTPUT_BUF_SIZE];
+};
+
+/* Creates the file, or "-" for standard output */
+struct output *
+output_open(const gchar *path, GError **err);
+
+/* Output appended to gs, can't fail */
+struct output *
+output_new_gstring(GString *gs);
+
+/* Flush, rename a file into place and free, FALSE if anything failed */
+gboolean
+output_close(struct output *out, GError **err);
+
+/* Drop a file written so far, and free */
+void
+output_abort(struct output *out);
+
+void
+output_flush(struct output *out);
+
+/* Writes larger than the buffer skip it */
+void
+output_write(struct output *out, const gchar *data, gsize len);
+
+/* Bytes written so far, including those still buffered */
+static inline guint64
+output_written(const struct output *out)
+{
+  return out->written + out->len;
+}
+
+/* Room for at least len bytes, to format in place and output_commit() */
+static inline gchar *
+output_reserve(struct output *out, gsize len)
+{
+  g_assert(len <= OUTPUT_BUF_SIZE);
+
+  if (G_UNLIKELY(len > OUTPUT_BUF_SIZE - out->len)) {
+    output_flush(out);
+  }
+
+  return out->buf + out->len;
+}
+
+static inline void
+output_commit(struct output *out, gsize len)
+{
+  out->len += len;
+}
+
+static inline void
+output_putc(struct output *out, gchar c)
+{
+  *output_reserve(out, 1) = c;
+  out->len++;
+}
+
+static inline void
+output_puts(struct output *out, const gchar *str)
+{
+  output_write(out, str, strlen(str));
+}
+
+#endif /* OUTPUT_H__ */
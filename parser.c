@@ -0,0 +1,1148 @@
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "amexparser.h"
+#include "arena.h"
+#include "hash.h"
+#include "intern.h"
+#include "log.h"
+#include "output.h"
+#include "splitter.h"
+
+#define SWE_LOWER_OE       "\xc3\xb6"
+#define SWE_LOWER_AO       "\xc3\xa5"
+
+#define CARD_IDSTR_BEGIN_PFX       "Nya k"SWE_LOWER_OE"p f"SWE_LOWER_OE"r "
+#define CARD_IDSTR_END_PFX         "Summa nya k"SWE_LOWER_OE"p för "
+#define INBET_IDSTR_PFX            " Inbetalningar"
+#define EXTRAKORT_PFX              "Extrakort som slutar p"SWE_LOWER_AO" "
+#define OCR_IDSTR                  "OCR: "
+#define DUE_DATE_IDSTR             "F"SWE_LOWER_OE"rfallodag"
+
+#define DT_STR_LEN                 16
+#define DATE_STR_LEN               9
+
+/* Bump when the layout of cached statements changes */
+#define CACHE_FORMAT_VERSION       1
+/* Bump whenever the same input parses differently, so cached statements
+ * parsed by older code are not served. 2: gutters far from the usual
+ * column split are ignored, 3: no fuzzy location matches below 6 letters,
+ * 4: amounts with misplaced thousand separators are rejected */
+#define PARSER_LOGIC_VERSION       4
+/* Length written for NULL strings in cached statements */
+#define CACHE_NULL_STR             G_MAXUINT32
+
+struct amex_parser {
+  struct amex_parser_options opts;
+  struct location_index *locs;
+  /* Part of every cache key, see location_index_version() */
+  guint64 locs_version;
+  /* Details of the transactions seen so far, for all statements parsed */
+  struct intern_table *interned;
+  gint ref_count;
+};
+
+struct amex_statement {
+  gchar *filename;
+  GPtrArray *cards;
+  gchar *ocr;
+  amex_date due_date;
+  struct statistics stats;
+  /* Everything above is allocated from the arena, points into the input or
+   * into the interned details */
+  struct arena arena;
+  struct intern_table *interned;
+  struct line_source input;
+  GArray *lines;
+  /* Details of a new description, until the intern table copies them */
+  GByteArray *scratch;
+};
+
+/* Working state of a single parse */
+struct parse_state {
+  const struct amex_parser *parser;
+  struct amex_statement *st;
+  struct amex_card *curr_card;
+  guint idx;
+};
+
+enum line_kind {
+  LINE_OTHER = 0,
+  LINE_CARD_BEGIN,
+  LINE_CARD_END,
+  LINE_TRANSACTION,
+  LINE_OCR,
+  LINE_DUE_DATE,
+};
+
+/* Lines are counted per kind */
+G_STATIC_ASSERT(STATS_LINES_OTHER + LINE_DUE_DATE == STATS_LINES_DUE_DATE);
+
+struct line_info {
+  enum line_kind kind;
+  /* Text following the identifying prefix (or the dates) */
+  const gchar *payload;
+  amex_date date;
+  amex_date process_date;
+};
+
+DEFINE_GQUARK("amex_parser");
+
+/* The same domain as the errors set by SET_GERROR */
+G_DEFINE_QUARK(amex_parser, amex_parser_error)
+
+static const gchar *
+format_dt(amex_date dt, gchar *buffer, gsize len)
+{
+  if (dt == AMEX_DATE_INVALID || len <= AMEX_DATE_ISO_LEN) {
+    g_snprintf(buffer, len, "<invalid>");
+    return buffer;
+  }
+
+  buffer[amex_date_format_iso(dt, buffer)] = '\0';
+
+  return buffer;
+}
+
+static const gchar *
+format_amount(amex_amount amount, gchar *buffer)
+{
+  buffer[amex_amount_format(amount, buffer)] = '\0';
+
+  return buffer;
+}
+
+static void
+free_amex_card(gpointer data)
+{
+  struct amex_card *card = (struct amex_card *) data;
+
+  if (!card) {
+    return;
+  }
+
+  /* The card itself and its transactions live in the statement arena */
+  if (card->transactions) {
+    g_ptr_array_free(card->transactions, TRUE);
+  }
+}
+
+const gchar *
+amex_card_format(const struct amex_card *card, gchar *buffer, gsize len)
+{
+  gchar suffix_str[32] = "";
+
+  if (!card || !card->holder) {
+    return "<invalid card>";
+  }
+
+  if (card->suffix) {
+    g_snprintf(suffix_str, sizeof(suffix_str), "-%s", card->suffix);
+  }
+
+  g_snprintf(buffer, len, "%s%s",
+             card->holder, suffix_str);
+
+  return buffer;
+}
+
+static struct amex_card *
+alloc_amex_card(struct arena *arena, const gchar *holder, const gchar *suffix)
+{
+  struct amex_card *card;
+
+  g_assert(arena);
+  g_assert(holder);
+
+  card = arena_new0(arena, struct amex_card);
+  card->holder = arena_strdup(arena, holder);
+  card->suffix = arena_strdup(arena, suffix);
+  card->transactions = g_ptr_array_new();
+  log_info(LOG_CAT_CLASSIFIER, "Allocated new %sAmex card %s for %s",
+           card->suffix ? "Extra " : "",
+           card->suffix ? card->suffix : "", card->holder);
+
+  return card;
+}
+
+static gboolean
+handle_card_change(struct parse_state *state, const gchar *holder,
+                   GError **err)
+{
+  GPtrArray *cards = state->st->cards;
+  guint i;
+  gchar *hldr_str = g_strdup(holder);
+  gchar *eptr = g_strstr_len(hldr_str, -1, EXTRAKORT_PFX);
+  gchar *suffix = NULL;
+
+  if (eptr) {
+    *eptr = '\0';
+    suffix = g_strstrip(eptr + strlen(EXTRAKORT_PFX));
+  }
+
+  g_strstrip(hldr_str);
+
+  for (i = 0; i < cards->len; i++) {
+    struct amex_card *c = g_ptr_array_index(cards, i);
+
+    if (!g_strcmp0(c->holder, hldr_str)) {
+      if (!suffix || !g_strcmp0(suffix, c->suffix)) {
+        gchar cbuf[AMEX_CARD_STR_LEN];
+
+        log_debug(LOG_CAT_CLASSIFIER, "Using existing card '%s'",
+                  amex_card_format(c, cbuf, sizeof(cbuf)));
+        state->curr_card = c;
+        goto out;
+      }
+    }
+  }
+
+  /* New card */
+  state->curr_card = alloc_amex_card(&state->st->arena, g_strstrip(hldr_str),
+                                     suffix);
+  g_ptr_array_add(cards, state->curr_card);
+  /* fall through */
+
+out:
+  g_free(hldr_str);
+
+  return TRUE;
+}
+
+static gboolean
+parse_amex_date(const gchar *str, amex_date *result, GError **err)
+{
+  g_assert(str);
+  g_assert(result);
+
+  /* Amex date format is DD.MM.YY */
+  if (strlen(str) < AMEX_DATE_STR_LEN) {
+    SET_GERROR(err, -1, "invalid date format, too short");
+    return FALSE;
+  }
+
+  if (!amex_date_parse(str, result)) {
+    /* Not a valid date */
+    SET_GERROR(err, -1, "could not parse date");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+#define HAS_PREFIX(v, pfx) \
+  ((v)->len >= sizeof(pfx) - 1 && !memcmp((v)->str, pfx, sizeof(pfx) - 1))
+
+/*
+ * Decide what kind of line this is in a single look at it. The first byte
+ * picks the only candidate, which is then verified. Transactions start with
+ * two dates, 08.06.21 08.06.21, which are parsed here once and passed on.
+ */
+static enum line_kind
+classify_line(const struct line_view *line, struct line_info *info)
+{
+  g_assert(line);
+  g_assert(info);
+
+  info->kind = LINE_OTHER;
+  info->payload = NULL;
+
+  switch (line->str[0]) {
+  case '0': case '1': case '2': case '3':
+    if (line->len >= DATE_STR_LEN * 2 &&
+        amex_date_parse(line->str, &info->date) &&
+        amex_date_parse(line->str + DATE_STR_LEN, &info->process_date)) {
+      info->kind = LINE_TRANSACTION;
+      info->payload = line->str + DATE_STR_LEN * 2;
+    }
+    break;
+  case 'N':
+    if (HAS_PREFIX(line, CARD_IDSTR_BEGIN_PFX)) {
+      info->kind = LINE_CARD_BEGIN;
+      info->payload = line->str + strlen(CARD_IDSTR_BEGIN_PFX);
+    }
+    break;
+  case 'S':
+    if (HAS_PREFIX(line, CARD_IDSTR_END_PFX)) {
+      info->kind = LINE_CARD_END;
+      info->payload = line->str + strlen(CARD_IDSTR_END_PFX);
+    }
+    break;
+  case 'O':
+    if (HAS_PREFIX(line, OCR_IDSTR)) {
+      info->kind = LINE_OCR;
+      info->payload = line->str + strlen(OCR_IDSTR);
+    }
+    break;
+  case 'F':
+    if (HAS_PREFIX(line, DUE_DATE_IDSTR)) {
+      info->kind = LINE_DUE_DATE;
+      info->payload = line->str + strlen(DUE_DATE_IDSTR);
+    }
+    break;
+  default:
+    break;
+  }
+
+  return info->kind;
+}
+
+static gboolean
+parse_transaction_amount(const gchar *str, amex_amount *result, GError **err)
+{
+  gsize len;
+
+  g_assert(str);
+  g_assert(result);
+
+  /* The amount is the last token, it ends at the first space (if any) */
+  len = strcspn(str, " ");
+  if (!amex_amount_parse(str, len, result)) {
+    SET_GERROR(err, -1, "value '%.*s' is malformed", (gint) len, str);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* The description without the match into details (len + 1 bytes),
+ * collapsing spaces */
+static const gchar *
+normalize_details(gchar *details, const gchar *str, gsize len,
+                  const struct location_match *match)
+{
+  const gchar *c;
+  gchar *d = details;
+
+  for (c = str; c < str + len; c++) {
+    gsize off = c - str;
+
+    if (match->kind != LOCATION_MATCH_NONE && off >= match->start &&
+        off < match->end) {
+      continue;
+    } else if (*c == ' ' && (d == details || d[-1] == ' ')) {
+      continue;
+    }
+    *d++ = *c;
+  }
+  if (d > details && d[-1] == ' ') {
+    d--;
+  }
+  /* The location was all there was, keep it as the description as well */
+  if (d == details) {
+    memcpy(details, str, len);
+    d = details + len;
+  }
+  *d = '\0';
+
+  return details;
+}
+
+/*
+ * Details of a description not seen before, written to buf which holds
+ * 2 * (len + 1) bytes
+ */
+static void
+describe_details(gchar *buf, struct location_index *locs, const gchar *str,
+                 gsize len, struct intern_details *value)
+{
+  static const struct location_match no_match = { LOCATION_MATCH_NONE, };
+  struct location_match match = { LOCATION_MATCH_NONE, };
+
+  if (!memchr(str, ' ', len)) {
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    value->details = value->plain = buf;
+    value->location = NULL;
+    value->kind = LOCATION_MATCH_NONE;
+    return;
+  }
+
+  /* Also when the location is on the next line, the description may turn up
+   * again without it */
+  if (location_index_match(locs, str, len, &match) &&
+      match.kind == LOCATION_MATCH_FUZZY) {
+    log_debug(LOG_CAT_DETAILS,
+              "Fuzzy location '%s' for '%.*s' (distance %u)", match.location,
+              (gint) (match.end - match.start), str + match.start,
+              match.distance);
+  }
+  value->details = normalize_details(buf, str, len, &match);
+  value->plain = match.kind == LOCATION_MATCH_NONE ? value->details :
+                 normalize_details(buf + len + 1, str, len, &no_match);
+  value->location = match.location;
+  value->kind = match.kind;
+}
+
+static gboolean
+parse_transaction_details(struct parse_state *state, const gchar *str,
+                          gsize len, struct amex_transaction *t,
+                          GError **err)
+{
+  const struct intern_details *value;
+  struct intern_details computed;
+  struct location_index *locs;
+  struct amex_statement *st;
+  const gchar *loc_str = NULL;
+  const gchar *begin = str;
+  const gchar *end = str + len;
+
+  g_assert(state);
+  g_assert(str);
+  g_assert(t);
+
+  locs = state->parser->locs;
+  st = state->st;
+
+  while (begin < end && g_ascii_isspace(*begin)) {
+    begin++;
+  }
+  while (end > begin && g_ascii_isspace(end[-1])) {
+    end--;
+  }
+
+  /* Algorithm is as follows:
+   *  - Take the following line and check against the location index. If a
+   *    match is made, then use this as the location, the line as the details.
+   *  - If no match, search the line itself for a known location (exact words
+   *    first, then a misspelt trailing one) and cut it out of the details.
+   * The line itself is only looked at the first time it is seen.
+   */
+  if (state->idx + 1 < st->lines->len) {
+    const struct line_view *next = &g_array_index(st->lines,
+                                                  struct line_view,
+                                                  state->idx + 1);
+
+    if ((loc_str = location_index_lookup(locs, next->str,
+                                         next->len)) != NULL) {
+      /* Got a location match! Nice! */
+      state->idx++;
+    }
+  }
+
+  if ((value = intern_table_lookup(st->interned, begin,
+                                   end - begin)) != NULL) {
+    stats_add(&st->stats, STATS_DETAILS_INTERNED, 1);
+  } else {
+    gchar *scratch;
+
+    g_byte_array_set_size(st->scratch, 2 * (end - begin + 1));
+    scratch = (gchar *) st->scratch->data;
+    describe_details(scratch, locs, begin, end - begin, &computed);
+    /* The statement keeps its own copy only if the table is full */
+    if ((value = intern_table_insert(st->interned, begin, end - begin,
+                                     &computed)) == NULL) {
+      computed.details = arena_strdup(&st->arena, scratch);
+      computed.plain = computed.plain == scratch ? computed.details :
+                       arena_strdup(&st->arena, computed.plain);
+      value = &computed;
+    }
+  }
+
+  if (!memchr(begin, ' ', end - begin)) {
+    log_warning(LOG_CAT_DETAILS, "L%d: Very weird line with no spaces (%s)",
+                state->idx, value->details);
+  } else {
+    log_debug(LOG_CAT_DETAILS, "Remaining line: '%.*s'",
+              (gint) (end - begin), begin);
+  }
+
+  if (loc_str) {
+    t->details = value->plain;
+    t->location = loc_str;
+    stats_add(&st->stats, STATS_LOCATION_NEXT_LINE, 1);
+    return TRUE;
+  }
+
+  t->details = value->details;
+  t->location = value->location;
+  switch (value->kind) {
+  case LOCATION_MATCH_EXACT:
+    stats_add(&st->stats, STATS_LOCATION_EXACT, 1);
+    break;
+  case LOCATION_MATCH_FUZZY:
+    stats_add(&st->stats, STATS_LOCATION_FUZZY, 1);
+    break;
+  default:
+    stats_add(&st->stats, STATS_LOCATION_MISS, 1);
+    break;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+process_transaction_line(struct parse_state *state,
+                         const struct line_info *info, GError **err)
+{
+  struct amex_transaction *t;
+  gchar dbuf[DT_STR_LEN];
+  gchar abuf[AMEX_AMOUNT_STR_LEN];
+  const gchar *details;
+  const gchar *tmp;
+  gint64 start;
+
+  g_assert(state);
+  g_assert(info);
+  g_assert(info->kind == LINE_TRANSACTION);
+
+  if (!state->curr_card) {
+    /* This should probably be an error ... */
+    log_warning(LOG_CAT_CLASSIFIER, "Transaction without a current card!");
+    return TRUE;
+  }
+
+  start = stats_clock(&state->st->stats);
+  t = arena_new0(&state->st->arena, struct amex_transaction);
+  t->date = info->date;
+  t->process_date = info->process_date;
+  details = info->payload;
+
+  /* Get the value of the transaction */
+  if ((tmp = strrchr(details, ' ')) == NULL) {
+    SET_GERROR(err, -1, "malformed line, missing amount separator");
+    goto out_fail;
+  }
+
+  /* Parse the value */
+  if (!parse_transaction_amount(tmp + 1, &t->amount, err)) {
+    g_prefix_error(err, "process amount: ");
+    goto out_fail;
+  }
+
+  /* Everything before the amount part */
+  if (!parse_transaction_details(state, details, tmp - details, t, err)) {
+    g_prefix_error(err, "parse details: ");
+    goto out_fail;
+  }
+  stats_time(&state->st->stats, STATS_TIME_DETAILS, start);
+
+  log_debug(LOG_CAT_DETAILS,
+            "Transaction for '%s', location=%s on %s for %s SEK, details: '%s'",
+            state->curr_card->holder,
+            t->location ? t->location : "unknown",
+            format_dt(t->date, dbuf, sizeof(dbuf)),
+            format_amount(t->amount, abuf), t->details);
+
+  g_ptr_array_add(state->curr_card->transactions, t);
+  stats_add(&state->st->stats, STATS_TRANSACTIONS, 1);
+
+  return TRUE;
+
+out_fail:
+  /* The transaction itself is reclaimed with the arena */
+  return FALSE;
+}
+
+static gboolean
+process_line(struct parse_state *state, const struct line_view *line,
+             GError **err)
+{
+  struct amex_statement *st;
+  struct line_info info;
+
+  g_assert(state);
+  g_assert(line);
+
+  st = state->st;
+
+  classify_line(line, &info);
+  stats_add(&st->stats, STATS_LINES_OTHER + info.kind, 1);
+
+  switch (info.kind) {
+  case LINE_CARD_BEGIN:
+    if (!handle_card_change(state, info.payload, err)) {
+      goto out_fail;
+    }
+    return TRUE;
+  case LINE_CARD_END:
+    if (!state->curr_card) {
+      SET_GERROR(err, -1, "got card end, but no current card!");
+      goto out_fail;
+    }
+    log_info(LOG_CAT_CLASSIFIER,
+             "Closed session for card '%s', %u transactions to date",
+             state->curr_card->holder, state->curr_card->transactions->len);
+    state->curr_card = NULL;
+    return TRUE;
+  case LINE_TRANSACTION:
+    if (!process_transaction_line(state, &info, err)) {
+      goto out_fail;
+    }
+    return TRUE;
+  case LINE_OCR:
+    if (st->ocr) {
+      break;
+    }
+    st->ocr = arena_strdup(&st->arena, info.payload);
+    return TRUE;
+  case LINE_DUE_DATE: {
+    GError *lerr = NULL;
+
+    while (g_ascii_isspace(*info.payload)) {
+      info.payload++;
+    }
+    if (!parse_amex_date(info.payload, &st->due_date, &lerr)) {
+      log_warning(LOG_CAT_CLASSIFIER, "Could not extract due date: %s",
+                  GERROR_MSG(lerr));
+    }
+    g_clear_error(&lerr);
+    return TRUE;
+  }
+  case LINE_OTHER:
+    break;
+  }
+
+  /* We don't know what to do with this line */
+  log_debug(LOG_CAT_CLASSIFIER, "Discarding unsupported line '%s'",
+            line->str);
+
+  return TRUE;
+
+out_fail:
+  log_error(LOG_CAT_CLASSIFIER, "Offending line %u: %s",
+            state->idx, line->str);
+
+  return FALSE;
+}
+
+static gboolean
+process_transactions(struct parse_state *state, GError **err)
+{
+  struct statistics *stats;
+  GArray *lines;
+  gboolean ret = TRUE;
+  gint64 details;
+  gint64 start;
+
+  g_assert(state);
+
+  stats = &state->st->stats;
+  lines = state->st->lines;
+  details = stats->ns[STATS_TIME_DETAILS];
+  start = stats_clock(stats);
+
+  for (state->idx = 0; state->idx < lines->len; state->idx++) {
+    const struct line_view *line = &g_array_index(lines, struct line_view,
+                                                  state->idx);
+
+    if (!process_line(state, line, err)) {
+      ret = FALSE;
+      break;
+    }
+    stats_add(stats, STATS_LINES, 1);
+  }
+
+  /* Details are timed per transaction, classifying is everything else */
+  stats_time(stats, STATS_TIME_CLASSIFY, start);
+  stats->ns[STATS_TIME_CLASSIFY] -= stats->ns[STATS_TIME_DETAILS] - details;
+
+  if (ret) {
+    log_info(LOG_CAT_CLASSIFIER, "Processed %u card(s)..",
+             state->st->cards->len);
+  }
+
+  return ret;
+}
+
+static void
+init_parse_state(struct parse_state *state, const struct amex_parser *parser,
+                 struct amex_statement *st)
+{
+  g_assert(state);
+  g_assert(parser);
+  g_assert(st);
+
+  memset(state, 0, sizeof(*state));
+  state->parser = parser;
+  state->st = st;
+}
+
+static struct amex_statement *
+statement_new(const struct amex_parser *parser, const gchar *filename)
+{
+  struct amex_statement *st;
+
+  g_assert(parser);
+  g_assert(filename);
+
+  st = g_new0(struct amex_statement, 1);
+  st->filename = g_strdup(filename);
+  st->lines = g_array_new(FALSE, FALSE, sizeof(struct line_view));
+  st->cards = g_ptr_array_new_with_free_func(free_amex_card);
+  st->stats.timing = parser->opts.timing;
+  arena_init(&st->arena);
+  st->input.arena = &st->arena;
+  st->input.stats = &st->stats;
+  st->input.jobs = parser->opts.split_jobs;
+  st->interned = intern_table_ref(parser->interned);
+  st->scratch = g_byte_array_new();
+
+  return st;
+}
+
+/* Map the statement and split it into lines */
+static gboolean
+split_statement(const struct amex_parser *parser, struct amex_statement *st,
+                GError **err)
+{
+  g_assert(parser);
+  g_assert(st);
+
+  return split_lines_file(st->filename, parser->opts.split_width,
+                          &st->input, st->lines, err);
+}
+
+/*
+ * Cached statements are stored in host byte order, the cache is local.
+ * Strings are written as their length followed by the bytes.
+ */
+static void
+append_cache_u32(GString *gs, guint32 v)
+{
+  g_string_append_len(gs, (const gchar *) &v, sizeof(v));
+}
+
+static void
+append_cache_str(GString *gs, const gchar *str)
+{
+  guint32 len = str ? strlen(str) : CACHE_NULL_STR;
+
+  append_cache_u32(gs, len);
+  if (str) {
+    g_string_append_len(gs, str, len);
+  }
+}
+
+static void
+serialize_statement(const struct amex_statement *st, GString *gs)
+{
+  guint i;
+  guint j;
+
+  append_cache_u32(gs, st->cards->len);
+  append_cache_str(gs, st->ocr);
+  append_cache_u32(gs, st->due_date);
+
+  for (i = 0; i < st->cards->len; i++) {
+    const struct amex_card *card = g_ptr_array_index(st->cards, i);
+
+    append_cache_str(gs, card->holder);
+    append_cache_str(gs, card->suffix);
+    append_cache_u32(gs, card->transactions->len);
+
+    for (j = 0; j < card->transactions->len; j++) {
+      const struct amex_transaction *t =
+        g_ptr_array_index(card->transactions, j);
+
+      append_cache_u32(gs, t->date);
+      append_cache_u32(gs, t->process_date);
+      g_string_append_len(gs, (const gchar *) &t->amount, sizeof(t->amount));
+      append_cache_str(gs, t->location);
+      append_cache_str(gs, t->details);
+    }
+  }
+}
+
+/* Reads fail once past the end, so a damaged entry is never overrun */
+struct cache_reader {
+  const gchar *p;
+  const gchar *end;
+};
+
+static gboolean
+read_cache_bytes(struct cache_reader *r, gpointer dest, gsize len)
+{
+  if ((gsize) (r->end - r->p) < len) {
+    return FALSE;
+  }
+  memcpy(dest, r->p, len);
+  r->p += len;
+
+  return TRUE;
+}
+
+static gboolean
+read_cache_str(struct cache_reader *r, struct arena *arena, gchar **str)
+{
+  guint32 len;
+
+  if (!read_cache_bytes(r, &len, sizeof(len))) {
+    return FALSE;
+  } else if (len == CACHE_NULL_STR) {
+    *str = NULL;
+    return TRUE;
+  } else if ((gsize) (r->end - r->p) < len) {
+    return FALSE;
+  }
+
+  *str = arena_strndup(arena, r->p, len);
+  r->p += len;
+
+  return TRUE;
+}
+
+static gboolean
+deserialize_statement(struct amex_statement *st, const gchar *data, gsize len)
+{
+  struct cache_reader r = { data, data + len };
+  guint32 n_cards;
+  guint32 i;
+
+  if (!read_cache_bytes(&r, &n_cards, sizeof(n_cards)) ||
+      !read_cache_str(&r, &st->arena, &st->ocr) ||
+      !read_cache_bytes(&r, &st->due_date, sizeof(st->due_date))) {
+    return FALSE;
+  }
+
+  for (i = 0; i < n_cards; i++) {
+    struct amex_card *card = arena_new0(&st->arena, struct amex_card);
+    guint32 n_transactions;
+    guint32 j;
+
+    card->transactions = g_ptr_array_new();
+    g_ptr_array_add(st->cards, card);
+    if (!read_cache_str(&r, &st->arena, &card->holder) || !card->holder ||
+        !read_cache_str(&r, &st->arena, &card->suffix) ||
+        !read_cache_bytes(&r, &n_transactions, sizeof(n_transactions))) {
+      return FALSE;
+    }
+
+    for (j = 0; j < n_transactions; j++) {
+      struct amex_transaction *t = arena_new0(&st->arena,
+                                              struct amex_transaction);
+      gchar *location;
+      gchar *details;
+
+      if (!read_cache_bytes(&r, &t->date, sizeof(t->date)) ||
+          !read_cache_bytes(&r, &t->process_date, sizeof(t->process_date)) ||
+          !read_cache_bytes(&r, &t->amount, sizeof(t->amount)) ||
+          !read_cache_str(&r, &st->arena, &location) ||
+          !read_cache_str(&r, &st->arena, &details) || !details) {
+        return FALSE;
+      }
+      t->location = location;
+      t->details = details;
+      g_ptr_array_add(card->transactions, t);
+    }
+    stats_add(&st->stats, STATS_TRANSACTIONS, n_transactions);
+  }
+
+  return r.p == r.end;
+}
+
+/* Over the input as mapped, before splitting changes it */
+static guint64
+statement_cache_key(const struct amex_parser *parser,
+                    const struct amex_statement *st)
+{
+  guint64 k[4];
+
+  k[0] = hash_xxh64(g_mapped_file_get_contents(st->input.map),
+                    g_mapped_file_get_length(st->input.map), 0);
+  k[1] = parser->opts.split_width;
+  k[2] = CACHE_FORMAT_VERSION;
+  k[3] = PARSER_LOGIC_VERSION;
+
+  return hash_xxh64(k, sizeof(k), parser->locs_version);
+}
+
+static gboolean
+load_cached_statement(const struct amex_parser *parser,
+                      struct amex_statement *st, guint64 key)
+{
+  gchar *data;
+  gsize len;
+
+  if ((data = amex_cache_lookup(parser->opts.cache, parser->locs_version,
+                                key, &len)) == NULL) {
+    return FALSE;
+  }
+
+  if (!deserialize_statement(st, data, len)) {
+    log_warning(LOG_CAT_GENERAL, "Ignoring damaged cache entry for '%s'",
+                st->filename);
+    g_free(data);
+    /* Start over, parsing it */
+    g_ptr_array_set_size(st->cards, 0);
+    st->ocr = NULL;
+    st->due_date = AMEX_DATE_INVALID;
+    st->stats.count[STATS_TRANSACTIONS] = 0;
+    return FALSE;
+  }
+  g_free(data);
+
+  log_info(LOG_CAT_GENERAL, "Read %u card(s) for '%s' from the cache",
+           st->cards->len, st->filename);
+
+  return TRUE;
+}
+
+static void
+store_cached_statement(const struct amex_parser *parser,
+                       const struct amex_statement *st, guint64 key)
+{
+  GError *err = NULL;
+  GString *gs;
+
+  gs = g_string_new(NULL);
+  serialize_statement(st, gs);
+
+  /* The statement was parsed fine, a cache that can't be written isn't fatal */
+  if (!amex_cache_store(parser->opts.cache, parser->locs_version, key,
+                        gs->str, gs->len, &err)) {
+    log_warning(LOG_CAT_GENERAL, "Could not cache '%s': %s",
+                st->filename, GERROR_MSG(err));
+    g_clear_error(&err);
+  }
+  g_string_free(gs, TRUE);
+}
+
+void
+amex_statement_free(struct amex_statement *st)
+{
+  if (!st) {
+    return;
+  }
+
+  g_array_free(st->lines, TRUE);
+  g_ptr_array_free(st->cards, TRUE);
+  g_byte_array_unref(st->scratch);
+  line_source_clear(&st->input);
+  /* Releases all lines, cards, transactions and strings in one go */
+  arena_clear(&st->arena);
+  intern_table_unref(st->interned);
+  g_free(st->filename);
+  g_free(st);
+}
+
+struct amex_parser *
+amex_parser_new(const struct amex_parser_options *opts,
+                struct location_index *locs)
+{
+  struct amex_parser *parser;
+
+  g_assert(opts);
+  g_assert(opts->split_width >= 0);
+
+  parser = g_new0(struct amex_parser, 1);
+  parser->ref_count = 1;
+  parser->opts = *opts;
+  /* The location index is read-only after loading, so it can be shared */
+  parser->locs = locs ? location_index_ref(locs) : location_index_new_empty();
+  if (opts->cache) {
+    parser->opts.cache = amex_cache_ref(opts->cache);
+    parser->locs_version = location_index_version(parser->locs);
+  }
+  parser->interned = intern_table_new(parser->locs);
+
+  return parser;
+}
+
+struct amex_parser *
+amex_parser_ref(struct amex_parser *parser)
+{
+  g_assert(parser);
+
+  g_atomic_int_inc(&parser->ref_count);
+
+  return parser;
+}
+
+void
+amex_parser_unref(struct amex_parser *parser)
+{
+  g_assert(parser);
+
+  if (!g_atomic_int_dec_and_test(&parser->ref_count)) {
+    return;
+  }
+
+  intern_table_unref(parser->interned);
+  location_index_unref(parser->locs);
+  g_clear_pointer(&parser->opts.cache, amex_cache_unref);
+  g_free(parser);
+}
+
+struct amex_statement *
+amex_parser_parse_file(const struct amex_parser *parser,
+                       const gchar *filename, GError **err)
+{
+  struct parse_state state;
+  struct amex_statement *st;
+  guint64 key = 0;
+  gint64 start;
+
+  g_assert(parser);
+  g_assert(filename);
+
+  st = statement_new(parser, filename);
+  init_parse_state(&state, parser, st);
+
+  /* A cached statement is only looked up by its contents */
+  if (parser->opts.cache) {
+    if (!line_source_map(&st->input, filename, err)) {
+      g_prefix_error(err, "could not parse input file: ");
+      goto out_fail;
+    }
+
+    start = stats_clock(&st->stats);
+    key = statement_cache_key(parser, st);
+    if (load_cached_statement(parser, st, key)) {
+      stats_time(&st->stats, STATS_TIME_CACHE, start);
+      stats_add(&st->stats, STATS_CACHE_HITS, 1);
+      goto out;
+    }
+    stats_time(&st->stats, STATS_TIME_CACHE, start);
+    stats_add(&st->stats, STATS_CACHE_MISSES, 1);
+  }
+
+  /* Read the file */
+  if (!split_statement(parser, st, err)) {
+    g_prefix_error(err, "could not parse input file: ");
+    goto out_fail;
+  }
+
+  /* Build the transaction state */
+  if (!process_transactions(&state, err)) {
+    g_prefix_error(err, "could not process transactions: ");
+    goto out_fail;
+  }
+
+  if (parser->opts.cache) {
+    start = stats_clock(&st->stats);
+    store_cached_statement(parser, st, key);
+    stats_time(&st->stats, STATS_TIME_CACHE, start);
+  }
+  /* fall through */
+out:
+  /* Nothing else is allocated from the arena once parsed */
+  st->stats.count[STATS_ALLOCATIONS] = st->arena.n_allocs;
+  st->stats.count[STATS_ALLOCATION_BLOCKS] = st->arena.n_blocks;
+
+  return st;
+
+out_fail:
+  amex_statement_free(st);
+
+  return NULL;
+}
+
+const gchar *
+amex_statement_filename(const struct amex_statement *st)
+{
+  g_assert(st);
+
+  return st->filename;
+}
+
+GPtrArray *
+amex_statement_cards(const struct amex_statement *st)
+{
+  g_assert(st);
+
+  return st->cards;
+}
+
+const gchar *
+amex_statement_ocr(const struct amex_statement *st)
+{
+  g_assert(st);
+
+  return st->ocr;
+}
+
+amex_date
+amex_statement_due_date(const struct amex_statement *st)
+{
+  g_assert(st);
+
+  return st->due_date;
+}
+
+struct statistics *
+amex_statement_stats(struct amex_statement *st)
+{
+  g_assert(st);
+
+  return &st->stats;
+}
+
+#define CSV_HEADER_TMPL "Datum;Bokf"SWE_LOWER_OE"rt;Specifikation;Ort;Valuta;Utl.belopp/moms;Belopp\n"
+
+static void
+write_csv_date(struct output *out, amex_date date)
+{
+  if (date == AMEX_DATE_INVALID) {
+    return;
+  }
+
+  /* Format in place in the output buffer */
+  output_commit(out, amex_date_format_md(date, output_reserve(out,
+                                                   AMEX_DATE_MD_LEN)));
+}
+
+static void
+write_csv_amount(struct output *out, amex_amount amount)
+{
+  output_commit(out, amex_amount_format(amount, output_reserve(out,
+                                                   AMEX_AMOUNT_STR_LEN)));
+}
+
+guint
+amex_statement_write_csv(const struct amex_statement *st, struct output *out)
+{
+  gchar cbuf[AMEX_CARD_STR_LEN];
+  guint i;
+  guint tc;
+
+  g_assert(st);
+  g_assert(out);
+
+  for  (i = 0, tc = 0; i < st->cards->len; i++) {
+    struct amex_card *c = g_ptr_array_index(st->cards, i);
+
+    guint j;
+
+    output_puts(out, "AMEX ");
+    output_puts(out, amex_card_format(c, cbuf, sizeof(cbuf)));
+    output_write(out, "\n" CSV_HEADER_TMPL, sizeof(CSV_HEADER_TMPL));
+
+    for (j = 0; j < c->transactions->len; j++) {
+      struct amex_transaction *t = g_ptr_array_index(c->transactions, j);
+
+      /* Datum;Bokfört;Specifikation;Ort;Valuta;Utl.belopp/moms;Belopp */
+      write_csv_date(out, t->date);
+      output_putc(out, ';');
+      write_csv_date(out, t->process_date);
+      output_putc(out, ';');
+      output_puts(out, t->details);
+      output_putc(out, ';');
+      output_puts(out, t->location ? t->location : "unknown");
+      output_write(out, ";;;", 3);
+      write_csv_amount(out, t->amount);
+      output_putc(out, '\n');
+      tc++;
+    }
+    output_putc(out, '\n');
+  }
+
+  return tc;
+}
+
+guint
+amex_statement_append_csv(const struct amex_statement *st, GString *gs)
+{
+  struct output *out;
+  guint tc;
+
+  g_assert(gs);
+
+  out = output_new_gstring(gs);
+  tc = amex_statement_write_csv(st, out);
+  output_close(out, NULL);
+
+  return tc;
+}
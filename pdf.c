@@ -0,0 +1,355 @@
+#include <glib.h>
+#include <stdio.h>
+#include <poppler.h>
+
+#include "debug.h"
+#include "log.h"
+#include "pdf.h"
+
+/* Narrower gaps between glyphs are not taken for the gutter, in points */
+#define PDF_GUTTER_MIN_WIDTH       8.0
+/* Pages wider than this are not considered for the gutter, in points */
+#define PDF_MAX_PAGE_WIDTH         2048
+/*
+ * The gutter must be at most this share of the page width from its middle,
+ * as 15 characters of the 160 of a text statement line
+ */
+#define PDF_GUTTER_MAX_OFFSET      0.09
+/* Both columns need glyphs on this share (in %) of the lines with any */
+#define PDF_GUTTER_MIN_LINE_SHARE  10
+/* Glyphs further apart than this (times their height) are separate words */
+#define PDF_WORD_GAP               0.3
+/* Glyphs closer than this (times their height) vertically share a line */
+#define PDF_LINE_SLACK             0.5
+
+struct pdf_glyph {
+  gdouble x1;
+  gdouble x2;
+  /* Vertical centre and height */
+  gdouble y;
+  gdouble height;
+  /* The character, in the page text */
+  const gchar *str;
+  guint len;
+  gboolean space;
+};
+
+DEFINE_GQUARK("amex_parser");
+
+static gint
+compare_glyphs_y(gconstpointer a, gconstpointer b)
+{
+  const struct pdf_glyph *ga = a;
+  const struct pdf_glyph *gb = b;
+
+  if (ga->y != gb->y) {
+    return ga->y < gb->y ? -1 : 1;
+  }
+
+  return ga->x1 < gb->x1 ? -1 : ga->x1 > gb->x1;
+}
+
+static gint
+compare_glyphs_x(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const struct pdf_glyph *ga = a;
+  const struct pdf_glyph *gb = b;
+
+  return ga->x1 < gb->x1 ? -1 : ga->x1 > gb->x1;
+}
+
+/* Pair every character of the page text with its bounding box */
+static GArray *
+page_glyphs(PopplerPage *page, gchar **text)
+{
+  PopplerRectangle *rects = NULL;
+  GArray *glyphs;
+  const gchar *c;
+  guint n_rects = 0;
+  guint i;
+
+  glyphs = g_array_new(FALSE, FALSE, sizeof(struct pdf_glyph));
+  *text = poppler_page_get_text(page);
+  if (!*text || !poppler_page_get_text_layout(page, &rects, &n_rects)) {
+    return glyphs;
+  }
+
+  for (c = *text, i = 0; *c && i < n_rects; c = g_utf8_next_char(c), i++) {
+    struct pdf_glyph g;
+
+    if (*c == '\n' || *c == '\r') {
+      continue;
+    }
+
+    g.x1 = MIN(rects[i].x1, rects[i].x2);
+    g.x2 = MAX(rects[i].x1, rects[i].x2);
+    g.y = (rects[i].y1 + rects[i].y2) / 2.0;
+    g.height = ABS(rects[i].y2 - rects[i].y1);
+    g.str = c;
+    g.len = g_utf8_next_char(c) - c;
+    g.space = g_ascii_isspace(*c);
+    g_array_append_val(glyphs, g);
+  }
+  g_free(rects);
+
+  return glyphs;
+}
+
+/*
+ * As for text statements, a band only separates the columns if it is about
+ * in the middle of the page and both sides have glyphs on enough lines.
+ */
+static gboolean
+is_plausible_gutter(guint start, guint end, gdouble page_width,
+                    guint lhs_rows, guint rhs_rows, guint text_rows)
+{
+  return ABS((start + end) / 2.0 - page_width / 2.0) <=
+         PDF_GUTTER_MAX_OFFSET * page_width &&
+         lhs_rows * 100 >= text_rows * PDF_GUTTER_MIN_LINE_SHARE &&
+         rhs_rows * 100 >= text_rows * PDF_GUTTER_MIN_LINE_SHARE;
+}
+
+/*
+ * The gutter is the widest plausible band of the page without any glyph in
+ * it, with glyphs on both sides. rows holds the first glyph of every line.
+ * Returns its centre, or half the page width if there is no such band.
+ */
+static gdouble
+detect_gutter(const GArray *glyphs, const GArray *rows, gdouble page_width)
+{
+  guint8 occupied[PDF_MAX_PAGE_WIDTH] = { 0, };
+  /* Lines by the x their glyphs start at, and end before */
+  guint32 leads[PDF_MAX_PAGE_WIDTH + 1] = { 0, };
+  guint32 trails[PDF_MAX_PAGE_WIDTH + 1] = { 0, };
+  guint width = MIN((guint) page_width + 1, PDF_MAX_PAGE_WIDTH);
+  guint text_rows = 0;
+  guint lhs_rows = 0;
+  guint ended_rows = 0;
+  guint best_start = 0;
+  guint best_len = 0;
+  guint start = 0;
+  gboolean seen = FALSE;
+  guint i;
+  guint j;
+
+  for (i = 0; i + 1 < rows->len; i++) {
+    guint lead = width;
+    guint trail = 0;
+
+    for (j = g_array_index(rows, guint, i);
+         j < g_array_index(rows, guint, i + 1); j++) {
+      const struct pdf_glyph *g = &g_array_index(glyphs, struct pdf_glyph, j);
+      guint x;
+
+      if (g->space || g->x1 < 0) {
+        continue;
+      }
+      for (x = g->x1; x < MIN(g->x2 + 1, width); x++) {
+        occupied[x] = 1;
+      }
+      lead = MIN(lead, MIN((guint) g->x1, width));
+      trail = MAX(trail, MIN((guint) (g->x2 + 1), width));
+    }
+
+    if (lead < trail) {
+      text_rows++;
+      leads[lead]++;
+      trails[trail]++;
+    }
+  }
+
+  /* ended_rows have no glyphs from i on, lhs_rows have some before i */
+  for (i = 0; i < width; i++) {
+    ended_rows += trails[i];
+    if (!occupied[i]) {
+      lhs_rows += leads[i];
+      continue;
+    }
+
+    /* The band is [start, i) */
+    if (seen && i - start > best_len &&
+        is_plausible_gutter(start, i, page_width, lhs_rows,
+                            text_rows - ended_rows, text_rows)) {
+      best_start = start;
+      best_len = i - start;
+    }
+    lhs_rows += leads[i];
+    seen = TRUE;
+    start = i + 1;
+  }
+
+  if (best_len < PDF_GUTTER_MIN_WIDTH) {
+    return page_width / 2.0;
+  }
+
+  return best_start + best_len / 2.0;
+}
+
+/* Append the glyphs of one column of a line as text, separating words */
+static void
+append_column(GString *gs, const struct pdf_glyph *row, guint n,
+              gboolean lhs, gdouble gutter)
+{
+  const struct pdf_glyph *prev = NULL;
+  guint i;
+
+  for (i = 0; i < n; i++) {
+    const struct pdf_glyph *g = &row[i];
+
+    if (((g->x1 + g->x2) / 2.0 < gutter) != lhs) {
+      continue;
+    }
+
+    if (g->space) {
+      if (gs->len && gs->str[gs->len - 1] != ' ') {
+        g_string_append_c(gs, ' ');
+      }
+    } else {
+      if (prev && !prev->space && gs->len && gs->str[gs->len - 1] != ' ' &&
+          g->x1 - prev->x2 > PDF_WORD_GAP * MAX(g->height, prev->height)) {
+        g_string_append_c(gs, ' ');
+      }
+      /* Semicolons would break the CSV output */
+      if (*g->str == ';') {
+        g_string_append_c(gs, '?');
+      } else {
+        g_string_append_len(gs, g->str, g->len);
+      }
+    }
+    prev = g;
+  }
+
+  while (gs->len && gs->str[gs->len - 1] == ' ') {
+    g_string_truncate(gs, gs->len - 1);
+  }
+}
+
+static gboolean
+is_page_identifier(const gchar *str)
+{
+  gint page;
+  gint total;
+
+  return g_str_has_prefix(str, PAGE_IDSTR_PFX) &&
+         sscanf(str, PAGE_IDSTR_PFX"%d av %d", &page, &total) == 2;
+}
+
+static void
+split_page(struct line_source *src, PopplerPage *page, gint page_num,
+           GArray *lines)
+{
+  GArray *glyphs;
+  GArray *rows;
+  GString *gs;
+  gchar *text = NULL;
+  gdouble width;
+  gdouble height;
+  gdouble gutter;
+  guint side;
+  guint i;
+
+  poppler_page_get_size(page, &width, &height);
+  glyphs = page_glyphs(page, &text);
+
+  /* Glyphs in reading order: top to bottom, then left to right */
+  g_array_sort(glyphs, compare_glyphs_y);
+
+  /* Start index of every line, and the glyph count as the last entry */
+  rows = g_array_new(FALSE, FALSE, sizeof(guint));
+  for (i = 0; i < glyphs->len; i++) {
+    const struct pdf_glyph *g = &g_array_index(glyphs, struct pdf_glyph, i);
+    const struct pdf_glyph *first;
+
+    if (rows->len) {
+      first = &g_array_index(glyphs, struct pdf_glyph,
+                             g_array_index(rows, guint, rows->len - 1));
+      if (g->y - first->y <= PDF_LINE_SLACK * MAX(first->height, 1.0)) {
+        continue;
+      }
+    }
+    g_array_append_val(rows, i);
+  }
+  g_array_append_val(rows, glyphs->len);
+
+  gutter = detect_gutter(glyphs, rows, width);
+  log_info(LOG_CAT_SPLITTER, "Page %d: columns split at x=%.1f of %.1f",
+           page_num, gutter, width);
+
+  for (i = 0; i + 1 < rows->len; i++) {
+    guint begin = g_array_index(rows, guint, i);
+    guint end = g_array_index(rows, guint, i + 1);
+
+    g_qsort_with_data(&g_array_index(glyphs, struct pdf_glyph, begin),
+                      end - begin, sizeof(struct pdf_glyph),
+                      compare_glyphs_x, NULL);
+  }
+
+  /* The whole left column comes first, as in the text statements */
+  gs = g_string_new(NULL);
+  for (side = 0; side < 2; side++) {
+    for (i = 0; i + 1 < rows->len; i++) {
+      guint begin = g_array_index(rows, guint, i);
+      guint end = g_array_index(rows, guint, i + 1);
+      struct line_view v;
+
+      g_string_truncate(gs, 0);
+      append_column(gs, &g_array_index(glyphs, struct pdf_glyph, begin),
+                    end - begin, side == 0, gutter);
+      if (!gs->len || is_page_identifier(gs->str)) {
+        continue;
+      }
+
+      v.str = arena_strndup(src->arena, gs->str, gs->len);
+      v.len = gs->len;
+      g_array_append_val(lines, v);
+    }
+  }
+
+  g_string_free(gs, TRUE);
+  g_array_free(rows, TRUE);
+  g_array_free(glyphs, TRUE);
+  g_free(text);
+}
+
+gboolean
+split_lines_pdf(GBytes *bytes, struct line_source *src, GArray *lines,
+                GError **err)
+{
+  PopplerDocument *doc;
+  gint n_pages;
+  gint i;
+
+  g_assert(bytes);
+  g_assert(src);
+  g_assert(src->arena);
+  g_assert(lines);
+
+  if ((doc = poppler_document_new_from_bytes(bytes, NULL, err)) == NULL) {
+    g_prefix_error(err, "could not open PDF: ");
+    return FALSE;
+  }
+
+  if ((n_pages = poppler_document_get_n_pages(doc)) < 1) {
+    SET_GERROR(err, -1, "PDF has no pages");
+    g_object_unref(doc);
+    return FALSE;
+  }
+
+  for (i = 0; i < n_pages; i++) {
+    PopplerPage *page = poppler_document_get_page(doc, i);
+
+    if (!page) {
+      continue;
+    }
+    log_info(LOG_CAT_SPLITTER, "Processing page %d of %d...", i + 1, n_pages);
+    split_page(src, page, i + 1, lines);
+    stats_add(src->stats, STATS_PAGES, 1);
+    g_object_unref(page);
+  }
+
+  log_info(LOG_CAT_SPLITTER, "Read %d PDF page(s) and added %u line(s)",
+           n_pages, lines->len);
+  g_object_unref(doc);
+
+  return TRUE;
+}
@@ -0,0 +1,22 @@
+#ifndef PDF_H__
+#define PDF_H__
+/*
+ * pdf.h - Lines of a PDF statement, read with poppler-glib
+ *
+ * Every glyph on a page comes with its position, so the columns are told
+ * apart by x coordinate rather than by character column, and lines are
+ * rebuilt from glyphs sharing a baseline. Only built with poppler-glib.
+ */
+#include <glib.h>
+
+#include "splitter.h"
+
+/* The file starts with this, whatever it is called */
+#define PDF_MAGIC                  "%PDF-"
+
+/* Split both columns of every page of the PDF document in bytes into lines */
+gboolean
+split_lines_pdf(GBytes *bytes, struct line_source *src, GArray *lines,
+                GError **err);
+
+#endif /* PDF_H__ */
@@ -0,0 +1,287 @@
+#include <glib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SCAN_X86
+#endif
+
+#include "scan.h"
+
+/* Set by the environment, to compare the implementations */
+#define SCAN_IMPL_ENV              "AMEX_PARSER_SCAN"
+
+/* struct line_scan.lead before any text is seen */
+#define SCAN_NO_TEXT               G_MAXSIZE
+
+typedef void (*scan_line_func)(gchar *str, const gchar *end,
+                               const gchar *marker, gsize marker_len,
+                               struct line_scan *res);
+
+struct scan_impl {
+  const gchar *name;
+  scan_line_func func;
+  gboolean (*supported)(void);
+};
+
+/* The same as g_ascii_isspace() */
+static inline gboolean
+is_blank(guchar c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline void
+scan_begin(struct line_scan *res)
+{
+  res->len = 0;
+  res->marker = -1;
+  res->lead = SCAN_NO_TEXT;
+  res->trail = 0;
+  res->ascii = TRUE;
+}
+
+static inline void
+scan_end(struct line_scan *res)
+{
+  if (res->lead == SCAN_NO_TEXT) {
+    res->lead = res->trail = res->len;
+  }
+}
+
+/* Scan [str + off, end) a byte at a time, for the tail of the vector ones */
+static void
+scan_bytes(gchar *str, gsize off, const gchar *end, const gchar *marker,
+           gsize marker_len, struct line_scan *res)
+{
+  gchar *p;
+
+  for (p = str + off; p < end && *p != '\n'; p++) {
+    guchar c = *p;
+
+    if (c == ';') {
+      *p = '?';
+    } else if (c & 0x80) {
+      res->ascii = FALSE;
+    }
+
+    if (!is_blank(c)) {
+      if (res->lead == SCAN_NO_TEXT) {
+        res->lead = p - str;
+      }
+      res->trail = p - str + 1;
+    }
+
+    if (c == (guchar) marker[0] && res->marker < 0 &&
+        (gsize) (end - p) >= marker_len && !memcmp(p, marker, marker_len)) {
+      res->marker = p - str;
+    }
+  }
+
+  res->len = p - str;
+}
+
+static void
+scan_line_scalar(gchar *str, const gchar *end, const gchar *marker,
+                 gsize marker_len, struct line_scan *res)
+{
+  scan_begin(res);
+  scan_bytes(str, 0, end, marker, marker_len, res);
+  scan_end(res);
+}
+
+static gboolean
+scan_always(void)
+{
+  return TRUE;
+}
+
+#ifdef HAVE_SCAN_X86
+/*
+ * Apply the byte masks of the block at str + off, bit i standing for byte
+ * i. Marker candidates match its first two bytes, the second one checked
+ * only within the block. Returns TRUE if the block ends the line.
+ */
+static inline gboolean
+scan_block(gchar *str, gsize off, guint bits, guint32 nl, guint32 semi,
+           guint32 first, guint32 second, guint32 high, guint32 text,
+           const gchar *end, const gchar *marker, gsize marker_len,
+           struct line_scan *res)
+{
+  /* Only the bytes before the newline belong to the line */
+  guint32 keep = nl ? (nl & -nl) - 1 : G_MAXUINT32;
+  gchar *p = str + off;
+
+  semi &= keep;
+  first &= keep & ((second >> 1) | 1u << (bits - 1));
+  text &= keep;
+
+  for (; semi; semi &= semi - 1) {
+    p[__builtin_ctz(semi)] = '?';
+  }
+  if (high & keep) {
+    res->ascii = FALSE;
+  }
+  if (text) {
+    if (res->lead == SCAN_NO_TEXT) {
+      res->lead = off + __builtin_ctz(text);
+    }
+    res->trail = off + 32 - __builtin_clz(text);
+  }
+  for (; first && res->marker < 0; first &= first - 1) {
+    gchar *m = p + __builtin_ctz(first);
+
+    if ((gsize) (end - m) >= marker_len && !memcmp(m, marker, marker_len)) {
+      res->marker = m - str;
+    }
+  }
+
+  if (nl) {
+    res->len = off + __builtin_ctz(nl);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+scan_line_sse2(gchar *str, const gchar *end, const gchar *marker,
+               gsize marker_len, struct line_scan *res)
+{
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i semi = _mm_set1_epi8(';');
+  const __m128i first = _mm_set1_epi8(marker[0]);
+  const __m128i second = _mm_set1_epi8(marker[1]);
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i ctrl_lo = _mm_set1_epi8('\t' - 1);
+  const __m128i ctrl_hi = _mm_set1_epi8('\r' + 1);
+  gsize len = end - str;
+  gsize off;
+
+  scan_begin(res);
+  for (off = 0; off + 16 <= len; off += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (str + off));
+    /* Signed, so bytes above 0x7f are never taken for blanks */
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                 _mm_and_si128(_mm_cmpgt_epi8(v, ctrl_lo),
+                                               _mm_cmplt_epi8(v, ctrl_hi)));
+
+    if (scan_block(str, off, 16, _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)),
+                   _mm_movemask_epi8(_mm_cmpeq_epi8(v, semi)),
+                   _mm_movemask_epi8(_mm_cmpeq_epi8(v, first)),
+                   _mm_movemask_epi8(_mm_cmpeq_epi8(v, second)),
+                   _mm_movemask_epi8(v), _mm_movemask_epi8(blank) ^ 0xffff,
+                   end, marker, marker_len, res)) {
+      goto out;
+    }
+  }
+  scan_bytes(str, off, end, marker, marker_len, res);
+
+out:
+  scan_end(res);
+}
+
+__attribute__((target("avx2")))
+static void
+scan_line_avx2(gchar *str, const gchar *end, const gchar *marker,
+               gsize marker_len, struct line_scan *res)
+{
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i semi = _mm256_set1_epi8(';');
+  const __m256i first = _mm256_set1_epi8(marker[0]);
+  const __m256i second = _mm256_set1_epi8(marker[1]);
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i ctrl_lo = _mm256_set1_epi8('\t' - 1);
+  const __m256i ctrl_hi = _mm256_set1_epi8('\r' + 1);
+  gsize len = end - str;
+  gsize off;
+
+  scan_begin(res);
+  for (off = 0; off + 32 <= len; off += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (str + off));
+    __m256i blank =
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                      _mm256_and_si256(_mm256_cmpgt_epi8(v, ctrl_lo),
+                                       _mm256_cmpgt_epi8(ctrl_hi, v)));
+
+    if (scan_block(str, off, 32,
+                   _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)),
+                   _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, semi)),
+                   _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first)),
+                   _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, second)),
+                   _mm256_movemask_epi8(v),
+                   ~(guint32) _mm256_movemask_epi8(blank),
+                   end, marker, marker_len, res)) {
+      goto out;
+    }
+  }
+  scan_bytes(str, off, end, marker, marker_len, res);
+
+out:
+  scan_end(res);
+}
+
+static gboolean
+scan_has_avx2(void)
+{
+  __builtin_cpu_init();
+
+  return __builtin_cpu_supports("avx2");
+}
+#endif /* HAVE_SCAN_X86 */
+
+/* Fastest first */
+static const struct scan_impl scan_impls[] = {
+#ifdef HAVE_SCAN_X86
+  { "avx2", scan_line_avx2, scan_has_avx2 },
+  { "sse2", scan_line_sse2, scan_always },
+#endif
+  { "scalar", scan_line_scalar, scan_always },
+};
+
+static const struct scan_impl *
+scan_impl(void)
+{
+  static gsize picked = 0;
+
+  if (g_once_init_enter(&picked)) {
+    const gchar *want = g_getenv(SCAN_IMPL_ENV);
+    const struct scan_impl *impl = NULL;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(scan_impls); i++) {
+      if (!scan_impls[i].supported()) {
+        continue;
+      }
+      if (!want || !g_strcmp0(want, scan_impls[i].name)) {
+        impl = &scan_impls[i];
+        break;
+      }
+      /* Unknown or unsupported, the fastest one is used instead */
+      if (!impl) {
+        impl = &scan_impls[i];
+      }
+    }
+    g_once_init_leave(&picked, (gsize) impl);
+  }
+
+  return (const struct scan_impl *) picked;
+}
+
+void
+scan_line(gchar *str, const gchar *end, const gchar *marker, gsize marker_len,
+          struct line_scan *res)
+{
+  g_assert(str);
+  g_assert(end >= str);
+  g_assert(marker && marker_len >= 2);
+  g_assert(res);
+
+  scan_impl()->func(str, end, marker, marker_len, res);
+}
+
+const gchar *
+scan_line_impl_name(void)
+{
+  return scan_impl()->name;
+}
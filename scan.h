@@ -0,0 +1,41 @@
+#ifndef SCAN_H__
+#define SCAN_H__
+/*
+ * scan.h - Single pass line scanning
+ *
+ * Every byte of a text statement goes through scan_line() exactly once: it
+ * finds the end of the line, replaces ';' (the CSV separator) with '?',
+ * looks for the page marker and notes where the text of the line starts and
+ * ends, all in the same pass. The work is done 32 (AVX2) or 16 (SSE2) bytes
+ * at a time where the CPU supports it, picked once at runtime.
+ */
+#include <glib.h>
+
+/* What scan_line() found in [str, str + len) */
+struct line_scan {
+  /* Up to the newline or the end of the input */
+  gsize len;
+  /* Offset of the marker, or -1 if the line has none */
+  gssize marker;
+  /* [lead, trail) is the line without surrounding whitespace, empty if lead
+   * is len */
+  gsize lead;
+  gsize trail;
+  gboolean ascii;
+};
+
+/*
+ * Scan the line starting at str, never reading beyond end. The marker is
+ * only matched if it ends before the newline, it is at least two bytes long
+ * and must not contain '\n' or ';'. Setting AMEX_PARSER_SCAN to scalar,
+ * sse2 or avx2 overrides the implementation picked, for comparing them.
+ */
+void
+scan_line(gchar *str, const gchar *end, const gchar *marker, gsize marker_len,
+          struct line_scan *res);
+
+/* The implementation scan_line() uses */
+const gchar *
+scan_line_impl_name(void);
+
+#endif /* SCAN_H__ */
@@ -0,0 +1,647 @@
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "log.h"
+#include "pdf.h"
+#include "scan.h"
+#include "splitter.h"
+
+#define PAGE_IDSTR_MAX_LEN         64
+/* Columns beyond this are not considered for the gutter */
+#define GUTTER_MAX_COLUMNS         512
+#define GUTTER_MIN_WIDTH           2
+/* The gutter must be at most this many columns from SPLIT_WIDTH_FALLBACK */
+#define GUTTER_MAX_OFFSET          15
+/* Both columns need text on this share (in %) of the lines with any text */
+#define GUTTER_MIN_LINE_SHARE      10
+/* Fewer pages than this are not worth handing to other threads */
+#define SPLIT_PARALLEL_MIN_PAGES   8
+/* Pages are handed out in runs, this many per thread */
+#define SPLIT_RUNS_PER_JOB         4
+
+/*
+ * A raw line of a page, [str, str + len) in the mapping. Its text without
+ * the surrounding whitespace is [str + lead, str + trail)
+ */
+struct page_line {
+  gchar *str;
+  gsize len;
+  gsize lead;
+  gsize trail;
+  gboolean ascii;
+};
+
+/* The lines of one page, and its columns once split */
+struct page {
+  gint num;
+  /* [first, first + len) in the page lines */
+  guint first;
+  guint len;
+  GArray *lhs;
+  GArray *rhs;
+};
+
+/* Pages split one after the other by a worker thread */
+struct page_run {
+  struct page *pages;
+  guint len;
+};
+
+/* What every page is split with, shared by the worker threads */
+struct split_ctx {
+  struct line_source *src;
+  GArray *page_lines;
+  gint split_width;
+  const gchar *map_end;
+};
+
+DEFINE_GQUARK("amex_parser");
+
+static gboolean
+parse_page_num(const gchar *str, gsize len, gint *page, gint *total_pages,
+               GError **err)
+{
+  gchar sbuff[PAGE_IDSTR_MAX_LEN];
+  gint tc;
+
+  g_assert(str);
+  g_assert(total_pages);
+  g_assert(page);
+
+  /* The marker is not terminated in the mapping, so scan a bounded copy */
+  len = MIN(len, sizeof(sbuff) - 1);
+  memcpy(sbuff, str, len);
+  sbuff[len] = '\0';
+
+  if ((tc = sscanf(sbuff, PAGE_IDSTR_PFX"%d av %d", page, total_pages)) < 0) {
+    SET_GERROR(err, -1, "could not parse page number: %s", g_strerror(errno));
+    return FALSE;
+  } else if (tc != 2) {
+    SET_GERROR(err, -1,
+               "invalid token count when parsing page (got %d, need 2)", tc);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+combine_columns(GArray *results, GArray *lhs, GArray *rhs)
+{
+  gint i;
+
+  g_assert(results);
+  g_assert(lhs);
+  g_assert(rhs);
+
+  for (i = 0; i < 2; i++) {
+    GArray *l = i == 0 ? lhs : rhs;
+
+    g_array_append_vals(results, l->data, l->len);
+    log_debug(LOG_CAT_SPLITTER, "[%s] Added %u entries",
+              i == 0 ? "LHS" : "RHS", l->len);
+    g_array_set_size(l, 0);
+  }
+}
+
+/*
+ * Trim the column [begin, end) and append it as a view, unless it is empty.
+ * The byte following the trimmed text is overwritten with a NUL. This is
+ * either whitespace, the newline or the split column, all of which are
+ * discarded anyway. Only an unterminated last line can not be terminated in
+ * place, it is copied to the source arena instead.
+ */
+static void
+add_column_view(struct line_source *src, GArray *column,
+                gchar *begin, gchar *end, const gchar *map_end)
+{
+  struct line_view v;
+
+  while (begin < end && g_ascii_isspace(*begin)) {
+    begin++;
+  }
+  while (end > begin && g_ascii_isspace(end[-1])) {
+    end--;
+  }
+
+  if (begin == end) {
+    return;
+  }
+
+  v.len = end - begin;
+  if (end < map_end) {
+    *end = '\0';
+    v.str = begin;
+  } else {
+    v.str = arena_strndup(src->arena, begin, v.len);
+  }
+
+  g_array_append_val(column, v);
+}
+
+static inline gboolean
+is_utf8_continuation(gchar c)
+{
+  return ((guchar) c & 0xc0) == 0x80;
+}
+
+/* Byte offset of character column col, or len if the line is shorter */
+static gsize
+column_offset(const struct page_line *pl, gsize col)
+{
+  gsize i;
+
+  if (pl->ascii) {
+    return MIN(col, pl->len);
+  }
+
+  for (i = 0; i < pl->len; i++) {
+    if (!is_utf8_continuation(pl->str[i]) && col-- == 0) {
+      return i;
+    }
+  }
+
+  return pl->len;
+}
+
+/*
+ * A band of empty columns only separates the page columns if it is about
+ * where they are split normally and both sides have text on enough lines.
+ * Otherwise it is more likely the gap in front of the amounts of a page
+ * with only the left hand column.
+ */
+static gboolean
+is_plausible_gutter(gsize split, guint lhs_lines, guint rhs_lines,
+                    guint text_lines)
+{
+  return split + GUTTER_MAX_OFFSET >= SPLIT_WIDTH_FALLBACK &&
+         split <= SPLIT_WIDTH_FALLBACK + GUTTER_MAX_OFFSET &&
+         lhs_lines * 100 >= text_lines * GUTTER_MIN_LINE_SHARE &&
+         rhs_lines * 100 >= text_lines * GUTTER_MIN_LINE_SHARE;
+}
+
+/*
+ * Find the gutter between the two page columns: count how many lines have
+ * something printed in every character column, then pick the widest
+ * plausible band of empty columns with text on both sides. Returns the
+ * column the right hand side starts at, or 0 if the page has no such band.
+ */
+static gint
+detect_split_width(const struct page_line *lines, guint n)
+{
+  guint32 occupied[GUTTER_MAX_COLUMNS] = { 0, };
+  /* Lines by the column their text starts at, and ends before */
+  guint32 leads[GUTTER_MAX_COLUMNS + 1] = { 0, };
+  guint32 trails[GUTTER_MAX_COLUMNS + 1] = { 0, };
+  guint text_lines = 0;
+  guint lhs_lines = 0;
+  guint ended_lines = 0;
+  gsize width = 0;
+  gsize band_start = 0;
+  gsize best_start = 0;
+  gsize best_end = 0;
+  gboolean text_seen = FALSE;
+  guint i;
+  gsize c;
+
+  for (i = 0; i < n; i++) {
+    const struct page_line *pl = &lines[i];
+    const guchar *s = (const guchar *) pl->str;
+
+    if (pl->lead == pl->len) {
+      continue;
+    }
+    text_lines++;
+
+    if (pl->ascii) {
+      gsize n = MIN(pl->len, GUTTER_MAX_COLUMNS);
+
+      /* Branch free, so this is vectorised */
+      for (c = 0; c < n; c++) {
+        occupied[c] += s[c] > ' ';
+      }
+      width = MAX(width, n);
+      leads[MIN(pl->lead, GUTTER_MAX_COLUMNS)]++;
+      trails[MIN(pl->trail, GUTTER_MAX_COLUMNS)]++;
+    } else {
+      gsize lead = GUTTER_MAX_COLUMNS;
+      gsize trail = GUTTER_MAX_COLUMNS;
+      gsize j;
+
+      for (j = 0, c = 0; j < pl->len && c < GUTTER_MAX_COLUMNS; j++) {
+        if (is_utf8_continuation(s[j])) {
+          continue;
+        }
+        if (s[j] > ' ') {
+          lead = MIN(lead, c);
+          trail = c + 1;
+        }
+        occupied[c++] += s[j] > ' ';
+      }
+      width = MAX(width, c);
+      leads[lead]++;
+      trails[trail]++;
+    }
+  }
+
+  /* ended_lines have no text from c on, lhs_lines have some before c */
+  for (c = 0; c < width; c++) {
+    ended_lines += trails[c];
+    if (!occupied[c]) {
+      lhs_lines += leads[c];
+      continue;
+    }
+
+    /* The band is [band_start, c) */
+    if (text_seen && c - band_start > best_end - best_start &&
+        is_plausible_gutter(c, lhs_lines, text_lines - ended_lines,
+                            text_lines)) {
+      best_start = band_start;
+      best_end = c;
+    }
+    lhs_lines += leads[c];
+    text_seen = TRUE;
+    band_start = c + 1;
+  }
+
+  if (best_end - best_start < GUTTER_MIN_WIDTH) {
+    return 0;
+  }
+
+  return best_end;
+}
+
+/*
+ * Split the lines of a page at split_width characters. The character at
+ * split_width - 1 is the gutter and is dropped. The outer ends of the
+ * columns are trimmed already, by the scan of the line.
+ */
+static void
+split_page(struct line_source *src, const struct page_line *lines, guint n,
+           gint split_width, GArray *lhs, GArray *rhs, const gchar *map_end)
+{
+  guint i;
+
+  for (i = 0; i < n; i++) {
+    const struct page_line *pl = &lines[i];
+    gsize lhs_end;
+    gsize rhs_begin;
+
+    if (pl->lead == pl->len) {
+      continue;
+    }
+
+    lhs_end = column_offset(pl, split_width - 1);
+    rhs_begin = column_offset(pl, split_width);
+    if (lhs_end < pl->len) {
+      add_column_view(src, lhs, pl->str + MIN(pl->lead, lhs_end),
+                      pl->str + lhs_end, map_end);
+      add_column_view(src, rhs, pl->str + rhs_begin,
+                      pl->str + MAX(pl->trail, rhs_begin), map_end);
+    } else {
+      add_column_view(src, lhs, pl->str + pl->lead, pl->str + pl->trail,
+                      map_end);
+    }
+  }
+}
+
+/*
+ * Split a page into the lhs and rhs columns. Pages only touch their own
+ * lines, so any number of them can be split at the same time. Only the last
+ * page may need the arena, see add_column_view().
+ */
+static void
+process_page(const struct split_ctx *ctx, const struct page *page,
+             GArray *lhs, GArray *rhs)
+{
+  struct page_line *lines = &g_array_index(ctx->page_lines, struct page_line,
+                                           page->first);
+  gint width = ctx->split_width;
+
+  if (!width && (width = detect_split_width(lines, page->len)) != 0) {
+    log_info(LOG_CAT_SPLITTER, "Page %d: detected line split width of %d",
+             page->num, width);
+  } else if (!width) {
+    width = SPLIT_WIDTH_FALLBACK;
+    log_info(LOG_CAT_SPLITTER, "Page %d: no column gutter found, using line "
+             "split width of %d", page->num, width);
+  }
+
+  split_page(ctx->src, lines, page->len, width, lhs, rhs, ctx->map_end);
+}
+
+static void
+split_run(const struct split_ctx *ctx, const struct page_run *run)
+{
+  guint i;
+
+  for (i = 0; i < run->len; i++) {
+    process_page(ctx, &run->pages[i], run->pages[i].lhs, run->pages[i].rhs);
+  }
+}
+
+static void
+split_run_worker(gpointer data, gpointer user_data)
+{
+  split_run(user_data, data);
+}
+
+/*
+ * Split runs of pages on jobs threads, the calling thread taking the last
+ * run. The columns are joined in page order afterwards, so the lines are
+ * the same as when splitting one page after the other.
+ */
+static gboolean
+split_pages_parallel(const struct split_ctx *ctx, GArray *pages, gint jobs,
+                     GArray *lines, GError **err)
+{
+  struct page_run *runs;
+  GThreadPool *pool;
+  guint n_runs;
+  guint per_run;
+  guint i;
+
+  for (i = 0; i < pages->len; i++) {
+    struct page *page = &g_array_index(pages, struct page, i);
+
+    page->lhs = g_array_new(FALSE, FALSE, sizeof(struct line_view));
+    page->rhs = g_array_new(FALSE, FALSE, sizeof(struct line_view));
+  }
+
+  per_run = (pages->len + jobs * SPLIT_RUNS_PER_JOB - 1) /
+            (jobs * SPLIT_RUNS_PER_JOB);
+  n_runs = (pages->len + per_run - 1) / per_run;
+  runs = g_new(struct page_run, n_runs);
+  for (i = 0; i < n_runs; i++) {
+    runs[i].pages = &g_array_index(pages, struct page, i * per_run);
+    runs[i].len = MIN(per_run, pages->len - i * per_run);
+  }
+
+  if ((pool = g_thread_pool_new(split_run_worker, (gpointer) ctx,
+                                jobs - 1, FALSE, err)) == NULL) {
+    goto out;
+  }
+  for (i = 0; i + 1 < n_runs; i++) {
+    g_thread_pool_push(pool, &runs[i], NULL);
+  }
+  /* The last page may need the arena, which only this thread uses */
+  split_run(ctx, &runs[n_runs - 1]);
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  for (i = 0; i < pages->len; i++) {
+    struct page *page = &g_array_index(pages, struct page, i);
+
+    combine_columns(lines, page->lhs, page->rhs);
+  }
+  /* fall through */
+out:
+  for (i = 0; i < pages->len; i++) {
+    struct page *page = &g_array_index(pages, struct page, i);
+
+    g_array_free(page->lhs, TRUE);
+    g_array_free(page->rhs, TRUE);
+  }
+  g_free(runs);
+
+  return pool != NULL;
+}
+
+static GMappedFile *
+map_input_file(const gchar *filename, GError **err)
+{
+  GMappedFile *map;
+  gint fd;
+
+  /* Writable private mappings only need read access to the file */
+  if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+    SET_GERROR(err, -1, "could not open '%s': %s",
+               filename, g_strerror(errno));
+    return NULL;
+  }
+
+  map = g_mapped_file_new_from_fd(fd, TRUE, err);
+  close(fd);
+
+  return map;
+}
+
+static gboolean
+split_pdf(const gchar *filename, gint split_width, struct line_source *src,
+          GArray *lines, GError **err)
+{
+#ifdef HAVE_POPPLER
+  GBytes *bytes;
+  gboolean ret;
+
+  if (split_width) {
+    log_info(LOG_CAT_SPLITTER, "Ignoring the line split width for PDF '%s'",
+             filename);
+  }
+
+  bytes = g_mapped_file_get_bytes(src->map);
+  ret = split_lines_pdf(bytes, src, lines, err);
+  g_bytes_unref(bytes);
+
+  return ret;
+#else
+  (void) split_width;
+  (void) lines;
+
+  SET_GERROR(err, -1, "'%s' is a PDF, which this build can not read. "
+             "Convert it with pdftotext -layout first", filename);
+
+  return FALSE;
+#endif
+}
+
+gboolean
+line_source_map(struct line_source *src, const gchar *filename, GError **err)
+{
+  gint64 start;
+
+  g_assert(src);
+  g_assert(!src->map);
+  g_assert(filename);
+
+  start = stats_clock(src->stats);
+  if ((src->map = map_input_file(filename, err)) == NULL) {
+    return FALSE;
+  }
+  stats_time(src->stats, STATS_TIME_READ, start);
+  stats_add(src->stats, STATS_BYTES_READ, g_mapped_file_get_length(src->map));
+
+  return TRUE;
+}
+
+/* Close the page being collected, and start the next one */
+static void
+add_page(GArray *pages, gint num, guint *first, guint end)
+{
+  struct page page = { num, *first, end - *first, NULL, NULL };
+
+  g_array_append_val(pages, page);
+  *first = end;
+}
+
+gboolean
+split_lines_file(const gchar *filename, gint split_width,
+                 struct line_source *src, GArray *lines, GError **err)
+{
+  struct split_ctx ctx;
+  gboolean ret = FALSE;
+  gint page = 0;
+  gint last_page = 0;
+  gint page_total = 0;
+  guint page_first = 0;
+  guint i = 0;
+  guint j;
+  gsize flen;
+  gchar *buffer;
+  gchar *map_end;
+  gchar *l;
+  gint64 start;
+
+  GArray *page_lines = NULL;
+  GArray *pages = NULL;
+  GArray *lhs = NULL;
+  GArray *rhs = NULL;
+
+  g_assert(filename);
+  g_assert(src);
+  g_assert(src->arena);
+  g_assert(lines);
+  g_assert(split_width >= 0);
+
+  /* 0. Map the file, unless the caller already did */
+  if (!src->map && !line_source_map(src, filename, err)) {
+    return FALSE;
+  }
+
+  buffer = g_mapped_file_get_contents(src->map);
+  flen = g_mapped_file_get_length(src->map);
+  map_end = buffer + flen;
+
+  start = stats_clock(src->stats);
+  if (flen >= strlen(PDF_MAGIC) &&
+      !memcmp(buffer, PDF_MAGIC, strlen(PDF_MAGIC))) {
+    ret = split_pdf(filename, split_width, src, lines, err);
+    stats_time(src->stats, STATS_TIME_SPLIT, start);
+    return ret;
+  }
+
+  page_lines = g_array_new(FALSE, FALSE, sizeof(struct page_line));
+  pages = g_array_new(FALSE, FALSE, sizeof(struct page));
+  log_info(LOG_CAT_SPLITTER, "Scanning lines using %s",
+           scan_line_impl_name());
+
+  /*
+   * 1. Find the lines of every page, splitting them comes after. Each line
+   * is scanned once, for its end, a page marker and its trimmed bounds, and
+   * ';' is replaced on the way
+   */
+  for (l = buffer; l < map_end; i++) {
+    struct line_scan scan;
+    struct page_line pl;
+    const gchar *tmp;
+    gchar *eol;
+    gchar *next;
+
+    scan_line(l, map_end, PAGE_IDSTR_PFX, strlen(PAGE_IDSTR_PFX), &scan);
+    eol = l + scan.len;
+    next = eol < map_end ? eol + 1 : eol;
+
+    tmp = scan.marker >= 0 ? l + scan.marker : NULL;
+    if (!tmp && !page_total) {
+      /* Discard everything until we find the page identifier */
+      l = next;
+      continue;
+    } else if (tmp) {
+      /* Page indicator */
+      if (!parse_page_num(tmp, eol - tmp, &page, &page_total, err)) {
+        goto out;
+      }
+
+      if (page > 1 && page != last_page) {
+        /* The lines so far make up the previous page */
+        add_page(pages, last_page, &page_first, page_lines->len);
+      }
+      last_page = page;
+      log_info(LOG_CAT_SPLITTER, "Processing page %d of %d...",
+               page, page_total);
+      l = next;
+      continue;
+    }
+
+    pl.str = l;
+    pl.len = scan.len;
+    pl.lead = scan.lead;
+    pl.trail = scan.trail;
+    pl.ascii = scan.ascii;
+    g_array_append_val(page_lines, pl);
+
+    l = next;
+  }
+
+  /* If we didn't find a page total then this is probably not an Amex faktura */
+  if (!page_total) {
+    SET_GERROR(err, -1,
+               "could not find page identifier (is this an Amex bill?)");
+    goto out;
+  }
+
+  /* The last page has no following page marker to close it */
+  add_page(pages, last_page, &page_first, page_lines->len);
+
+  /* 2. Split the columns of every page */
+  ctx.src = src;
+  ctx.page_lines = page_lines;
+  ctx.split_width = split_width;
+  ctx.map_end = map_end;
+  if (src->jobs > 1 && pages->len >= SPLIT_PARALLEL_MIN_PAGES) {
+    log_info(LOG_CAT_SPLITTER, "Splitting %u pages using %d thread(s)",
+             pages->len, src->jobs);
+    if (!split_pages_parallel(&ctx, pages, src->jobs, lines, err)) {
+      goto out;
+    }
+  } else {
+    lhs = g_array_new(FALSE, FALSE, sizeof(struct line_view));
+    rhs = g_array_new(FALSE, FALSE, sizeof(struct line_view));
+    for (j = 0; j < pages->len; j++) {
+      process_page(&ctx, &g_array_index(pages, struct page, j), lhs, rhs);
+      combine_columns(lines, lhs, rhs);
+    }
+  }
+  stats_add(src->stats, STATS_PAGES, pages->len);
+
+  log_info(LOG_CAT_SPLITTER,
+           "Read %zi byte(s), %d pages and added %d line(s) from '%s'",
+           flen, page_total, lines->len, filename);
+  ret = TRUE;
+
+out:
+  stats_time(src->stats, STATS_TIME_SPLIT, start);
+  g_array_free(page_lines, TRUE);
+  g_array_free(pages, TRUE);
+  if (lhs) {
+    g_array_free(lhs, TRUE);
+    g_array_free(rhs, TRUE);
+  }
+
+  if (!ret) {
+    g_prefix_error(err, "L%d: ", i);
+  }
+
+  return ret;
+}
+
+void
+line_source_clear(struct line_source *src)
+{
+  g_assert(src);
+
+  g_clear_pointer(&src->map, g_mapped_file_unref);
+}
@@ -0,0 +1,58 @@
+#ifndef SPLITTER_H__
+#define SPLITTER_H__
+/*
+ * splitter.h - Column splitter for pdftotext -layout statements
+ *
+ * The input file is mapped privately (copy-on-write) and every line of both
+ * page columns is handed out as a view into that mapping. Views are trimmed
+ * and NUL-terminated in place, so no line is ever copied.
+ */
+#include <glib.h>
+
+#include "arena.h"
+#include "stats.h"
+
+/* Starts the "Sida 1 av 2" line identifying every page */
+#define PAGE_IDSTR_PFX             "Sida "
+
+/* Used for pages where no gutter between the columns can be found */
+#define SPLIT_WIDTH_FALLBACK       80
+
+/* A trimmed, NUL-terminated line inside the mapped input */
+struct line_view {
+  const gchar *str;
+  gsize len;
+};
+
+/*
+ * The mapping the line views point into. The arena and the (optional)
+ * statistics are borrowed
+ */
+struct line_source {
+  GMappedFile *map;
+  struct arena *arena;
+  struct statistics *stats;
+  /* Threads splitting the pages of text files, 1 or less splits them here */
+  gint jobs;
+};
+
+/* Map the file, before it is split. The mapping is changed by splitting */
+gboolean
+line_source_map(struct line_source *src, const gchar *filename, GError **err);
+
+/*
+ * Split both columns of every page into lines. The columns are split at
+ * split_width characters, or at the gutter detected per page if it is 0.
+ * Pages are found first and then split, on src->jobs threads for long text
+ * files; the lines come out the same either way. PDF files are read directly
+ * if built with poppler-glib. The file is mapped first, unless that was
+ * already done with line_source_map().
+ */
+gboolean
+split_lines_file(const gchar *filename, gint split_width,
+                 struct line_source *src, GArray *lines, GError **err);
+
+void
+line_source_clear(struct line_source *src);
+
+#endif /* SPLITTER_H__ */
@@ -0,0 +1,210 @@
+#include <glib.h>
+
+#include "stats.h"
+
+#define NS_PER_MS                  1000000.0
+
+static const gchar *timer_names[STATS_TIME_COUNT] = {
+  [STATS_TIME_READ]      = "read",
+  [STATS_TIME_SPLIT]     = "split",
+  [STATS_TIME_LOCATIONS] = "locations",
+  [STATS_TIME_CLASSIFY]  = "classify",
+  [STATS_TIME_DETAILS]   = "details",
+  [STATS_TIME_OUTPUT]    = "output",
+  [STATS_TIME_CACHE]     = "cache",
+};
+
+static const gchar *counter_names[STATS_COUNTER_COUNT] = {
+  [STATS_PAGES]              = "pages",
+  [STATS_LINES]              = "lines",
+  [STATS_LINES_OTHER]        = "lines_other",
+  [STATS_LINES_CARD_BEGIN]   = "lines_card_begin",
+  [STATS_LINES_CARD_END]     = "lines_card_end",
+  [STATS_LINES_TRANSACTION]  = "lines_transaction",
+  [STATS_LINES_OCR]          = "lines_ocr",
+  [STATS_LINES_DUE_DATE]     = "lines_due_date",
+  [STATS_TRANSACTIONS]       = "transactions",
+  [STATS_LOCATION_NEXT_LINE] = "location_next_line",
+  [STATS_LOCATION_EXACT]     = "location_exact",
+  [STATS_LOCATION_FUZZY]     = "location_fuzzy",
+  [STATS_LOCATION_MISS]      = "location_miss",
+  [STATS_DETAILS_INTERNED]   = "details_interned",
+  [STATS_BYTES_READ]         = "bytes_read",
+  [STATS_BYTES_WRITTEN]      = "bytes_written",
+  [STATS_ALLOCATIONS]        = "allocations",
+  [STATS_ALLOCATION_BLOCKS]  = "allocation_blocks",
+  [STATS_CACHE_HITS]         = "cache_hits",
+  [STATS_CACHE_MISSES]       = "cache_misses",
+};
+
+static gint64
+total_time(const struct statistics *stats)
+{
+  gint64 total = 0;
+  guint i;
+
+  for (i = 0; i < STATS_TIME_COUNT; i++) {
+    total += stats->ns[i];
+  }
+
+  return total;
+}
+
+void
+stats_merge(struct statistics *into, const struct statistics *from)
+{
+  guint i;
+
+  g_assert(into);
+  g_assert(from);
+
+  for (i = 0; i < STATS_TIME_COUNT; i++) {
+    into->ns[i] += from->ns[i];
+  }
+  for (i = 0; i < STATS_COUNTER_COUNT; i++) {
+    into->count[i] += from->count[i];
+  }
+}
+
+static void
+append_json_string(GString *gs, const gchar *str)
+{
+  g_string_append_c(gs, '"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      g_string_append_c(gs, '\\');
+      g_string_append_c(gs, *str);
+    } else if ((guchar) *str < 0x20) {
+      g_string_append_printf(gs, "\\u%04x", (guchar) *str);
+    } else {
+      g_string_append_c(gs, *str);
+    }
+  }
+  g_string_append_c(gs, '"');
+}
+
+static void
+append_json(GString *gs, const gchar *filename,
+            const struct statistics *stats)
+{
+  guint i;
+
+  g_string_append_c(gs, '{');
+  if (filename) {
+    g_string_append(gs, "\"file\":");
+    append_json_string(gs, filename);
+    g_string_append_c(gs, ',');
+  }
+
+  g_string_append(gs, "\"time_ns\":{");
+  for (i = 0; i < STATS_TIME_COUNT; i++) {
+    g_string_append_printf(gs, "\"%s\":%" G_GINT64_FORMAT ",",
+                           timer_names[i], stats->ns[i]);
+  }
+  g_string_append_printf(gs, "\"total\":%" G_GINT64_FORMAT "},\"counters\":{",
+                         total_time(stats));
+  for (i = 0; i < STATS_COUNTER_COUNT; i++) {
+    g_string_append_printf(gs, "%s\"%s\":%" G_GUINT64_FORMAT, i ? "," : "",
+                           counter_names[i], stats->count[i]);
+  }
+  g_string_append(gs, "}}");
+}
+
+static void
+append_text(GString *gs, const struct statistics *stats)
+{
+  guint i;
+
+  g_string_append(gs, " Timings (ms):\n");
+  for (i = 0; i < STATS_TIME_COUNT; i++) {
+    g_string_append_printf(gs, "    %-20s %12.3f\n", timer_names[i],
+                           stats->ns[i] / NS_PER_MS);
+  }
+  g_string_append_printf(gs, "    %-20s %12.3f\n Counters:\n", "total",
+                         total_time(stats) / NS_PER_MS);
+  for (i = 0; i < STATS_COUNTER_COUNT; i++) {
+    g_string_append_printf(gs, "    %-20s %12" G_GUINT64_FORMAT "\n",
+                           counter_names[i], stats->count[i]);
+  }
+}
+
+void
+stats_report_init(struct stats_report *report, enum stats_format format)
+{
+  g_assert(report);
+
+  memset(report, 0, sizeof(*report));
+  report->format = format;
+  report->total.timing = format != STATS_FORMAT_NONE;
+  report->statements = g_string_new(NULL);
+}
+
+void
+stats_report_add(struct stats_report *report, const gchar *filename,
+                 const struct statistics *stats)
+{
+  GString *gs;
+
+  g_assert(report);
+  g_assert(filename);
+  g_assert(stats);
+
+  stats_merge(&report->total, stats);
+  gs = report->statements;
+
+  if (report->format == STATS_FORMAT_JSON) {
+    if (report->n_statements) {
+      g_string_append_c(gs, ',');
+    }
+    append_json(gs, filename, stats);
+  } else {
+    g_string_append_printf(gs, " %-40s %10.3f ms %8" G_GUINT64_FORMAT
+                           " line(s) %8" G_GUINT64_FORMAT " transaction(s)\n",
+                           filename, total_time(stats) / NS_PER_MS,
+                           stats->count[STATS_LINES],
+                           stats->count[STATS_TRANSACTIONS]);
+  }
+  report->n_statements++;
+}
+
+void
+stats_report_print(const struct stats_report *report)
+{
+  GString *gs;
+
+  g_assert(report);
+
+  if (report->format == STATS_FORMAT_NONE) {
+    return;
+  }
+
+  gs = g_string_new(NULL);
+  if (report->format == STATS_FORMAT_JSON) {
+    g_string_append_printf(gs, "{\"statements\":[%s],\"total\":",
+                           report->statements->str);
+    append_json(gs, NULL, &report->total);
+    g_string_append(gs, "}\n");
+  } else {
+    g_string_append_printf(gs, "Statistics for %u statement(s):\n",
+                           report->n_statements);
+    /* A single statement is the same as the total */
+    if (report->n_statements > 1) {
+      g_string_append(gs, report->statements->str);
+    }
+    append_text(gs, &report->total);
+  }
+
+  g_printerr("%s", gs->str);
+  g_string_free(gs, TRUE);
+}
+
+void
+stats_report_clear(struct stats_report *report)
+{
+  g_assert(report);
+
+  if (report->statements) {
+    g_string_free(report->statements, TRUE);
+  }
+  memset(report, 0, sizeof(*report));
+}
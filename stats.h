@@ -0,0 +1,125 @@
+#ifndef STATS_H__
+#define STATS_H__
+/*
+ * stats.h - Per-stage timings and counters
+ *
+ * Every statement keeps its own statistics, which are merged into a report
+ * printed at exit (--stats). Counters are always kept, they are cheap.
+ * Timings use the monotonic clock and are only taken when enabled, as some
+ * stages are timed per transaction.
+ */
+#include <glib.h>
+#include <time.h>
+
+enum stats_format {
+  STATS_FORMAT_NONE = 0,
+  STATS_FORMAT_TEXT,
+  STATS_FORMAT_JSON,
+};
+
+enum stats_timer {
+  STATS_TIME_READ = 0,
+  STATS_TIME_SPLIT,
+  STATS_TIME_LOCATIONS,
+  STATS_TIME_CLASSIFY,
+  STATS_TIME_DETAILS,
+  STATS_TIME_OUTPUT,
+  /* Hashing the input, and reading or writing the cache entry */
+  STATS_TIME_CACHE,
+  STATS_TIME_COUNT,
+};
+
+enum stats_counter {
+  STATS_PAGES = 0,
+  STATS_LINES,
+  /* One per line kind, in the order the parser classifies them */
+  STATS_LINES_OTHER,
+  STATS_LINES_CARD_BEGIN,
+  STATS_LINES_CARD_END,
+  STATS_LINES_TRANSACTION,
+  STATS_LINES_OCR,
+  STATS_LINES_DUE_DATE,
+  STATS_TRANSACTIONS,
+  /* The location was the whole following line */
+  STATS_LOCATION_NEXT_LINE,
+  /* The location was found in the details line itself */
+  STATS_LOCATION_EXACT,
+  STATS_LOCATION_FUZZY,
+  STATS_LOCATION_MISS,
+  /* Details found already parsed, see intern.h */
+  STATS_DETAILS_INTERNED,
+  STATS_BYTES_READ,
+  STATS_BYTES_WRITTEN,
+  /* Arena allocations, and the heap blocks backing them */
+  STATS_ALLOCATIONS,
+  STATS_ALLOCATION_BLOCKS,
+  /* Statements read back from the result cache, and parsed into it */
+  STATS_CACHE_HITS,
+  STATS_CACHE_MISSES,
+  STATS_COUNTER_COUNT,
+};
+
+struct statistics {
+  gboolean timing;
+  gint64 ns[STATS_TIME_COUNT];
+  guint64 count[STATS_COUNTER_COUNT];
+};
+
+/* Statistics of a run, with the statements in the order they were added */
+struct stats_report {
+  enum stats_format format;
+  struct statistics total;
+  GString *statements;
+  guint n_statements;
+};
+
+/* Monotonic time in nanoseconds, or 0 if timing is disabled */
+static inline gint64
+stats_clock(const struct statistics *stats)
+{
+  struct timespec ts;
+
+  if (!stats || !stats->timing) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+/* Add the time since start, as returned by stats_clock() */
+static inline void
+stats_time(struct statistics *stats, enum stats_timer timer, gint64 start)
+{
+  if (stats && stats->timing) {
+    stats->ns[timer] += stats_clock(stats) - start;
+  }
+}
+
+static inline void
+stats_add(struct statistics *stats, enum stats_counter counter, guint64 n)
+{
+  if (stats) {
+    stats->count[counter] += n;
+  }
+}
+
+void
+stats_merge(struct statistics *into, const struct statistics *from);
+
+void
+stats_report_init(struct stats_report *report, enum stats_format format);
+
+/* Record a statement and add it to the total */
+void
+stats_report_add(struct stats_report *report, const gchar *filename,
+                 const struct statistics *stats);
+
+/* Print the report to stderr */
+void
+stats_report_print(const struct stats_report *report);
+
+void
+stats_report_clear(struct stats_report *report);
+
+#endif /* STATS_H__ */
@@ -0,0 +1,848 @@
+#include <glib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "log.h"
+#include "output.h"
+#include "store.h"
+
+#define STORE_MAGIC                "AMEXSTO"
+#define STORE_VERSION              1
+/* No suffix (main card) or no location */
+#define STORE_NONE                 G_MAXUINT32
+
+DEFINE_GQUARK("amex_parser");
+
+/*
+ * The file is the header followed by the sections below, in this order.
+ * Strings are referred to by offset, everything else by index.
+ */
+struct store_header {
+  gchar magic[8];
+  guint32 version;
+  guint32 n_transactions;
+  guint32 n_statements;
+  guint32 n_cards;
+  guint32 n_locations;
+  /* Indexes of the transactions of every card and then every location */
+  guint32 n_postings;
+  guint32 strings_len;
+  guint32 reserved;
+};
+
+/* Sorted by date, process date, statement and position in the statement */
+struct store_transaction {
+  amex_amount amount;
+  amex_date date;
+  amex_date process_date;
+  guint32 statement;
+  guint32 seq;
+  guint32 card;
+  guint32 location;
+  guint32 details;
+  guint32 reserved;
+};
+
+struct store_statement {
+  guint32 ocr;
+  guint32 filename;
+  amex_date due_date;
+};
+
+struct store_card {
+  guint32 holder;
+  guint32 suffix;
+  guint32 postings;
+  guint32 n_postings;
+};
+
+struct store_location {
+  guint32 name;
+  guint32 postings;
+  guint32 n_postings;
+};
+
+struct amex_store {
+  GMappedFile *map;
+  const struct store_header *hdr;
+  const struct store_transaction *transactions;
+  const struct store_statement *statements;
+  const struct store_card *cards;
+  const struct store_location *locations;
+  const guint32 *postings;
+  const gchar *strings;
+};
+
+static gboolean
+attach_file(struct amex_store *store, const gchar *contents, gsize len,
+            GError **err)
+{
+  const struct store_header *hdr = (const struct store_header *) contents;
+  const gchar *p = contents;
+  gsize need;
+
+  if (len < sizeof(*hdr) ||
+      memcmp(hdr->magic, STORE_MAGIC, sizeof(hdr->magic)) != 0) {
+    SET_GERROR(err, -1, "not a transaction store");
+    return FALSE;
+  } else if (hdr->version != STORE_VERSION) {
+    SET_GERROR(err, -1, "unsupported transaction store version %u",
+               hdr->version);
+    return FALSE;
+  }
+
+  need = sizeof(*hdr) +
+         (gsize) hdr->n_transactions * sizeof(struct store_transaction) +
+         (gsize) hdr->n_statements * sizeof(struct store_statement) +
+         (gsize) hdr->n_cards * sizeof(struct store_card) +
+         (gsize) hdr->n_locations * sizeof(struct store_location) +
+         (gsize) hdr->n_postings * sizeof(guint32) + hdr->strings_len;
+  if (need != len) {
+    SET_GERROR(err, -1, "corrupt transaction store (size mismatch)");
+    return FALSE;
+  }
+
+  store->hdr = hdr;
+  p += sizeof(*hdr);
+  store->transactions = (const struct store_transaction *) p;
+  p += hdr->n_transactions * sizeof(struct store_transaction);
+  store->statements = (const struct store_statement *) p;
+  p += hdr->n_statements * sizeof(struct store_statement);
+  store->cards = (const struct store_card *) p;
+  p += hdr->n_cards * sizeof(struct store_card);
+  store->locations = (const struct store_location *) p;
+  p += hdr->n_locations * sizeof(struct store_location);
+  store->postings = (const guint32 *) p;
+  p += hdr->n_postings * sizeof(guint32);
+  store->strings = p;
+
+  return TRUE;
+}
+
+static gboolean
+valid_postings(const struct amex_store *store, guint32 first, guint32 n)
+{
+  const struct store_header *hdr = store->hdr;
+  guint32 i;
+
+  if (first > hdr->n_postings || n > hdr->n_postings - first) {
+    return FALSE;
+  }
+
+  /* Ascending, so they are by date as well */
+  for (i = first; i < first + n; i++) {
+    if (store->postings[i] >= hdr->n_transactions ||
+        (i > first && store->postings[i] <= store->postings[i - 1])) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* The file comes from disk, check everything once before trusting it */
+static gboolean
+validate_file(const struct amex_store *store, GError **err)
+{
+  const struct store_header *hdr = store->hdr;
+  guint32 len = hdr->strings_len;
+  guint32 i;
+
+  if (!len || store->strings[len - 1] != '\0') {
+    goto out_corrupt;
+  }
+
+  for (i = 0; i < hdr->n_transactions; i++) {
+    const struct store_transaction *t = &store->transactions[i];
+
+    if (t->statement >= hdr->n_statements || t->card >= hdr->n_cards ||
+        (t->location != STORE_NONE && t->location >= hdr->n_locations) ||
+        t->details >= len ||
+        (i && t->date < store->transactions[i - 1].date)) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < hdr->n_statements; i++) {
+    const struct store_statement *s = &store->statements[i];
+
+    if (s->ocr >= len || s->filename >= len) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < hdr->n_cards; i++) {
+    const struct store_card *c = &store->cards[i];
+
+    if (c->holder >= len || (c->suffix != STORE_NONE && c->suffix >= len) ||
+        !valid_postings(store, c->postings, c->n_postings)) {
+      goto out_corrupt;
+    }
+  }
+  for (i = 0; i < hdr->n_locations; i++) {
+    const struct store_location *l = &store->locations[i];
+
+    if (l->name >= len || !valid_postings(store, l->postings, l->n_postings)) {
+      goto out_corrupt;
+    }
+  }
+
+  return TRUE;
+
+out_corrupt:
+  SET_GERROR(err, -1, "corrupt transaction store");
+  return FALSE;
+}
+
+struct amex_store *
+amex_store_open(const gchar *filename, GError **err)
+{
+  struct amex_store *store;
+
+  g_assert(filename);
+
+  store = g_new0(struct amex_store, 1);
+  if ((store->map = g_mapped_file_new(filename, FALSE, err)) == NULL) {
+    g_free(store);
+    return NULL;
+  }
+
+  if (!attach_file(store, g_mapped_file_get_contents(store->map),
+                   g_mapped_file_get_length(store->map), err) ||
+      !validate_file(store, err)) {
+    g_prefix_error(err, "%s: ", filename);
+    amex_store_close(store);
+    return NULL;
+  }
+
+  log_info(LOG_CAT_GENERAL, "Mapped %u transaction(s) of %u statement(s) "
+           "from '%s'", store->hdr->n_transactions, store->hdr->n_statements,
+           filename);
+
+  return store;
+}
+
+void
+amex_store_close(struct amex_store *store)
+{
+  if (!store) {
+    return;
+  }
+
+  g_mapped_file_unref(store->map);
+  g_free(store);
+}
+
+guint
+amex_store_transactions(const struct amex_store *store)
+{
+  g_assert(store);
+
+  return store->hdr->n_transactions;
+}
+
+guint
+amex_store_statements(const struct amex_store *store)
+{
+  g_assert(store);
+
+  return store->hdr->n_statements;
+}
+
+/* Query ----------------------------------------------------------------- */
+
+/* Index of the transaction at pos of the list, or of all transactions */
+static inline guint32
+posting(const guint32 *list, guint32 pos)
+{
+  return list ? list[pos] : pos;
+}
+
+/* First position in the list with a date not before date */
+static guint32
+lower_bound(const struct amex_store *store, const guint32 *list, guint32 n,
+            amex_date date)
+{
+  guint32 lo = 0;
+  guint32 hi = n;
+
+  while (lo < hi) {
+    guint32 mid = lo + (hi - lo) / 2;
+
+    if (store->transactions[posting(list, mid)].date < date) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* Append the transactions of the list in the date range of the filter */
+static void
+add_date_range(const struct amex_store *store, const guint32 *list,
+               guint32 n, const struct amex_store_filter *filter,
+               GArray *matches)
+{
+  guint32 first = filter->from ? lower_bound(store, list, n, filter->from) : 0;
+  guint32 end = filter->to ? lower_bound(store, list, n, filter->to + 1) : n;
+  guint32 i;
+
+  for (i = first; i < end; i++) {
+    guint32 idx = posting(list, i);
+
+    g_array_append_val(matches, idx);
+  }
+}
+
+static gboolean
+card_matches(const struct amex_store *store, const struct store_card *c,
+             const gchar *card)
+{
+  const gchar *holder = store->strings + c->holder;
+  gsize holder_len = strlen(holder);
+
+  if (c->suffix == STORE_NONE) {
+    return !g_ascii_strcasecmp(holder, card);
+  }
+
+  /* HOLDER-SUFFIX, or just SUFFIX */
+  return !g_strcmp0(store->strings + c->suffix, card) ||
+         (!g_ascii_strncasecmp(holder, card, holder_len) &&
+          card[holder_len] == '-' &&
+          !g_strcmp0(store->strings + c->suffix, card + holder_len + 1));
+}
+
+static gboolean
+contains_ascii_ci(const gchar *haystack, const gchar *needle, gsize len)
+{
+  for (; *haystack; haystack++) {
+    if (!g_ascii_strncasecmp(haystack, needle, len)) {
+      return TRUE;
+    }
+  }
+
+  return !len;
+}
+
+static gint
+compare_postings(gconstpointer a, gconstpointer b)
+{
+  guint32 pa = *(const guint32 *) a;
+  guint32 pb = *(const guint32 *) b;
+
+  return pa < pb ? -1 : pa > pb;
+}
+
+/* Allow the card or location, and add its list, returns the list length */
+static guint32
+select_postings(GArray *postings, gboolean *selected, guint32 id,
+                guint32 first, guint32 n)
+{
+  guint32 range[2] = { first, n };
+
+  selected[id] = TRUE;
+  g_array_append_vals(postings, range, 2);
+
+  return n;
+}
+
+guint
+amex_store_query(const struct amex_store *store,
+                 const struct amex_store_filter *filter, amex_store_func func,
+                 gpointer user_data)
+{
+  const struct store_header *hdr;
+  gboolean *cards = NULL;
+  gboolean *locations = NULL;
+  GArray *card_lists = NULL;
+  GArray *location_lists = NULL;
+  GArray *lists = NULL;
+  GArray *matches;
+  guint32 n_card = 0;
+  guint32 n_location = 0;
+  gsize details_len = 0;
+  guint count = 0;
+  guint32 i;
+
+  g_assert(store);
+  g_assert(filter);
+  g_assert(func);
+
+  hdr = store->hdr;
+  matches = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+  if (filter->card) {
+    cards = g_new0(gboolean, hdr->n_cards);
+    card_lists = g_array_new(FALSE, FALSE, sizeof(guint32));
+    for (i = 0; i < hdr->n_cards; i++) {
+      const struct store_card *c = &store->cards[i];
+
+      if (card_matches(store, c, filter->card)) {
+        n_card += select_postings(card_lists, cards, i, c->postings,
+                                  c->n_postings);
+      }
+    }
+    lists = card_lists;
+  }
+  if (filter->location) {
+    locations = g_new0(gboolean, hdr->n_locations);
+    location_lists = g_array_new(FALSE, FALSE, sizeof(guint32));
+    for (i = 0; i < hdr->n_locations; i++) {
+      const struct store_location *l = &store->locations[i];
+
+      if (!g_ascii_strcasecmp(store->strings + l->name, filter->location)) {
+        n_location += select_postings(location_lists, locations, i,
+                                      l->postings, l->n_postings);
+      }
+    }
+    if (!lists || n_location < n_card) {
+      lists = location_lists;
+    }
+  }
+
+  /* The date range of the shortest lists, or of all transactions */
+  if (!lists) {
+    add_date_range(store, NULL, hdr->n_transactions, filter, matches);
+  } else {
+    for (i = 0; i < lists->len; i += 2) {
+      guint32 first = g_array_index(lists, guint32, i);
+      guint32 n = g_array_index(lists, guint32, i + 1);
+
+      add_date_range(store, store->postings + first, n, filter, matches);
+    }
+    /* Back to date order if more than one list matched */
+    if (lists->len > 2) {
+      g_array_sort(matches, compare_postings);
+    }
+  }
+
+  if (filter->details) {
+    details_len = strlen(filter->details);
+  }
+  for (i = 0; i < matches->len; i++) {
+    const struct store_transaction *t;
+    const struct store_card *c;
+    struct amex_store_row row;
+
+    t = &store->transactions[g_array_index(matches, guint32, i)];
+    if ((cards && !cards[t->card]) ||
+        (locations && (t->location == STORE_NONE ||
+                       !locations[t->location])) ||
+        (filter->has_min && t->amount < filter->min) ||
+        (filter->has_max && t->amount > filter->max) ||
+        (filter->details &&
+         !contains_ascii_ci(store->strings + t->details, filter->details,
+                            details_len))) {
+      continue;
+    }
+
+    c = &store->cards[t->card];
+    row.holder = store->strings + c->holder;
+    row.suffix = c->suffix != STORE_NONE ? store->strings + c->suffix : NULL;
+    row.location = t->location != STORE_NONE ?
+                   store->strings + store->locations[t->location].name : NULL;
+    row.details = store->strings + t->details;
+    row.ocr = store->strings + store->statements[t->statement].ocr;
+    row.date = t->date;
+    row.process_date = t->process_date;
+    row.amount = t->amount;
+    func(&row, user_data);
+    count++;
+  }
+
+  if (card_lists) {
+    g_array_free(card_lists, TRUE);
+  }
+  if (location_lists) {
+    g_array_free(location_lists, TRUE);
+  }
+  g_free(locations);
+  g_free(cards);
+  g_array_free(matches, TRUE);
+
+  return count;
+}
+
+/* Builder ---------------------------------------------------------------- */
+
+struct store_builder {
+  GByteArray *strings;
+  /* String -> offset + 1 */
+  GHashTable *offsets;
+  GArray *transactions;
+  GArray *statements;
+  GArray *cards;
+  /* Holder and suffix offsets -> card index + 1 */
+  GHashTable *card_ids;
+  GArray *locations;
+  /* Name offset + 1 -> location index + 1 */
+  GHashTable *location_ids;
+};
+
+static void
+builder_init(struct store_builder *b)
+{
+  b->strings = g_byte_array_new();
+  b->offsets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  b->transactions = g_array_new(FALSE, FALSE,
+                                sizeof(struct store_transaction));
+  b->statements = g_array_new(FALSE, FALSE, sizeof(struct store_statement));
+  b->cards = g_array_new(FALSE, FALSE, sizeof(struct store_card));
+  b->card_ids = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                      NULL);
+  b->locations = g_array_new(FALSE, FALSE, sizeof(struct store_location));
+  b->location_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+  /* Offset 0 is the empty string */
+  g_byte_array_append(b->strings, (const guint8 *) "", 1);
+}
+
+static void
+builder_clear(struct store_builder *b)
+{
+  g_hash_table_destroy(b->location_ids);
+  g_array_free(b->locations, TRUE);
+  g_hash_table_destroy(b->card_ids);
+  g_array_free(b->cards, TRUE);
+  g_array_free(b->statements, TRUE);
+  g_array_free(b->transactions, TRUE);
+  g_hash_table_destroy(b->offsets);
+  g_byte_array_free(b->strings, TRUE);
+}
+
+static guint32
+builder_string(struct store_builder *b, const gchar *str)
+{
+  gpointer off;
+
+  if (!*str) {
+    return 0;
+  } else if ((off = g_hash_table_lookup(b->offsets, str)) != NULL) {
+    return GPOINTER_TO_UINT(off) - 1;
+  }
+
+  off = GUINT_TO_POINTER(b->strings->len + 1);
+  g_byte_array_append(b->strings, (const guint8 *) str, strlen(str) + 1);
+  g_hash_table_insert(b->offsets, g_strdup(str), off);
+
+  return GPOINTER_TO_UINT(off) - 1;
+}
+
+static guint32
+builder_card(struct store_builder *b, const gchar *holder,
+             const gchar *suffix)
+{
+  struct store_card card = { 0, };
+  gint64 *stored;
+  gint64 key;
+  gpointer id;
+
+  card.holder = builder_string(b, holder);
+  card.suffix = suffix ? builder_string(b, suffix) : STORE_NONE;
+  key = ((gint64) card.holder << 32) | card.suffix;
+  if ((id = g_hash_table_lookup(b->card_ids, &key)) != NULL) {
+    return GPOINTER_TO_UINT(id) - 1;
+  }
+
+  g_array_append_val(b->cards, card);
+  stored = g_new(gint64, 1);
+  *stored = key;
+  g_hash_table_insert(b->card_ids, stored, GUINT_TO_POINTER(b->cards->len));
+
+  return b->cards->len - 1;
+}
+
+static guint32
+builder_location(struct store_builder *b, const gchar *name)
+{
+  struct store_location location = { 0, };
+  gpointer id;
+
+  if (!name) {
+    return STORE_NONE;
+  }
+
+  location.name = builder_string(b, name);
+  if ((id = g_hash_table_lookup(b->location_ids,
+                                GUINT_TO_POINTER(location.name + 1))) != NULL) {
+    return GPOINTER_TO_UINT(id) - 1;
+  }
+
+  g_array_append_val(b->locations, location);
+  g_hash_table_insert(b->location_ids, GUINT_TO_POINTER(location.name + 1),
+                      GUINT_TO_POINTER(b->locations->len));
+
+  return b->locations->len - 1;
+}
+
+static guint32
+builder_statement(struct store_builder *b, const gchar *ocr,
+                  const gchar *filename, amex_date due_date)
+{
+  struct store_statement s;
+
+  s.ocr = builder_string(b, ocr);
+  s.filename = builder_string(b, filename);
+  s.due_date = due_date;
+  g_array_append_val(b->statements, s);
+
+  return b->statements->len - 1;
+}
+
+static void
+builder_transaction(struct store_builder *b, guint32 statement, guint32 seq,
+                    guint32 card, const gchar *location, const gchar *details,
+                    amex_date date, amex_date process_date, amex_amount amount)
+{
+  struct store_transaction t = { 0, };
+
+  t.amount = amount;
+  t.date = date;
+  t.process_date = process_date;
+  t.statement = statement;
+  t.seq = seq;
+  t.card = card;
+  t.location = builder_location(b, location);
+  t.details = builder_string(b, details);
+  g_array_append_val(b->transactions, t);
+}
+
+static gint
+compare_transactions(gconstpointer a, gconstpointer b)
+{
+  const struct store_transaction *ta = a;
+  const struct store_transaction *tb = b;
+
+  if (ta->date != tb->date) {
+    return ta->date < tb->date ? -1 : 1;
+  } else if (ta->process_date != tb->process_date) {
+    return ta->process_date < tb->process_date ? -1 : 1;
+  } else if (ta->statement != tb->statement) {
+    return ta->statement < tb->statement ? -1 : 1;
+  }
+
+  return ta->seq < tb->seq ? -1 : ta->seq > tb->seq;
+}
+
+/* Copy what is kept of the old store */
+static void
+builder_add_store(struct store_builder *b, const struct amex_store *store,
+                  GHashTable *replaced)
+{
+  const struct store_header *hdr = store->hdr;
+  guint32 *statements;
+  guint32 i;
+
+  statements = g_new(guint32, hdr->n_statements);
+  for (i = 0; i < hdr->n_statements; i++) {
+    const struct store_statement *s = &store->statements[i];
+    const gchar *ocr = store->strings + s->ocr;
+
+    statements[i] = g_hash_table_contains(replaced, ocr) ? STORE_NONE :
+                    builder_statement(b, ocr, store->strings + s->filename,
+                                      s->due_date);
+  }
+
+  for (i = 0; i < hdr->n_transactions; i++) {
+    const struct store_transaction *t = &store->transactions[i];
+    const struct store_card *c = &store->cards[t->card];
+
+    if (statements[t->statement] == STORE_NONE) {
+      continue;
+    }
+    builder_transaction(b, statements[t->statement], t->seq,
+                        builder_card(b, store->strings + c->holder,
+                                     c->suffix != STORE_NONE ?
+                                     store->strings + c->suffix : NULL),
+                        t->location != STORE_NONE ?
+                        store->strings +
+                        store->locations[t->location].name : NULL,
+                        store->strings + t->details, t->date,
+                        t->process_date, t->amount);
+  }
+
+  g_free(statements);
+}
+
+static void
+builder_add_statement(struct store_builder *b, const struct amex_statement *st)
+{
+  GPtrArray *cards = amex_statement_cards(st);
+  guint32 statement;
+  guint32 seq = 0;
+  guint i, j;
+
+  statement = builder_statement(b, amex_statement_ocr(st),
+                                amex_statement_filename(st),
+                                amex_statement_due_date(st));
+  for (i = 0; i < cards->len; i++) {
+    const struct amex_card *c = g_ptr_array_index(cards, i);
+    guint32 card = builder_card(b, c->holder, c->suffix);
+
+    for (j = 0; j < c->transactions->len; j++) {
+      const struct amex_transaction *t = g_ptr_array_index(c->transactions,
+                                                           j);
+
+      builder_transaction(b, statement, seq++, card, t->location, t->details,
+                          t->date, t->process_date, t->amount);
+    }
+  }
+}
+
+/* Sort the transactions and fill in the postings of cards and locations */
+static GArray *
+builder_finish(struct store_builder *b)
+{
+  GArray *postings;
+  guint32 *next;
+  guint32 n_located = 0;
+  guint32 i;
+
+  g_array_sort(b->transactions, compare_transactions);
+
+  for (i = 0; i < b->transactions->len; i++) {
+    const struct store_transaction *t = &g_array_index(b->transactions,
+                                                       struct store_transaction,
+                                                       i);
+
+    g_array_index(b->cards, struct store_card, t->card).n_postings++;
+    if (t->location != STORE_NONE) {
+      g_array_index(b->locations, struct store_location,
+                    t->location).n_postings++;
+      n_located++;
+    }
+  }
+
+  postings = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+                               b->transactions->len + n_located);
+  g_array_set_size(postings, b->transactions->len + n_located);
+
+  /* Cards first, then locations, each one after the other */
+  next = g_new(guint32, b->cards->len + b->locations->len);
+  for (i = 0, n_located = 0; i < b->cards->len; i++) {
+    struct store_card *c = &g_array_index(b->cards, struct store_card, i);
+
+    c->postings = next[i] = n_located;
+    n_located += c->n_postings;
+  }
+  for (i = 0; i < b->locations->len; i++) {
+    struct store_location *l = &g_array_index(b->locations,
+                                              struct store_location, i);
+
+    l->postings = next[b->cards->len + i] = n_located;
+    n_located += l->n_postings;
+  }
+
+  /* In transaction order, so every list is by date */
+  for (i = 0; i < b->transactions->len; i++) {
+    const struct store_transaction *t = &g_array_index(b->transactions,
+                                                       struct store_transaction,
+                                                       i);
+
+    g_array_index(postings, guint32, next[t->card]++) = i;
+    if (t->location != STORE_NONE) {
+      g_array_index(postings, guint32,
+                    next[b->cards->len + t->location]++) = i;
+    }
+  }
+  g_free(next);
+
+  return postings;
+}
+
+static gboolean
+builder_write(struct store_builder *b, GArray *postings,
+              const gchar *filename, GError **err)
+{
+  struct store_header hdr = { STORE_MAGIC, };
+  struct output *out;
+
+  hdr.version = STORE_VERSION;
+  hdr.n_transactions = b->transactions->len;
+  hdr.n_statements = b->statements->len;
+  hdr.n_cards = b->cards->len;
+  hdr.n_locations = b->locations->len;
+  hdr.n_postings = postings->len;
+  hdr.strings_len = b->strings->len;
+
+  if ((out = output_open(filename, err)) == NULL) {
+    return FALSE;
+  }
+  output_write(out, (const gchar *) &hdr, sizeof(hdr));
+  output_write(out, b->transactions->data,
+               b->transactions->len * sizeof(struct store_transaction));
+  output_write(out, b->statements->data,
+               b->statements->len * sizeof(struct store_statement));
+  output_write(out, b->cards->data,
+               b->cards->len * sizeof(struct store_card));
+  output_write(out, b->locations->data,
+               b->locations->len * sizeof(struct store_location));
+  output_write(out, postings->data, postings->len * sizeof(guint32));
+  output_write(out, (const gchar *) b->strings->data, b->strings->len);
+
+  return output_close(out, err);
+}
+
+gboolean
+amex_store_update(const gchar *filename, struct amex_statement **sts,
+                  guint n, guint *skipped, GError **err)
+{
+  struct store_builder b;
+  struct amex_store *old = NULL;
+  GHashTable *replaced;
+  GArray *postings;
+  gboolean ret = FALSE;
+  guint i;
+
+  g_assert(filename);
+  g_assert(sts || !n);
+  g_assert(skipped);
+
+  /* OCR -> the last statement with it + 1 */
+  replaced = g_hash_table_new(g_str_hash, g_str_equal);
+  for (i = 0; i < n; i++) {
+    const gchar *ocr = amex_statement_ocr(sts[i]);
+
+    if (!ocr) {
+      log_error(LOG_CAT_OUTPUT, "Could not store '%s': no OCR number, the "
+                "statement can not be stored", amex_statement_filename(sts[i]));
+      (*skipped)++;
+      continue;
+    }
+    g_hash_table_insert(replaced, (gpointer) ocr, GUINT_TO_POINTER(i + 1));
+  }
+
+  if (g_file_test(filename, G_FILE_TEST_EXISTS) &&
+      (old = amex_store_open(filename, err)) == NULL) {
+    g_hash_table_destroy(replaced);
+    return FALSE;
+  }
+
+  builder_init(&b);
+  if (old) {
+    builder_add_store(&b, old, replaced);
+  }
+  for (i = 0; i < n; i++) {
+    const gchar *ocr = amex_statement_ocr(sts[i]);
+
+    if (ocr && GPOINTER_TO_UINT(g_hash_table_lookup(replaced, ocr)) == i + 1) {
+      builder_add_statement(&b, sts[i]);
+    }
+  }
+  postings = builder_finish(&b);
+
+  if (!builder_write(&b, postings, filename, err)) {
+    goto out;
+  }
+
+  log_info(LOG_CAT_OUTPUT, "Stored %u transaction(s) of %u statement(s) in "
+           "'%s'", b.transactions->len, b.statements->len, filename);
+  ret = TRUE;
+  /* fall through */
+out:
+  g_array_free(postings, TRUE);
+  builder_clear(&b);
+  amex_store_close(old);
+  g_hash_table_destroy(replaced);
+
+  return ret;
+}
@@ -0,0 +1,83 @@
+#ifndef STORE_H__
+#define STORE_H__
+/*
+ * store.h - Parsed transactions kept in a file, for querying
+ *
+ * The store is a single file that is mapped and used as is. It holds the
+ * transactions of all statements added to it sorted by date, and for every
+ * card and location the (also date sorted) list of its transactions, so a
+ * query only looks at the transactions of the date range of the smallest
+ * list that applies. Statements are identified by their OCR number, adding
+ * a statement again replaces its transactions.
+ */
+#include <glib.h>
+
+#include "amexparser.h"
+
+#define AMEX_STORE_SUFFIX          ".amexstore"
+
+struct amex_store;
+
+/* Anything left unset (0 or NULL) matches every transaction */
+struct amex_store_filter {
+  /* Inclusive */
+  amex_date from;
+  amex_date to;
+  /* Card as by amex_card_format(), or just the suffix of an extra card */
+  const gchar *card;
+  /* Canonical location name */
+  const gchar *location;
+  /* Inclusive, if has_min / has_max */
+  gboolean has_min;
+  amex_amount min;
+  gboolean has_max;
+  amex_amount max;
+  /* Found in the details, ignoring ASCII case */
+  const gchar *details;
+};
+
+struct amex_store_row {
+  const gchar *holder;
+  /* NULL for the main card */
+  const gchar *suffix;
+  /* NULL if unknown */
+  const gchar *location;
+  const gchar *details;
+  const gchar *ocr;
+  amex_date date;
+  amex_date process_date;
+  amex_amount amount;
+};
+
+typedef void (*amex_store_func)(const struct amex_store_row *row,
+                                gpointer user_data);
+
+/* Map a store for querying */
+struct amex_store *
+amex_store_open(const gchar *filename, GError **err);
+
+void
+amex_store_close(struct amex_store *store);
+
+guint
+amex_store_transactions(const struct amex_store *store);
+
+guint
+amex_store_statements(const struct amex_store *store);
+
+/* Call func for every matching transaction by date, returns how many */
+guint
+amex_store_query(const struct amex_store *store,
+                 const struct amex_store_filter *filter, amex_store_func func,
+                 gpointer user_data);
+
+/*
+ * Add statements to the store, created if missing, and replace the file.
+ * Statements without an OCR number can't be told apart, they are logged and
+ * counted in skipped.
+ */
+gboolean
+amex_store_update(const gchar *filename, struct amex_statement **sts,
+                  guint n, guint *skipped, GError **err);
+
+#endif /* STORE_H__ */
@@ -0,0 +1,633 @@
+#include <glib.h>
+#include <string.h>
+
+#include "amex_amount.h"
+#include "amex_date.h"
+#include "summary.h"
+
+/* Rolled up over all cards */
+#define ALL_CARDS                  G_MAXUINT
+/* Month of transactions without a valid date */
+#define UNKNOWN_MONTH              0
+#define ALL_MONTHS                 G_MAXUINT
+/* Location pointer for rolled up over all locations */
+#define ALL_LOCATIONS              ((const gchar *) summary_all_locations)
+
+static const gchar summary_all_locations[] = "";
+
+struct summary_total {
+  guint64 count;
+  amex_amount amount;
+};
+
+/* An accumulator, and the key it is found by */
+struct summary_group {
+  /* Index into cards */
+  guint card;
+  /* Years since 0 * 12 + month - 1, or UNKNOWN_MONTH */
+  guint month;
+  /* From the string chunk, so compared by pointer, NULL if unknown */
+  const gchar *location;
+  struct summary_total sum;
+};
+
+struct summary_merchant {
+  const gchar *details;
+  struct summary_total sum;
+};
+
+struct amex_summary {
+  /* All strings, each only once */
+  GStringChunk *strings;
+  /* Card names from the string chunk, in the order they were first seen */
+  GPtrArray *cards;
+  /* Card name -> index + 1 */
+  GHashTable *card_index;
+  /* struct summary_group, also the key */
+  GHashTable *groups;
+  /* Details from the string chunk -> struct summary_merchant */
+  GHashTable *merchants;
+  /* Strings of the card being added -> the same from the string chunk */
+  GHashTable *seen;
+  struct summary_total total;
+};
+
+static guint
+hash_group(gconstpointer key)
+{
+  const struct summary_group *g = key;
+
+  return (g->card * 0x9e3779b1u) ^ (g->month * 0x85ebca6bu) ^
+         g_direct_hash(g->location);
+}
+
+static gboolean
+equal_group(gconstpointer a, gconstpointer b)
+{
+  const struct summary_group *ga = a;
+  const struct summary_group *gb = b;
+
+  return ga->card == gb->card && ga->month == gb->month &&
+         ga->location == gb->location;
+}
+
+static void
+total_add(struct summary_total *into, const struct summary_total *from)
+{
+  into->count += from->count;
+  into->amount += from->amount;
+}
+
+struct amex_summary *
+amex_summary_new(void)
+{
+  struct amex_summary *summary;
+
+  summary = g_new0(struct amex_summary, 1);
+  summary->strings = g_string_chunk_new(4096);
+  summary->cards = g_ptr_array_new();
+  summary->card_index = g_hash_table_new(g_str_hash, g_str_equal);
+  summary->groups = g_hash_table_new_full(hash_group, equal_group, g_free,
+                                          NULL);
+  summary->merchants = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL, g_free);
+  summary->seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  return summary;
+}
+
+void
+amex_summary_free(struct amex_summary *summary)
+{
+  if (!summary) {
+    return;
+  }
+
+  g_hash_table_destroy(summary->seen);
+  g_hash_table_destroy(summary->merchants);
+  g_hash_table_destroy(summary->groups);
+  g_hash_table_destroy(summary->card_index);
+  g_ptr_array_free(summary->cards, TRUE);
+  g_string_chunk_free(summary->strings);
+  g_free(summary);
+}
+
+static guint
+card_index(struct amex_summary *summary, const gchar *card)
+{
+  gpointer idx;
+  gchar *name;
+
+  if ((idx = g_hash_table_lookup(summary->card_index, card)) != NULL) {
+    return GPOINTER_TO_UINT(idx) - 1;
+  }
+
+  name = g_string_chunk_insert_const(summary->strings, card);
+  g_ptr_array_add(summary->cards, name);
+  g_hash_table_insert(summary->card_index, name,
+                      GUINT_TO_POINTER(summary->cards->len));
+
+  return summary->cards->len - 1;
+}
+
+/* The string from the chunk, the same string is usually seen many times */
+static const gchar *
+intern_string(struct amex_summary *summary, const gchar *str)
+{
+  const gchar *interned;
+
+  if (!str) {
+    return NULL;
+  } else if ((interned = g_hash_table_lookup(summary->seen, str)) == NULL) {
+    interned = g_string_chunk_insert_const(summary->strings, str);
+    g_hash_table_insert(summary->seen, (gpointer) str, (gpointer) interned);
+  }
+
+  return interned;
+}
+
+static void
+group_add(GHashTable *groups, const struct summary_group *key,
+          const struct summary_total *sum)
+{
+  struct summary_group *g;
+
+  if ((g = g_hash_table_lookup(groups, key)) == NULL) {
+    g = g_new(struct summary_group, 1);
+    *g = *key;
+    memset(&g->sum, 0, sizeof(g->sum));
+    g_hash_table_add(groups, g);
+  }
+  total_add(&g->sum, sum);
+}
+
+static void
+merchant_add(struct amex_summary *summary, const gchar *details,
+             const struct summary_total *sum)
+{
+  struct summary_merchant *m;
+
+  if ((m = g_hash_table_lookup(summary->merchants, details)) == NULL) {
+    m = g_new0(struct summary_merchant, 1);
+    m->details = details;
+    g_hash_table_insert(summary->merchants, (gpointer) details, m);
+  }
+  total_add(&m->sum, sum);
+}
+
+static guint
+month_of(amex_date date)
+{
+  if (date == AMEX_DATE_INVALID) {
+    return UNKNOWN_MONTH;
+  }
+
+  return amex_date_year(date) * 12 + amex_date_month(date) - 1;
+}
+
+void
+amex_summary_add_card(struct amex_summary *summary, const gchar *card,
+                      const GPtrArray *transactions)
+{
+  struct summary_group key = { 0, };
+  guint i;
+
+  g_assert(summary);
+  g_assert(card);
+  g_assert(transactions);
+
+  key.card = card_index(summary, card);
+  for (i = 0; i < transactions->len; i++) {
+    const struct amex_transaction *t = g_ptr_array_index(transactions, i);
+    struct summary_total sum = { 1, t->amount };
+
+    key.month = month_of(t->date);
+    key.location = intern_string(summary, t->location);
+    group_add(summary->groups, &key, &sum);
+    merchant_add(summary, intern_string(summary, t->details), &sum);
+    total_add(&summary->total, &sum);
+  }
+
+  /* The strings seen may be freed after this */
+  g_hash_table_remove_all(summary->seen);
+}
+
+void
+amex_summary_add(struct amex_summary *summary,
+                 const struct amex_statement *st)
+{
+  GPtrArray *cards;
+  gchar cbuf[AMEX_CARD_STR_LEN];
+  guint i;
+
+  g_assert(summary);
+  g_assert(st);
+
+  cards = amex_statement_cards(st);
+  for (i = 0; i < cards->len; i++) {
+    struct amex_card *c = g_ptr_array_index(cards, i);
+
+    amex_summary_add_card(summary, amex_card_format(c, cbuf, sizeof(cbuf)),
+                          c->transactions);
+  }
+}
+
+void
+amex_summary_merge(struct amex_summary *into, const struct amex_summary *from)
+{
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  g_assert(into);
+  g_assert(from);
+
+  /* Keep the order the cards were seen in */
+  for (i = 0; i < from->cards->len; i++) {
+    card_index(into, g_ptr_array_index(from->cards, i));
+  }
+
+  g_hash_table_iter_init(&iter, from->groups);
+  while (g_hash_table_iter_next(&iter, &value, NULL)) {
+    const struct summary_group *g = value;
+    struct summary_group key = { 0, };
+
+    key.card = card_index(into, g_ptr_array_index(from->cards, g->card));
+    key.month = g->month;
+    key.location = g->location ?
+                   g_string_chunk_insert_const(into->strings, g->location) :
+                   NULL;
+    group_add(into->groups, &key, &g->sum);
+  }
+
+  g_hash_table_iter_init(&iter, from->merchants);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    const struct summary_merchant *m = value;
+
+    merchant_add(into, g_string_chunk_insert_const(into->strings,
+                                                   m->details), &m->sum);
+  }
+
+  total_add(&into->total, &from->total);
+}
+
+guint64
+amex_summary_transactions(const struct amex_summary *summary)
+{
+  g_assert(summary);
+
+  return summary->total.count;
+}
+
+static gint
+compare_groups(gconstpointer a, gconstpointer b)
+{
+  const struct summary_group *ga = a;
+  const struct summary_group *gb = b;
+
+  if (ga->card != gb->card) {
+    return ga->card < gb->card ? -1 : 1;
+  } else if (ga->month != gb->month) {
+    return ga->month < gb->month ? -1 : 1;
+  } else if (ga->location == gb->location) {
+    return 0;
+  }
+
+  /* Unknown locations go last */
+  if (!ga->location || !gb->location) {
+    return ga->location ? -1 : 1;
+  }
+
+  return g_strcmp0(ga->location, gb->location);
+}
+
+/* Most spent first, then by name */
+static gint
+compare_merchants(gconstpointer a, gconstpointer b)
+{
+  const struct summary_merchant *ma = *(const struct summary_merchant **) a;
+  const struct summary_merchant *mb = *(const struct summary_merchant **) b;
+
+  if (ma->sum.amount != mb->sum.amount) {
+    return ma->sum.amount > mb->sum.amount ? -1 : 1;
+  }
+
+  return strcmp(ma->details, mb->details);
+}
+
+/*
+ * The groups summed up over what isn't kept, sorted by card, month and
+ * location. Cards, months and locations not kept are ALL_*.
+ */
+static GArray *
+rollup(const struct amex_summary *summary, gboolean by_card,
+       gboolean by_month, gboolean by_location)
+{
+  GHashTable *totals;
+  GHashTableIter iter;
+  GArray *groups;
+  gpointer value;
+
+  totals = g_hash_table_new_full(hash_group, equal_group, g_free, NULL);
+  g_hash_table_iter_init(&iter, summary->groups);
+  while (g_hash_table_iter_next(&iter, &value, NULL)) {
+    const struct summary_group *g = value;
+    struct summary_group key = { 0, };
+
+    key.card = by_card ? g->card : ALL_CARDS;
+    key.month = by_month ? g->month : ALL_MONTHS;
+    key.location = by_location ? g->location : ALL_LOCATIONS;
+    group_add(totals, &key, &g->sum);
+  }
+
+  groups = g_array_sized_new(FALSE, FALSE, sizeof(struct summary_group),
+                             g_hash_table_size(totals));
+  g_hash_table_iter_init(&iter, totals);
+  while (g_hash_table_iter_next(&iter, &value, NULL)) {
+    g_array_append_vals(groups, value, 1);
+  }
+  g_hash_table_destroy(totals);
+  g_array_sort(groups, compare_groups);
+
+  return groups;
+}
+
+static GPtrArray *
+top_merchants(const struct amex_summary *summary)
+{
+  GPtrArray *merchants;
+  GHashTableIter iter;
+  gpointer value;
+
+  merchants = g_ptr_array_sized_new(g_hash_table_size(summary->merchants));
+  g_hash_table_iter_init(&iter, summary->merchants);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    g_ptr_array_add(merchants, value);
+  }
+  g_ptr_array_sort(merchants, compare_merchants);
+  if (merchants->len > AMEX_SUMMARY_TOP_MERCHANTS) {
+    g_ptr_array_set_size(merchants, AMEX_SUMMARY_TOP_MERCHANTS);
+  }
+
+  return merchants;
+}
+
+static const gchar *
+format_month(guint month, gchar *buffer, gsize len)
+{
+  if (month == UNKNOWN_MONTH) {
+    g_strlcpy(buffer, "unknown", len);
+  } else {
+    g_snprintf(buffer, len, "%04u-%02u", month / 12, month % 12 + 1);
+  }
+
+  return buffer;
+}
+
+static void
+append_text_total(GString *gs, guint indent, const gchar *name,
+                  const struct summary_total *sum)
+{
+  gchar abuf[AMEX_AMOUNT_STR_LEN];
+
+  abuf[amex_amount_format(sum->amount, abuf)] = '\0';
+  g_string_append_printf(gs, "%*s%-*s %14s SEK %8" G_GUINT64_FORMAT "\n",
+                         indent, "", 50 - indent, name, abuf, sum->count);
+}
+
+void
+amex_summary_append_text(const struct amex_summary *summary, GString *gs)
+{
+  GArray *cards, *card_months, *groups, *months, *locations;
+  GPtrArray *merchants;
+  gchar mbuf[16];
+  guint i, j, k;
+
+  g_assert(summary);
+  g_assert(gs);
+
+  cards = rollup(summary, TRUE, FALSE, FALSE);
+  card_months = rollup(summary, TRUE, TRUE, FALSE);
+  groups = rollup(summary, TRUE, TRUE, TRUE);
+  months = rollup(summary, FALSE, TRUE, FALSE);
+  locations = rollup(summary, FALSE, FALSE, TRUE);
+  merchants = top_merchants(summary);
+
+  g_string_append_printf(gs, "Report for %" G_GUINT64_FORMAT
+                         " transaction(s):\n %-49s %18s %8s\n",
+                         summary->total.count, "Card, month and location",
+                         "Amount", "Count");
+  /* All three are sorted by card, and the last two by month */
+  for (i = 0, j = 0, k = 0; i < cards->len; i++) {
+    const struct summary_group *c = &g_array_index(cards,
+                                                   struct summary_group, i);
+
+    append_text_total(gs, 1, g_ptr_array_index(summary->cards, c->card),
+                      &c->sum);
+    for (; j < card_months->len &&
+           g_array_index(card_months, struct summary_group,
+                         j).card == c->card; j++) {
+      const struct summary_group *m = &g_array_index(card_months,
+                                                     struct summary_group, j);
+
+      append_text_total(gs, 3, format_month(m->month, mbuf, sizeof(mbuf)),
+                        &m->sum);
+      for (; k < groups->len &&
+             g_array_index(groups, struct summary_group, k).card == c->card &&
+             g_array_index(groups, struct summary_group,
+                           k).month == m->month; k++) {
+        const struct summary_group *g = &g_array_index(groups,
+                                                       struct summary_group,
+                                                       k);
+
+        append_text_total(gs, 5, g->location ? g->location : "(unknown)",
+                          &g->sum);
+      }
+    }
+  }
+
+  g_string_append(gs, " By month:\n");
+  for (i = 0; i < months->len; i++) {
+    const struct summary_group *m = &g_array_index(months,
+                                                   struct summary_group, i);
+
+    append_text_total(gs, 3, format_month(m->month, mbuf, sizeof(mbuf)),
+                      &m->sum);
+  }
+
+  g_string_append(gs, " By location:\n");
+  for (i = 0; i < locations->len; i++) {
+    const struct summary_group *l = &g_array_index(locations,
+                                                   struct summary_group, i);
+
+    append_text_total(gs, 3, l->location ? l->location : "(unknown)",
+                      &l->sum);
+  }
+
+  g_string_append(gs, " Top merchants:\n");
+  for (i = 0; i < merchants->len; i++) {
+    const struct summary_merchant *m = g_ptr_array_index(merchants, i);
+
+    append_text_total(gs, 3, m->details, &m->sum);
+  }
+  append_text_total(gs, 1, "Total", &summary->total);
+
+  g_ptr_array_free(merchants, TRUE);
+  g_array_free(locations, TRUE);
+  g_array_free(months, TRUE);
+  g_array_free(groups, TRUE);
+  g_array_free(card_months, TRUE);
+  g_array_free(cards, TRUE);
+}
+
+static void
+append_json_string(GString *gs, const gchar *str)
+{
+  if (!str) {
+    g_string_append(gs, "null");
+    return;
+  }
+
+  g_string_append_c(gs, '"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      g_string_append_c(gs, '\\');
+      g_string_append_c(gs, *str);
+    } else if ((guchar) *str < 0x20) {
+      g_string_append_printf(gs, "\\u%04x", (guchar) *str);
+    } else {
+      g_string_append_c(gs, *str);
+    }
+  }
+  g_string_append_c(gs, '"');
+}
+
+/* Ends an object opened by the caller, with the name already added */
+static void
+append_json_total(GString *gs, const struct summary_total *sum)
+{
+  gchar abuf[AMEX_AMOUNT_STR_LEN];
+
+  abuf[amex_amount_format(sum->amount, abuf)] = '\0';
+  g_string_append_printf(gs, "\"transactions\":%" G_GUINT64_FORMAT
+                         ",\"amount\":%s", sum->count, abuf);
+}
+
+static void
+append_json_month(GString *gs, guint month)
+{
+  gchar mbuf[16];
+
+  g_string_append(gs, "\"month\":");
+  if (month == UNKNOWN_MONTH) {
+    g_string_append(gs, "null");
+  } else {
+    append_json_string(gs, format_month(month, mbuf, sizeof(mbuf)));
+  }
+  g_string_append_c(gs, ',');
+}
+
+void
+amex_summary_append_json(const struct amex_summary *summary, GString *gs)
+{
+  GArray *cards, *card_months, *groups, *months, *locations;
+  GPtrArray *merchants;
+  guint i, j, k;
+
+  g_assert(summary);
+  g_assert(gs);
+
+  cards = rollup(summary, TRUE, FALSE, FALSE);
+  card_months = rollup(summary, TRUE, TRUE, FALSE);
+  groups = rollup(summary, TRUE, TRUE, TRUE);
+  months = rollup(summary, FALSE, TRUE, FALSE);
+  locations = rollup(summary, FALSE, FALSE, TRUE);
+  merchants = top_merchants(summary);
+
+  g_string_append(gs, "{\"cards\":[");
+  for (i = 0, j = 0, k = 0; i < cards->len; i++) {
+    const struct summary_group *c = &g_array_index(cards,
+                                                   struct summary_group, i);
+    guint first_month = j;
+
+    g_string_append(gs, i ? ",{\"card\":" : "{\"card\":");
+    append_json_string(gs, g_ptr_array_index(summary->cards, c->card));
+    g_string_append_c(gs, ',');
+    append_json_total(gs, &c->sum);
+    g_string_append(gs, ",\"months\":[");
+    for (; j < card_months->len &&
+           g_array_index(card_months, struct summary_group,
+                         j).card == c->card; j++) {
+      const struct summary_group *m = &g_array_index(card_months,
+                                                     struct summary_group, j);
+      guint first_location = k;
+
+      g_string_append(gs, j > first_month ? ",{" : "{");
+      append_json_month(gs, m->month);
+      append_json_total(gs, &m->sum);
+      g_string_append(gs, ",\"locations\":[");
+      for (; k < groups->len &&
+             g_array_index(groups, struct summary_group, k).card == c->card &&
+             g_array_index(groups, struct summary_group,
+                           k).month == m->month; k++) {
+        const struct summary_group *g = &g_array_index(groups,
+                                                       struct summary_group,
+                                                       k);
+
+        g_string_append(gs, k > first_location ? ",{\"location\":" :
+                                                 "{\"location\":");
+        append_json_string(gs, g->location);
+        g_string_append_c(gs, ',');
+        append_json_total(gs, &g->sum);
+        g_string_append_c(gs, '}');
+      }
+      g_string_append(gs, "]}");
+    }
+    g_string_append(gs, "]}");
+  }
+
+  g_string_append(gs, "],\"months\":[");
+  for (i = 0; i < months->len; i++) {
+    const struct summary_group *m = &g_array_index(months,
+                                                   struct summary_group, i);
+
+    g_string_append(gs, i ? ",{" : "{");
+    append_json_month(gs, m->month);
+    append_json_total(gs, &m->sum);
+    g_string_append_c(gs, '}');
+  }
+
+  g_string_append(gs, "],\"locations\":[");
+  for (i = 0; i < locations->len; i++) {
+    const struct summary_group *l = &g_array_index(locations,
+                                                   struct summary_group, i);
+
+    g_string_append(gs, i ? ",{\"location\":" : "{\"location\":");
+    append_json_string(gs, l->location);
+    g_string_append_c(gs, ',');
+    append_json_total(gs, &l->sum);
+    g_string_append_c(gs, '}');
+  }
+
+  g_string_append(gs, "],\"top_merchants\":[");
+  for (i = 0; i < merchants->len; i++) {
+    const struct summary_merchant *m = g_ptr_array_index(merchants, i);
+
+    g_string_append(gs, i ? ",{\"details\":" : "{\"details\":");
+    append_json_string(gs, m->details);
+    g_string_append_c(gs, ',');
+    append_json_total(gs, &m->sum);
+    g_string_append_c(gs, '}');
+  }
+
+  g_string_append(gs, "],\"total\":{");
+  append_json_total(gs, &summary->total);
+  g_string_append(gs, "}}");
+
+  g_ptr_array_free(merchants, TRUE);
+  g_array_free(locations, TRUE);
+  g_array_free(months, TRUE);
+  g_array_free(groups, TRUE);
+  g_array_free(card_months, TRUE);
+  g_array_free(cards, TRUE);
+}
@@ -0,0 +1,51 @@
+#ifndef SUMMARY_H__
+#define SUMMARY_H__
+/*
+ * summary.h - Spending summed up by card, month and location
+ *
+ * Transactions are added to one accumulator per card, month and location in
+ * a single pass, everything else is rolled up from those when writing: the
+ * totals per card, per card and month, per month, per location and overall.
+ * The spending per merchant (the transaction details) is kept alongside for
+ * the top merchants. Summaries filled on different threads can be merged.
+ */
+#include <glib.h>
+
+#include "amexparser.h"
+
+/* Merchants listed in a report */
+#define AMEX_SUMMARY_TOP_MERCHANTS 10
+
+struct amex_summary;
+
+struct amex_summary *
+amex_summary_new(void);
+
+void
+amex_summary_free(struct amex_summary *summary);
+
+/* Add the transactions of all cards, nothing is kept pointing into st */
+void
+amex_summary_add(struct amex_summary *summary,
+                 const struct amex_statement *st);
+
+/* Add struct amex_transaction of the card named as by amex_card_format() */
+void
+amex_summary_add_card(struct amex_summary *summary, const gchar *card,
+                      const GPtrArray *transactions);
+
+/* Add from to into, cards not seen before go after those of into */
+void
+amex_summary_merge(struct amex_summary *into,
+                   const struct amex_summary *from);
+
+guint64
+amex_summary_transactions(const struct amex_summary *summary);
+
+void
+amex_summary_append_text(const struct amex_summary *summary, GString *gs);
+
+void
+amex_summary_append_json(const struct amex_summary *summary, GString *gs);
+
+#endif /* SUMMARY_H__ */
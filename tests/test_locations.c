@@ -0,0 +1,98 @@
+/*
+ * Location matching in transaction details, in particular that the fuzzy
+ * fallback leaves ordinary merchant words alone: a match is cut out of the
+ * details, so a false one loses part of the description.
+ */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "locations.h"
+
+struct match_case {
+  const gchar *details;
+  enum location_match_kind kind;
+  const gchar *location;
+};
+
+static const gchar locations[] =
+  "Stockholm\n"
+  "Lund\n"
+  "Bjuv\n"
+  "Kalmar\n"
+  "Malmo -> Malm\xc3\xb6\n"
+  "Palmerston -> Palmerston North\n";
+
+static const struct match_case match_cases[] = {
+  { "ICA MAXI STOCKHOLM", LOCATION_MATCH_EXACT, "Stockholm" },
+  { "PRESSBYRAN LUND", LOCATION_MATCH_EXACT, "Lund" },
+  { "COOP MALMO", LOCATION_MATCH_EXACT, "Malm\xc3\xb6" },
+  /* Misspelt, long enough to be told apart from other words */
+  { "ICA MAXI STOCKHOLN", LOCATION_MATCH_FUZZY, "Stockholm" },
+  { "ICA MAXI STOKHOLM", LOCATION_MATCH_FUZZY, "Stockholm" },
+  { "COOP KALMER", LOCATION_MATCH_FUZZY, "Kalmar" },
+  /* Short words one character away from a location are left alone */
+  { "SWEDBANK ROBUR FUND", LOCATION_MATCH_NONE, NULL },
+  { "CLARION LAND", LOCATION_MATCH_NONE, NULL },
+  { "RESTAURANG BAND", LOCATION_MATCH_NONE, NULL },
+  { "PIZZERIA LUNA", LOCATION_MATCH_NONE, NULL },
+  { "SHELL BJUB", LOCATION_MATCH_NONE, NULL },
+  { "FUND LAND", LOCATION_MATCH_NONE, NULL },
+  { "HOTEL MALMA", LOCATION_MATCH_NONE, NULL },
+};
+
+static struct location_index *
+load_locations(void)
+{
+  struct location_index *index;
+  GError *err = NULL;
+  gchar *filename;
+  gint fd;
+
+  fd = g_file_open_tmp("amex-test-loc-XXXXXX.txt", &filename, &err);
+  g_assert_no_error(err);
+  close(fd);
+  g_file_set_contents(filename, locations, -1, &err);
+  g_assert_no_error(err);
+
+  index = location_index_load(filename, &err);
+  g_assert_no_error(err);
+  g_unlink(filename);
+  g_free(filename);
+
+  return index;
+}
+
+static void
+test_match(void)
+{
+  struct location_index *index = load_locations();
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(match_cases); i++) {
+    const struct match_case *c = &match_cases[i];
+    struct location_match m;
+
+    g_test_message("'%s'", c->details);
+    g_assert_cmpint(location_index_match(index, c->details, strlen(c->details),
+                                         &m), ==,
+                    c->kind != LOCATION_MATCH_NONE);
+    g_assert_cmpint(m.kind, ==, c->kind);
+    if (c->location) {
+      g_assert_cmpstr(m.location, ==, c->location);
+    }
+  }
+
+  location_index_unref(index);
+}
+
+int
+main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/locations/match", test_match);
+
+  return g_test_run();
+}
@@ -0,0 +1,176 @@
+/*
+ * Boundary inputs of the date and amount parsers, which everything written
+ * (CSV, ledger, store, Arrow and SQLite) relies on.
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "amex_amount.h"
+#include "amex_date.h"
+
+struct date_case {
+  const gchar *str;
+  gboolean valid;
+  guint year;
+  guint month;
+  guint day;
+};
+
+struct amount_case {
+  const gchar *str;
+  gboolean valid;
+  amex_amount amount;
+};
+
+static const struct date_case date_cases[] = {
+  { "01.01.21", TRUE, 2021, 1, 1 },
+  { "31.12.99", TRUE, 2099, 12, 31 },
+  { "31.01.21", TRUE, 2021, 1, 31 },
+  { "30.04.21", TRUE, 2021, 4, 30 },
+  { "31.04.21", FALSE, },
+  /* Months out of range, 16 and up used to wrap onto real months */
+  { "15.00.21", FALSE, },
+  { "15.13.21", FALSE, },
+  { "15.15.21", FALSE, },
+  { "15.16.21", FALSE, },
+  { "15.17.21", FALSE, },
+  { "15.28.21", FALSE, },
+  { "15.99.21", FALSE, },
+  /* Days out of range */
+  { "00.01.21", FALSE, },
+  { "32.01.21", FALSE, },
+  { "99.12.21", FALSE, },
+  /* Leap years, 2000 is one too */
+  { "29.02.24", TRUE, 2024, 2, 29 },
+  { "29.02.00", TRUE, 2000, 2, 29 },
+  { "29.02.21", FALSE, },
+  { "28.02.21", TRUE, 2021, 2, 28 },
+  { "30.02.24", FALSE, },
+  /* Malformed */
+  { "01-01-21", FALSE, },
+  { "01/01.21", FALSE, },
+  { "01.01 21", FALSE, },
+  { "0a.01.21", FALSE, },
+  { "01.1a.21", FALSE, },
+  { "01.01.2x", FALSE, },
+  { " 1.01.21", FALSE, },
+  { "1.1.2021", FALSE, },
+};
+
+static const struct amount_case amount_cases[] = {
+  { "0", TRUE, 0 },
+  { "0,01", TRUE, 1 },
+  { "12,5", TRUE, 1250 },
+  { "-12,00", TRUE, -1200 },
+  { "1.234,56", TRUE, 123456 },
+  { "1.234.567", TRUE, 123456700 },
+  { "12.345,67", TRUE, 1234567 },
+  { "123.456", TRUE, 12345600 },
+  { "99999999999999,99", TRUE, G_GINT64_CONSTANT(9999999999999999) },
+  { "-99999999999999,99", TRUE, -G_GINT64_CONSTANT(9999999999999999) },
+  /* Too many digits */
+  { "100000000000000", FALSE, },
+  /* Decimals */
+  { "12,", FALSE, },
+  { "12,345", FALSE, },
+  { "1,234,56", FALSE, },
+  { "-,50", FALSE, },
+  { ",50", FALSE, },
+  /* Thousand separators not between groups of three */
+  { "1..2", FALSE, },
+  { "12.", FALSE, },
+  { "12.,50", FALSE, },
+  { "1.23", FALSE, },
+  { "1.2345", FALSE, },
+  { "1.234.56", FALSE, },
+  { "1234.567", FALSE, },
+  { "-.123", FALSE, },
+  /* Malformed */
+  { "", FALSE, },
+  { "-", FALSE, },
+  { ".5", FALSE, },
+  { "12a,00", FALSE, },
+  { "1 234,00", FALSE, },
+  { "12,0a", FALSE, },
+  { "+12,00", FALSE, },
+  { "--12,00", FALSE, },
+};
+
+static void
+test_date_parse(void)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(date_cases); i++) {
+    const struct date_case *c = &date_cases[i];
+    amex_date d = AMEX_DATE_INVALID;
+
+    g_test_message("%s", c->str);
+    g_assert_cmpint(amex_date_parse(c->str, &d), ==, c->valid);
+    if (!c->valid) {
+      g_assert_cmpuint(d, ==, AMEX_DATE_INVALID);
+      continue;
+    }
+
+    g_assert_cmpuint(amex_date_year(d), ==, c->year);
+    g_assert_cmpuint(amex_date_month(d), ==, c->month);
+    g_assert_cmpuint(amex_date_day(d), ==, c->day);
+  }
+}
+
+static void
+test_date_order(void)
+{
+  amex_date a;
+  amex_date b;
+
+  /* Packed dates compare as the dates do */
+  g_assert_true(amex_date_parse("31.12.21", &a));
+  g_assert_true(amex_date_parse("01.01.22", &b));
+  g_assert_cmpuint(a, <, b);
+  g_assert_true(amex_date_parse("30.11.22", &a));
+  g_assert_cmpuint(b, <, a);
+}
+
+static void
+test_amount_parse(void)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(amount_cases); i++) {
+    const struct amount_case *c = &amount_cases[i];
+    amex_amount a = 0;
+
+    g_test_message("'%s'", c->str);
+    g_assert_cmpint(amex_amount_parse(c->str, strlen(c->str), &a), ==,
+                    c->valid);
+    if (c->valid) {
+      g_assert_cmpint(a, ==, c->amount);
+    }
+  }
+}
+
+static void
+test_amount_format(void)
+{
+  gchar buf[AMEX_AMOUNT_STR_LEN];
+  gsize len;
+
+  len = amex_amount_format(-123456, buf);
+  g_assert_cmpmem(buf, len, "-1234.56", 8);
+  len = amex_amount_format(5, buf);
+  g_assert_cmpmem(buf, len, "0.05", 4);
+}
+
+int
+main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/date/parse", test_date_parse);
+  g_test_add_func("/date/order", test_date_order);
+  g_test_add_func("/amount/parse", test_amount_parse);
+  g_test_add_func("/amount/format", test_amount_format);
+
+  return g_test_run();
+}